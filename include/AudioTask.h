@@ -10,43 +10,314 @@ unsigned long volumeLastChanged = millis();
 SemaphoreHandle_t xMutex = xSemaphoreCreateMutex();
 
 // Create the task handle (a reference to the task being created later)
-TaskHandle_t playAudioTaskHandle;
+TaskHandle_t playAudioTaskHandle = NULL;
 
 volatile bool allowPlayAudio = false;
 
+// The task sleeps for the time it takes I2S to drain one DMA descriptor (its length
+// comes from the latency profile), at which point there is room to write more audio.
+
+// Upper limit on audio.loop() calls per wakeup, so one wakeup can't starve other tasks
+const uint8_t maxAudioLoopsPerWake = 16;
+
+// Wakeup statistics (cumulative since boot) - used to prove the CPU saving over polling
+volatile uint32_t audioTaskWakeups = 0;
+uint64_t audioTaskIdleMicros = 0;
+
+// Time spent in audio.loop() (cumulative since boot) - the CPU governor's load figure
+uint64_t audioLoopMicros = 0;
+
+// Samples decoded (cumulative since boot) - tells the task whether audio.loop() is
+// getting anywhere
+volatile uint32_t decodedSamples = 0;
+
+// The task's stack covers audio.loop() (the AAC decoder is the deepest path) plus the
+// per sample hook: DSP, resampler, crossfade and earcon mixing. The free stack report
+// warns if the headroom ever drops below the margin.
+const uint32_t audioTaskStackSize = 6000;
+const uint32_t audioTaskStackMargin = 512;
+
+// Station change latency - from connectToStation() to the first sample reaching I2S
+volatile int64_t stationSwitchStartMicros = 0;
+volatile int64_t stationSwitchLatencyMicros = 0;
+
+// Timeshift: a pause lets the DSP volume ramp down before the decoder is frozen
+const unsigned long timeshiftFadeMS = 50;
+volatile unsigned long timeshiftPausedMillis = 0;
+
+// Timeshift seek latency - from resume / jump to live to the first sample reaching I2S
+volatile int64_t timeshiftSeekStartMicros = 0;
+volatile int64_t timeshiftSeekLatencyMicros = 0;
+
+// Decoding is about to be restarted on purpose (not an underrun)
+volatile bool decodeRestartExpected = false;
+
+// Muted for a while: decoding and I2S are stopped to save power (see powerSave.h)
+volatile bool decodeSuspended = false;
+
+// Unmute latency - from the unmute to the first sample reaching I2S
+volatile int64_t muteResumeStartMicros = 0;
+volatile int64_t muteResumeLatencyMicros = 0;
+volatile bool muteResumeFromSaving = false;
+
+// Alarm start - from the prebuffer being released to the first sample reaching I2S
+volatile int64_t alarmReleaseMicros = 0;
+volatile int64_t alarmStartLatencyMicros = 0;
+
+// Local file seek latency - from the seek request to the first sample reaching I2S
+volatile int64_t localSeekStartMicros = 0;
+volatile int64_t localSeekLatencyMicros = 0;
+
+// Called for every sample on its way to I2S (from audio.loop())
+void recordFirstSample()
+{
+  if (stationSwitchStartMicros != 0)
+  {
+    stationSwitchLatencyMicros = esp_timer_get_time() - stationSwitchStartMicros;
+    stationSwitchStartMicros = 0;
+  }
+  if (timeshiftSeekStartMicros != 0)
+  {
+    timeshiftSeekLatencyMicros = esp_timer_get_time() - timeshiftSeekStartMicros;
+    timeshiftSeekStartMicros = 0;
+  }
+  if (muteResumeStartMicros != 0)
+  {
+    muteResumeLatencyMicros = esp_timer_get_time() - muteResumeStartMicros;
+    muteResumeStartMicros = 0;
+  }
+  if (alarmReleaseMicros != 0)
+  {
+    alarmStartLatencyMicros = esp_timer_get_time() - alarmReleaseMicros;
+    alarmReleaseMicros = 0;
+  }
+  if (localSeekStartMicros != 0)
+  {
+    localSeekLatencyMicros = esp_timer_get_time() - localSeekStartMicros;
+    localSeekStartMicros = 0;
+  }
+}
+
+// Wake the audio task early, eg new stream data fetched or playing (re)enabled
+void wakeAudioTask()
+{
+  if (playAudioTaskHandle != NULL)
+    xTaskNotifyGive(playAudioTaskHandle);
+}
+
+// Paused (timeshift) and faded out, or muted long enough to save power - the decoder is
+// left exactly where it is
+bool playbackFrozen()
+{
+  return decodeSuspended || (timeshiftPaused && millis() - timeshiftPausedMillis > timeshiftFadeMS);
+}
+
+// Timeshift controls, called from the UI task. The stream carries on being recorded
+// while paused; resuming plays on from the pause point.
+void pausePlayback()
+{
+  setDspVolume(0);
+  timeshiftPausedMillis = millis();
+  timeshiftPaused = true;
+}
+
+void resumePlayback()
+{
+  timeshiftSeekStartMicros = esp_timer_get_time();
+  timeshiftPaused = false;
+  setDspVolume(currentVolume);
+  wakeAudioTask();
+}
+
+// Throw away the recording (and whatever the decoder has queued) and play live again
+void jumpToLive()
+{
+  xSemaphoreTake(xMutex, portMAX_DELAY);
+  audio.stopSong();
+  decodeRestartExpected = true;
+  timeshiftLiveRequested = true;
+  timeshiftSeekStartMicros = esp_timer_get_time();
+  timeshiftPaused = false;
+  xSemaphoreGive(xMutex);
+  setDspVolume(currentVolume);
+}
+
+// How long the audio task can sleep before I2S has a free DMA descriptor
+TickType_t audioTaskSleepTicks()
+{
+  if (!allowPlayAudio || playbackFrozen())
+    return pdMS_TO_TICKS(1000);
+
+  uint32_t sampleRate = audio.getSampleRate();
+  if (sampleRate == 0)
+    sampleRate = 44100;
+
+  TickType_t ticks = pdMS_TO_TICKS((currentProfile->dmaBufLen * 1000UL) / sampleRate);
+  return (ticks > 0) ? ticks : 1;
+}
+
 // This is the task that we will start running (on Core 1, don't use Core 0)
 void playAudioTask(void *parameter)
 {
   static unsigned long prevMillis = 0;
-  Serial.println("Started playAudioTask");
+  static uint32_t prevWakeups = 0;
+  static uint64_t prevIdleMicros = 0;
+  static uint32_t decodingGeneration = 0;
+  static unsigned long prevDriftMillis = 0;
+  static unsigned long silentSinceMillis = 0;
+  static uint32_t decodeStartSamples = 0;
+  logInfo("Started playAudioTask");
 
   // Loop forever
   while (1)
   {
-    if (allowPlayAudio)
+    // Block until there is work to do: either we are notified (stream data arrived, play allowed)
+    // or I2S has drained a DMA descriptor and needs feeding again
+    int64_t sleepStart = esp_timer_get_time();
+    ulTaskNotifyTake(pdTRUE, audioTaskSleepTicks());
+    audioTaskIdleMicros += esp_timer_get_time() - sleepStart;
+    audioTaskWakeups++;
+
+    // Wind down (or back up) while muted
+    servicePowerSave();
+    sampleI2SEvents(allowPlayAudio && !playbackFrozen() && audio.isRunning());
+
+    if (allowPlayAudio && !playbackFrozen())
     {
-      // Play audio stream - semaphore protects against channel change
+      // (Re)start decoding from the stream ring once enough has been fetched - this
+      // covers both a new station and recovering from an underrun
+      // Note when the current stream stopped decoding, to time the gap if it restarts
+      if (!audio.isRunning() && silentSinceMillis == 0 && decodingGeneration == streamingGeneration && !decodeRestartExpected)
+        silentSinceMillis = millis();
+
+      if (!audio.isRunning() && streamReadyToDecode())
+      {
+        xSemaphoreTake(xMutex, portMAX_DELAY);
+        if (!audio.isRunning() && streamReadyToDecode())
+        {
+          // Restarting the same stream means the ring ran dry
+          if (decodingGeneration == streamingGeneration && !decodeRestartExpected)
+          {
+            noteStreamUnderrun();
+            if (silentSinceMillis != 0)
+              recordSilence(millis() - silentSinceMillis);
+          }
+          silentSinceMillis = 0;
+          decodeRestartExpected = false;
+          decodingGeneration = streamingGeneration;
+          char codecPath[sizeof(streamingCodecPath)];
+          streamingCodec(codecPath, sizeof(codecPath));
+          audio.connecttoFS(ringFS, codecPath);
+          // Rate from the stream cache: filters ready before the first frame
+          uint32_t expectedRate = streamingSampleRate;
+          resetResampler(expectedRate);
+          setDspSampleRate(expectedRate);
+          setSpectrumSampleRate(expectedRate);
+          decodeStartSamples = decodedSamples;
+        }
+        xSemaphoreGive(xMutex);
+      }
+
+      // Keep calling audio.loop() while it makes progress (bytes arriving or being decoded)
+      for (uint8_t loops = 0; loops < maxAudioLoopsPerWake; loops++)
+      {
+        // Play audio stream - semaphore protects against channel change
+        xSemaphoreTake(xMutex, portMAX_DELAY);
+        uint32_t samplesBefore = decodedSamples;
+        uint32_t filledBefore = audio.inBufferFilled();
+        int64_t loopStart = esp_timer_get_time();
+        audio.loop();
+        uint32_t loopMicros = esp_timer_get_time() - loopStart;
+        recordAudioLoop(loopMicros);
+        audioLoopMicros += loopMicros;
+        // Samples decoded, or (before the first frame) the input buffer still filling
+        bool progress = decodedSamples != samplesBefore || audio.inBufferFilled() != filledBefore;
+        xSemaphoreGive(xMutex);
+
+        if (!progress)
+          break;
+      }
+
+      sampleTelemetry();
       xSemaphoreTake(xMutex, portMAX_DELAY);
-      audio.loop();
+      uint32_t inBufferFilled = audio.inBufferFilled();
       xSemaphoreGive(xMutex);
+      serviceBufferHealth(inBufferFilled);
+      serviceCrossfade();
+      serviceEarcons();
 
-      // Ensure lower priority tasks can run
-      // - yield() will only give way to higher priority tasks, delay() allows all tasks to run
-      delay(1);
-    }
-    else
-    {
-      // Not allowed to play yet
-      delay(10);
+      // EQ filters depend on the stream's sample rate, once the decoder has found it
+      uint32_t sampleRate = decodedSamples != decodeStartSamples ? audio.getSampleRate() : 0;
+      setDspSampleRate(sampleRate);
+      setSpectrumSampleRate(sampleRate);
+
+      // Keep the stream ring centred when resampling to a fixed output rate
+      if (millis() - prevDriftMillis >= 1000)
+      {
+        updateDriftCorrection((float)ringFilled(streamRing) / streamRing.size, (millis() - prevDriftMillis) / 1000.0);
+        prevDriftMillis = millis();
+      }
+
+      if (timeshiftSeekLatencyMicros != 0)
+      {
+        logInfo("Timeshift seek to first sample: %lldms", timeshiftSeekLatencyMicros / 1000);
+        timeshiftSeekLatencyMicros = 0;
+      }
+
+      if (localSeekLatencyMicros != 0)
+      {
+        logInfo("Local seek to first sample: %lldms", localSeekLatencyMicros / 1000);
+        localSeekLatencyMicros = 0;
+      }
+
+      if (muteResumeLatencyMicros != 0)
+      {
+        logInfo("Unmute to first sample: %lldms (%s)", muteResumeLatencyMicros / 1000,
+                muteResumeFromSaving ? "power save" : "grace");
+        muteResumeLatencyMicros = 0;
+      }
+
+      if (stationSwitchLatencyMicros != 0)
+      {
+        logInfo("Station switch to first sample: %lldms (%s)",
+                stationSwitchLatencyMicros / 1000, lastSwitchWasWarm ? "warm standby" : "cold connect");
+        recordFirstAudio(stationSwitchLatencyMicros / 1000, lastSwitchWasWarm);
+        noteStreamSampleRate(audio.getSampleRate());
+        stationSwitchLatencyMicros = 0;
+      }
     }
 
+    // Lowest CPU clock that keeps up
+    serviceCpuGovernor(audioLoopMicros);
+
     // We should check that the stack size allocated was correct. This shows the FREE
     // stack space every second. Assuming we have run all paths it should remain constant.
     // Comment out this code once satisfied that we have allocated the correct stack space.
     if (millis() - prevMillis > 15000)
     {
       unsigned long remainingStack = uxTaskGetStackHighWaterMark(NULL);
-      Serial.printf("Audio Free stack:%lu\n", remainingStack);
+      logInfo("Audio Free stack:%lu", remainingStack);
+      if (remainingStack < audioTaskStackMargin)
+        logWarn("Audio stack headroom below %u", audioTaskStackMargin);
+
+      // Wakeups and idle time since the last report
+      unsigned long elapsedMillis = millis() - prevMillis;
+      uint32_t wakeups = audioTaskWakeups - prevWakeups;
+      uint64_t idleMicros = audioTaskIdleMicros - prevIdleMicros;
+      logInfo("Audio wakeups:%u idle:%llums (%llu%%) total wakeups:%u idle:%llus",
+              wakeups, idleMicros / 1000, (idleMicros / 10) / elapsedMillis,
+              audioTaskWakeups, audioTaskIdleMicros / 1000000);
+
+      adaptPrebufferWatermark();
+      reportBufferHealth();
+      reportDspLoad();
+      reportDriftCorrection();
+      reportCpuGovernor();
+      reportPowerSave();
+      reportEarcons();
+
+      prevWakeups = audioTaskWakeups;
+      prevIdleMicros = audioTaskIdleMicros;
       prevMillis = millis();
     }
   }
@@ -60,9 +331,9 @@ void createAudioMusicTask()
   xTaskCreatePinnedToCore(
       playAudioTask,        /* Function to implement the task */
       "PlayAudio",          /* Name of the task */
-      3000,                 /* Stack size in words */
+      audioTaskStackSize,   /* Stack size in words */
       NULL,                 /* Task input parameter */
       2,                    /* Priority of the task - must be higher than 0 (idle)*/
       &playAudioTaskHandle, /* Task handle. */
       1);                   /* Core where the task should run */
-}
\ No newline at end of file
+}
@@ -0,0 +1,435 @@
+// Wake-up alarms and the sleep timer (run by the button handler task)
+// An alarm connects to its station leadSecs ahead of time with the decoder held back, so
+// by the alarm time the stream ring is full and the audio can start on the dot instead
+// of waiting on the connection and prebuffer. The hold is released by a one shot timer
+// slightly early - by how long the decoder took to produce its first sample last time -
+// and the volume then fades in from silence. Alarms are kept in preferences.
+//
+// The sleep timer fades the volume out over sleepFadeSecs and then mutes, which lets
+// the power saving mute wind the radio down until the next alarm.
+//
+// Set from the serial console:
+//   a                    list the alarms and the sleep timer
+//   a<n> HH:MM [station=<n>] [volume=<0-21>] [fade=<secs>] [lead=<secs>] [days=<0-6...>]
+//                        set alarm n (days are tm_wday digits, 0 is Sunday: 12345 for
+//                        weekdays, every day if not given)
+//   a<n> off             cancel alarm n
+//   s<minutes>           sleep timer, s0 to cancel
+#include <Arduino.h>
+#include <sys/time.h>
+#include "esp_timer.h"
+#include "main.h"
+
+const uint8_t maxAlarms = 4;
+const uint8_t everyDay = 0x7F;
+const uint16_t defaultAlarmFadeSecs = 60;
+const uint16_t defaultAlarmLeadSecs = 30;
+const uint16_t maxAlarmLeadSecs = 300;
+const uint16_t sleepFadeSecs = 30;
+
+// Before NTP has set the clock there is nothing to schedule against
+const time_t alarmClockValid = 1600000000;
+
+// How far ahead of the alarm the hold is released, until an alarm has been measured
+const uint32_t defaultAlarmStartupMS = 50;
+
+// Give up on an alarm that hasn't produced any audio this long after its time
+const unsigned long alarmNoAudioMS = 30000;
+
+struct alarmSetting
+{
+  bool enabled;
+  uint8_t hour;
+  uint8_t minute;
+  uint8_t days; // Bit per tm_wday
+  uint8_t station;
+  uint8_t volume;
+  uint16_t fadeSecs;
+  uint16_t leadSecs;
+};
+
+alarmSetting alarms[maxAlarms];
+time_t alarmNextFire[maxAlarms];
+
+// The alarm being prebuffered or started (-1 for none)
+int8_t armedAlarm = -1;
+bool alarmStarting = false;
+int64_t armedFireMicros = 0;
+int64_t armedReleaseMicros = 0;
+volatile uint32_t armedPrebufferBytes = 0;
+unsigned long armedVolumeMark = 0;
+unsigned long armedChannelMark = 0;
+esp_timer_handle_t alarmTimer = NULL;
+uint32_t alarmStartupMS = defaultAlarmStartupMS;
+
+// Volume fade (alarm fade in or sleep timer fade out) - abandoned if the user touches the
+// volume or mute
+struct volumeFade
+{
+  bool active;
+  bool fadeOut;
+  uint8_t from;
+  uint8_t to;
+  unsigned long startMillis;
+  unsigned long durationMS;
+  unsigned long volumeChangedMark;
+};
+
+volumeFade fade;
+unsigned long sleepAtMillis = 0; // 0 when the sleep timer isn't set
+
+void saveAlarms()
+{
+  preferences.putBytes("alarms", alarms, sizeof(alarms));
+}
+
+// Next time the alarm goes off after now (0 if it can't)
+time_t nextAlarmTime(const alarmSetting &alarm, time_t now)
+{
+  if (!alarm.enabled || now < alarmClockValid)
+    return 0;
+
+  struct tm when;
+  localtime_r(&now, &when);
+  for (uint8_t day = 0; day <= 7; day++)
+  {
+    struct tm candidate = when;
+    candidate.tm_mday += day;
+    candidate.tm_hour = alarm.hour;
+    candidate.tm_min = alarm.minute;
+    candidate.tm_sec = 0;
+    candidate.tm_isdst = -1;
+    time_t fire = mktime(&candidate);
+    if (fire > now && (alarm.days & (1 << candidate.tm_wday)))
+      return fire;
+  }
+  return 0;
+}
+
+// Runs in the esp_timer task just ahead of the alarm time
+void alarmTimerCallback(void *arg)
+{
+  armedPrebufferBytes = ringFilled(streamRing);
+  alarmReleaseMicros = esp_timer_get_time();
+  decodeHeld = false;
+  wakeAudioTask();
+}
+
+// Called from setup() once the stations are loaded
+void loadAlarms()
+{
+  memset(alarms, 0, sizeof(alarms));
+  if (preferences.getBytesLength("alarms") == sizeof(alarms))
+    preferences.getBytes("alarms", alarms, sizeof(alarms));
+
+  esp_timer_create_args_t timerArgs = {};
+  timerArgs.callback = alarmTimerCallback;
+  timerArgs.name = "alarm";
+  if (esp_timer_create(&timerArgs, &alarmTimer) != ESP_OK)
+    logError("Unable to create alarm timer");
+
+  for (uint8_t i = 0; i < maxAlarms; i++)
+  {
+    if (alarms[i].enabled)
+      logInfo("Alarm %u: %02u:%02u %s, %us lead, %us fade in", i, alarms[i].hour, alarms[i].minute,
+              alarms[i].station < numberOfStations ? radioStation[alarms[i].station].name : "?",
+              alarms[i].leadSecs, alarms[i].fadeSecs);
+  }
+}
+
+void startVolumeFade(uint8_t from, uint8_t to, uint16_t secs, bool fadeOut)
+{
+  fade.from = from;
+  fade.to = to;
+  fade.startMillis = millis();
+  fade.durationMS = max(secs * 1000UL, 1UL);
+  fade.fadeOut = fadeOut;
+  fade.volumeChangedMark = volumeLastChanged;
+  fade.active = true;
+  setDspVolume(from);
+}
+
+// Returns true when a fade has just finished (not when it was abandoned)
+bool serviceVolumeFade()
+{
+  if (!fade.active)
+    return false;
+
+  if (volumeLastChanged != fade.volumeChangedMark)
+  {
+    logInfo("Volume fade abandoned");
+    fade.active = false;
+    return false;
+  }
+
+  unsigned long elapsed = min(millis() - fade.startMillis, fade.durationMS);
+  int16_t level = fade.from + ((int16_t)(fade.to - fade.from) * (long)elapsed) / (long)fade.durationMS;
+  setDspVolume(level);
+
+  // Fading in sets the volume the buttons carry on from
+  if (!fade.fadeOut)
+    currentVolume = level;
+
+  if (elapsed < fade.durationMS)
+    return false;
+  fade.active = false;
+  return true;
+}
+
+// Lead time before an alarm: tune in silently with the decoder held back until the timer
+void armAlarm(uint8_t index, time_t fireTime)
+{
+  const alarmSetting &alarm = alarms[index];
+
+  // Something is already playing - leave it be
+  if (!muted && audio.isRunning() && !fade.active)
+  {
+    logInfo("Alarm %u: radio already playing", index);
+    return;
+  }
+
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  int64_t untilFireMicros = (int64_t)fireTime * 1000000 - ((int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+  int64_t releaseDelayMicros = max(untilFireMicros - (int64_t)alarmStartupMS * 1000, (int64_t)0);
+
+  armedAlarm = index;
+  alarmStarting = true;
+  armedFireMicros = esp_timer_get_time() + untilFireMicros;
+  armedReleaseMicros = esp_timer_get_time() + releaseDelayMicros;
+  sleepAtMillis = 0;
+  fade.active = false;
+
+  setDspVolume(0);
+  decodeHeld = true;
+  if (alarm.station < numberOfStations)
+    currentStation = alarm.station;
+  connectToStation();
+  preferences.putUInt("currentStation", currentStation);
+
+  if (muted)
+  {
+    muted = false;
+    setPowerSaveMute(false);
+    if (timeshiftPaused)
+      resumePlayback();
+    setDspVolume(0);
+    displayMuteOff();
+  }
+
+  // The alarm times its own start
+  stationSwitchStartMicros = 0;
+  timeshiftSeekStartMicros = 0;
+  muteResumeStartMicros = 0;
+  channelLastChanged = millis();
+  armedChannelMark = channelLastChanged;
+  armedVolumeMark = volumeLastChanged;
+
+  esp_timer_stop(alarmTimer);
+  esp_timer_start_once(alarmTimer, releaseDelayMicros);
+  logInfo("Alarm %u: tuning to %s, starting in %llums", index, radioStation[currentStation].name,
+          untilFireMicros / 1000);
+}
+
+// The user changed station, volume or mute while the alarm was waiting to start
+void cancelArmedAlarm()
+{
+  esp_timer_stop(alarmTimer);
+  alarmReleaseMicros = 0;
+  decodeHeld = false;
+  wakeAudioTask();
+  if (!muted)
+    setDspVolume(currentVolume);
+  logInfo("Alarm %u: cancelled", armedAlarm);
+  armedAlarm = -1;
+  alarmStarting = false;
+}
+
+void logAlarmStart()
+{
+  int64_t firstSampleMicros = armedReleaseMicros + alarmStartLatencyMicros;
+  uint32_t startupMS = alarmStartLatencyMicros / 1000;
+  logInfo("Alarm %u: first sample %+lldms from %02u:%02u (released %ums early, decoder start %ums, %u bytes "
+          "prebuffered)",
+          armedAlarm, (firstSampleMicros - armedFireMicros) / 1000, alarms[armedAlarm].hour,
+          alarms[armedAlarm].minute, alarmStartupMS, startupMS, armedPrebufferBytes);
+
+  // Release the next one early by what this one took
+  alarmStartupMS = (alarmStartupMS + startupMS) / 2;
+  alarmStartLatencyMicros = 0;
+}
+
+// Called by the button handler task every time round its loop
+void serviceAlarms()
+{
+  time_t now = time(NULL);
+  for (uint8_t i = 0; i < maxAlarms; i++)
+  {
+    if (alarmNextFire[i] == 0)
+      alarmNextFire[i] = nextAlarmTime(alarms[i], now);
+    if (alarmNextFire[i] != 0 && now + alarms[i].leadSecs >= alarmNextFire[i] && armedAlarm < 0)
+    {
+      armAlarm(i, alarmNextFire[i]);
+      alarmNextFire[i] = nextAlarmTime(alarms[i], alarmNextFire[i]);
+    }
+  }
+
+  if (armedAlarm >= 0)
+  {
+    if (decodeHeld && (volumeLastChanged != armedVolumeMark || channelLastChanged != armedChannelMark))
+      cancelArmedAlarm();
+    else if (alarmStarting && !decodeHeld)
+    {
+      // Timer gone off - bring the volume up from silence
+      alarmStarting = false;
+      startVolumeFade(0, alarms[armedAlarm].volume, alarms[armedAlarm].fadeSecs, false);
+    }
+    else if (alarmStartLatencyMicros != 0)
+    {
+      logAlarmStart();
+      armedAlarm = -1;
+    }
+    else if (!alarmStarting && esp_timer_get_time() - armedFireMicros > alarmNoAudioMS * 1000LL)
+    {
+      logWarn("Alarm %u: no audio %lus after the alarm time", armedAlarm, alarmNoAudioMS / 1000);
+      alarmReleaseMicros = 0;
+      armedAlarm = -1;
+    }
+  }
+
+  // Sleep timer: fade out, then mute (and let power saving take over)
+  if (sleepAtMillis != 0 && (long)(millis() - sleepAtMillis) >= 0)
+  {
+    sleepAtMillis = 0;
+    if (!muted)
+    {
+      logInfo("Sleep timer: fading out over %us", sleepFadeSecs);
+      startVolumeFade(currentVolume, 0, sleepFadeSecs, true);
+    }
+  }
+
+  if (serviceVolumeFade() && fade.fadeOut && !muted)
+  {
+    logInfo("Sleep timer: muted");
+    toggleMute();
+  }
+}
+
+void listAlarms()
+{
+  time_t now = time(NULL);
+  for (uint8_t i = 0; i < maxAlarms; i++)
+  {
+    const alarmSetting &alarm = alarms[i];
+    if (!alarm.enabled)
+    {
+      logInfo("Alarm %u: off", i);
+      continue;
+    }
+    char days[8];
+    uint8_t len = 0;
+    for (uint8_t day = 0; day < 7; day++)
+    {
+      if (alarm.days & (1 << day))
+        days[len++] = '0' + day;
+    }
+    days[len] = 0;
+    time_t next = nextAlarmTime(alarm, now);
+    logInfo("Alarm %u: %02u:%02u days:%s station:%u volume:%u fade:%us lead:%us, next in %ldmin", i, alarm.hour,
+            alarm.minute, days, alarm.station, alarm.volume, alarm.fadeSecs, alarm.leadSecs,
+            next ? (long)(next - now) / 60 : -1L);
+  }
+  if (sleepAtMillis != 0)
+    logInfo("Sleep timer: %lumin left", (sleepAtMillis - millis()) / 60000);
+}
+
+// Serial command 'a' (see the top of this file)
+void alarmCommand()
+{
+  char line[96];
+  readCommandLine(line, sizeof(line));
+
+  char *token = strtok(line, " ");
+  if (token == NULL)
+  {
+    listAlarms();
+    return;
+  }
+
+  uint8_t index = atoi(token);
+  if (index >= maxAlarms)
+  {
+    logWarn("Alarm %u: only %u alarms", index, maxAlarms);
+    return;
+  }
+  alarmSetting alarm = alarms[index];
+
+  token = strtok(NULL, " ");
+  unsigned hour, minute;
+  if (token != NULL && strcmp(token, "off") == 0)
+    alarm.enabled = false;
+  else if (token != NULL && sscanf(token, "%u:%u", &hour, &minute) == 2 && hour < 24 && minute < 60)
+  {
+    alarm.enabled = true;
+    alarm.hour = hour;
+    alarm.minute = minute;
+    alarm.days = everyDay;
+    alarm.station = currentStation;
+    alarm.volume = currentVolume;
+    alarm.fadeSecs = defaultAlarmFadeSecs;
+    alarm.leadSecs = defaultAlarmLeadSecs;
+    while ((token = strtok(NULL, " ")) != NULL)
+    {
+      char *value = strchr(token, '=');
+      if (value == NULL)
+        continue;
+      *value++ = 0;
+      if (strcmp(token, "station") == 0)
+        alarm.station = min(atoi(value), max(numberOfStations - 1, 0));
+      else if (strcmp(token, "volume") == 0)
+        alarm.volume = min(atoi(value), (int)maxVolume);
+      else if (strcmp(token, "fade") == 0)
+        alarm.fadeSecs = atoi(value);
+      else if (strcmp(token, "lead") == 0)
+        alarm.leadSecs = min(atoi(value), (int)maxAlarmLeadSecs);
+      else if (strcmp(token, "days") == 0)
+      {
+        alarm.days = 0;
+        for (char *day = value; *day >= '0' && *day <= '6'; day++)
+          alarm.days |= 1 << (*day - '0');
+        if (alarm.days == 0)
+          alarm.days = everyDay;
+      }
+    }
+  }
+  else
+  {
+    logWarn("Alarm: expected a<n> HH:MM [station=] [volume=] [fade=] [lead=] [days=] or a<n> off");
+    return;
+  }
+
+  alarms[index] = alarm;
+  alarmNextFire[index] = nextAlarmTime(alarm, time(NULL));
+  saveAlarms();
+  listAlarms();
+}
+
+// Serial command 's<minutes>'
+void sleepTimerCommand()
+{
+  char line[16];
+  readCommandLine(line, sizeof(line));
+  unsigned long minutes = strtoul(line, NULL, 10);
+
+  fade.active = fade.active && !fade.fadeOut;
+  if (minutes == 0)
+  {
+    sleepAtMillis = 0;
+    logInfo("Sleep timer: off");
+    return;
+  }
+  sleepAtMillis = millis() + minutes * 60000;
+  if (sleepAtMillis == 0)
+    sleepAtMillis = 1;
+  logInfo("Sleep timer: %lumin", minutes);
+}
@@ -0,0 +1,168 @@
+// Ensure this header file is included only once
+#ifndef _AsyncLog_
+#define _AsyncLog_
+
+// Deferred logging
+// Writing to Serial at 115200 baud takes around 1ms per 10 characters, far too long
+// for the audio and fetch tasks to wait. logError/logWarn/logInfo/logDebug format the
+// message straight into a slot of a lock-free ring (any task, either core) and return;
+// a low priority task writes the ring out to Serial. If the ring is full the record
+// is dropped and counted rather than holding up the caller.
+//
+// Levels above LOG_LEVEL are compiled out completely (arguments are not evaluated).
+#include <Arduino.h>
+#include <atomic>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Ring of fixed size records (power of 2), longer messages are truncated
+const uint8_t logRecords = 32;
+const uint8_t logRecordLength = 160;
+
+struct logRecord
+{
+  std::atomic<uint32_t> sequence; // 2 x lap of the ring: free for writing that lap, +1 once written
+  uint8_t level;
+  char text[logRecordLength];
+};
+
+logRecord logRing[logRecords];
+std::atomic<uint32_t> logWritePos(0);
+uint32_t logReadPos = 0; // Only used by the flush task
+std::atomic<uint32_t> logRecordsLost(0);
+
+// Create the task handle (a reference to the task being created later)
+TaskHandle_t logFlushTaskHandle = NULL;
+
+// Bounded multi-producer ring: a writer claims a slot by advancing logWritePos, fills it
+// and then publishes it by setting its sequence. The flush task only ever reads slots
+// that have been published, in order. (Starts out all zero, so usable before setup().)
+void logWrite(uint8_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void logWrite(uint8_t level, const char *format, ...)
+{
+  uint32_t pos = logWritePos.load(std::memory_order_relaxed);
+  logRecord *record;
+  while (1)
+  {
+    record = &logRing[pos & (logRecords - 1)];
+    int32_t lap = (int32_t)(record->sequence.load(std::memory_order_acquire) - 2 * (pos / logRecords));
+    if (lap == 0)
+    {
+      if (logWritePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    }
+    else if (lap < 0)
+    {
+      // Full - the flush task hasn't freed this slot yet
+      logRecordsLost.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    else
+    {
+      pos = logWritePos.load(std::memory_order_relaxed);
+    }
+  }
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(record->text, sizeof(record->text), format, args);
+  va_end(args);
+  record->level = level;
+  record->sequence.store(2 * (pos / logRecords) + 1, std::memory_order_release);
+}
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define logError(...) logWrite(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define logError(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define logWarn(...) logWrite(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define logWarn(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define logInfo(...) logWrite(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define logInfo(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define logDebug(...) logWrite(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define logDebug(...) do {} while (0)
+#endif
+
+// Write out one record, false if there are none waiting
+bool flushLogRecord()
+{
+  static const char *levelPrefix[] = {"", "E ", "W ", "", "D "};
+
+  logRecord *record = &logRing[logReadPos & (logRecords - 1)];
+  uint32_t lap = logReadPos / logRecords;
+  if (record->sequence.load(std::memory_order_acquire) != 2 * lap + 1)
+    return false;
+
+  Serial.print(levelPrefix[record->level]);
+  Serial.println(record->text);
+
+  // Slot is free for the writer one lap on
+  record->sequence.store(2 * (lap + 1), std::memory_order_release);
+  logReadPos++;
+  return true;
+}
+
+// This is the task that we will start running (low priority, it only runs when nothing else wants to)
+void logFlushTask(void *parameter)
+{
+  static unsigned long prevMillis = 0;
+  uint32_t reportedLost = 0;
+
+  // Loop forever
+  while (1)
+  {
+    while (flushLogRecord())
+      ;
+
+    uint32_t lost = logRecordsLost.load(std::memory_order_relaxed);
+    if (lost != reportedLost)
+    {
+      Serial.printf("Log: %u records lost\n", lost - reportedLost);
+      reportedLost = lost;
+    }
+
+    if (millis() - prevMillis > 15000)
+    {
+      unsigned long remainingStack = uxTaskGetStackHighWaterMark(NULL);
+      logInfo("LogFlush Free stack:%lu", remainingStack);
+      prevMillis = millis();
+    }
+
+    vTaskDelay(20 / portTICK_PERIOD_MS);
+  }
+}
+
+// Called from the main setup() routine (anything logged before then is kept in the ring)
+void createLogFlushTask()
+{
+  xTaskCreatePinnedToCore(
+      logFlushTask,        /* Function to implement the task */
+      "LogFlush",          /* Name of the task */
+      2000,                /* Stack size in words */
+      NULL,                /* Task input parameter */
+      1,                   /* Priority of the task - must be higher than 0 (idle)*/
+      &logFlushTaskHandle, /* Task handle. */
+      0);                  /* Core where the task should run */
+}
+
+#endif
@@ -0,0 +1,279 @@
+// Fixed point DSP applied to every decoded sample on its way to I2S
+// One pass, in place, over each stereo sample:
+//   3 band biquad EQ (bass shelf, mid peak, treble shelf) -> volume ramp -> peak limiter
+// The volume ramp follows a dB-linear curve so mute / volume changes never click.
+// Serial command 'q' shows the EQ, 'q<b|m|t><dB>' sets a band (eg qb+6, qt-3), the gains
+// are kept in EEPROM.
+#include <Arduino.h>
+#include "main.h"
+
+// Volume curve: top step is unity gain, each step down is volumeStepDB quieter, 0 is silence
+const float volumeStepDB = 2.5;
+
+// Time for the volume ramp to cover the full range (also the mute fade time)
+const uint16_t volumeRampMS = 30;
+
+// EQ bands - gains are limited to +/- maxEqDB
+enum eqBand
+{
+  EQ_BASS,
+  EQ_MID,
+  EQ_TREBLE,
+  EQ_BANDS
+};
+const float eqFrequency[EQ_BANDS] = {120.0, 1000.0, 8000.0};
+const int8_t maxEqDB = 12;
+
+// Limiter holds peaks to this level (Q15), releasing at limiterReleasePerSample
+#define LOUDNESS_LIMITER true
+const int32_t limiterThreshold = 29000;
+const int32_t limiterReleasePerSample = 2;
+
+// Biquad coefficients are Q28 (range +/- 8), samples are kept as 32 bit integers
+struct biquad
+{
+  int32_t b0, b1, b2, a1, a2;
+  bool active; // Bands set to 0dB are skipped entirely
+};
+struct biquadState
+{
+  int32_t x1, x2, y1, y2;
+  int32_t error; // Fraction dropped from the last output, carried into the next
+};
+
+// Coefficients in use (only touched by the audio task) and the next set to swap in
+biquad eqFilters[EQ_BANDS];
+biquad pendingEqFilters[EQ_BANDS];
+volatile bool eqFiltersPending = false;
+biquadState eqState[2][EQ_BANDS];
+
+int8_t eqGainDB[EQ_BANDS] = {0, 0, 0};
+volatile bool eqGainsChanged = false;
+uint32_t dspSampleRate = 44100;
+
+// Volume ramp (gains are Q15 scaled by 256 so the ramp step has some resolution)
+int32_t volumeGainTable[maxVolume + 1];
+volatile int32_t targetGain = 0;
+int32_t currentGain = 0;
+int32_t gainRampStep = 1;
+
+// Limiter envelope (Q15)
+int32_t limiterEnvelope = 0;
+
+// Load measurement, see reportDspLoad()
+uint32_t dspCycles = 0;
+uint32_t dspSamples = 0;
+
+// Work out the biquad coefficients for one band (RBJ audio EQ cookbook)
+void calculateEqBand(uint8_t band, biquad &filter)
+{
+  float gain = eqGainDB[band];
+  filter.active = (gain != 0);
+  if (!filter.active)
+    return;
+
+  float A = powf(10.0, gain / 40.0);
+  float w0 = 2.0 * PI * eqFrequency[band] / dspSampleRate;
+  float cosw0 = cosf(w0);
+  float alpha = sinf(w0) / 2.0 * M_SQRT2; // Shelf slope 1 / peak Q of 0.707
+  float sqrtA2alpha = 2.0 * sqrtf(A) * alpha;
+  float b0, b1, b2, a0, a1, a2;
+
+  if (band == EQ_BASS)
+  {
+    b0 = A * ((A + 1) - (A - 1) * cosw0 + sqrtA2alpha);
+    b1 = 2 * A * ((A - 1) - (A + 1) * cosw0);
+    b2 = A * ((A + 1) - (A - 1) * cosw0 - sqrtA2alpha);
+    a0 = (A + 1) + (A - 1) * cosw0 + sqrtA2alpha;
+    a1 = -2 * ((A - 1) + (A + 1) * cosw0);
+    a2 = (A + 1) + (A - 1) * cosw0 - sqrtA2alpha;
+  }
+  else if (band == EQ_TREBLE)
+  {
+    b0 = A * ((A + 1) + (A - 1) * cosw0 + sqrtA2alpha);
+    b1 = -2 * A * ((A - 1) + (A + 1) * cosw0);
+    b2 = A * ((A + 1) + (A - 1) * cosw0 - sqrtA2alpha);
+    a0 = (A + 1) - (A - 1) * cosw0 + sqrtA2alpha;
+    a1 = 2 * ((A - 1) - (A + 1) * cosw0);
+    a2 = (A + 1) - (A - 1) * cosw0 - sqrtA2alpha;
+  }
+  else
+  {
+    b0 = 1 + alpha * A;
+    b1 = -2 * cosw0;
+    b2 = 1 - alpha * A;
+    a0 = 1 + alpha / A;
+    a1 = -2 * cosw0;
+    a2 = 1 - alpha / A;
+  }
+
+  const float q28 = 268435456.0;
+  filter.b0 = (b0 / a0) * q28;
+  filter.b1 = (b1 / a0) * q28;
+  filter.b2 = (b2 / a0) * q28;
+  filter.a1 = (a1 / a0) * q28;
+  filter.a2 = (a2 / a0) * q28;
+}
+
+// Recalculate all bands, the audio task picks them up before its next sample
+void updateEqFilters()
+{
+  for (uint8_t band = 0; band < EQ_BANDS; band++)
+    calculateEqBand(band, pendingEqFilters[band]);
+  eqFiltersPending = true;
+}
+
+// Set the gain (dB) of one EQ band and remember it - called from the UI task, the audio
+// task works out the new filters
+void setEqBand(uint8_t band, int8_t gainDB)
+{
+  eqGainDB[band] = constrain(gainDB, -maxEqDB, maxEqDB);
+  preferences.putChar(band == EQ_BASS ? "eqBass" : band == EQ_MID ? "eqMid" : "eqTreble", eqGainDB[band]);
+  eqGainsChanged = true;
+}
+
+// Filters depend on the sample rate and the EQ gains, called by the audio task after
+// each wakeup
+void setDspSampleRate(uint32_t sampleRate)
+{
+  if (sampleRate != 0 && sampleRate != dspSampleRate)
+  {
+    dspSampleRate = sampleRate;
+    eqGainsChanged = true;
+  }
+  if (eqGainsChanged)
+  {
+    eqGainsChanged = false;
+    updateEqFilters();
+  }
+}
+
+// Serial command 'q' (see the top of this file)
+void eqCommand()
+{
+  char line[16];
+  readCommandLine(line, sizeof(line));
+
+  const char *bandLetters = "bmt";
+  const char *band = (line[0] != '\0') ? strchr(bandLetters, line[0]) : NULL;
+  if (band != NULL && line[1] != '\0')
+    setEqBand(band - bandLetters, atoi(line + 1));
+  else if (line[0] != '\0')
+  {
+    logWarn("EQ: expected q<b|m|t><dB> (-%d to %d)", maxEqDB, maxEqDB);
+    return;
+  }
+  logInfo("EQ: bass %ddB, mid %ddB, treble %ddB", eqGainDB[EQ_BASS], eqGainDB[EQ_MID], eqGainDB[EQ_TREBLE]);
+}
+
+// Volume (0..maxVolume) - the gain ramps to the new level rather than jumping
+void setDspVolume(uint8_t volume)
+{
+  targetGain = volumeGainTable[min(volume, maxVolume)];
+}
+
+// Called from setup() before audio starts
+void setupDsp()
+{
+  // dB-linear volume curve
+  volumeGainTable[0] = 0;
+  for (uint8_t step = 1; step <= maxVolume; step++)
+    volumeGainTable[step] = powf(10.0, -volumeStepDB * (maxVolume - step) / 20.0) * 32768.0 * 256.0;
+
+  // Whole range in volumeRampMS at 44.1kHz
+  gainRampStep = max((int32_t)1, (int32_t)(volumeGainTable[maxVolume] / (44100 * volumeRampMS / 1000)));
+
+  eqGainDB[EQ_BASS] = preferences.getChar("eqBass", 0);
+  eqGainDB[EQ_MID] = preferences.getChar("eqMid", 0);
+  eqGainDB[EQ_TREBLE] = preferences.getChar("eqTreble", 0);
+  updateEqFilters();
+}
+
+// Direct form 1 biquad with error feedback - plain truncation of the output would be a
+// bias the feedback amplifies hugely at low frequencies (a DC offset of thousands with
+// the bass shelf)
+inline int32_t runBiquad(const biquad &f, biquadState &s, int32_t x)
+{
+  int64_t acc = (int64_t)f.b0 * x + (int64_t)f.b1 * s.x1 + (int64_t)f.b2 * s.x2 -
+                (int64_t)f.a1 * s.y1 - (int64_t)f.a2 * s.y2 + s.error;
+  int32_t y = acc >> 28;
+  s.error = acc - ((int64_t)y << 28);
+  s.x2 = s.x1;
+  s.x1 = x;
+  s.y2 = s.y1;
+  s.y1 = y;
+  return y;
+}
+
+inline int16_t saturate16(int32_t x)
+{
+  return (x > 32767) ? 32767 : (x < -32768) ? -32768 : x;
+}
+
+// Process one stereo sample in place (each half of the 32 bits is a channel)
+void processDsp(uint32_t *sample)
+{
+  uint32_t startCycles = ESP.getCycleCount();
+
+  if (eqFiltersPending)
+  {
+    memcpy(eqFilters, pendingEqFilters, sizeof(eqFilters));
+    memset(eqState, 0, sizeof(eqState));
+    eqFiltersPending = false;
+  }
+
+  // Volume ramp
+  if (currentGain < targetGain)
+    currentGain = min(currentGain + gainRampStep, (int32_t)targetGain);
+  else if (currentGain > targetGain)
+    currentGain = max(currentGain - gainRampStep, (int32_t)targetGain);
+
+  int32_t channel[2] = {(int16_t)(*sample >> 16), (int16_t)(*sample & 0xFFFF)};
+  int32_t peak = 0;
+
+  for (uint8_t ch = 0; ch < 2; ch++)
+  {
+    int32_t x = channel[ch];
+    for (uint8_t band = 0; band < EQ_BANDS; band++)
+    {
+      if (eqFilters[band].active)
+        x = runBiquad(eqFilters[band], eqState[ch][band], x);
+    }
+    x = ((int64_t)x * currentGain) >> 23;
+    channel[ch] = x;
+    peak = max(peak, (int32_t)abs(x));
+  }
+
+  // Peak limiter - instant attack, slow release
+  if (LOUDNESS_LIMITER)
+  {
+    limiterEnvelope = max(peak, limiterEnvelope - limiterReleasePerSample);
+    if (limiterEnvelope > limiterThreshold)
+    {
+      int32_t limiterGain = (limiterThreshold << 15) / limiterEnvelope;
+      channel[0] = ((int64_t)channel[0] * limiterGain) >> 15;
+      channel[1] = ((int64_t)channel[1] * limiterGain) >> 15;
+    }
+  }
+
+  *sample = ((uint32_t)(uint16_t)saturate16(channel[0]) << 16) | (uint16_t)saturate16(channel[1]);
+
+  dspCycles += ESP.getCycleCount() - startCycles;
+  dspSamples++;
+}
+
+// Average cost per stereo sample since the last report, against the time available
+// per sample at the current CPU clock and sample rate. This is the only cycle figure to
+// go by - the native test_audio_dsp only times the same code on the host, in ns/sample.
+void reportDspLoad()
+{
+  if (dspSamples == 0)
+    return;
+
+  uint32_t cyclesPerSample = dspCycles / dspSamples;
+  uint32_t budget = (getCpuFrequencyMhz() * 1000000UL) / dspSampleRate;
+  logInfo("DSP: %u cycles/sample (%u%% of %u at %uMHz, %uHz)", cyclesPerSample,
+          (cyclesPerSample * 100) / budget, budget, getCpuFrequencyMhz(), dspSampleRate);
+  dspCycles = 0;
+  dspSamples = 0;
+}
@@ -0,0 +1,157 @@
+// Stream buffer health, in time rather than bytes
+// How safe the buffer is depends on the stream: 32KB is two seconds of a 128k stream but
+// under one of a 320k stream. The audio task samples what is buffered (the stream ring
+// plus the decoder's input buffer) every bufferHealthSampleMS and converts it to
+// milliseconds of audio at the stream's bitrate - the icy-br header, or the rate the
+// decoder is actually consuming when a station doesn't send one. The level and its slope
+// are smoothed (EWMA) and the slope gives a predicted time to underrun.
+// Used by the buffer icon, the CPU governor and the stream watchdog.
+#include <Arduino.h>
+#include "main.h"
+
+const unsigned long bufferHealthSampleMS = 100;
+
+// EWMA weights per sample: the level settles in a few hundred ms, the slope over a couple
+// of seconds (network reads arrive in bursts)
+const float bufferLevelAlpha = 0.25;
+const float bufferSlopeAlpha = 0.05;
+
+// Slopes shallower than this (ms of audio per second) are noise, not a trend
+const int32_t bufferSlopeDeadbandMS = 50;
+
+// Predictions older than this are not used (nothing playing, or paused)
+const unsigned long bufferHealthStaleMS = 500;
+
+// Buffer icon: red / amber below these (capped at a share of what the ring can hold,
+// so a small low latency ring can still show green)
+const uint32_t bufferRedMS = 1500;
+const uint32_t bufferAmberMS = 4000;
+const uint8_t bufferRedCapacityPercent = 30;
+const uint8_t bufferAmberCapacityPercent = 60;
+const uint32_t bufferRedUnderrunMS = 3000;
+const uint32_t bufferAmberUnderrunMS = 15000;
+
+// Never, as far as we can tell
+const uint32_t noUnderrun = UINT32_MAX;
+
+struct bufferHealth
+{
+  uint32_t bufferedMS;   // Smoothed audio buffered
+  int32_t slopeMSPerSec; // Smoothed change in bufferedMS per second
+  uint32_t underrunMS;   // Predicted time until the buffer runs dry (noUnderrun if not falling)
+  uint32_t capacityMS;   // What the stream ring holds when full
+  uint16_t kbps;         // Bitrate used for the conversion
+  bool valid;
+};
+
+bufferHealth health;
+portMUX_TYPE bufferHealthMux = portMUX_INITIALIZER_UNLOCKED;
+unsigned long bufferHealthMillis = 0;
+
+// Query: consistent copy of the latest estimate (from any task)
+void getBufferHealth(bufferHealth &snapshot)
+{
+  portENTER_CRITICAL(&bufferHealthMux);
+  snapshot = health;
+  portEXIT_CRITICAL(&bufferHealthMux);
+  snapshot.valid = snapshot.valid && millis() - bufferHealthMillis < bufferHealthStaleMS;
+}
+
+// Predicted time to underrun, noUnderrun if unknown or not falling
+uint32_t predictedUnderrunMS()
+{
+  bufferHealth snapshot;
+  getBufferHealth(snapshot);
+  return snapshot.valid ? snapshot.underrunMS : noUnderrun;
+}
+
+// Bitrate of the active stream: from its headers, otherwise measured at the decoder
+uint16_t bufferBitrateKbps(bool newStream, bool restart)
+{
+  static unsigned long prevMillis = 0;
+  static uint32_t prevDecodeBytes = 0;
+  static float measuredKbps = 0;
+
+  if (newStream)
+    measuredKbps = 0;
+  if (restart)
+  {
+    prevMillis = millis();
+    prevDecodeBytes = decodeBytesTotal;
+  }
+
+  // The decoder reads at the playback rate once it is running
+  unsigned long elapsed = millis() - prevMillis;
+  if (elapsed >= 1000)
+  {
+    float kbps = ((decodeBytesTotal - prevDecodeBytes) * 8.0) / elapsed;
+    if (kbps > 0)
+      measuredKbps = (measuredKbps == 0) ? kbps : measuredKbps + (kbps - measuredKbps) * 0.2;
+    prevMillis = millis();
+    prevDecodeBytes = decodeBytesTotal;
+  }
+
+  if (streamingBitrateKbps > 0)
+    return streamingBitrateKbps;
+  return max((uint16_t)measuredKbps, (uint16_t)8);
+}
+
+// Called by the audio task while playing, with the bytes waiting in the decoder
+void serviceBufferHealth(uint32_t decoderBytes)
+{
+  static unsigned long prevMillis = 0;
+  static uint32_t prevGeneration = 0;
+  static float level = 0;
+  static float slope = 0;
+
+  unsigned long elapsed = millis() - prevMillis;
+  if (elapsed < bufferHealthSampleMS)
+    return;
+
+  // A new station starts from scratch, as does a gap in sampling
+  bool newStream = prevGeneration != streamingGeneration;
+  bool restart = newStream || elapsed > bufferHealthStaleMS;
+  prevGeneration = streamingGeneration;
+  prevMillis = millis();
+
+  uint16_t kbps = bufferBitrateKbps(newStream, restart);
+  float bufferedMS = ((ringFilled(streamRing) + decoderBytes) * 8.0) / kbps;
+  if (restart)
+  {
+    level = bufferedMS;
+    slope = 0;
+  }
+  else
+  {
+    float prevLevel = level;
+    level += (bufferedMS - level) * bufferLevelAlpha;
+    slope += (((level - prevLevel) * 1000) / elapsed - slope) * bufferSlopeAlpha;
+  }
+
+  bufferHealth estimate;
+  estimate.bufferedMS = level;
+  estimate.slopeMSPerSec = slope;
+  estimate.underrunMS = (slope < -bufferSlopeDeadbandMS) ? (uint32_t)((level * 1000) / -slope) : noUnderrun;
+  estimate.capacityMS = (streamRing.size * 8) / kbps;
+  estimate.kbps = kbps;
+  estimate.valid = true;
+
+  portENTER_CRITICAL(&bufferHealthMux);
+  health = estimate;
+  bufferHealthMillis = millis();
+  portEXIT_CRITICAL(&bufferHealthMux);
+}
+
+void reportBufferHealth()
+{
+  bufferHealth snapshot;
+  getBufferHealth(snapshot);
+  if (!snapshot.valid)
+    return;
+  if (snapshot.underrunMS == noUnderrun)
+    logInfo("Buffer %ums of %ums at %ukbps, %+dms/s", snapshot.bufferedMS, snapshot.capacityMS, snapshot.kbps,
+            snapshot.slopeMSPerSec);
+  else
+    logInfo("Buffer %ums of %ums at %ukbps, %+dms/s, underrun in %ums", snapshot.bufferedMS, snapshot.capacityMS,
+            snapshot.kbps, snapshot.slopeMSPerSec, snapshot.underrunMS);
+}
@@ -27,6 +27,8 @@ bool checkForSettingsPressed(uint16_t x, uint16_t y);
 void checkMainButtons(uint16_t x, uint16_t y);
 void checkSettingsButtons(uint16_t x, uint16_t y);
 void toggleMute();
+bool checkForJumpToLivePressed(uint16_t x, uint16_t y);
+void unpauseForVolume();
 void calculateDisplayBuffer();
 void resetDisplayBuffer();
 
@@ -37,7 +39,7 @@ TaskHandle_t buttonHandlerTaskHandle;
 void buttonHandlerTask(void *parameter)
 {
   static unsigned long prevMillis = 0;
-  Serial.println("Started buttonHandlerTask");
+  logInfo("Started buttonHandlerTask");
 
   // Loop forever - this is now essentially the main loop of the program
   while (1)
@@ -46,11 +48,19 @@ void buttonHandlerTask(void *parameter)
     // Ensure lower priority tasks can run
     // - yield() will only give way to higher priority tasks, delay() allows all tasks to run
 
-    vTaskDelay(50 / portTICK_PERIOD_MS);
+    // Station/track/bitrate changes are drawn as soon as they arrive
+    processUiEvent(50 / portTICK_PERIOD_MS);
+    drawSpectrum();
 
     yield();
     calculateDisplayBuffer(); // Maybe this should be its own task - but would require a semapore
 
+    yield();
+    serviceTelemetry();
+
+    yield();
+    serviceAlarms();
+
     yield();
     if (buttonPressed)
     {
@@ -69,7 +79,8 @@ void buttonHandlerTask(void *parameter)
     if (millis() - prevMillis > 15000)
     {
       unsigned long remainingStack = uxTaskGetStackHighWaterMark(NULL);
-      Serial.printf("ButtonHandler Free stack:%lu\n", remainingStack);
+      logInfo("ButtonHandler Free stack:%lu", remainingStack);
+      reportUiEvents();
       prevMillis = millis();
     }
   }
@@ -95,7 +106,7 @@ void clearPressedButtons()
 {
   if (pressedButtonBitMap > 0)
   {
-    Serial.printf("Clearing pressed button(s) : %d\n", pressedButtonBitMap);
+    logInfo("Clearing pressed button(s) : %d", pressedButtonBitMap);
 
     if (pressedButtonBitMap & BUTTON_CHANNEL_DOWN_PRESSED)
     {
@@ -161,6 +172,7 @@ void checkMainButtons(uint16_t x, uint16_t y)
 {
   if (checkForMutePressed(x, y))
   {
+    playEarcon(EARCON_CLICK);
     return;
   }
   else if (checkForVolumeDownPressed(x, y))
@@ -183,11 +195,20 @@ void checkMainButtons(uint16_t x, uint16_t y)
   {
     pressedButtonBitMap |= BUTTON_SETTINGS_PRESSED;
   }
+  else if (checkForJumpToLivePressed(x, y))
+  {
+    playEarcon(EARCON_CLICK);
+    return;
+  }
   else
   {
-    Serial.println("No matching buttons pressed");
+    logInfo("No matching buttons pressed");
     pressedButtonBitMap = 0;
+    return;
   }
+
+  // Something to hear as well as see
+  playEarcon(EARCON_CLICK);
 }
 
 // Checks for settings buttons when settings selected
@@ -208,7 +229,7 @@ void checkSettingsButtons(uint16_t x, uint16_t y)
   }
   else
   {
-    Serial.println("DEBUG: No matching settings buttons pressed");
+    logDebug("No matching settings buttons pressed");
 
     // Clear settings menu if no matching buttons pressed - including main screen
     if (settingsSelected)
@@ -224,7 +245,7 @@ boolean checkForMutePressed(uint16_t x, uint16_t y)
   // Has the Mute button been pressed?
   if (isMuteButtonPressed(x, y))
   {
-    Serial.println("Mute pressed");
+    logInfo("Mute pressed");
     toggleMute();
     return true;
   }
@@ -238,11 +259,11 @@ boolean checkForVolumeDownPressed(uint16_t x, uint16_t y)
   {
     if (currentVolume > 0)
       currentVolume--;
-    Serial.printf("Volume Down pressed, volume = %d\n", currentVolume);
-    audio.setVolume(currentVolume);
+    logInfo("Volume Down pressed, volume = %d", currentVolume);
+    unpauseForVolume();
+    setDspVolume(currentVolume);
     displayVolumeDownPressed();
     displayVolumeUp(); // Clear Up
-    displayMuteOff();  // Clear Down
     buttonPressed = true;
     buttonLastPressed = millis();
     return true;
@@ -257,11 +278,11 @@ boolean checkForVolumeUpPressed(uint16_t x, uint16_t y)
   {
     if (currentVolume < maxVolume)
       currentVolume++;
-    Serial.printf("Volume Up pressed, volume = %d\n", currentVolume);
-    audio.setVolume(currentVolume);
+    logInfo("Volume Up pressed, volume = %d", currentVolume);
+    unpauseForVolume();
+    setDspVolume(currentVolume);
     displayVolumeUpPressed();
     displayVolumeDown(); // Clear Down
-    displayMuteOff();    // Clear Mute
     buttonPressed = true;
     buttonLastPressed = millis();
     return true;
@@ -274,7 +295,7 @@ boolean checkForBrightnessDownPressed(uint16_t x, uint16_t y)
   // Has the Brightness Down button been pressed?
   if (isBrightnessDownButtonPressed(x, y))
   {
-    Serial.printf("Brightness Down pressed\n");
+    logInfo("Brightness Down pressed");
     displayBrightnessDownPressed();
     decrementScreenBrightness();
 
@@ -290,7 +311,7 @@ boolean checkForBrightnessUpPressed(uint16_t x, uint16_t y)
   // Has the Brightness Down button been pressed?
   if (isBrightnessUpButtonPressed(x, y))
   {
-    Serial.printf("Brightness Up pressed\n");
+    logInfo("Brightness Up pressed");
     displayBrightnessUpPressed();
     incrementScreenBrightness();
 
@@ -306,14 +327,17 @@ boolean checkForChannelDownPressed(uint16_t x, uint16_t y)
   // Has the Channel Down (prev) Button been pressed?
   if (isPrevButtonPressed(x, y))
   {
-    Serial.println("Channel Down (prev) Button Pressed");
-    changeStation(-1);
+    logInfo("Channel Down (prev) Button Pressed");
+
+    // Clear existing track information before changing channel (a warm standby
+    // station can report its details straight away)
+    discardUiEvents();
     resetDisplayBuffer();
     clearBitRate();
-
-    // Clear existing track information after changing channel
     displayTrackArtist("");
 
+    changeStation(-1);
+
     displayChannelDownPressed();
     buttonPressed = true;
     buttonLastPressed = millis();
@@ -327,14 +351,17 @@ boolean checkForChannelUpPressed(uint16_t x, uint16_t y)
   // Has the Channel Up (next) Button been pressed?
   if (isNextButtonPressed(x, y))
   {
-    Serial.println("Channel Up (next) Button Pressed");
-    changeStation(+1);
+    logInfo("Channel Up (next) Button Pressed");
+
+    // Clear existing track information before changing channel (a warm standby
+    // station can report its details straight away)
+    discardUiEvents();
     resetDisplayBuffer();
     clearBitRate();
-
-    // Clear existing track information after changing channel
     displayTrackArtist("");
 
+    changeStation(+1);
+
     displayChannelUpPressed();
     buttonPressed = true;
     buttonLastPressed = millis();
@@ -348,7 +375,7 @@ boolean checkForSettingsPressed(uint16_t x, uint16_t y)
   // Has Settings button been pressed?
   if (isSettingsButtonPressed(x, y))
   {
-    Serial.printf("Settings button pressed\n");
+    logInfo("Settings button pressed");
     displaySettingsPressed();
 
     buttonPressed = true;
@@ -358,19 +385,59 @@ boolean checkForSettingsPressed(uint16_t x, uint16_t y)
   return false;
 }
 
+// With TIMESHIFT, mute pauses the programme (it keeps being recorded) and unmute resumes it
+// - a long mute also winds the radio down to save power (see powerSave.h)
 void toggleMute()
 {
   if (!muted)
   {
     muted = true;
-    audio.setVolume(0);
+    if (TIMESHIFT)
+      pausePlayback();
+    else
+      setDspVolume(0);
+    setPowerSaveMute(true);
     displayMuteOn();
   }
   else
   {
     muted = false;
-    audio.setVolume(currentVolume);
+    setPowerSaveMute(false);
+    if (TIMESHIFT)
+      resumePlayback();
+    else
+      setDspVolume(currentVolume);
     displayMuteOff();
   }
   volumeLastChanged = millis();
+}
+
+// Changing the volume takes mute off - with TIMESHIFT that also carries on playing
+// from where it was paused
+void unpauseForVolume()
+{
+  if (muted || timeshiftPaused)
+  {
+    muted = false;
+    setPowerSaveMute(false);
+    if (timeshiftPaused)
+      resumePlayback();
+  }
+  displayMuteOff();
+}
+
+// Tapping the station name while paused or behind live goes back to the live programme
+bool checkForJumpToLivePressed(uint16_t x, uint16_t y)
+{
+  if (TIMESHIFT && isStationNamePressed(x, y) && timeshifting())
+  {
+    logInfo("Jump to live pressed");
+    jumpToLive();
+    muted = false;
+    setPowerSaveMute(false);
+    displayMuteOff();
+    buttonLastPressed = millis();
+    return true;
+  }
+  return false;
 }
\ No newline at end of file
@@ -19,7 +19,7 @@ TaskHandle_t displayClockTaskHandle;
 // This is the task that we will start running (on Core 1, don't use Core 0)
 void displayClockTask(void *parameter)
 {
-  Serial.println("Started displayClockTask");
+  logInfo("Started displayClockTask");
 
   // Loop forever
   while (1)
@@ -33,7 +33,7 @@ void displayClockTask(void *parameter)
 
     // Temporarily display stack size - can remove later
     unsigned long remainingStack = uxTaskGetStackHighWaterMark(NULL);
-    Serial.printf("Clock Free stack:%lu\n", remainingStack);
+    logInfo("Clock Free stack:%lu", remainingStack);
   }
 }
 
@@ -63,7 +63,7 @@ void getLocalTime()
 
     if (!getLocalTime(&timeinfo))
     {
-      Serial.println("*** printLocalTime() - Failed to obtain time");
+      logWarn("*** printLocalTime() - Failed to obtain time");
     }
     else
     {
@@ -73,7 +73,7 @@ void getLocalTime()
   }
   else
   {
-    Serial.println("*** printLocalTime() - WiFi NOT connected");
+    logWarn("*** printLocalTime() - WiFi NOT connected");
   }
 }
 
@@ -0,0 +1,220 @@
+// CPU clock governor (run by the audio task once a second)
+// Most of the time the radio is decoding a modest MP3 stream, and while muted or paused
+// it isn't decoding at all, so the full clock is wasted. The governor picks the lowest
+// of 80/160/240MHz that leaves enough headroom:
+// - idle (muted or paused) -> 80MHz, unless something else is keeping the CPU busy.
+//   Connecting to a station and prebuffering aren't idle: a TLS handshake at 80MHz
+//   takes seconds.
+// - AAC or high bitrate streams, or a crossfade (two stations' worth of decoding),
+//   never go below 160MHz
+// - the busier core more than governorUpPercent busy, the buffer health estimate
+//   predicting an underrun soon, or an underrun -> step up straight away
+// - stepping down waits until the load would still be comfortable at the lower clock
+//   for governorDownHoldMS
+// APB stays at 80MHz for all three clocks, so I2S, UART and WiFi are unaffected.
+//
+// The load is the whole CPU, not just the audio task: a tick hook on each core counts
+// the ticks that find the core's idle task running. (An idle hook can't be used the
+// way crossfade.h does for its short measurement - to see every idle moment it has to
+// keep the idle task from waiting for interrupts, which is the power this saves.)
+#include <Arduino.h>
+#include "esp_freertos_hooks.h"
+#include "main.h"
+
+// Set CPU_GOVERNOR to false to stay at the clock set in platformio.ini
+#define CPU_GOVERNOR true
+
+const uint8_t governorLevels = 3;
+const uint16_t governorMhz[governorLevels] = {80, 160, 240};
+
+const uint8_t governorUpPercent = 60;   // Busy above this - step up
+const uint8_t governorDownPercent = 45; // Projected busy at the lower clock below this - may step down
+const unsigned long governorDownHoldMS = 10000;
+const unsigned long governorIdleMS = 3000; // Muted or paused this long counts as idle (connecting doesn't)
+const uint16_t governorHighBitrateKbps = 192;
+
+// Buffer predicted to run dry within this long (see bufferHealth.h)
+const uint32_t governorUnderrunMS = 10000;
+
+uint8_t governorLevel = 1;
+unsigned long governorLevelMillis[governorLevels] = {0, 0, 0};
+uint32_t governorChanges = 0;
+
+// Tick counts per core, from the tick hooks
+TaskHandle_t governorIdleTask[2] = {NULL, NULL};
+volatile uint32_t governorTicks[2] = {0, 0};
+volatile uint32_t governorIdleTicks[2] = {0, 0};
+uint8_t governorCoreLoad[2] = {0, 0}; // Over the last second, for the report
+
+void IRAM_ATTR governorTick(uint8_t core)
+{
+  governorTicks[core]++;
+  if (xTaskGetCurrentTaskHandle() == governorIdleTask[core])
+    governorIdleTicks[core]++;
+}
+
+void IRAM_ATTR governorTickHook0()
+{
+  governorTick(0);
+}
+
+void IRAM_ATTR governorTickHook1()
+{
+  governorTick(1);
+}
+
+// Busy percentage of the busier core since the last call
+uint32_t governorCpuBusyPercent()
+{
+  static uint32_t prevTicks[2] = {0, 0};
+  static uint32_t prevIdleTicks[2] = {0, 0};
+
+  uint32_t busiest = 0;
+  for (uint8_t core = 0; core < 2; core++)
+  {
+    uint32_t ticks = governorTicks[core] - prevTicks[core];
+    uint32_t idleTicks = governorIdleTicks[core] - prevIdleTicks[core];
+    prevTicks[core] += ticks;
+    prevIdleTicks[core] += idleTicks;
+    governorCoreLoad[core] = ticks ? 100 - (min(idleTicks, ticks) * 100) / ticks : 0;
+    busiest = max(busiest, (uint32_t)governorCoreLoad[core]);
+  }
+  return busiest;
+}
+
+bool governorActive()
+{
+  return CPU_GOVERNOR && !decodeBenchmarkRunning;
+}
+
+uint8_t governorLevelFor(uint32_t mhz)
+{
+  for (uint8_t level = 0; level < governorLevels; level++)
+  {
+    if (governorMhz[level] >= mhz)
+      return level;
+  }
+  return governorLevels - 1;
+}
+
+void setGovernorLevel(uint8_t level, const char *reason)
+{
+  if (level == governorLevel)
+    return;
+  logInfo("CPU governor: %uMHz -> %uMHz (%s)", governorMhz[governorLevel], governorMhz[level], reason);
+  governorLevel = level;
+  governorChanges++;
+  setCpuFrequencyMhz(governorMhz[level]);
+}
+
+// Called by the audio task every time round its loop
+void serviceCpuGovernor(uint64_t audioLoopMicros)
+{
+  static unsigned long prevMillis = 0;
+  static uint64_t prevLoopMicros = 0;
+  static uint32_t prevUnderruns = 0;
+  static unsigned long lastPlayingMillis = 0;
+  static unsigned long canStepDownSince = 0;
+
+  unsigned long elapsed = millis() - prevMillis;
+  if (!governorActive() || elapsed < 1000)
+    return;
+
+  // Time at each clock (for the report)
+  governorLevelMillis[governorLevel] += elapsed;
+
+  // audio.loop() on its own as well, in case the tick hooks couldn't be installed
+  uint32_t busyPercent = max(governorCpuBusyPercent(), (uint32_t)(((audioLoopMicros - prevLoopMicros) / 10) / elapsed));
+  bool falling = predictedUnderrunMS() < governorUnderrunMS;
+  bool underrun = streamUnderruns != prevUnderruns;
+  prevMillis = millis();
+  prevLoopMicros = audioLoopMicros;
+  prevUnderruns = streamUnderruns;
+
+  // Playing, or on the way to it (connecting, prebuffering, an underrun)
+  bool playing = allowPlayAudio && !playbackFrozen() && !muted;
+  if (playing)
+    lastPlayingMillis = millis();
+  if (!playing && millis() - lastPlayingMillis > governorIdleMS &&
+      (busyPercent * governorMhz[governorLevel]) / governorMhz[0] < governorDownPercent)
+  {
+    canStepDownSince = 0;
+    setGovernorLevel(0, "idle");
+    return;
+  }
+
+  // Floor for what is being played
+  uint8_t floorLevel = 0;
+  char codecPath[sizeof(streamingCodecPath)];
+  streamingCodec(codecPath, sizeof(codecPath));
+  if (strstr(codecPath, ".aac") || streamingBitrateKbps >= governorHighBitrateKbps)
+    floorLevel = 1;
+  if (CROSSFADE && crossfade != CROSSFADE_IDLE)
+    floorLevel = governorLevels - 1;
+
+  if (governorLevel < floorLevel)
+  {
+    setGovernorLevel(floorLevel, "stream needs it");
+    canStepDownSince = 0;
+    return;
+  }
+
+  if (governorLevel < governorLevels - 1 &&
+      (busyPercent > governorUpPercent || underrun || falling))
+  {
+    setGovernorLevel(governorLevel + 1, underrun ? "underrun" : busyPercent > governorUpPercent ? "busy" : "buffer falling");
+    canStepDownSince = 0;
+    return;
+  }
+
+  // Would the lower clock still have headroom?
+  if (governorLevel > floorLevel &&
+      (busyPercent * governorMhz[governorLevel]) / governorMhz[governorLevel - 1] < governorDownPercent)
+  {
+    if (canStepDownSince == 0)
+      canStepDownSince = millis();
+    else if (millis() - canStepDownSince > governorDownHoldMS)
+    {
+      setGovernorLevel(governorLevel - 1, "headroom");
+      canStepDownSince = 0;
+    }
+  }
+  else
+  {
+    canStepDownSince = 0;
+  }
+}
+
+void reportCpuGovernor()
+{
+  if (!CPU_GOVERNOR)
+    return;
+
+  unsigned long secs[governorLevels];
+  unsigned long totalSecs = 0;
+  for (uint8_t level = 0; level < governorLevels; level++)
+  {
+    secs[level] = governorLevelMillis[level] / 1000;
+    totalSecs += secs[level];
+  }
+  if (totalSecs == 0)
+    return;
+  logInfo("CPU governor: %uMHz now (load core0:%u%% core1:%u%%), time at 80/160/240MHz %lus/%lus/%lus "
+          "(%lu%%/%lu%%/%lu%%) changes:%u",
+          getCpuFrequencyMhz(), governorCoreLoad[0], governorCoreLoad[1], secs[0], secs[1], secs[2],
+          (secs[0] * 100) / totalSecs, (secs[1] * 100) / totalSecs, (secs[2] * 100) / totalSecs, governorChanges);
+}
+
+// Called from setup() - start from whatever clock platformio.ini booted at
+void setupCpuGovernor()
+{
+  if (!CPU_GOVERNOR)
+    return;
+  governorLevel = governorLevelFor(getCpuFrequencyMhz());
+
+  governorIdleTask[0] = xTaskGetIdleTaskHandleForCPU(0);
+  governorIdleTask[1] = xTaskGetIdleTaskHandleForCPU(1);
+  if (esp_register_freertos_tick_hook_for_cpu(governorTickHook0, 0) != ESP_OK ||
+      esp_register_freertos_tick_hook_for_cpu(governorTickHook1, 1) != ESP_OK)
+    logWarn("CPU governor: no tick hooks, load is the audio task only");
+}
@@ -0,0 +1,385 @@
+// Crossfade between stations on a channel change
+// There is only one decoder (the audio library's MP3/AAC decoders keep global state), so
+// the two stations can't be decoded side by side. Instead, while the new station
+// prebuffers (in a standby slot, see streamFetch.h) the outgoing station plays on with
+// the decoder running ahead of I2S, until crossfadeMS of its audio is held here. The
+// decoder is then switched to the new station and the held audio is mixed into its first
+// crossfadeMS with equal-power (sine/cosine) gains.
+//
+// All of the sample handling is done by the audio task, in the audio_process_i2s() hook,
+// before the DSP - so volume, EQ and the limiter apply to the mix.
+//
+// Serial command 'x' shows the overlap, 'x<ms>' sets it (x0 turns crossfading off).
+#include <Arduino.h>
+#include "main.h"
+#include "esp_freertos_hooks.h"
+
+// Set CROSSFADE to false to go back to stopping the old station straight away
+#define CROSSFADE true
+
+// Overlap (0 turns it off), stored as "crossfadeMS" in preferences
+const uint16_t defaultCrossfadeMS = 1500;
+
+// Longest overlap the buffer is sized for (stereo samples at up to 48kHz). Without PSRAM
+// the buffer comes out of internal RAM, so the overlap is kept short.
+const uint16_t maxCrossfadeMS = 3000;
+const uint16_t maxCrossfadeMSNoPsram = 250;
+const uint32_t crossfadeMaxSampleRate = 48000;
+
+// Internal RAM left over after the buffer is taken, for the network stack and TLS -
+// below this the channel change is a plain cut instead
+const uint32_t crossfadeHeapReserve = 24000;
+
+// Give up on the fade (play the new station straight) if it takes longer than this
+// to start after the old station is stopped
+const unsigned long crossfadeSwitchTimeoutMS = 1000;
+
+enum crossfadeState
+{
+  CROSSFADE_IDLE,
+  CROSSFADE_FILLING,   // Outgoing station plays on, decoder running ahead to fill the buffer
+  CROSSFADE_SWITCHING, // Outgoing decoder stopped, waiting for the first incoming sample
+  CROSSFADE_MIXING     // Buffered outgoing audio mixed into the incoming station
+};
+
+volatile crossfadeState crossfade = CROSSFADE_IDLE;
+volatile bool crossfadeMixDone = false; // Set by the hook, reported by the audio task
+uint16_t crossfadeMS = defaultCrossfadeMS;
+
+// Buffer of outgoing (pre-DSP) stereo samples - only touched by the audio task, and only
+// allocated or freed with the audio mutex held
+uint32_t *crossfadeBuffer = NULL;
+uint32_t crossfadeCapacity = 0;
+bool crossfadeBufferInternal = false; // Not PSRAM: given back after each change
+uint32_t crossfadeHead = 0; // Free running, like the rings
+uint32_t crossfadeTail = 0;
+uint32_t crossfadeTarget = 0; // Samples of overlap for this change
+uint32_t crossfadeSampleRate = 0;
+bool crossfadeDecimate = false;
+
+// Mix position (Q16 fraction through the fade) and step per sample
+uint32_t crossfadePhase = 0;
+uint32_t crossfadeStep = 0;
+
+// Equal-power gain curve: a quarter sine, Q15, read with linear interpolation
+const uint8_t crossfadeCurvePoints = 64;
+int16_t crossfadeCurve[crossfadeCurvePoints + 1];
+
+// Timings for the report
+int64_t crossfadeRequestMicros = 0;
+int64_t crossfadeStoppedMicros = 0;
+int64_t crossfadeMixStartMicros = 0;
+uint32_t crossfadeMixCycles = 0;
+uint32_t crossfadeMixSamples = 0;
+
+// Load during the overlap: each core's idle time per 100ms window (measured by idle hooks
+// installed for the duration) and the free heap, keeping the worst seen
+const unsigned long crossfadeLoadWindowMS = 100;
+volatile int64_t idleHookMicros[2] = {0, 0};
+volatile int64_t idleHookLastMicros[2] = {0, 0};
+int64_t crossfadeWindowStartMicros = 0;
+int64_t crossfadeWindowIdleMicros[2] = {0, 0};
+uint8_t crossfadePeakLoad[2] = {0, 0};
+uint32_t crossfadeMinFreeHeap = 0;
+uint32_t crossfadeStartFreeHeap = 0;
+
+// Called by the idle task over and over when there is nothing else to do. Gaps longer than
+// a few hundred microseconds mean another task ran in between and don't count as idle.
+bool crossfadeIdleHook(uint8_t core)
+{
+  int64_t now = esp_timer_get_time();
+  int64_t gap = now - idleHookLastMicros[core];
+  if (gap < 200)
+    idleHookMicros[core] += gap;
+  idleHookLastMicros[core] = now;
+  return false; // Keep being called (no wait for interrupt)
+}
+
+bool crossfadeIdleHook0()
+{
+  return crossfadeIdleHook(0);
+}
+
+bool crossfadeIdleHook1()
+{
+  return crossfadeIdleHook(1);
+}
+
+uint32_t crossfadeFilled()
+{
+  return crossfadeHead - crossfadeTail;
+}
+
+// Longest overlap this board can hold
+uint16_t crossfadeLimitMS()
+{
+  return psramFound() ? maxCrossfadeMS : maxCrossfadeMSNoPsram;
+}
+
+// Called from setup(). The buffer isn't allocated here: without PSRAM it would hold
+// 48KB of internal RAM for the whole time the radio is on, for a second or so of use
+// on each channel change.
+void setupCrossfade()
+{
+  if (!CROSSFADE)
+    return;
+
+  for (uint8_t i = 0; i <= crossfadeCurvePoints; i++)
+    crossfadeCurve[i] = 32767 * sin(HALF_PI * i / crossfadeCurvePoints);
+
+  crossfadeMS = min(preferences.getUShort("crossfadeMS", defaultCrossfadeMS), crossfadeLimitMS());
+  logInfo("Crossfade: %ums overlap, buffer %u bytes%s (free heap %u, largest block %u)", crossfadeMS,
+          (crossfadeMaxSampleRate * crossfadeMS / 1000) * sizeof(uint32_t), psramFound() ? " in PSRAM" : " when needed",
+          heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT),
+          heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+}
+
+// Buffer big enough for crossfadeMS, called with the audio mutex held. In PSRAM it's
+// allocated the first time and kept (re-allocated if the overlap has been made longer).
+// In internal RAM it's only taken if enough is left over, and serviceCrossfade() frees it
+// again once the change is done.
+bool reserveCrossfadeBuffer()
+{
+  uint32_t capacity = (crossfadeMaxSampleRate * crossfadeMS) / 1000;
+  if (crossfadeBuffer != NULL && crossfadeCapacity >= capacity)
+    return true;
+
+  free(crossfadeBuffer);
+  crossfadeBuffer = NULL;
+  crossfadeCapacity = 0;
+  size_t bytes = capacity * sizeof(uint32_t);
+  if (psramFound())
+    crossfadeBuffer = (uint32_t *)heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  crossfadeBufferInternal = crossfadeBuffer == NULL;
+  size_t largestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (crossfadeBuffer == NULL && largestBlock >= bytes + crossfadeHeapReserve)
+    crossfadeBuffer = (uint32_t *)heap_caps_malloc(bytes, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (crossfadeBuffer == NULL)
+  {
+    logWarn("Crossfade: no room for %u byte buffer (free heap %u, largest block %u), cutting instead", bytes,
+            heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT), largestBlock);
+    return false;
+  }
+  crossfadeCapacity = capacity;
+  return true;
+}
+
+// Internal RAM buffer no longer needed (audio task, between changes)
+void releaseCrossfadeBuffer()
+{
+  xSemaphoreTake(xMutex, portMAX_DELAY);
+  if (crossfade == CROSSFADE_IDLE && crossfadeBufferInternal)
+  {
+    free(crossfadeBuffer);
+    crossfadeBuffer = NULL;
+    crossfadeCapacity = 0;
+    crossfadeBufferInternal = false;
+  }
+  xSemaphoreGive(xMutex);
+}
+
+// Can a channel change be crossfaded right now? (The old station has to be playing, and
+// there has to be room for the buffer.) Called with the audio mutex held.
+bool crossfadeAvailable()
+{
+  return CROSSFADE && crossfadeMS > 0 && crossfade == CROSSFADE_IDLE && audio.isRunning() && !timeshifting() &&
+         reserveCrossfadeBuffer();
+}
+
+// Serial command 'x' (see the top of this file)
+void crossfadeCommand()
+{
+  char line[16];
+  readCommandLine(line, sizeof(line));
+  if (line[0] != '\0')
+  {
+    if (!isdigit(line[0]))
+    {
+      logWarn("Crossfade: expected x<ms> (0 to %u)", crossfadeLimitMS());
+      return;
+    }
+    crossfadeMS = min((uint16_t)min(atol(line), 65535L), crossfadeLimitMS());
+    preferences.putUShort("crossfadeMS", crossfadeMS);
+  }
+  logInfo("Crossfade: %ums overlap%s", crossfadeMS, crossfadeMS == 0 ? " (off)" : "");
+}
+
+// Called by connectToStation() (with the audio mutex held) instead of stopping the decoder
+void startCrossfade()
+{
+  crossfadeSampleRate = audio.getSampleRate();
+  if (crossfadeSampleRate == 0)
+    crossfadeSampleRate = 44100;
+  crossfadeTarget = min((crossfadeSampleRate * crossfadeMS) / 1000, crossfadeCapacity);
+  crossfadeHead = 0;
+  crossfadeTail = 0;
+  crossfadeDecimate = false;
+  crossfadeMixCycles = 0;
+  crossfadeMixSamples = 0;
+  crossfadeRequestMicros = esp_timer_get_time();
+
+  // Load measurement for the duration of the overlap
+  crossfadeWindowStartMicros = crossfadeRequestMicros;
+  for (uint8_t core = 0; core < 2; core++)
+  {
+    idleHookLastMicros[core] = crossfadeRequestMicros;
+    crossfadeWindowIdleMicros[core] = idleHookMicros[core];
+    crossfadePeakLoad[core] = 0;
+  }
+  esp_register_freertos_idle_hook_for_cpu(crossfadeIdleHook0, 0);
+  esp_register_freertos_idle_hook_for_cpu(crossfadeIdleHook1, 1);
+  crossfadeStartFreeHeap = ESP.getFreeHeap();
+  crossfadeMinFreeHeap = crossfadeStartFreeHeap;
+
+  crossfade = CROSSFADE_FILLING;
+}
+
+void endCrossfade(const char *outcome)
+{
+  esp_deregister_freertos_idle_hook_for_cpu(crossfadeIdleHook0, 0);
+  esp_deregister_freertos_idle_hook_for_cpu(crossfadeIdleHook1, 1);
+  crossfade = CROSSFADE_IDLE;
+
+  logInfo("Crossfade %s: fill %lldms, switch gap %lldms, mix %u cycles/sample, peak load core0:%u%% core1:%u%%, "
+          "min free heap %u (%d during overlap)",
+          outcome, (crossfadeStoppedMicros - crossfadeRequestMicros) / 1000,
+          (crossfadeMixStartMicros - crossfadeStoppedMicros) / 1000,
+          crossfadeMixSamples ? crossfadeMixCycles / crossfadeMixSamples : 0,
+          crossfadePeakLoad[0], crossfadePeakLoad[1],
+          crossfadeMinFreeHeap, (int32_t)crossfadeMinFreeHeap - (int32_t)crossfadeStartFreeHeap);
+}
+
+// A hard cut (eg another channel change before the fade finished) - drop what is held
+void cancelCrossfade()
+{
+  crossfadeMixDone = false;
+  if (crossfade == CROSSFADE_IDLE)
+    return;
+  if (crossfade == CROSSFADE_FILLING)
+    crossfadeStoppedMicros = esp_timer_get_time();
+  if (crossfade != CROSSFADE_MIXING)
+    crossfadeMixStartMicros = esp_timer_get_time();
+  endCrossfade("cancelled");
+}
+
+// Called from audio_process_i2s() for every decoded sample, before the DSP.
+// Returns false if the sample has been kept back rather than played.
+bool crossfadeSample(uint32_t *sample)
+{
+  switch (crossfade)
+  {
+  case CROSSFADE_FILLING:
+  {
+    // Run the decoder at twice real time until the buffer holds the overlap: every
+    // sample goes in, only every other one comes out to be played
+    crossfadeBuffer[crossfadeHead++ % crossfadeCapacity] = *sample;
+    crossfadeDecimate = !crossfadeDecimate;
+    if (crossfadeFilled() <= crossfadeTarget && crossfadeDecimate)
+      return false;
+    *sample = crossfadeBuffer[crossfadeTail++ % crossfadeCapacity];
+    return true;
+  }
+
+  case CROSSFADE_SWITCHING:
+    // First sample of the new station
+    crossfadeMixStartMicros = esp_timer_get_time();
+    stationSwitchLatencyMicros = crossfadeMixStartMicros - crossfadeRequestMicros;
+    if (audio.getSampleRate() != crossfadeSampleRate || crossfadeFilled() == 0)
+    {
+      // Held audio would play at the wrong speed
+      endCrossfade("skipped (sample rate changed)");
+      return true;
+    }
+    crossfadePhase = 0;
+    crossfadeStep = (65536UL * crossfadeCurvePoints) / crossfadeFilled();
+    crossfade = CROSSFADE_MIXING;
+    // Fall through
+
+  case CROSSFADE_MIXING:
+  {
+    uint32_t startCycles = ESP.getCycleCount();
+
+    // Equal-power gains: incoming rises along the sine, outgoing falls along the cosine
+    uint32_t index = crossfadePhase >> 16;
+    int32_t fraction = (crossfadePhase >> 1) & 0x7FFF;
+    int32_t gainIn = crossfadeCurve[index] + (((crossfadeCurve[index + 1] - crossfadeCurve[index]) * fraction) >> 15);
+    int32_t gainOut = crossfadeCurve[crossfadeCurvePoints - index] +
+                      (((crossfadeCurve[crossfadeCurvePoints - index - 1] - crossfadeCurve[crossfadeCurvePoints - index]) * fraction) >> 15);
+    crossfadePhase = min(crossfadePhase + crossfadeStep, (uint32_t)(crossfadeCurvePoints - 1) << 16 | 0xFFFF);
+
+    uint32_t outgoing = crossfadeBuffer[crossfadeTail++ % crossfadeCapacity];
+    int32_t left = ((int16_t)(*sample >> 16) * gainIn + (int16_t)(outgoing >> 16) * gainOut) >> 15;
+    int32_t right = ((int16_t)(*sample & 0xFFFF) * gainIn + (int16_t)(outgoing & 0xFFFF) * gainOut) >> 15;
+    *sample = ((uint32_t)(uint16_t)saturate16(left) << 16) | (uint16_t)saturate16(right);
+
+    crossfadeMixCycles += ESP.getCycleCount() - startCycles;
+    crossfadeMixSamples++;
+    if (crossfadeFilled() == 0)
+    {
+      crossfade = CROSSFADE_IDLE;
+      crossfadeMixDone = true;
+    }
+    return true;
+  }
+
+  default:
+    return true;
+  }
+}
+
+// Called by the audio task after each round of audio.loop() calls
+void serviceCrossfade()
+{
+  if (crossfadeMixDone)
+  {
+    crossfadeMixDone = false;
+    endCrossfade("done");
+  }
+  if (crossfade == CROSSFADE_IDLE)
+  {
+    if (crossfadeBufferInternal)
+      releaseCrossfadeBuffer();
+    return;
+  }
+
+  // Load and heap over the last window
+  int64_t now = esp_timer_get_time();
+  if (now - crossfadeWindowStartMicros >= crossfadeLoadWindowMS * 1000)
+  {
+    int64_t window = now - crossfadeWindowStartMicros;
+    for (uint8_t core = 0; core < 2; core++)
+    {
+      int64_t idle = idleHookMicros[core] - crossfadeWindowIdleMicros[core];
+      uint8_t load = 100 - min((int64_t)100, (idle * 100) / window);
+      crossfadePeakLoad[core] = max(crossfadePeakLoad[core], load);
+      crossfadeWindowIdleMicros[core] = idleHookMicros[core];
+    }
+    crossfadeMinFreeHeap = min(crossfadeMinFreeHeap, ESP.getFreeHeap());
+    crossfadeWindowStartMicros = now;
+  }
+
+  // Overlap held and the new station prebuffered: stop the old station, the fetch
+  // stage switches the ring over and the decoder restarts on the new one as usual
+  if (crossfade == CROSSFADE_FILLING && crossfadeFilled() >= crossfadeTarget && crossfadeIncomingReady)
+  {
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+    audio.stopSong();
+    decodeRestartExpected = true;
+    crossfadeStoppedMicros = esp_timer_get_time();
+    crossfade = CROSSFADE_SWITCHING;
+    crossfadeDecoderStopped = true;
+    xSemaphoreGive(xMutex);
+  }
+
+  // New station slow to start - the held audio is stale by now
+  if (crossfade == CROSSFADE_SWITCHING && now - crossfadeStoppedMicros > crossfadeSwitchTimeoutMS * 1000)
+  {
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+    if (crossfade == CROSSFADE_SWITCHING)
+    {
+      crossfadeMixStartMicros = now;
+      endCrossfade("abandoned (new station late)");
+    }
+    xSemaphoreGive(xMutex);
+  }
+}
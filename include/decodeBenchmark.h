@@ -0,0 +1,203 @@
+// Decode throughput benchmark (build the "decode-benchmark" environment to run it)
+// At boot, before any station is played, every recording in /bench on LittleFS is
+// decoded through the same path as a live stream - audio.loop() with our DSP in the
+// audio_process_i2s() hook - but nothing is written to I2S, so it runs flat out.
+// For each file it reports frames per second, cycles per frame (and what that means
+// for the load at each CPU clock), DSP cycles per sample and the peak heap used.
+//
+// The recordings aren't part of the repository - copy some into data/bench and upload
+// the filesystem. Results are written to /bench/results.txt. If /bench/baseline.txt is
+// there (an earlier results file, copied back into data/bench) each file is compared
+// against it and anything more than benchmarkTolerancePercent slower or bigger is
+// reported as a regression. Without one the run only reports NO BASELINE, not PASS.
+//
+// Everything after the decoder (earcon mix, DSP, spectrum, resampler) is also timed on
+// the host by test/test_post_decode_benchmark, against a baseline checked in there.
+#include <Arduino.h>
+#include "main.h"
+
+// Normally off - turned on by the decode-benchmark build flags in platformio.ini
+#ifndef DECODE_BENCHMARK
+#define DECODE_BENCHMARK false
+#endif
+
+const char *benchmarkDir = "/bench";
+const char *benchmarkResultsFile = "/bench/results.txt";
+const char *benchmarkBaselineFile = "/bench/baseline.txt";
+const uint8_t benchmarkTolerancePercent = 10;
+
+struct benchmarkResult
+{
+  char file[48];
+  uint32_t cyclesPerFrame;
+  uint32_t dspCyclesPerSample;
+  uint32_t peakHeap;
+};
+
+// Counted in the audio_process_i2s() hook while a file is being decoded
+volatile bool decodeBenchmarkRunning = false;
+uint32_t benchmarkSamples = 0;
+uint64_t benchmarkDspCycles = 0;
+
+// Called from audio_process_i2s() instead of sending the sample on to I2S
+void benchmarkSample(uint32_t *sample)
+{
+  uint32_t startCycles = ESP.getCycleCount();
+  processDsp(sample);
+  benchmarkDspCycles += ESP.getCycleCount() - startCycles;
+  benchmarkSamples++;
+}
+
+// MP3 frames are 1152 samples (576 for the lower MPEG-2 rates), AAC frames 1024
+uint16_t samplesPerFrame(const char *file, uint32_t sampleRate)
+{
+  if (strstr(file, ".aac") || strstr(file, ".m4a"))
+    return 1024;
+  return (sampleRate >= 32000) ? 1152 : 576;
+}
+
+// Decode one file as fast as possible, false if it couldn't be played
+bool benchmarkFile(const char *path, benchmarkResult &result)
+{
+  strlcpy(result.file, path, sizeof(result.file));
+  benchmarkSamples = 0;
+  benchmarkDspCycles = 0;
+  uint32_t startHeap = ESP.getFreeHeap();
+  uint32_t minHeap = startHeap;
+
+  int64_t start = esp_timer_get_time();
+  decodeBenchmarkRunning = true;
+  if (!audio.connecttoFS(LITTLEFS, path))
+  {
+    decodeBenchmarkRunning = false;
+    return false;
+  }
+  uint32_t sampleRate = 0;
+  while (audio.isRunning())
+  {
+    audio.loop();
+    minHeap = min(minHeap, ESP.getFreeHeap());
+    if (sampleRate == 0)
+      sampleRate = audio.getSampleRate();
+  }
+  decodeBenchmarkRunning = false;
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  if (benchmarkSamples == 0 || sampleRate == 0)
+    return false;
+
+  uint32_t frames = benchmarkSamples / samplesPerFrame(path, sampleRate);
+  uint64_t cycles = (uint64_t)elapsed * getCpuFrequencyMhz();
+  result.cyclesPerFrame = cycles / max(frames, (uint32_t)1);
+  result.dspCyclesPerSample = benchmarkDspCycles / benchmarkSamples;
+  result.peakHeap = startHeap - minHeap;
+
+  // Share of the CPU a live stream of this file would need at each clock
+  uint64_t cyclesPerAudioSecond = (cycles * sampleRate) / benchmarkSamples;
+  logInfo("Benchmark %s: %u frames in %lldms (%llu frames/s, %ux real time) %u cycles/frame at %uMHz",
+          path, frames, elapsed / 1000, (frames * 1000000ULL) / elapsed,
+          (uint32_t)(((uint64_t)benchmarkSamples * 1000000) / sampleRate / elapsed), result.cyclesPerFrame,
+          getCpuFrequencyMhz());
+  logInfo("Benchmark %s: DSP %u cycles/sample, load at 80/160/240MHz %llu/%llu/%llu%%, peak heap %u",
+          path, result.dspCyclesPerSample, cyclesPerAudioSecond / 800000, cyclesPerAudioSecond / 1600000,
+          cyclesPerAudioSecond / 2400000, result.peakHeap);
+  return true;
+}
+
+// Baseline line for a file, false if it isn't in the baseline
+bool findBaseline(const char *path, benchmarkResult &baseline)
+{
+  File file = LITTLEFS.open(benchmarkBaselineFile, FILE_READ);
+  if (!file)
+    return false;
+
+  char line[96];
+  while (file.available())
+  {
+    size_t len = file.readBytesUntil('\n', line, sizeof(line) - 1);
+    line[len] = '\0';
+    if (sscanf(line, "%47s %u %u %u", baseline.file, &baseline.cyclesPerFrame, &baseline.dspCyclesPerSample,
+               &baseline.peakHeap) == 4 &&
+        strcmp(baseline.file, path) == 0)
+    {
+      file.close();
+      return true;
+    }
+  }
+  file.close();
+  return false;
+}
+
+bool exceedsBaseline(const char *what, uint32_t value, uint32_t baseline)
+{
+  if (value * 100 <= baseline * (100 + benchmarkTolerancePercent))
+    return false;
+  logWarn("Benchmark regression: %s %u (baseline %u, +%u%%)", what, value, baseline,
+          baseline ? ((value - baseline) * 100) / baseline : 100);
+  return true;
+}
+
+// Called from setup() before the first station is loaded
+void runDecodeBenchmark()
+{
+  if (!DECODE_BENCHMARK)
+    return;
+
+  File dir = LITTLEFS.open(benchmarkDir);
+  if (!dir || !dir.isDirectory())
+  {
+    logError("Benchmark: no %s directory on LittleFS (copy recordings into data%s and upload the filesystem)",
+             benchmarkDir, benchmarkDir);
+    return;
+  }
+
+  // Collect the names first - results are written into the same directory
+  const uint8_t maxFiles = 16;
+  static char paths[maxFiles][48];
+  uint8_t fileCount = 0;
+  for (File entry = dir.openNextFile(); entry && fileCount < maxFiles; entry = dir.openNextFile())
+  {
+    const char *name = entry.name();
+    if (strstr(name, ".mp3") || strstr(name, ".aac") || strstr(name, ".m4a"))
+    {
+      if (name[0] == '/')
+        strlcpy(paths[fileCount], name, sizeof(paths[fileCount]));
+      else
+        snprintf(paths[fileCount], sizeof(paths[fileCount]), "%s/%s", benchmarkDir, name);
+      fileCount++;
+    }
+  }
+  dir.close();
+
+  File results = LITTLEFS.open(benchmarkResultsFile, FILE_WRITE);
+  uint8_t regressions = 0;
+  uint8_t compared = 0;
+  for (uint8_t i = 0; i < fileCount; i++)
+  {
+    benchmarkResult result, baseline;
+    if (!benchmarkFile(paths[i], result))
+    {
+      logError("Benchmark %s: could not be decoded", paths[i]);
+      regressions++;
+      continue;
+    }
+    if (results)
+      results.printf("%s %u %u %u\n", result.file, result.cyclesPerFrame, result.dspCyclesPerSample, result.peakHeap);
+
+    if (findBaseline(paths[i], baseline))
+    {
+      compared++;
+      bool regressed = exceedsBaseline("cycles/frame", result.cyclesPerFrame, baseline.cyclesPerFrame);
+      regressed |= exceedsBaseline("DSP cycles/sample", result.dspCyclesPerSample, baseline.dspCyclesPerSample);
+      regressed |= exceedsBaseline("peak heap", result.peakHeap, baseline.peakHeap);
+      if (regressed)
+        regressions++;
+    }
+  }
+  if (results)
+    results.close();
+
+  // One line for a test rig watching the serial port
+  logInfo("Decode benchmark %s: %u files, %u compared with baseline, %u regressions",
+          regressions ? "FAIL" : (compared ? "PASS" : "NO BASELINE"), fileCount, compared, regressions);
+}
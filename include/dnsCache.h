@@ -0,0 +1,251 @@
+// Host name cache in front of station connects
+// Stations often share hosts, and lwIP only keeps a handful of names. Resolved
+// addresses are kept here for dnsCacheTTLSecs and a snapshot is saved to NVS. At boot
+// the snapshot is loaded with every entry marked stale: a stale address is used
+// straight away (so the first connect after power on doesn't wait for DNS) while a
+// background lookup refreshes it. If connecting to a stale address fails, or the
+// refresh does, the entry is dropped and the host is looked up properly next time. A
+// stale entry that is never refreshed expires with the TTL like any other.
+// Numeric hosts never get here, they need no lookup.
+#include <Arduino.h>
+#include <Preferences.h>
+#include "lwip/dns.h"
+
+const uint8_t dnsCacheSize = 16;
+
+// Longest host name kept, as long as a station URL's can be
+const size_t maxHostLength = 128;
+
+// The lwIP lookup API doesn't pass on the record's TTL, so we apply our own
+const unsigned long dnsCacheTTLSecs = 600;
+
+// Snapshot written at most this often (and only when an address has changed)
+const unsigned long dnsCacheSaveMS = 60000;
+
+struct dnsCacheEntry
+{
+  char host[maxHostLength];
+  uint32_t ip;
+  unsigned long resolvedMillis;
+  unsigned long lastUsedMillis;
+  bool stale; // Loaded from the snapshot and not yet refreshed
+};
+
+// Lookup statistics (cumulative since boot)
+struct dnsCacheStats
+{
+  uint32_t hits;
+  uint32_t staleHits;
+  uint32_t misses;
+  uint32_t failures;
+  uint32_t staleFailures; // Stale address turned out to be wrong
+  uint32_t refreshFailures; // Stale address could not be confirmed
+  uint32_t missTotalMillis;
+  uint32_t missMaxMillis;
+};
+
+dnsCacheEntry dnsCache[dnsCacheSize];
+dnsCacheStats dnsStats;
+bool dnsCacheDirty = false;
+
+// lwIP calls back on its own task
+portMUX_TYPE dnsCacheMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Own namespace, only ever used by the stream fetch task
+Preferences dnsCachePrefs;
+
+int8_t findDnsCacheEntry(const char *host)
+{
+  for (uint8_t i = 0; i < dnsCacheSize; i++)
+  {
+    if (dnsCache[i].host[0] != '\0' && strcmp(dnsCache[i].host, host) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Remember a resolved address, replacing the least recently used entry if full
+void dnsCacheStore(const char *host, uint32_t ip)
+{
+  portENTER_CRITICAL(&dnsCacheMux);
+  int8_t slot = findDnsCacheEntry(host);
+  if (slot < 0)
+  {
+    slot = 0;
+    for (uint8_t i = 0; i < dnsCacheSize; i++)
+    {
+      if (dnsCache[i].host[0] == '\0')
+      {
+        slot = i;
+        break;
+      }
+      if (dnsCache[i].lastUsedMillis < dnsCache[slot].lastUsedMillis)
+        slot = i;
+    }
+    strlcpy(dnsCache[slot].host, host, sizeof(dnsCache[slot].host));
+    dnsCache[slot].ip = 0;
+    dnsCache[slot].lastUsedMillis = millis();
+  }
+
+  if (dnsCache[slot].ip != ip)
+    dnsCacheDirty = true;
+  dnsCache[slot].ip = ip;
+  dnsCache[slot].resolvedMillis = millis();
+  dnsCache[slot].stale = false;
+  portEXIT_CRITICAL(&dnsCacheMux);
+}
+
+void dnsCacheForget(const char *host)
+{
+  portENTER_CRITICAL(&dnsCacheMux);
+  int8_t slot = findDnsCacheEntry(host);
+  if (slot >= 0)
+  {
+    dnsCache[slot].host[0] = '\0';
+    dnsStats.staleFailures++;
+    dnsCacheDirty = true;
+  }
+  portEXIT_CRITICAL(&dnsCacheMux);
+}
+
+// A stale entry whose refresh failed - the name may have gone or moved, don't hand the
+// old address out again
+void dnsRefreshFailed(const char *host)
+{
+  portENTER_CRITICAL(&dnsCacheMux);
+  int8_t slot = findDnsCacheEntry(host);
+  if (slot >= 0 && dnsCache[slot].stale)
+  {
+    dnsCache[slot].host[0] = '\0';
+    dnsStats.refreshFailures++;
+    dnsCacheDirty = true;
+  }
+  portEXIT_CRITICAL(&dnsCacheMux);
+}
+
+// Background refresh of a stale entry
+void dnsRefreshFound(const char *name, const ip_addr_t *ipaddr, void *arg)
+{
+  if (ipaddr)
+    dnsCacheStore(name, ipaddr->u_addr.ip4.addr);
+  else
+    dnsRefreshFailed(name);
+}
+
+void refreshDnsCacheEntry(const char *host)
+{
+  ip_addr_t address;
+  err_t err = dns_gethostbyname(host, &address, &dnsRefreshFound, NULL);
+  if (err == ERR_OK)
+    dnsCacheStore(host, address.u_addr.ip4.addr);
+  else if (err != ERR_INPROGRESS)
+    dnsRefreshFailed(host);
+}
+
+// Cached address for host? A stale answer is still returned (until it expires), and
+// refreshed for next time
+bool dnsCacheLookup(const char *host, uint32_t &ip, bool &stale)
+{
+  portENTER_CRITICAL(&dnsCacheMux);
+  int8_t slot = findDnsCacheEntry(host);
+  bool found = slot >= 0 && millis() - dnsCache[slot].resolvedMillis < dnsCacheTTLSecs * 1000;
+  if (found)
+  {
+    ip = dnsCache[slot].ip;
+    stale = dnsCache[slot].stale;
+    dnsCache[slot].lastUsedMillis = millis();
+    if (stale)
+      dnsStats.staleHits++;
+    else
+      dnsStats.hits++;
+  }
+  else
+  {
+    dnsStats.misses++;
+  }
+  portEXIT_CRITICAL(&dnsCacheMux);
+
+  if (found && stale)
+    refreshDnsCacheEntry(host);
+  return found;
+}
+
+// Time taken by a lookup that missed the cache
+void recordDnsLookup(bool succeeded, uint32_t lookupMillis)
+{
+  portENTER_CRITICAL(&dnsCacheMux);
+  if (!succeeded)
+    dnsStats.failures++;
+  dnsStats.missTotalMillis += lookupMillis;
+  dnsStats.missMaxMillis = max(dnsStats.missMaxMillis, lookupMillis);
+  portEXIT_CRITICAL(&dnsCacheMux);
+}
+
+// Snapshot is just the host names and addresses
+struct dnsSnapshotEntry
+{
+  char host[maxHostLength];
+  uint32_t ip;
+};
+
+// Load the snapshot at boot and start refreshing every entry in the background
+void loadDnsCache()
+{
+  static dnsSnapshotEntry snapshot[dnsCacheSize];
+  memset(dnsCache, 0, sizeof(dnsCache));
+  memset(&dnsStats, 0, sizeof(dnsStats));
+
+  if (!dnsCachePrefs.begin("dnsCache", false) || dnsCachePrefs.getBytesLength("hosts") != sizeof(snapshot))
+    return;
+
+  dnsCachePrefs.getBytes("hosts", snapshot, sizeof(snapshot));
+  uint8_t loaded = 0;
+  for (uint8_t i = 0; i < dnsCacheSize; i++)
+  {
+    if (snapshot[i].host[0] == '\0')
+      continue;
+    strlcpy(dnsCache[i].host, snapshot[i].host, sizeof(dnsCache[i].host));
+    dnsCache[i].ip = snapshot[i].ip;
+    dnsCache[i].resolvedMillis = millis(); // Good for one TTL unless the refresh fails
+    dnsCache[i].stale = true;
+    loaded++;
+  }
+  logInfo("DNS cache: %u hosts loaded", loaded);
+
+  for (uint8_t i = 0; i < dnsCacheSize; i++)
+  {
+    if (dnsCache[i].host[0] != '\0')
+      refreshDnsCacheEntry(dnsCache[i].host);
+  }
+}
+
+// Called by the stream fetch task - saves the snapshot if anything has changed
+void serviceDnsCache()
+{
+  static unsigned long prevSaveMillis = 0;
+  static dnsSnapshotEntry snapshot[dnsCacheSize];
+
+  if (!dnsCacheDirty || millis() - prevSaveMillis < dnsCacheSaveMS)
+    return;
+
+  portENTER_CRITICAL(&dnsCacheMux);
+  for (uint8_t i = 0; i < dnsCacheSize; i++)
+  {
+    strlcpy(snapshot[i].host, dnsCache[i].host, sizeof(snapshot[i].host));
+    snapshot[i].ip = dnsCache[i].ip;
+  }
+  dnsCacheDirty = false;
+  portEXIT_CRITICAL(&dnsCacheMux);
+
+  dnsCachePrefs.putBytes("hosts", snapshot, sizeof(snapshot));
+  prevSaveMillis = millis();
+}
+
+void reportDnsCache()
+{
+  uint32_t lookups = dnsStats.hits + dnsStats.staleHits + dnsStats.misses;
+  logInfo("DNS cache lookups:%u hits:%u stale:%u misses:%u (avg %ums max %ums) failed:%u stale wrong:%u unconfirmed:%u",
+          lookups, dnsStats.hits, dnsStats.staleHits, dnsStats.misses,
+          dnsStats.misses ? dnsStats.missTotalMillis / dnsStats.misses : 0, dnsStats.missMaxMillis,
+          dnsStats.failures, dnsStats.staleFailures, dnsStats.refreshFailures);
+}
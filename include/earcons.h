@@ -0,0 +1,461 @@
+// Earcons - short sounds (button clicks, chimes, spoken prompts) mixed over the station
+// Each clip is decoded once at boot into a PCM cache (PSRAM when there is some), so
+// playing one costs no decoding - only a mix into the samples already on their way to
+// I2S, with the station ducked underneath while it plays.
+//
+// Clips come from /earcons/<name>.mp3 (or .wav / .aac) on LittleFS, decoded through the
+// audio library the same way as the decode benchmark. Anything missing is replaced by a
+// generated tone so every earcon makes some sound. Clips are kept mono at their own
+// sample rate, with the silence the encoder adds at either end trimmed off.
+//
+// The mix is done by the audio task in the audio_process_i2s() hook, after the crossfade
+// and before the DSP - so the volume (and mute) and the limiter apply to it. While the
+// decoder isn't running (reconnecting, between stations) the audio task writes the
+// earcon to I2S itself.
+//
+// Latency: a request wakes the audio task and the clip starts on the next sample it
+// handles, but that sample still queues behind whatever is in the I2S DMA buffers. The
+// bound is the DMA queue (set by the latency profile) plus earconHandoffBoundMS; each
+// earcon's latency is logged against it (about 45ms on the low latency profile, 205ms
+// on balanced).
+//
+// Serial command 'e': e lists the clips, e<n> plays clip n.
+#include <Arduino.h>
+#include "driver/i2s.h"
+#include "main.h"
+
+// Set EARCON_MIXER to false for no earcons (nothing is decoded or allocated)
+#define EARCON_MIXER true
+
+const char *earconDir = "/earcons";
+const char *earconNames[EARCONS] = {"click", "chime", "reconnecting"};
+const char *earconExtensions[] = {".mp3", ".wav", ".aac"};
+
+// Stand-in tones: the first half at startHz, the second at endHz
+struct earconTone
+{
+  uint16_t startHz;
+  uint16_t endHz;
+  uint16_t ms;
+};
+const earconTone earconTones[EARCONS] = {{2000, 2000, 12}, {880, 1320, 300}, {660, 440, 400}};
+const uint32_t earconToneRate = 16000;
+
+// PCM cache (mono 16 bit) - without PSRAM there is only room for the tones and a click
+const uint32_t earconCacheBytes = 393216;
+const uint32_t earconCacheBytesNoPsram = 32768;
+const uint16_t maxEarconMS = 4000;
+const int16_t earconSilenceLevel = 32;
+
+// Levels (Q15): the clip, and the station while a clip plays
+const int32_t earconGain = 16384;     // -6dB
+const int32_t earconDuckGain = 8192;  // -12dB
+const uint16_t earconDuckAttackMS = 10;
+const uint16_t earconDuckReleaseMS = 250;
+
+// Latency: from the request to the clip's first sample being mixed (the I2S DMA queue
+// is added to this), and the age at which a request that couldn't be played is dropped
+const uint16_t earconHandoffBoundMS = 20;
+const unsigned long earconStaleMS = 500;
+
+struct earconClip
+{
+  uint32_t offset; // Into the cache
+  uint32_t samples;
+  uint32_t sampleRate;
+  bool decoded; // From a file rather than a tone
+};
+
+int16_t *earconCache = NULL;
+uint32_t earconCacheSamples = 0;
+uint32_t earconCacheUsed = 0;
+earconClip earconClips[EARCONS];
+
+// Request from any task, picked up by the audio task
+volatile int8_t earconRequested = -1;
+volatile int64_t earconRequestMicros = 0;
+
+// Playback - only touched by the audio task
+int8_t earconPlaying = -1;
+uint32_t earconIndex = 0;
+uint32_t earconFraction = 0; // Q16
+uint32_t earconStep = 0;     // Q16 clip samples per output sample
+uint32_t earconMixRate = 0;
+
+// Station gain (Q15 scaled by 256, like the volume ramp) and its steps at the mix rate
+const int32_t earconUnityGain = 32767 << 8;
+int32_t earconDuck = earconUnityGain;
+int32_t earconAttackStep = 1;
+int32_t earconReleaseStep = 1;
+
+// Capture while a clip is decoded at boot
+volatile bool earconDecoding = false;
+uint32_t earconCaptureCount = 0;
+uint32_t earconCaptureLimit = 0;
+
+// Latency and load (the hook records, the audio task logs)
+bool earconStarted = false;
+int8_t earconStartedId = 0;
+bool earconStartedDirect = false;
+int64_t earconHandoffMicros = 0;
+uint32_t earconTriggers = 0;
+uint32_t earconDropped = 0;
+uint32_t earconOverBound = 0;
+uint32_t earconMaxHandoffMS = 0;
+uint32_t earconMaxAudibleMS = 0;
+uint32_t earconMixCycles = 0;
+uint32_t earconMixSamples = 0;
+uint32_t earconReportedTriggers = 0;
+
+// Time for the I2S DMA queue to play out at a sample rate
+uint32_t earconQueueMS(uint32_t sampleRate)
+{
+  return ((uint32_t)currentProfile->dmaBufCount * currentProfile->dmaBufLen * 1000) / sampleRate;
+}
+
+uint32_t earconLatencyBoundMS(uint32_t sampleRate)
+{
+  return earconQueueMS(sampleRate) + earconHandoffBoundMS;
+}
+
+// ===================== PCM cache =======================
+// Called from audio_process_i2s() instead of sending the sample on to I2S
+void earconCaptureSample(uint32_t *sample)
+{
+  if (earconCaptureCount >= earconCaptureLimit)
+    return;
+  int32_t mono = ((int16_t)(*sample >> 16) + (int16_t)(*sample & 0xFFFF)) / 2;
+  earconCache[earconCacheUsed + earconCaptureCount++] = mono;
+}
+
+// Drop the silence at either end of what has just been put in the cache
+void trimEarcon(earconClip &clip)
+{
+  int16_t *pcm = earconCache + clip.offset;
+  uint32_t start = 0;
+  while (start < clip.samples && abs(pcm[start]) <= earconSilenceLevel)
+    start++;
+  uint32_t end = clip.samples;
+  while (end > start && abs(pcm[end - 1]) <= earconSilenceLevel)
+    end--;
+  clip.samples = end - start;
+  memmove(pcm, pcm + start, clip.samples * sizeof(int16_t));
+}
+
+uint32_t earconToneSamples(uint8_t earcon)
+{
+  return (earconToneRate * earconTones[earcon].ms) / 1000;
+}
+
+// Decode a file into the cache (through the audio_process_i2s() hook), false if it
+// couldn't be played. Room is left for the tones of the earcons still to come.
+bool decodeEarcon(uint8_t earcon, const char *path)
+{
+  earconClip &clip = earconClips[earcon];
+  uint32_t reserved = 0;
+  for (uint8_t later = earcon + 1; later < EARCONS; later++)
+    reserved += earconToneSamples(later);
+  earconCaptureCount = 0;
+  earconCaptureLimit = min((uint32_t)(48 * maxEarconMS), earconCacheSamples - min(earconCacheUsed + reserved, earconCacheSamples));
+
+  int64_t start = esp_timer_get_time();
+  earconDecoding = true;
+  if (!audio.connecttoFS(LITTLEFS, path))
+  {
+    earconDecoding = false;
+    return false;
+  }
+  while (audio.isRunning() && earconCaptureCount < earconCaptureLimit)
+    audio.loop();
+  bool truncated = audio.isRunning();
+  audio.stopSong();
+  earconDecoding = false;
+
+  clip.offset = earconCacheUsed;
+  clip.sampleRate = audio.getSampleRate();
+  clip.samples = earconCaptureCount;
+  clip.decoded = true;
+  if (clip.samples == 0 || clip.sampleRate == 0)
+    return false;
+  if (clip.samples > (clip.sampleRate * maxEarconMS) / 1000)
+  {
+    clip.samples = (clip.sampleRate * maxEarconMS) / 1000;
+    truncated = true;
+  }
+  trimEarcon(clip);
+  if (clip.samples == 0)
+    return false;
+  earconCacheUsed += clip.samples;
+
+  if (truncated)
+    logWarn("Earcon %s: %s cut short to fit the cache", earconNames[earcon], path);
+  logInfo("Earcon %s: %s decoded in %lldms - %ums at %uHz, %u bytes", earconNames[earcon], path,
+          (esp_timer_get_time() - start) / 1000, (clip.samples * 1000) / clip.sampleRate, clip.sampleRate,
+          clip.samples * sizeof(int16_t));
+  return true;
+}
+
+// Generate the stand-in tone - a short attack then a linear decay over each note
+bool synthesizeEarcon(uint8_t earcon)
+{
+  const earconTone &tone = earconTones[earcon];
+  earconClip &clip = earconClips[earcon];
+  clip.offset = earconCacheUsed;
+  clip.sampleRate = earconToneRate;
+  clip.samples = earconToneSamples(earcon);
+  clip.decoded = false;
+  if (clip.samples > earconCacheSamples - earconCacheUsed)
+  {
+    clip.samples = 0;
+    logWarn("Earcon %s: no room in the cache", earconNames[earcon]);
+    return false;
+  }
+
+  int16_t *pcm = earconCache + clip.offset;
+  uint32_t noteSamples = (clip.samples + 1) / 2;
+  uint32_t attackSamples = earconToneRate / 500; // 2ms
+  float phase = 0;
+  for (uint32_t i = 0; i < clip.samples; i++)
+  {
+    uint32_t position = i % noteSamples;
+    float envelope = (position < attackSamples) ? (float)position / attackSamples
+                                                : 1.0 - (float)(position - attackSamples) / (noteSamples - attackSamples);
+    phase += 2.0 * PI * ((i < noteSamples) ? tone.startHz : tone.endHz) / earconToneRate;
+    pcm[i] = 24000.0 * envelope * sinf(phase);
+  }
+  earconCacheUsed += clip.samples;
+  logInfo("Earcon %s: %u/%uHz tone, %ums, %u bytes", earconNames[earcon], tone.startHz, tone.endHz, tone.ms,
+          clip.samples * sizeof(int16_t));
+  return true;
+}
+
+// Called from setup() before the first station is loaded (the audio task isn't
+// decoding yet, so the decoder is free)
+void setupEarcons()
+{
+  if (!EARCON_MIXER)
+    return;
+
+  uint32_t bytes = earconCacheBytesNoPsram;
+  if (psramFound())
+  {
+    earconCache = (int16_t *)heap_caps_malloc(earconCacheBytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (earconCache != NULL)
+      bytes = earconCacheBytes;
+  }
+  if (earconCache == NULL)
+    earconCache = (int16_t *)malloc(bytes);
+  if (earconCache == NULL)
+  {
+    logError("Unable to allocate earcon cache");
+    return;
+  }
+  earconCacheSamples = bytes / sizeof(int16_t);
+
+  for (uint8_t earcon = 0; earcon < EARCONS; earcon++)
+  {
+    bool found = false;
+    for (uint8_t i = 0; i < sizeof(earconExtensions) / sizeof(earconExtensions[0]) && !found; i++)
+    {
+      char path[48];
+      snprintf(path, sizeof(path), "%s/%s%s", earconDir, earconNames[earcon], earconExtensions[i]);
+      if (LITTLEFS.exists(path))
+      {
+        found = decodeEarcon(earcon, path);
+        if (!found)
+          logWarn("Earcon %s: %s could not be decoded", earconNames[earcon], path);
+      }
+    }
+    if (!found)
+      synthesizeEarcon(earcon);
+  }
+
+  logInfo("Earcons: %u of %u byte cache used%s, latency bound %ums (I2S queue %ums + %ums) at 44.1kHz",
+          earconCacheUsed * sizeof(int16_t), earconCacheSamples * sizeof(int16_t), psramFound() ? " in PSRAM" : "",
+          earconLatencyBoundMS(44100), earconQueueMS(44100), earconHandoffBoundMS);
+}
+
+// ===================== Mixer ===========================
+// Called from any task
+void playEarcon(earconId earcon)
+{
+  if (!EARCON_MIXER || earconCache == NULL || earconClips[earcon].samples == 0)
+    return;
+  earconRequestMicros = esp_timer_get_time();
+  earconRequested = earcon;
+  wakeAudioTask();
+}
+
+// Clip and duck steps for the rate samples are being mixed at
+void setEarconMixRate(uint32_t sampleRate)
+{
+  earconMixRate = sampleRate;
+  if (earconPlaying >= 0)
+    earconStep = ((uint64_t)earconClips[earconPlaying].sampleRate << 16) / sampleRate;
+  earconAttackStep = max((int32_t)1, (int32_t)((earconUnityGain - (earconDuckGain << 8)) / (sampleRate * earconDuckAttackMS / 1000)));
+  earconReleaseStep = max((int32_t)1, (int32_t)((earconUnityGain - (earconDuckGain << 8)) / (sampleRate * earconDuckReleaseMS / 1000)));
+}
+
+// Take up a request (a newer one replaces the clip playing)
+void startEarcon(uint32_t sampleRate, bool direct)
+{
+  int8_t earcon = earconRequested;
+  earconRequested = -1;
+  int64_t waited = esp_timer_get_time() - earconRequestMicros;
+  if (waited > earconStaleMS * 1000)
+  {
+    earconDropped++;
+    return;
+  }
+
+  earconPlaying = earcon;
+  earconIndex = 0;
+  earconFraction = 0;
+  setEarconMixRate(sampleRate);
+  earconHandoffMicros = waited;
+  earconStartedId = earcon;
+  earconStartedDirect = direct;
+  earconStarted = true;
+}
+
+// Duck the station and add the clip (linearly interpolated to the mix rate)
+inline void mixEarconSample(uint32_t *sample)
+{
+  int32_t clipSample = 0;
+  if (earconPlaying >= 0)
+  {
+    earconDuck = max(earconDuck - earconAttackStep, earconDuckGain << 8);
+    const earconClip &clip = earconClips[earconPlaying];
+    const int16_t *pcm = earconCache + clip.offset;
+    int32_t s0 = pcm[earconIndex];
+    int32_t s1 = (earconIndex + 1 < clip.samples) ? pcm[earconIndex + 1] : 0;
+    clipSample = ((s0 + (((s1 - s0) * (int32_t)(earconFraction >> 1)) >> 15)) * earconGain) >> 15;
+
+    earconFraction += earconStep;
+    earconIndex += earconFraction >> 16;
+    earconFraction &= 0xFFFF;
+    if (earconIndex >= clip.samples)
+      earconPlaying = -1;
+  }
+  else
+    earconDuck = min(earconDuck + earconReleaseStep, earconUnityGain);
+
+  int32_t duck = earconDuck >> 8;
+  int32_t left = (((int16_t)(*sample >> 16) * duck) >> 15) + clipSample;
+  int32_t right = (((int16_t)(*sample & 0xFFFF) * duck) >> 15) + clipSample;
+  *sample = ((uint32_t)(uint16_t)saturate16(left) << 16) | (uint16_t)saturate16(right);
+}
+
+// Called from audio_process_i2s() for every decoded sample, before the DSP
+void mixEarcon(uint32_t *sample)
+{
+  if (earconRequested >= 0)
+    startEarcon(audio.getSampleRate(), false);
+  if (earconPlaying < 0 && earconDuck == earconUnityGain)
+    return;
+
+  uint32_t startCycles = ESP.getCycleCount();
+  if (earconMixRate != audio.getSampleRate())
+    setEarconMixRate(audio.getSampleRate());
+  mixEarconSample(sample);
+  earconMixCycles += ESP.getCycleCount() - startCycles;
+  earconMixSamples++;
+}
+
+// No decoder running: write the earcon to I2S ourselves, a couple of DMA descriptors'
+// worth each time round the audio task loop
+void feedEarcon()
+{
+  if ((earconPlaying < 0 && earconRequested < 0) || audio.isRunning() || decodeSuspended)
+    return;
+
+  uint32_t sampleRate = fixedOutputRate() ? outputRate : audio.getSampleRate();
+  if (sampleRate == 0)
+    sampleRate = 44100;
+  if (earconRequested >= 0)
+    startEarcon(sampleRate, true);
+  if (earconMixRate != sampleRate)
+    setEarconMixRate(sampleRate);
+
+  static uint32_t block[64];
+  uint32_t written = 0;
+  while (earconPlaying >= 0 && written < 2UL * currentProfile->dmaBufLen)
+  {
+    uint8_t count = 0;
+    while (count < sizeof(block) / sizeof(block[0]) && earconPlaying >= 0)
+    {
+      block[count] = 0;
+      mixEarconSample(&block[count]);
+      processDsp(&block[count]);
+      count++;
+    }
+    size_t bytesWritten;
+    i2s_write(I2S_NUM_0, block, count * sizeof(uint32_t), &bytesWritten, portMAX_DELAY);
+    written += count;
+  }
+}
+
+// Called by the audio task after each round of audio.loop() calls
+void serviceEarcons()
+{
+  if (!EARCON_MIXER)
+    return;
+
+  feedEarcon();
+
+  if (!earconStarted)
+    return;
+  earconStarted = false;
+
+  uint32_t handoffMS = earconHandoffMicros / 1000;
+  uint32_t audibleMS = handoffMS + earconQueueMS(earconMixRate);
+  uint32_t boundMS = earconLatencyBoundMS(earconMixRate);
+  earconTriggers++;
+  earconMaxHandoffMS = max(earconMaxHandoffMS, handoffMS);
+  earconMaxAudibleMS = max(earconMaxAudibleMS, audibleMS);
+  if (audibleMS > boundMS)
+  {
+    earconOverBound++;
+    logWarn("Earcon %s: request to mix %ums (%s), audible within %ums - over the %ums bound",
+            earconNames[earconStartedId], handoffMS, earconStartedDirect ? "direct" : "decoder",
+            audibleMS, boundMS);
+  }
+  else
+    logInfo("Earcon %s: request to mix %ums (%s), audible within %ums (bound %ums)",
+            earconNames[earconStartedId], handoffMS, earconStartedDirect ? "direct" : "decoder",
+            audibleMS, boundMS);
+}
+
+// Called from the audio task's periodic report, only if anything was played
+void reportEarcons()
+{
+  if (!EARCON_MIXER || earconTriggers + earconDropped == earconReportedTriggers)
+    return;
+  earconReportedTriggers = earconTriggers + earconDropped;
+  logInfo("Earcons: %u played, %u dropped, request to mix max %ums, audible max %ums, %u over bound, mix %u cycles/sample",
+          earconTriggers, earconDropped, earconMaxHandoffMS, earconMaxAudibleMS, earconOverBound,
+          earconMixSamples ? earconMixCycles / earconMixSamples : 0);
+}
+
+// Serial command 'e' (see the top of this file)
+void earconCommand()
+{
+  char line[8];
+  readCommandLine(line, sizeof(line));
+  if (line[0] == '\0')
+  {
+    for (uint8_t earcon = 0; earcon < EARCONS; earcon++)
+    {
+      const earconClip &clip = earconClips[earcon];
+      logInfo("Earcon %u %s: %ums at %uHz (%s)", earcon, earconNames[earcon],
+              clip.sampleRate ? (clip.samples * 1000) / clip.sampleRate : 0, clip.sampleRate,
+              clip.decoded ? "file" : "tone");
+    }
+    reportEarcons();
+    return;
+  }
+
+  uint8_t earcon = atoi(line);
+  if (earcon < EARCONS)
+    playEarcon((earconId)earcon);
+}
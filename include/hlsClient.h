@@ -0,0 +1,879 @@
+// HLS client (part of the fetch stage, run by the fetch task)
+// Some broadcasters only offer HLS: a playlist of short segments that is reloaded as new
+// ones are published, often with several bitrates (variants) listed in a master playlist.
+// When the connection engine finds an HLS playlist (#EXT-X- tags) the station connection
+// stays open with no socket of its own, and this client fetches the segments into its
+// ring instead:
+// - the playlist is reloaded every target duration (half that if nothing new appeared)
+// - up to hlsSegmentSlots segments are fetched at once: the one being played goes
+//   straight into the station's ring (or through its prefetch buffer to the recording,
+//   while timeshifted), the following ones into prefetch buffers, so their connects
+//   and first bytes overlap the current segment
+// - MPEG-TS segments are demultiplexed to the ADTS (or MPEG audio) stream inside,
+//   packed audio segments just lose their ID3 header
+// - the variant is chosen from the measured throughput (at most hlsSafetyPercent of it)
+//   and the buffer health estimate: a predicted underrun steps down straight away,
+//   stepping up waits for a healthy buffer and hlsUpSwitchHoldMS since the last switch
+// Only the active station has an HLS session; an HLS standby station is left parked
+// (no connections) and starts its session when it is selected. Playlists and segments
+// may be http:// or https://.
+#include <Arduino.h>
+#include "main.h"
+
+const uint8_t hlsMaxVariants = 6;
+const uint8_t hlsMaxSegments = 12; // Most recent entries of the media playlist
+const uint8_t hlsSegmentSlots = 3; // Segment being played plus those being prefetched
+const uint8_t hlsLiveStartSegments = 3; // Live streams start this far from the end
+
+// Prefetch buffer per slot (more with PSRAM), the rest of a segment waits in the socket
+const uint32_t hlsPrefetchBytes = 32768;
+const uint32_t hlsPrefetchBytesNoPsram = 8192;
+
+// Variant selection
+const uint8_t hlsSafetyPercent = 70;
+const uint32_t hlsStartBandwidth = 128000; // Until the throughput has been measured
+const uint32_t hlsDownUnderrunMS = 5000;   // Step down if the buffer is predicted to run dry this soon
+const unsigned long hlsUpSwitchHoldMS = 20000;
+
+const uint8_t hlsMaxPlaylistFailures = 3;
+const unsigned long hlsPlaylistRetryMS = 1000;
+
+struct hlsVariant
+{
+  uint32_t bandwidth;
+  char url[256];
+};
+
+struct hlsSegment
+{
+  uint32_t sequence;
+  char url[256];
+};
+
+enum hlsDemuxMode
+{
+  DEMUX_DETECT,
+  DEMUX_TS,
+  DEMUX_RAW
+};
+
+struct hlsSlot
+{
+  streamConnection conn;
+  spscRing buffer; // Prefetched audio, until the slot is the one being played
+  bool active;
+  bool done; // Everything received (or given up on)
+  bool retried;
+  uint32_t sequence;
+  unsigned long requestMillis;
+  unsigned long firstByteMillis;
+  uint32_t bytes;
+  hlsDemuxMode demux;
+  uint8_t packet[188]; // TS packet (or ID3 header) being assembled
+  uint8_t packetLen;
+  uint32_t skipBytes; // Rest of an ID3 tag
+};
+
+struct hlsSession
+{
+  streamConnection *owner;
+  char masterUrl[256];
+  char mediaUrl[256];
+  hlsVariant variants[hlsMaxVariants];
+  uint8_t variantCount;
+  uint8_t variant;
+  unsigned long lastSwitchMillis;
+
+  // Media playlist
+  hlsSegment segments[hlsMaxSegments];
+  uint8_t segmentCount;
+  uint32_t parseSequence;
+  bool variantPending; // #EXT-X-STREAM-INF seen, its URL is on the next line
+  uint32_t pendingBandwidth;
+  bool loadingMaster;
+  bool playlistLoading;
+  uint8_t playlistFailures;
+  unsigned long playlistMillis; // Last load finished (or failed)
+  uint32_t targetDurationMS;
+  bool endList;
+  bool started;
+  bool newSegments; // Last reload found segments we hadn't seen
+  uint32_t newestSequence;
+  uint32_t nextSequence; // Next segment to fetch
+
+  // Audio stream inside the TS segments
+  uint16_t pmtPid;
+  uint16_t audioPid;
+
+  // Throughput, measured over time spent downloading
+  unsigned long serviceMillis;
+  uint32_t throughputBps;
+  unsigned long downloadMillis;
+  uint32_t downloadBytes;
+};
+
+hlsSession hls;
+streamConnection hlsPlaylistConn;
+hlsSlot hlsSlots[hlsSegmentSlots];
+
+// Counters for the periodic report
+uint32_t hlsSegmentsFetched = 0;
+uint32_t hlsSegmentsFailed = 0;
+uint32_t hlsVariantSwitches = 0;
+uint32_t hlsFirstByteTotalMillis = 0;
+
+static uint8_t hlsChunk[1460];
+
+// Resolve a playlist entry against the playlist's own URL, false if it can't be fetched
+bool resolveHlsUrl(const char *base, const char *ref, char *url, size_t size)
+{
+  if (strncmp(ref, "http://", 7) == 0 || strncmp(ref, "https://", 8) == 0)
+  {
+    strlcpy(url, ref, size);
+    return true;
+  }
+  if (strstr(ref, "://"))
+    return false; // Some other scheme
+
+  // Scheme relative refs keep the playlist's scheme
+  const char *hostStart = strstr(base, "://");
+  if (!hostStart)
+    return false;
+  hostStart += 3;
+  if (strncmp(ref, "//", 2) == 0)
+  {
+    snprintf(url, size, "%.*s%s", (int)(hostStart - base - 2), base, ref);
+    return true;
+  }
+
+  const char *pathStart = strchr(hostStart, '/');
+  size_t hostEnd = pathStart ? pathStart - base : strlen(base);
+  if (ref[0] == '/')
+  {
+    snprintf(url, size, "%.*s%s", (int)hostEnd, base, ref);
+    return true;
+  }
+
+  // Relative to the playlist's directory (ignoring any query string)
+  const char *query = strchr(base, '?');
+  size_t baseLen = query ? query - base : strlen(base);
+  size_t dirEnd = hostEnd;
+  for (size_t i = hostEnd; i < baseLen; i++)
+  {
+    if (base[i] == '/')
+      dirEnd = i;
+  }
+  snprintf(url, size, "%.*s/%s", (int)dirEnd, base, ref);
+  return true;
+}
+
+// Start fetching a helper connection (playlist or segment)
+void beginHlsFetch(streamConnection &conn, hlsConnectionRole role, const char *url)
+{
+  static bool initialised = false;
+  if (!initialised)
+  {
+    hlsPlaylistConn.connectFd = -1;
+    for (uint8_t i = 0; i < hlsSegmentSlots; i++)
+    {
+      hlsSlots[i].conn.connectFd = -1;
+      if (!ringInit(hlsSlots[i].buffer, psramFound() ? hlsPrefetchBytes : hlsPrefetchBytesNoPsram))
+        logError("HLS: unable to allocate prefetch buffer");
+      hlsSlots[i].conn.ring = &hlsSlots[i].buffer;
+    }
+    hlsPlaylistConn.ring = &hlsSlots[0].buffer; // Never written, playlists are parsed
+    initialised = true;
+  }
+
+  closeStream(conn);
+  conn.hlsRole = role;
+  strlcpy(conn.url, url, sizeof(conn.url));
+  strlcpy(conn.currentUrl, url, sizeof(conn.currentUrl));
+  conn.fromCache = false;
+  memset(&conn.timings, 0, sizeof(conn.timings));
+  conn.connectStart = millis();
+  beginStreamHop(conn);
+}
+
+void loadHlsPlaylist(const char *url)
+{
+  hls.playlistLoading = true;
+  hls.segmentCount = 0;
+  hls.variantPending = false;
+  hls.parseSequence = 0;
+  hls.endList = false;
+  hls.loadingMaster = !hls.started && strlen(hls.masterUrl) == 0 && hls.variantCount == 0;
+  beginHlsFetch(hlsPlaylistConn, HLS_PLAYLIST, url);
+}
+
+// Called by the connection engine when a station's playlist turns out to be HLS
+void beginHls(streamConnection &conn)
+{
+  if (conn.racing)
+  {
+    failStream(conn, "HLS mirror");
+    return;
+  }
+  logInfo("Fetch: %s is HLS", conn.currentUrl);
+  conn.client.stop();
+  releaseSecureClient(conn);
+  strlcpy(conn.codecPath, "/stream.aac", sizeof(conn.codecPath));
+  cacheResolvedStream(conn);
+  setStreamState(conn, STREAM_BUFFERING);
+}
+
+void startHlsSession(streamConnection &conn)
+{
+  if (hls.owner != NULL)
+    endHlsSession(*hls.owner);
+  memset(&hls, 0, sizeof(hls));
+  hls.owner = &conn;
+  hls.targetDurationMS = 10000;
+  strlcpy(hls.mediaUrl, conn.currentUrl, sizeof(hls.mediaUrl));
+  loadHlsPlaylist(conn.currentUrl);
+}
+
+// The station's connection is being closed
+void endHlsSession(streamConnection &conn)
+{
+  if (hls.owner != &conn)
+    return;
+  closeStream(hlsPlaylistConn);
+  for (uint8_t i = 0; i < hlsSegmentSlots; i++)
+  {
+    closeStream(hlsSlots[i].conn);
+    hlsSlots[i].active = false;
+  }
+  hls.owner = NULL;
+}
+
+// The station's connection has been moved to another slot (see swapStreams()). A station
+// that is no longer active gives its session up and is parked until selected again.
+void hlsSessionMoved(streamConnection &from, streamConnection &to)
+{
+  if (hls.owner != &from)
+    return;
+  if (&to == &activeStream)
+  {
+    hls.owner = &to;
+    return;
+  }
+  hls.owner = &to;
+  endHlsSession(to);
+}
+
+// ===================== Playlists =======================
+void addHlsSegment(const char *url)
+{
+  if (hls.segmentCount == hlsMaxSegments)
+  {
+    memmove(&hls.segments[0], &hls.segments[1], sizeof(hlsSegment) * (hlsMaxSegments - 1));
+    hls.segmentCount--;
+  }
+  hlsSegment &segment = hls.segments[hls.segmentCount];
+  segment.sequence = hls.parseSequence++;
+  if (resolveHlsUrl(hlsPlaylistConn.currentUrl, url, segment.url, sizeof(segment.url)))
+    hls.segmentCount++;
+}
+
+void addHlsVariant(const char *url)
+{
+  if (!hls.loadingMaster || hls.variantCount == hlsMaxVariants)
+    return;
+  hlsVariant &variant = hls.variants[hls.variantCount];
+  variant.bandwidth = hls.pendingBandwidth;
+  if (resolveHlsUrl(hlsPlaylistConn.currentUrl, url, variant.url, sizeof(variant.url)))
+    hls.variantCount++;
+}
+
+// Called by the connection engine for each line of a playlist we fetched
+void hlsPlaylistLine(streamConnection &conn, const char *line)
+{
+  if (strncmp(line, "#EXT-X-STREAM-INF:", 18) == 0)
+  {
+    const char *bandwidth = strstr(line, "BANDWIDTH=");
+    hls.pendingBandwidth = bandwidth ? strtoul(bandwidth + 10, NULL, 10) : 0;
+    hls.variantPending = true;
+  }
+  else if (strncmp(line, "#EXT-X-TARGETDURATION:", 22) == 0)
+    hls.targetDurationMS = max(atoi(line + 22), 1) * 1000;
+  else if (strncmp(line, "#EXT-X-MEDIA-SEQUENCE:", 22) == 0)
+    hls.parseSequence = strtoul(line + 22, NULL, 10);
+  else if (strncmp(line, "#EXT-X-ENDLIST", 14) == 0)
+    hls.endList = true;
+  else if (line[0] != '\0' && line[0] != '#')
+  {
+    if (hls.variantPending)
+      addHlsVariant(line);
+    else
+      addHlsSegment(line);
+    hls.variantPending = false;
+  }
+}
+
+uint8_t initialHlsVariant()
+{
+  uint8_t variant = 0;
+  for (uint8_t i = 0; i < hls.variantCount; i++)
+  {
+    if (hls.variants[i].bandwidth <= hlsStartBandwidth)
+      variant = i;
+  }
+  return variant;
+}
+
+// Called by the connection engine once a playlist has been read
+void endOfHlsPlaylist(streamConnection &conn)
+{
+  hls.playlistLoading = false;
+  hls.playlistMillis = millis();
+  closeStream(conn);
+
+  // Master playlist: sort the variants by bandwidth and load the starting one
+  if (hls.loadingMaster && hls.variantCount > 0)
+  {
+    for (uint8_t i = 1; i < hls.variantCount; i++)
+    {
+      for (uint8_t j = i; j > 0 && hls.variants[j].bandwidth < hls.variants[j - 1].bandwidth; j--)
+      {
+        hlsVariant swapped = hls.variants[j];
+        hls.variants[j] = hls.variants[j - 1];
+        hls.variants[j - 1] = swapped;
+      }
+    }
+    strlcpy(hls.masterUrl, hls.mediaUrl, sizeof(hls.masterUrl));
+    hls.variant = initialHlsVariant();
+    hls.lastSwitchMillis = millis();
+    strlcpy(hls.mediaUrl, hls.variants[hls.variant].url, sizeof(hls.mediaUrl));
+    logInfo("HLS: %u variants, starting at %ukbps", hls.variantCount, hls.variants[hls.variant].bandwidth / 1000);
+    loadHlsPlaylist(hls.mediaUrl);
+    return;
+  }
+  hls.loadingMaster = false;
+
+  if (hls.segmentCount == 0)
+  {
+    hls.playlistFailures++;
+    logWarn("HLS: no segments in %s", hls.mediaUrl);
+    return;
+  }
+  hls.playlistFailures = 0;
+
+  uint32_t first = hls.segments[0].sequence;
+  uint32_t newest = hls.segments[hls.segmentCount - 1].sequence;
+  hls.newSegments = !hls.started || newest > hls.newestSequence;
+  hls.newestSequence = newest;
+  logDebug("HLS: playlist %u-%u loaded in %lums", first, newest, millis() - conn.connectStart);
+
+  if (!hls.started)
+  {
+    uint32_t fromEnd = hlsLiveStartSegments - 1;
+    hls.nextSequence = (hls.endList || newest - first < fromEnd) ? first : newest - fromEnd;
+    hls.started = true;
+    logInfo("HLS: starting at segment %u (%u-%u, target %ums)", hls.nextSequence, first, newest, hls.targetDurationMS);
+  }
+  else if (hls.nextSequence < first)
+  {
+    logWarn("HLS: fell behind the playlist, skipping segments %u-%u", hls.nextSequence, first - 1);
+    hls.nextSequence = first;
+  }
+  else if (hls.nextSequence > newest + hlsMaxSegments)
+  {
+    // A variant numbered differently from the last one
+    hls.nextSequence = (newest - first < hlsLiveStartSegments - 1) ? first : newest - (hlsLiveStartSegments - 1);
+    logWarn("HLS: segment numbers don't follow on, continuing at %u", hls.nextSequence);
+  }
+}
+
+// Reload the media playlist when it is due, retry a failed load
+void serviceHlsPlaylist(streamConnection &owner)
+{
+  if (hls.playlistLoading)
+  {
+    advanceStream(hlsPlaylistConn);
+    if (hlsPlaylistConn.state != STREAM_IDLE)
+      return;
+
+    // Failed (the engine has closed the connection)
+    hls.playlistLoading = false;
+    hls.playlistFailures++;
+    hls.playlistMillis = millis();
+  }
+
+  if (hls.playlistFailures >= hlsMaxPlaylistFailures)
+  {
+    failStream(owner, "HLS playlist unavailable");
+    return;
+  }
+
+  unsigned long interval = hls.newSegments ? hls.targetDurationMS : hls.targetDurationMS / 2;
+  if (hls.playlistFailures > 0)
+    interval = hlsPlaylistRetryMS;
+  if ((!hls.started || !hls.endList) && millis() - hls.playlistMillis >= interval)
+    loadHlsPlaylist(hls.mediaUrl);
+}
+
+// ===================== Demultiplexing ==================
+// Program association / map tables - find the audio elementary stream
+void parseHlsPsi(const uint8_t *section, uint8_t len, uint16_t pid)
+{
+  if (len < 12)
+    return;
+  uint16_t sectionEnd = min((uint16_t)(3 + (((section[1] & 0x0F) << 8) | section[2]) - 4), (uint16_t)len);
+
+  if (pid == 0 && section[0] == 0x00)
+  {
+    for (uint16_t i = 8; i + 4 <= sectionEnd; i += 4)
+    {
+      uint16_t program = (section[i] << 8) | section[i + 1];
+      if (program != 0)
+      {
+        hls.pmtPid = ((section[i + 2] & 0x1F) << 8) | section[i + 3];
+        return;
+      }
+    }
+  }
+  else if (pid == hls.pmtPid && section[0] == 0x02)
+  {
+    uint16_t i = 12 + (((section[10] & 0x0F) << 8) | section[11]);
+    while (i + 5 <= sectionEnd)
+    {
+      uint8_t streamType = section[i];
+      uint16_t esPid = ((section[i + 1] & 0x1F) << 8) | section[i + 2];
+      if (streamType == 0x0F || streamType == 0x03 || streamType == 0x04)
+      {
+        if (hls.audioPid != esPid && hls.owner != NULL)
+          strlcpy(hls.owner->codecPath, streamType == 0x0F ? "/stream.aac" : "/stream.mp3", sizeof(hls.owner->codecPath));
+        hls.audioPid = esPid;
+        return;
+      }
+      i += 5 + (((section[i + 3] & 0x0F) << 8) | section[i + 4]);
+    }
+  }
+}
+
+// One 188 byte TS packet - audio payload (less PES headers) goes to out
+void demuxHlsPacket(const uint8_t *packet, spscRing &out)
+{
+  uint16_t pid = ((packet[1] & 0x1F) << 8) | packet[2];
+  bool unitStart = packet[1] & 0x40;
+  uint8_t adaptation = (packet[3] >> 4) & 0x03;
+  uint16_t offset = 4;
+  if (adaptation & 0x02)
+    offset += 1 + packet[4];
+  if (!(adaptation & 0x01) || offset >= 188)
+    return;
+
+  if (pid == 0 || (hls.pmtPid != 0 && pid == hls.pmtPid))
+  {
+    if (unitStart)
+      offset += 1 + packet[offset]; // Pointer field
+    if (offset < 188)
+      parseHlsPsi(packet + offset, 188 - offset, pid);
+  }
+  else if (hls.audioPid != 0 && pid == hls.audioPid)
+  {
+    if (unitStart)
+    {
+      const uint8_t *pes = packet + offset;
+      if (offset + 9 > 188 || pes[0] != 0 || pes[1] != 0 || pes[2] != 1)
+        return;
+      offset += 9 + pes[8];
+      if (offset >= 188)
+        return;
+    }
+    ringWrite(out, packet + offset, 188 - offset);
+  }
+}
+
+// Segment bytes as received - the audio in them goes to out (never more than came in)
+void demuxHls(hlsSlot &slot, const uint8_t *data, uint32_t len, spscRing &out)
+{
+  while (len > 0)
+  {
+    switch (slot.demux)
+    {
+    case DEMUX_DETECT:
+      // Collect enough to tell a TS segment from packed audio (and read an ID3 header)
+      slot.packet[slot.packetLen++] = *data++;
+      len--;
+      if (slot.packetLen < 10)
+        break;
+      if (slot.packet[0] == 0x47)
+      {
+        slot.demux = DEMUX_TS;
+        continue; // Packet already started
+      }
+      if (memcmp(slot.packet, "ID3", 3) == 0)
+      {
+        slot.skipBytes = ((slot.packet[6] & 0x7F) << 21) | ((slot.packet[7] & 0x7F) << 14) |
+                         ((slot.packet[8] & 0x7F) << 7) | (slot.packet[9] & 0x7F);
+        if (slot.packet[5] & 0x10)
+          slot.skipBytes += 10; // Footer
+        slot.packetLen = 0;
+        slot.demux = DEMUX_RAW;
+        break;
+      }
+      ringWrite(out, slot.packet, slot.packetLen);
+      slot.packetLen = 0;
+      slot.demux = DEMUX_RAW;
+      break;
+    case DEMUX_TS:
+    {
+      // Resynchronise on the sync byte if a packet boundary is lost
+      if (slot.packetLen == 0 && *data != 0x47)
+      {
+        data++;
+        len--;
+        break;
+      }
+      uint8_t copy = min(len, (uint32_t)(188 - slot.packetLen));
+      memcpy(slot.packet + slot.packetLen, data, copy);
+      slot.packetLen += copy;
+      data += copy;
+      len -= copy;
+      if (slot.packetLen == 188)
+      {
+        demuxHlsPacket(slot.packet, out);
+        slot.packetLen = 0;
+      }
+      break;
+    }
+    case DEMUX_RAW:
+    {
+      uint32_t skipped = min(len, slot.skipBytes);
+      slot.skipBytes -= skipped;
+      ringWrite(out, data + skipped, len - skipped);
+      len = 0;
+      break;
+    }
+    }
+  }
+}
+
+// ===================== Segments ========================
+// Choose the variant for the next segment from the throughput and the buffer health
+uint8_t chooseHlsVariant(const char *&reason)
+{
+  reason = NULL;
+  if (hls.variantCount < 2 || hls.throughputBps == 0)
+    return hls.variant;
+
+  uint8_t wanted = 0;
+  uint64_t budget = ((uint64_t)hls.throughputBps * hlsSafetyPercent) / 100;
+  for (uint8_t i = 0; i < hls.variantCount; i++)
+  {
+    if (hls.variants[i].bandwidth <= budget)
+      wanted = i;
+  }
+
+  uint32_t underrunMS = predictedUnderrunMS();
+  if (underrunMS < hlsDownUnderrunMS && hls.variant > 0)
+  {
+    reason = "buffer running out";
+    return min(wanted, (uint8_t)(hls.variant - 1));
+  }
+  if (wanted < hls.variant)
+  {
+    reason = "throughput";
+    return wanted;
+  }
+  if (wanted > hls.variant && underrunMS == noUnderrun && millis() - hls.lastSwitchMillis > hlsUpSwitchHoldMS)
+  {
+    reason = "throughput";
+    return hls.variant + 1;
+  }
+  return hls.variant;
+}
+
+void switchHlsVariant(uint8_t variant, const char *reason)
+{
+  bufferHealth snapshot;
+  getBufferHealth(snapshot);
+  logInfo("HLS: variant %ukbps -> %ukbps (%s, throughput %ukbps, buffer %ums)",
+          hls.variants[hls.variant].bandwidth / 1000, hls.variants[variant].bandwidth / 1000, reason,
+          hls.throughputBps / 1000, snapshot.bufferedMS);
+  hls.variant = variant;
+  hls.lastSwitchMillis = millis();
+  hlsVariantSwitches++;
+  strlcpy(hls.mediaUrl, hls.variants[variant].url, sizeof(hls.mediaUrl));
+  loadHlsPlaylist(hls.mediaUrl);
+}
+
+// Start fetching the next segments into any free slots
+void startHlsSegments()
+{
+  for (uint8_t i = 0; i < hlsSegmentSlots && hls.started && !hls.playlistLoading; i++)
+  {
+    hlsSlot &slot = hlsSlots[i];
+    if (slot.active)
+      continue;
+
+    int8_t entry = -1;
+    for (uint8_t j = 0; j < hls.segmentCount; j++)
+    {
+      if (hls.segments[j].sequence == hls.nextSequence)
+        entry = j;
+    }
+    if (entry < 0)
+      return; // Waiting for the playlist to move on
+
+    const char *reason;
+    uint8_t variant = chooseHlsVariant(reason);
+    if (variant != hls.variant)
+    {
+      switchHlsVariant(variant, reason);
+      return;
+    }
+
+    slot.active = true;
+    slot.done = false;
+    slot.retried = false;
+    slot.sequence = hls.nextSequence++;
+    slot.requestMillis = millis();
+    slot.firstByteMillis = 0;
+    slot.bytes = 0;
+    slot.demux = DEMUX_DETECT;
+    slot.packetLen = 0;
+    slot.skipBytes = 0;
+    ringReset(slot.buffer);
+    beginHlsFetch(slot.conn, HLS_SEGMENT, hls.segments[entry].url);
+  }
+}
+
+// The slot being played is the one with the earliest segment
+int8_t currentHlsSlot()
+{
+  int8_t current = -1;
+  for (uint8_t i = 0; i < hlsSegmentSlots; i++)
+  {
+    if (hlsSlots[i].active && (current < 0 || hlsSlots[i].sequence < hlsSlots[current].sequence))
+      current = i;
+  }
+  return current;
+}
+
+// Is the station being timeshifted? Its audio then goes to the recording (through
+// writeStreamAudio()) rather than straight into its ring.
+bool hlsRecording()
+{
+  return hls.owner == &activeStream && timeshifting();
+}
+
+// Room for more of a segment: in the station's ring for the segment being played (once
+// its prefetched part has been handed over), otherwise in its prefetch buffer
+// less a packet, as a TS packet completed by one read can include bytes from the last.
+// While recording every segment is read into its prefetch buffer, to be handed over.
+uint32_t hlsSlotSpace(hlsSlot &slot, bool current)
+{
+  uint32_t space = 0;
+  if (current && ringFilled(slot.buffer) == 0 && !hlsRecording())
+    space = ringFree(*hls.owner->ring);
+  else if (!current || hlsRecording())
+    space = ringFree(slot.buffer);
+  return (space > sizeof(slot.packet)) ? space - sizeof(slot.packet) : 0;
+}
+
+void hlsAudioWritten(uint32_t bytes)
+{
+  if (bytes == 0)
+    return;
+  if (hls.owner == &activeStream)
+  {
+    noteStreamReceived(bytes);
+    wakeAudioTask();
+  }
+}
+
+void endHlsSegment(hlsSlot &slot, bool failed)
+{
+  slot.done = true;
+  closeStream(slot.conn);
+  if (failed)
+  {
+    hlsSegmentsFailed++;
+    logWarn("HLS: segment %u failed, skipped", slot.sequence);
+    return;
+  }
+  hlsSegmentsFetched++;
+  hlsFirstByteTotalMillis += slot.firstByteMillis - slot.requestMillis;
+  logInfo("HLS: segment %u %uB first byte %lums, complete %lums", slot.sequence, slot.bytes,
+          slot.firstByteMillis - slot.requestMillis, millis() - slot.requestMillis);
+}
+
+// Move every segment fetch on, keeping the station's ring fed in segment order
+void serviceHlsSegments(streamConnection &owner)
+{
+  bool downloading = false;
+  int8_t current = currentHlsSlot();
+
+  for (uint8_t i = 0; i < hlsSegmentSlots; i++)
+  {
+    hlsSlot &slot = hlsSlots[i];
+    if (!slot.active)
+      continue;
+    bool isCurrent = (i == current);
+
+    // Hand the prefetched part over first (the recording takes all there is)
+    if (isCurrent && ringFilled(slot.buffer) > 0)
+    {
+      uint32_t space = hlsRecording() ? sizeof(hlsChunk) : min(ringFree(*owner.ring), (uint32_t)sizeof(hlsChunk));
+      uint32_t moved = ringRead(slot.buffer, hlsChunk, space);
+      writeStreamAudio(owner, hlsChunk, moved);
+      hlsAudioWritten(moved);
+    }
+
+    if (!slot.done)
+    {
+      if (!isStreaming(slot.conn))
+      {
+        if (slot.conn.state != STREAM_IDLE)
+          advanceStream(slot.conn);
+        if (slot.conn.state == STREAM_IDLE)
+        {
+          // Failed to connect - one more go, then skip the segment
+          if (!slot.retried)
+          {
+            char url[256];
+            strlcpy(url, slot.conn.currentUrl, sizeof(url));
+            slot.retried = true;
+            beginHlsFetch(slot.conn, HLS_SEGMENT, url);
+          }
+          else
+            endHlsSegment(slot, true);
+        }
+        continue;
+      }
+
+      uint32_t space = hlsSlotSpace(slot, isCurrent);
+      if (space > 0 && streamClient(slot.conn).available())
+      {
+        int bytesRead = streamClient(slot.conn).read(hlsChunk, min(space, (uint32_t)sizeof(hlsChunk)));
+        if (bytesRead > 0)
+        {
+          if (slot.firstByteMillis == 0)
+            slot.firstByteMillis = millis();
+          slot.bytes += bytesRead;
+          hls.downloadBytes += bytesRead;
+          fetchBytesTotal += bytesRead;
+          spscRing &out = (isCurrent && ringFilled(slot.buffer) == 0 && !hlsRecording()) ? *owner.ring : slot.buffer;
+          uint32_t filledBefore = ringFilled(out);
+          demuxHls(slot, hlsChunk, bytesRead, out);
+          if (&out == owner.ring)
+            hlsAudioWritten(ringFilled(out) - filledBefore);
+        }
+      }
+      if (space > 0)
+        downloading = true;
+
+      if (!streamClient(slot.conn).connected() && !streamClient(slot.conn).available())
+        endHlsSegment(slot, slot.bytes == 0);
+    }
+
+    // Finished with the segment being played once it has all been handed over
+    if (isCurrent && slot.done && ringFilled(slot.buffer) == 0)
+    {
+      slot.active = false;
+      current = currentHlsSlot();
+    }
+  }
+
+  // Throughput over the time something was downloading (not held up by full buffers)
+  if (downloading && hls.serviceMillis != 0)
+    hls.downloadMillis += millis() - hls.serviceMillis;
+  hls.serviceMillis = millis();
+  if (hls.downloadMillis >= 1000)
+  {
+    uint32_t sample = ((uint64_t)hls.downloadBytes * 8000) / hls.downloadMillis;
+    hls.throughputBps = (hls.throughputBps == 0) ? sample : (hls.throughputBps * 7 + sample * 3) / 10;
+    hls.downloadMillis = 0;
+    hls.downloadBytes = 0;
+  }
+
+  // Nothing to fetch until the playlist moves on - waiting, not stalled
+  if (currentHlsSlot() < 0 && (hls.playlistLoading || hls.started))
+    noteStreamReceived(0);
+}
+
+// Called by serviceStream() for an HLS station connection
+void serviceHls(streamConnection &conn)
+{
+  // Standby HLS stations stay parked until they are selected
+  if (&conn != &activeStream)
+    return;
+  if (hls.owner != &conn)
+    startHlsSession(conn);
+
+  serviceHlsPlaylist(conn);
+  if (hls.owner != &conn)
+    return; // Failed
+  startHlsSegments();
+  serviceHlsSegments(conn);
+
+  // A playlist that has ended (not live radio, but possible)
+  if (hls.endList && hls.nextSequence > hls.newestSequence && currentHlsSlot() < 0)
+    failStream(conn, "end of HLS playlist");
+}
+
+// Called by addStreamWait() for an HLS station connection
+bool addHlsWaits(streamConnection &conn, fd_set &readSet, fd_set &writeSet, int &maxFd, uint32_t &timeoutMS)
+{
+  if (hls.owner != &conn)
+  {
+    // About to start its session (or parked)
+    if (&conn == &activeStream)
+      timeoutMS = min(timeoutMS, (uint32_t)5);
+    return false;
+  }
+
+  if (hls.playlistLoading && addStreamWait(hlsPlaylistConn, readSet, writeSet, maxFd, timeoutMS))
+    return true;
+
+  int8_t current = currentHlsSlot();
+  for (uint8_t i = 0; i < hlsSegmentSlots; i++)
+  {
+    hlsSlot &slot = hlsSlots[i];
+    if (!slot.active)
+      continue;
+    if (i == current && ringFilled(slot.buffer) > 0 && (hlsRecording() || ringFree(*conn.ring) > 0))
+      return true; // Prefetched audio to hand over
+    if (slot.done)
+      continue;
+    if (!isStreaming(slot.conn))
+    {
+      if (addStreamWait(slot.conn, readSet, writeSet, maxFd, timeoutMS))
+        return true;
+      continue;
+    }
+    if (hlsSlotSpace(slot, i == current) == 0)
+      continue; // Full - waits for the decoder
+    if (streamClient(slot.conn).available())
+      return true;
+    if (streamClientFd(slot.conn) >= 0)
+    {
+      FD_SET(streamClientFd(slot.conn), &readSet);
+      maxFd = max(maxFd, streamClientFd(slot.conn));
+    }
+    else
+      timeoutMS = min(timeoutMS, (uint32_t)5); // TLS, polled
+  }
+
+  // Next playlist reload
+  if (!hls.playlistLoading && !hls.endList)
+  {
+    unsigned long sinceLoad = millis() - hls.playlistMillis;
+    timeoutMS = min(timeoutMS, (uint32_t)(sinceLoad < hls.targetDurationMS / 2 ? hls.targetDurationMS / 2 - sinceLoad : 1));
+  }
+  return false;
+}
+
+void reportHls()
+{
+  if (hls.owner == NULL)
+    return;
+  logInfo("HLS: variant %u/%u %ukbps, throughput %ukbps, segments %u (failed %u, avg first byte %ums), switches %u",
+          hls.variant + 1, max(hls.variantCount, (uint8_t)1),
+          hls.variantCount ? hls.variants[hls.variant].bandwidth / 1000 : 0, hls.throughputBps / 1000,
+          hlsSegmentsFetched, hlsSegmentsFailed,
+          hlsSegmentsFetched ? hlsFirstByteTotalMillis / hlsSegmentsFetched : 0, hlsVariantSwitches);
+}
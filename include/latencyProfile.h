@@ -0,0 +1,171 @@
+// Latency profiles - trade start-up / channel change delay against resilience to
+// network jitter. Each profile sets the depth of the compressed stream ring, the
+// prebuffer watermark decoding waits for, and the I2S DMA descriptor count/length.
+// The adaptive profile starts playing early and raises the watermark after underruns.
+// Serial command 'l' lists the profiles, 'l<n>' or 'l<name>' selects one (from the next
+// restart, the buffers are allocated at boot).
+
+// Ensure this header file is included only once
+#ifndef _LatencyProfile_
+#define _LatencyProfile_
+
+#include <Arduino.h>
+#include "driver/i2s.h"
+#include "main.h"
+
+enum latencyProfileId
+{
+  LATENCY_LOW,
+  LATENCY_BALANCED,
+  LATENCY_ROBUST,
+  LATENCY_ADAPTIVE,
+  LATENCY_PROFILES
+};
+
+struct latencyProfile
+{
+  const char *name;
+  uint32_t ringBytes;      // Compressed stream buffer (goes in PSRAM when present)
+  uint32_t prebufferBytes; // Decoding starts / restarts at this fill level
+  uint8_t dmaBufCount;     // I2S DMA descriptors
+  uint16_t dmaBufLen;      // Samples per I2S DMA descriptor
+  bool adaptive;           // Grow the prebuffer watermark after each underrun
+};
+
+const latencyProfile latencyProfiles[LATENCY_PROFILES] = {
+    {"low-latency", 16384, 4000, 4, 256, false},
+    {"balanced", 32768, 12000, 8, 1024, false},
+    {"robust", 131072, 48000, 16, 1024, false},
+    {"adaptive", 131072, 4000, 8, 512, true},
+};
+
+// Without PSRAM the stream ring has to come out of internal RAM, so cap it
+const uint32_t maxInternalRingBytes = 65536;
+
+// Profile used until one is saved in EEPROM
+#define DEFAULT_LATENCY_PROFILE LATENCY_BALANCED
+
+const latencyProfile *currentProfile = &latencyProfiles[DEFAULT_LATENCY_PROFILE];
+
+// Watermark in use - fixed for most profiles, grows after underruns when adaptive
+volatile uint32_t prebufferWatermark = latencyProfiles[DEFAULT_LATENCY_PROFILE].prebufferBytes;
+volatile uint32_t streamUnderruns = 0;
+unsigned long lastUnderrunMillis = 0;
+
+// I2S driver events - it posts one per DMA descriptor sent, and a TX_Q_OVF when it had
+// to send a descriptor nothing had been written to (I2S itself ran dry). The queue drops
+// its oldest event when full so only needs to cover the gap between audio task wakeups.
+const uint8_t i2sEventQueueLength = 16;
+QueueHandle_t i2sEventQueue = NULL;
+
+// Adaptive profile: grow by half again per underrun, shrink back slowly once stable
+const uint8_t adaptiveGrowPercent = 150;
+const unsigned long adaptiveShrinkAfterMS = 300000;
+
+// Stream ring size for the current profile and board
+uint32_t profileRingBytes()
+{
+  if (!psramFound() && currentProfile->ringBytes > maxInternalRingBytes)
+    return maxInternalRingBytes;
+  return currentProfile->ringBytes;
+}
+
+// Retrieve the profile saved in EEPROM - must be called before the audio tasks are created
+void loadLatencyProfile()
+{
+  uint8_t profile = preferences.getUChar("latencyProfile", DEFAULT_LATENCY_PROFILE);
+  if (profile >= LATENCY_PROFILES)
+    profile = DEFAULT_LATENCY_PROFILE;
+
+  currentProfile = &latencyProfiles[profile];
+  prebufferWatermark = currentProfile->prebufferBytes;
+
+  logInfo("Latency profile: %s (ring %u bytes%s, prebuffer %u, DMA %dx%d)",
+          currentProfile->name, profileRingBytes(), psramFound() ? " in PSRAM" : "",
+          prebufferWatermark, currentProfile->dmaBufCount, currentProfile->dmaBufLen);
+}
+
+// Remember a new profile - buffers are allocated at boot so it applies after a restart
+void saveLatencyProfile(latencyProfileId profile)
+{
+  preferences.putUChar("latencyProfile", profile);
+  logInfo("Latency profile %s selected, restart to apply", latencyProfiles[profile].name);
+}
+
+// Serial command 'l' (see the top of this file)
+void latencyProfileCommand()
+{
+  char line[16];
+  readCommandLine(line, sizeof(line));
+  if (line[0] == '\0')
+  {
+    uint8_t saved = preferences.getUChar("latencyProfile", DEFAULT_LATENCY_PROFILE);
+    for (uint8_t i = 0; i < LATENCY_PROFILES; i++)
+      logInfo("Latency profile %u %s: ring %u, prebuffer %u, DMA %ux%u%s%s", i, latencyProfiles[i].name,
+              latencyProfiles[i].ringBytes, latencyProfiles[i].prebufferBytes, latencyProfiles[i].dmaBufCount,
+              latencyProfiles[i].dmaBufLen, currentProfile == &latencyProfiles[i] ? " (in use)" : "",
+              saved == i && currentProfile != &latencyProfiles[i] ? " (after restart)" : "");
+    return;
+  }
+
+  for (uint8_t i = 0; i < LATENCY_PROFILES; i++)
+  {
+    if ((isdigit(line[0]) && (uint8_t)atoi(line) == i) || strcmp(line, latencyProfiles[i].name) == 0)
+    {
+      saveLatencyProfile((latencyProfileId)i);
+      return;
+    }
+  }
+  logWarn("Latency profile: expected l<0-%u> or l<name>", LATENCY_PROFILES - 1);
+}
+
+// The audio library installs I2S with its own DMA settings, re-install it with the
+// profile's descriptor count and length (must be called before audio.setPinout())
+void applyI2SProfile()
+{
+  i2s_config_t i2sConfig = {};
+  i2sConfig.mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_TX);
+  i2sConfig.sample_rate = 44100;
+  i2sConfig.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
+  i2sConfig.channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT;
+  i2sConfig.communication_format = (i2s_comm_format_t)(I2S_COMM_FORMAT_I2S | I2S_COMM_FORMAT_I2S_MSB);
+  i2sConfig.intr_alloc_flags = ESP_INTR_FLAG_LEVEL1;
+  i2sConfig.dma_buf_count = currentProfile->dmaBufCount;
+  i2sConfig.dma_buf_len = currentProfile->dmaBufLen;
+  i2sConfig.use_apll = false;
+  i2sConfig.tx_desc_auto_clear = true;
+
+  i2s_driver_uninstall(I2S_NUM_0);
+  if (i2s_driver_install(I2S_NUM_0, &i2sConfig, i2sEventQueueLength, &i2sEventQueue) != ESP_OK)
+    logError("Unable to install I2S driver");
+}
+
+// Called by the audio task when the stream ring ran dry mid-stream
+void noteStreamUnderrun()
+{
+  streamUnderruns++;
+  lastUnderrunMillis = millis();
+
+  if (currentProfile->adaptive)
+  {
+    uint32_t maxWatermark = (profileRingBytes() * 3) / 4;
+    prebufferWatermark = min((prebufferWatermark * adaptiveGrowPercent) / 100, maxWatermark);
+  }
+  logWarn("Stream underrun %u, prebuffer now %u bytes", streamUnderruns, prebufferWatermark);
+}
+
+// Adaptive profile: after a long spell without underruns, step back towards the starting watermark
+void adaptPrebufferWatermark()
+{
+  if (!currentProfile->adaptive || prebufferWatermark <= currentProfile->prebufferBytes)
+    return;
+
+  if (millis() - lastUnderrunMillis > adaptiveShrinkAfterMS)
+  {
+    prebufferWatermark = max((prebufferWatermark * 100) / adaptiveGrowPercent, currentProfile->prebufferBytes);
+    lastUnderrunMillis = millis();
+    logInfo("Stream stable, prebuffer now %u bytes", prebufferWatermark);
+  }
+}
+
+#endif
@@ -0,0 +1,607 @@
+// Local file playback (part of the fetch stage, run by the fetch task)
+// A station whose URL is file:/path plays a file from LittleFS instead of a network
+// stream - a jingle, or something to fall back on when the network is down. The file is
+// read into the station's ring like any other stream (so buffering, DSP and crossfades
+// all work as usual) and loops when it reaches the end.
+//
+// MP3 files get a frame index so a seek (or resuming where the file was left) goes
+// straight to the right frame rather than scanning from the start. The index is built
+// the first time the file is played, a few frames every time round the fetch loop with
+// its own file handle, and saved beside the file (<path>.idx) for next time. It holds
+// the offset of every framesPerEntry'th frame: when it fills up every other entry is
+// dropped and the spacing doubles, so it stays within maxFrameIndexEntries however long
+// the file is and a seek never walks more than framesPerEntry frame headers.
+//
+// Only the active station has a file open; a local standby station is left parked.
+// Files come from LittleFS - a card mounted with SD.begin() could be used by pointing
+// localFS at it.
+//
+// Serial command 'f': f shows the position, f<secs> seeks to it, f+<secs> / f-<secs>
+// seek relative to where the file is playing.
+#include <Arduino.h>
+#include "main.h"
+
+// Set LOCAL_PLAYBACK to false to treat file: URLs like any other (ie fail to connect)
+#define LOCAL_PLAYBACK true
+
+const char *localUrlScheme = "file:";
+fs::FS &localFS = LITTLEFS;
+
+// Frame index file: a frameIndexHeader followed by entries * uint32_t file offsets
+const char *frameIndexSuffix = ".idx";
+const uint32_t frameIndexMagic = 0x5849504D; // "MPIX"
+const uint16_t frameIndexVersion = 1;
+const uint16_t maxFrameIndexEntries = 1024;
+
+// Frames indexed per fetch loop while the file plays
+const uint16_t frameIndexScanFrames = 64;
+
+// Junk between frames (or a tag) searched for the next frame before giving up
+const uint32_t maxFrameResync = 4096;
+
+struct frameIndexHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t samplesPerFrame;
+  uint32_t fileSize;
+  uint32_t sampleRate;
+  uint32_t frames;
+  uint16_t framesPerEntry;
+  uint16_t entries;
+};
+
+struct mpegFrame
+{
+  uint16_t length;
+  uint16_t samples;
+  uint32_t sampleRate;
+  uint16_t kbps;
+};
+
+struct localFileSession
+{
+  streamConnection *owner;
+  char path[128];
+  bool mp3;
+  uint32_t loops;
+  uint32_t playedOffset; // Where the decoder has got to (what it hasn't read is in the ring)
+
+  frameIndexHeader index;
+  bool indexComplete;
+  bool indexLoaded; // From the .idx file rather than scanned
+  uint32_t scanOffset;
+  unsigned long scanStartMillis;
+};
+
+localFileSession localPlayer;
+File localFile;
+File indexScanFile;
+static uint32_t frameIndexEntries[maxFrameIndexEntries];
+
+// Seek request from the UI task (the decoder has been stopped)
+volatile uint32_t localSeekTargetMS = 0;
+
+// Statistics (cumulative since boot)
+uint32_t localSeeks = 0;
+uint64_t localSeekLookupMicros = 0;
+
+bool isLocalUrl(const char *url)
+{
+  return LOCAL_PLAYBACK && strncmp(url, localUrlScheme, strlen(localUrlScheme)) == 0;
+}
+
+// file:/path or file:///path
+const char *localUrlPath(const char *url)
+{
+  const char *path = url + strlen(localUrlScheme);
+  if (strncmp(path, "//", 2) == 0)
+    path += 2;
+  return path;
+}
+
+// ===================== MPEG audio frames ===============
+// Decode a frame header, false if these 4 bytes aren't one
+bool parseMpegHeader(const uint8_t *header, mpegFrame &frame)
+{
+  static const uint16_t mpeg1Kbps[3][15] = {
+      {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},   // Layer III
+      {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},  // Layer II
+      {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448}}; // Layer I
+  static const uint16_t mpeg2Kbps[3][15] = {
+      {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+      {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+      {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256}};
+  static const uint32_t sampleRates[3] = {44100, 48000, 32000};
+
+  if (header[0] != 0xFF || (header[1] & 0xE0) != 0xE0)
+    return false;
+  uint8_t version = (header[1] >> 3) & 3; // 0 = MPEG-2.5, 2 = MPEG-2, 3 = MPEG-1
+  uint8_t layer = (header[1] >> 1) & 3;   // 1 = III, 2 = II, 3 = I
+  uint8_t bitrateIndex = header[2] >> 4;
+  uint8_t rateIndex = (header[2] >> 2) & 3;
+  uint8_t padding = (header[2] >> 1) & 1;
+  if (version == 1 || layer == 0 || bitrateIndex == 0 || bitrateIndex == 15 || rateIndex == 3)
+    return false;
+
+  bool mpeg1 = version == 3;
+  frame.sampleRate = sampleRates[rateIndex] >> (mpeg1 ? 0 : (version == 2 ? 1 : 2));
+  frame.kbps = (mpeg1 ? mpeg1Kbps : mpeg2Kbps)[layer - 1][bitrateIndex];
+  uint32_t bitsPerSec = frame.kbps * 1000UL;
+  if (layer == 3)
+  {
+    frame.samples = 384;
+    frame.length = ((12 * bitsPerSec) / frame.sampleRate + padding) * 4;
+  }
+  else if (layer == 2 || mpeg1)
+  {
+    frame.samples = 1152;
+    frame.length = (144 * bitsPerSec) / frame.sampleRate + padding;
+  }
+  else
+  {
+    frame.samples = 576;
+    frame.length = (72 * bitsPerSec) / frame.sampleRate + padding;
+  }
+  return true;
+}
+
+bool readMpegFrame(File &file, uint32_t offset, mpegFrame &frame)
+{
+  uint8_t header[4];
+  if (!file.seek(offset) || file.read(header, sizeof(header)) != sizeof(header))
+    return false;
+  return parseMpegHeader(header, frame);
+}
+
+// The frame at offset, or the next one after any junk (moving offset on to it). A frame
+// found by searching only counts if another follows it. False at the end of the audio.
+bool findMpegFrame(File &file, uint32_t &offset, mpegFrame &frame)
+{
+  if (readMpegFrame(file, offset, frame))
+    return true;
+
+  static uint8_t search[256];
+  uint32_t searched = 0;
+  while (searched < maxFrameResync)
+  {
+    if (!file.seek(offset))
+      return false;
+    size_t len = file.read(search, sizeof(search));
+    if (len < 4)
+      return false;
+    for (size_t i = 0; i + 3 < len; i++)
+    {
+      if (!parseMpegHeader(search + i, frame))
+        continue;
+      uint32_t next = offset + i + frame.length;
+      mpegFrame following;
+      if (next == file.size() || readMpegFrame(file, next, following))
+      {
+        offset += i;
+        return parseMpegHeader(search + i, frame);
+      }
+    }
+    offset += len - 3;
+    searched += len - 3;
+  }
+  return false;
+}
+
+// Size of an ID3v2 tag at the start of the file (0 if there isn't one)
+uint32_t id3v2Size(File &file)
+{
+  uint8_t header[10];
+  if (!file.seek(0) || file.read(header, sizeof(header)) != sizeof(header) || memcmp(header, "ID3", 3) != 0)
+    return 0;
+  uint32_t size = ((header[6] & 0x7F) << 21) | ((header[7] & 0x7F) << 14) | ((header[8] & 0x7F) << 7) | (header[9] & 0x7F);
+  return size + 10 + ((header[5] & 0x10) ? 10 : 0);
+}
+
+// ===================== Frame index =====================
+void indexFilePath(char *indexPath, size_t size)
+{
+  snprintf(indexPath, size, "%s%s", localPlayer.path, frameIndexSuffix);
+}
+
+uint32_t indexDurationMS(uint32_t frames)
+{
+  if (localPlayer.index.sampleRate == 0)
+    return 0;
+  return ((uint64_t)frames * localPlayer.index.samplesPerFrame * 1000) / localPlayer.index.sampleRate;
+}
+
+uint32_t indexBytes()
+{
+  return sizeof(frameIndexHeader) + localPlayer.index.entries * sizeof(uint32_t);
+}
+
+// The index saved beside the file, if it is there and still matches the file
+bool loadFrameIndex()
+{
+  char indexPath[sizeof(localPlayer.path) + 4];
+  indexFilePath(indexPath, sizeof(indexPath));
+  if (!localFS.exists(indexPath))
+    return false;
+
+  unsigned long startMicros = esp_timer_get_time();
+  File file = localFS.open(indexPath, FILE_READ);
+  frameIndexHeader &header = localPlayer.index;
+  bool valid = file && file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+               header.magic == frameIndexMagic && header.version == frameIndexVersion &&
+               header.fileSize == localFile.size() && header.entries <= maxFrameIndexEntries &&
+               header.framesPerEntry > 0 && header.sampleRate > 0 && file.size() == indexBytes() &&
+               file.read((uint8_t *)frameIndexEntries, header.entries * sizeof(uint32_t)) ==
+                   header.entries * sizeof(uint32_t);
+  file.close();
+  if (!valid)
+  {
+    logWarn("Local: %s is out of date, rebuilding", indexPath);
+    memset(&header, 0, sizeof(header));
+    return false;
+  }
+
+  localPlayer.indexComplete = true;
+  localPlayer.indexLoaded = true;
+  logInfo("Local: frame index %s loaded in %luus - %u frames (%us), %u entries every %u frames, %u bytes", indexPath,
+          (unsigned long)(esp_timer_get_time() - startMicros), header.frames, indexDurationMS(header.frames) / 1000,
+          header.entries, header.framesPerEntry, indexBytes());
+  return true;
+}
+
+void saveFrameIndex()
+{
+  char indexPath[sizeof(localPlayer.path) + 4];
+  indexFilePath(indexPath, sizeof(indexPath));
+  File file = localFS.open(indexPath, FILE_WRITE);
+  if (!file)
+  {
+    logWarn("Local: unable to write %s", indexPath);
+    return;
+  }
+  file.write((const uint8_t *)&localPlayer.index, sizeof(localPlayer.index));
+  file.write((const uint8_t *)frameIndexEntries, localPlayer.index.entries * sizeof(uint32_t));
+  file.close();
+}
+
+void beginFrameIndexScan()
+{
+  memset(&localPlayer.index, 0, sizeof(localPlayer.index));
+  localPlayer.index.magic = frameIndexMagic;
+  localPlayer.index.version = frameIndexVersion;
+  localPlayer.index.fileSize = localFile.size();
+  localPlayer.index.framesPerEntry = 1;
+  localPlayer.indexComplete = false;
+  localPlayer.indexLoaded = false;
+  localPlayer.scanStartMillis = millis();
+  indexScanFile = localFS.open(localPlayer.path, FILE_READ);
+  localPlayer.scanOffset = id3v2Size(indexScanFile);
+}
+
+// Record a frame's offset if it starts an entry, halving the index when it is full
+void addFrameIndexEntry(uint32_t frame, uint32_t offset)
+{
+  frameIndexHeader &index = localPlayer.index;
+  if (frame % index.framesPerEntry != 0)
+    return;
+  if (index.entries == maxFrameIndexEntries)
+  {
+    for (uint16_t i = 0; i < maxFrameIndexEntries / 2; i++)
+      frameIndexEntries[i] = frameIndexEntries[i * 2];
+    index.entries = maxFrameIndexEntries / 2;
+    index.framesPerEntry *= 2; // The frame (a multiple of the full index) starts an entry at this spacing too
+  }
+  frameIndexEntries[index.entries++] = offset;
+}
+
+void finishFrameIndexScan()
+{
+  indexScanFile.close();
+  localPlayer.indexComplete = true;
+  if (localPlayer.index.frames == 0)
+  {
+    logWarn("Local: no MPEG audio frames found in %s", localPlayer.path);
+    return;
+  }
+  saveFrameIndex();
+  logInfo("Local: frame index for %s built in %lums - %u frames (%us), %u entries every %u frames, %u bytes",
+          localPlayer.path, millis() - localPlayer.scanStartMillis, localPlayer.index.frames,
+          indexDurationMS(localPlayer.index.frames) / 1000, localPlayer.index.entries,
+          localPlayer.index.framesPerEntry, indexBytes());
+}
+
+// Index up to maxFrames more frames
+void scanFrameIndex(uint32_t maxFrames)
+{
+  frameIndexHeader &index = localPlayer.index;
+  mpegFrame frame;
+  for (uint32_t i = 0; i < maxFrames && !localPlayer.indexComplete; i++)
+  {
+    if (!findMpegFrame(indexScanFile, localPlayer.scanOffset, frame))
+    {
+      finishFrameIndexScan();
+      return;
+    }
+    if (index.frames == 0)
+    {
+      index.sampleRate = frame.sampleRate;
+      index.samplesPerFrame = frame.samples;
+    }
+    addFrameIndexEntry(index.frames, localPlayer.scanOffset);
+    index.frames++;
+    localPlayer.scanOffset += frame.length;
+  }
+}
+
+// Roughly where in the file (in ms) an offset is - between entries the frames are
+// taken to be evenly spread
+uint32_t localPositionMS(uint32_t offset)
+{
+  const frameIndexHeader &index = localPlayer.index;
+  if (index.entries == 0 || offset < frameIndexEntries[0])
+    return 0;
+
+  // Last entry at or before the offset
+  uint16_t low = 0;
+  uint16_t high = index.entries;
+  while (high - low > 1)
+  {
+    uint16_t mid = (low + high) / 2;
+    if (frameIndexEntries[mid] <= offset)
+      low = mid;
+    else
+      high = mid;
+  }
+
+  uint32_t frame = low * index.framesPerEntry;
+  bool last = low + 1 >= index.entries;
+  uint32_t entryEnd = last ? (localPlayer.indexComplete ? index.fileSize : localPlayer.scanOffset) : frameIndexEntries[low + 1];
+  uint32_t entryFrames = last ? index.frames - frame : index.framesPerEntry;
+  if (entryEnd > frameIndexEntries[low])
+    frame += min(((uint64_t)(offset - frameIndexEntries[low]) * entryFrames) / (entryEnd - frameIndexEntries[low]),
+                 (uint64_t)entryFrames);
+  return indexDurationMS(frame);
+}
+
+// Move the file to the frame playing at targetMS: one index lookup, then at most
+// framesPerEntry frame headers. Only what hasn't been indexed yet is scanned.
+bool positionLocalFile(uint32_t targetMS)
+{
+  int64_t startMicros = esp_timer_get_time();
+  frameIndexHeader &index = localPlayer.index;
+
+  if (localPlayer.mp3 && index.frames == 0)
+    scanFrameIndex(1);
+  if (!localPlayer.mp3 || index.sampleRate == 0)
+  {
+    logWarn("Local: can't seek in %s", localPlayer.path);
+    return false;
+  }
+
+  uint32_t target = ((uint64_t)targetMS * index.sampleRate) / ((uint32_t)index.samplesPerFrame * 1000);
+  uint32_t scanned = index.frames;
+  while (!localPlayer.indexComplete && target >= index.frames)
+    scanFrameIndex(frameIndexScanFrames);
+  if (target >= index.frames)
+    target = index.frames - 1;
+
+  uint16_t entry = target / index.framesPerEntry;
+  uint32_t offset = frameIndexEntries[entry];
+  uint32_t walked = 0;
+  mpegFrame frame;
+  for (uint32_t i = entry * index.framesPerEntry; i < target && findMpegFrame(localFile, offset, frame); i++)
+  {
+    offset += frame.length;
+    walked++;
+  }
+  localFile.seek(offset);
+  localPlayer.playedOffset = offset;
+
+  uint32_t lookupMicros = esp_timer_get_time() - startMicros;
+  localSeeks++;
+  localSeekLookupMicros += lookupMicros;
+  logInfo("Local: seek to %u.%03us - frame %u at %u (entry %u, %u headers walked, %u frames scanned) in %uus",
+          targetMS / 1000, targetMS % 1000, target, offset, entry, walked, index.frames - scanned, lookupMicros);
+  return true;
+}
+
+// ===================== Session =========================
+// Called by startStream() for a file: URL
+void beginLocalFile(streamConnection &conn)
+{
+  const char *path = localUrlPath(conn.url);
+  const char *name = strrchr(path, '/');
+  strlcpy(conn.host, path, sizeof(conn.host));
+  strlcpy(conn.timings.host, path, sizeof(conn.timings.host));
+  strlcpy(conn.icyName, name ? name + 1 : path, sizeof(conn.icyName));
+
+  const char *extension = strrchr(path, '.');
+  if (extension != NULL && strcasecmp(extension, ".mp3") == 0)
+    strlcpy(conn.codecPath, "/stream.mp3", sizeof(conn.codecPath));
+  else if (extension != NULL && strcasecmp(extension, ".aac") == 0)
+    strlcpy(conn.codecPath, "/stream.aac", sizeof(conn.codecPath));
+  else
+  {
+    failStream(conn, "unsupported file type");
+    return;
+  }
+
+  conn.local = true;
+  setStreamState(conn, STREAM_BUFFERING);
+}
+
+// Open the file for the active station, carrying on from where it was left last time
+void startLocalSession(streamConnection &conn)
+{
+  if (localPlayer.owner != NULL)
+    endLocalFile(*localPlayer.owner);
+
+  localPlayer.owner = &conn;
+  strlcpy(localPlayer.path, localUrlPath(conn.url), sizeof(localPlayer.path));
+  localPlayer.mp3 = strcmp(conn.codecPath, "/stream.mp3") == 0;
+  localPlayer.loops = 0;
+  memset(&localPlayer.index, 0, sizeof(localPlayer.index));
+  localPlayer.indexComplete = false;
+  localPlayer.indexLoaded = false;
+
+  localFile = localFS.open(localPlayer.path, FILE_READ);
+  if (!localFile || localFile.isDirectory() || localFile.size() == 0)
+  {
+    localPlayer.owner = NULL;
+    failStream(conn, "file not found or empty");
+    return;
+  }
+  logInfo("Local: playing %s (%u bytes)", localPlayer.path, localFile.size());
+
+  if (localPlayer.mp3 && !loadFrameIndex())
+    beginFrameIndexScan();
+
+  // The bitrate of the first frame stands in for the ICY header
+  mpegFrame frame;
+  uint32_t offset = id3v2Size(localFile);
+  if (localPlayer.mp3 && findMpegFrame(localFile, offset, frame))
+    snprintf(conn.icyBitrate, sizeof(conn.icyBitrate), "%u", frame.kbps);
+  localFile.seek(0);
+  localPlayer.playedOffset = 0;
+
+  char resumePath[sizeof(localPlayer.path)];
+  preferences.getString("localPath", resumePath, sizeof(resumePath));
+  uint32_t resumeMS = preferences.getUInt("localResumeMS", 0);
+  if (localPlayer.mp3 && resumeMS > 0 && strcmp(resumePath, localPlayer.path) == 0)
+  {
+    logInfo("Local: resuming %s at %us", localPlayer.path, resumeMS / 1000);
+    positionLocalFile(resumeMS);
+  }
+}
+
+// The station is being closed - remember where it got to
+void endLocalFile(streamConnection &conn)
+{
+  if (localPlayer.owner != &conn)
+    return;
+
+  if (localPlayer.mp3)
+  {
+    preferences.putString("localPath", localPlayer.path);
+    preferences.putUInt("localResumeMS", localPositionMS(localPlayer.playedOffset));
+  }
+  if (!localPlayer.indexComplete)
+    indexScanFile.close();
+  localFile.close();
+  localPlayer.owner = NULL;
+  localSeekPending = false; // A seek the station didn't get to
+}
+
+// The station's connection has been moved to another slot (see swapStreams())
+void localFileMoved(streamConnection &from, streamConnection &to)
+{
+  if (localPlayer.owner != &from)
+    return;
+  localPlayer.owner = &to;
+  if (&to != &activeStream)
+    endLocalFile(to);
+}
+
+// Called by serviceStream() for a local station: keep its ring topped up from the file
+void serviceLocalFile(streamConnection &conn)
+{
+  // Standby local stations stay parked until they are selected
+  if (&conn != &activeStream)
+    return;
+  if (localPlayer.owner != &conn)
+  {
+    startLocalSession(conn);
+    if (localPlayer.owner != &conn)
+      return; // Failed
+  }
+
+  // Seek requested (the decoder is stopped until the flag is cleared, so its ring can be emptied)
+  if (localSeekPending)
+  {
+    ringReset(*conn.ring);
+    positionLocalFile(localSeekTargetMS);
+    localSeekPending = false;
+    wakeAudioTask();
+  }
+
+  if (!localPlayer.indexComplete)
+    scanFrameIndex(frameIndexScanFrames);
+
+  uint32_t space = ringFree(*conn.ring);
+  if (space > 0)
+  {
+    int bytesRead = localFile.read(fetchChunk, min(space, (uint32_t)sizeof(fetchChunk)));
+    if (bytesRead > 0)
+    {
+      ringWrite(*conn.ring, fetchChunk, bytesRead);
+      wakeAudioTask();
+    }
+    else
+    {
+      // Round again (the decoder resyncs on the first frame)
+      localPlayer.loops++;
+      logInfo("Local: %s finished, playing again (%u)", localPlayer.path, localPlayer.loops);
+      localFile.seek(0);
+    }
+  }
+
+  uint32_t buffered = ringFilled(*conn.ring);
+  uint32_t position = localFile.position();
+  localPlayer.playedOffset = (position >= buffered) ? position - buffered : 0;
+}
+
+// Called by addStreamWait() - a local station has data whenever its ring has room (and
+// keeps the fetch loop going while its index is built)
+bool localFileReady(streamConnection &conn)
+{
+  return &conn == &activeStream && (localPlayer.owner != &conn || ringFree(*conn.ring) > 0 || localSeekPending ||
+                                    !localPlayer.indexComplete);
+}
+
+// Called from the UI task: stop the decoder and have the fetch task reposition the file
+void seekLocalFile(uint32_t targetMS)
+{
+  if (!activeStream.local || localPlayer.owner != &activeStream)
+  {
+    logWarn("Local: not playing a file");
+    return;
+  }
+  xSemaphoreTake(xMutex, portMAX_DELAY);
+  audio.stopSong();
+  decodeRestartExpected = true;
+  localSeekTargetMS = targetMS;
+  localSeekPending = true;
+  localSeekStartMicros = esp_timer_get_time();
+  xSemaphoreGive(xMutex);
+  xTaskNotifyGive(streamFetchTaskHandle);
+}
+
+void reportLocalFile()
+{
+  if (localPlayer.owner == NULL)
+    return;
+  const frameIndexHeader &index = localPlayer.index;
+  logInfo("Local: %s at %us of %us%s, index %u entries every %u frames (%u bytes, %s), seeks %u avg lookup %lluus",
+          localPlayer.path, localPositionMS(localPlayer.playedOffset) / 1000, indexDurationMS(index.frames) / 1000,
+          localPlayer.indexComplete ? "" : "+", index.entries, index.framesPerEntry, indexBytes(),
+          localPlayer.indexLoaded ? "loaded" : (localPlayer.indexComplete ? "built" : "building"), localSeeks,
+          localSeeks ? localSeekLookupMicros / localSeeks : 0);
+}
+
+// Serial command 'f' (see the top of this file)
+void localFileCommand()
+{
+  char line[16];
+  readCommandLine(line, sizeof(line));
+  if (line[0] == '\0')
+  {
+    reportLocalFile();
+    return;
+  }
+
+  int32_t secs = atoi(line);
+  int32_t targetSecs = secs;
+  if (line[0] == '+' || line[0] == '-')
+    targetSecs = (int32_t)(localPositionMS(localPlayer.playedOffset) / 1000) + secs;
+  seekLocalFile(max(targetSecs, (int32_t)0) * 1000UL);
+}
@@ -17,6 +17,46 @@ std::string getSSID();
 const char *wl_status_to_string(wl_status_t status);
 // =======================================================
 
+// ===================== Audio ===========================
+// Audio task forward declarations
+void wakeAudioTask();
+void setDspSampleRate(uint32_t sampleRate);
+void setDspVolume(uint8_t volume);
+void reportDspLoad();
+void resetResampler(uint32_t expectedRate);
+void updateDriftCorrection(float ringFillFraction, float elapsedSecs);
+void reportDriftCorrection();
+void recordAudioLoop(uint32_t micros);
+void recordSilence(uint32_t silentMillis);
+void recordFirstAudio(uint32_t latencyMillis, bool warm);
+void recordReconnect(const char *reason);
+void recordReconnectGap(uint32_t gapMillis);
+void noteStreamReceived(uint32_t bytes);
+void resetStreamWatchdog();
+void serviceStreamWatchdog(const char *url, bool playing);
+void sampleTelemetry();
+void sampleI2SEvents(bool playing);
+void setSpectrumSampleRate(uint32_t sampleRate);
+void serviceCrossfade();
+void serviceCpuGovernor(uint64_t audioLoopMicros);
+void reportCpuGovernor();
+void servicePowerSave();
+void reportPowerSave();
+
+// Earcons - short sounds mixed over the station (see earcons.h)
+enum earconId
+{
+  EARCON_CLICK,        // Button pressed
+  EARCON_CHIME,        // Station back after the watchdog reconnected it
+  EARCON_RECONNECTING, // Watchdog reconnecting the station
+  EARCONS
+};
+void playEarcon(earconId earcon);
+void serviceEarcons();
+void reportEarcons();
+void earconCommand();
+// =======================================================
+
 // ===================== LittleFS ========================
 // SPIFFS (in-memory SPI File System) replacement
 #include <LITTLEFS.h>
@@ -66,6 +106,7 @@ void displaySettingsPressed();
 void displayMainButtons();
 void displaySettingsButtons();
 void clearBitRate();
+void displaySpectrum(const uint8_t *barHeights, uint8_t bars, uint8_t vuLeft, uint8_t vuRight);
 
 // Instantiate screen (object) using hardware SPI. Defaults to 320H x 240W
 TFT_eSPI tft = TFT_eSPI();       // Invoke custom library
@@ -81,6 +122,15 @@ void changeStation(int8_t upOrDown);
 //void connectToStation();
 const char *getFriendlyStationName();
 
+// Alarms and sleep timer forward declarations
+void serviceAlarms();
+void alarmCommand();
+void sleepTimerCommand();
+void readCommandLine(char *line, size_t size);
+
+// Local file playback forward declarations
+void localFileCommand();
+
 // EEPROM writing routines (eg: remembers previous radio stn)
 Preferences preferences;
 // =======================================================
@@ -0,0 +1,267 @@
+// Racing a playlist's mirrors (part of the connection engine in streamConnect.h)
+// Station playlists often list the same stream on several servers, and the first is
+// not necessarily the best. When a playlist has more than one entry every mirror is
+// connected at once; once each has delivered mirrorMeasureMS of audio (or failed) the
+// one that would fill the prebuffer soonest - time to first byte plus the watermark at
+// its measured rate - takes over the station's connection and the rest are closed.
+// What each mirror delivered while it was measured is kept in a ring of its own, and the
+// winner's is handed to the station's ring, so the race costs no audio: the prebuffer
+// starts from everything the winner has sent. The rings are only allocated for the race.
+// The winner is remembered in the stream cache, so later connects go straight to it
+// (and a fresh race is run if it stops working).
+#include <Arduino.h>
+#include "spscRing.h"
+
+const uint8_t maxMirrorRacers = 3;
+
+// How much of each mirror's stream to measure, and how long to wait for slow ones
+const unsigned long mirrorMeasureMS = 500;
+const unsigned long mirrorRaceTimeoutMS = 3500;
+
+// Each mirror's audio is held for the winner - measuring stops early if it fills up
+const uint32_t mirrorRingBytes = 32768;
+const uint32_t mirrorRingBytesNoPsram = 8192;
+
+struct mirrorResult
+{
+  unsigned long firstByteMillis; // 0 until audio arrives
+  unsigned long endMillis;       // When measuring stopped, 0 until then
+  uint32_t bytes;                // Received in the measuring window
+};
+
+// Only one race runs at a time (another playlist just takes its first entry)
+streamConnection mirrorRacers[maxMirrorRacers];
+mirrorResult mirrorResults[maxMirrorRacers];
+streamConnection *mirrorRaceOwner = NULL;
+uint8_t mirrorRaceCount = 0;
+unsigned long mirrorRaceStart = 0;
+
+spscRing mirrorRings[maxMirrorRacers];
+
+void freeMirrorRings()
+{
+  for (uint8_t i = 0; i < maxMirrorRacers; i++)
+  {
+    free(mirrorRings[i].buffer);
+    mirrorRings[i].buffer = NULL;
+    mirrorRings[i].size = 0;
+  }
+}
+
+// Start racing conn's playlist entries, false if a race can't be run now
+bool beginMirrorRace(streamConnection &conn)
+{
+  static bool initialised = false;
+  if (mirrorRaceOwner != NULL || conn.racing)
+    return false;
+
+  // TLS handshakes block one after another, an https race wouldn't measure anything
+  for (uint8_t i = 0; i < min(conn.mirrorCount, maxMirrorRacers); i++)
+  {
+    if (strncmp(conn.mirrorUrls[i], "https://", 8) == 0)
+      return false;
+  }
+
+  if (!initialised)
+  {
+    for (uint8_t i = 0; i < maxMirrorRacers; i++)
+    {
+      mirrorRacers[i].ring = &mirrorRings[i];
+      mirrorRacers[i].connectFd = -1;
+    }
+    initialised = true;
+  }
+
+  // No room to hold the mirrors' audio - just take the first entry
+  uint8_t racers = min(conn.mirrorCount, maxMirrorRacers);
+  for (uint8_t i = 0; i < racers; i++)
+  {
+    if (!ringInit(mirrorRings[i], psramFound() ? mirrorRingBytes : mirrorRingBytesNoPsram))
+    {
+      logWarn("Fetch: no memory to race mirrors for %s", conn.url);
+      freeMirrorRings();
+      return false;
+    }
+  }
+
+  // Finished with the playlist itself
+  conn.client.stop();
+  releaseSecureClient(conn);
+  mirrorRaceOwner = &conn;
+  mirrorRaceCount = racers;
+  mirrorRaceStart = millis();
+  setStreamState(conn, STREAM_RACING);
+  logInfo("Fetch: racing %u mirrors for %s", mirrorRaceCount, conn.url);
+
+  for (uint8_t i = 0; i < mirrorRaceCount; i++)
+  {
+    streamConnection &racer = mirrorRacers[i];
+    closeStream(racer);
+    strlcpy(racer.url, conn.url, sizeof(racer.url));
+    strlcpy(racer.currentUrl, conn.mirrorUrls[i], sizeof(racer.currentUrl));
+    racer.fromCache = false;
+    racer.racing = true;
+    memset(&racer.timings, 0, sizeof(racer.timings));
+    racer.timings.hops = conn.timings.hops + 1;
+    racer.connectStart = millis();
+    racer.icyName[0] = '\0';
+    racer.icyBitrate[0] = '\0';
+    racer.streamTitle[0] = '\0';
+    mirrorResults[i].firstByteMillis = 0;
+    mirrorResults[i].endMillis = 0;
+    mirrorResults[i].bytes = 0;
+    beginStreamHop(racer);
+  }
+  return true;
+}
+
+void closeMirrorRacers()
+{
+  for (uint8_t i = 0; i < mirrorRaceCount; i++)
+    closeStream(mirrorRacers[i]);
+  mirrorRaceOwner = NULL;
+  freeMirrorRings();
+}
+
+// The station's connection is being closed mid race
+void abortMirrorRace(streamConnection &conn)
+{
+  if (mirrorRaceOwner == &conn)
+    closeMirrorRacers();
+}
+
+// The station's connection has been moved to another slot (see swapStreams())
+void mirrorRaceMoved(streamConnection &from, streamConnection &to)
+{
+  if (mirrorRaceOwner == &from)
+    mirrorRaceOwner = &to;
+}
+
+// How long a mirror has been measured for
+unsigned long mirrorMeasuredMS(const mirrorResult &result)
+{
+  unsigned long end = result.endMillis ? result.endMillis : millis();
+  return max(min(end - result.firstByteMillis, mirrorMeasureMS), 1UL);
+}
+
+// Estimated time (from the start of the race) for a mirror to fill the prebuffer
+uint32_t mirrorScore(const mirrorResult &result)
+{
+  uint32_t firstByteMS = result.firstByteMillis - mirrorRaceStart;
+  return firstByteMS + ((uint64_t)prebufferWatermark * mirrorMeasuredMS(result)) / result.bytes;
+}
+
+// The winner takes over the station's connection, keeping the station's ring - and the
+// audio it received while it was being measured goes in first
+void adoptMirror(streamConnection &conn, streamConnection &winner)
+{
+  static uint8_t chunk[1460];
+  spscRing &from = *winner.ring;
+  if (ringFilled(from) > ringFree(*conn.ring))
+    ringSkip(from, ringFilled(from) - ringFree(*conn.ring)); // Oldest goes, the decoder resyncs
+  while (ringFilled(from) > 0)
+  {
+    uint32_t len = ringRead(from, chunk, sizeof(chunk));
+    writeStreamAudio(conn, chunk, len);
+  }
+
+  spscRing *ring = conn.ring;
+  unsigned long connectStart = conn.connectStart;
+  for (uint8_t phase = 0; phase < CONNECT_PHASES; phase++)
+    winner.timings.phaseMillis[phase] += conn.timings.phaseMillis[phase];
+
+  mirrorRaceOwner = NULL;
+  conn = winner;
+  conn.ring = ring;
+  conn.connectStart = connectStart;
+  conn.racing = false;
+
+  // The connection (and its socket) now belongs to the station
+  winner.client.stop();
+  winner.tls = NULL;
+  winner.state = STREAM_IDLE;
+  winner.url[0] = '\0';
+
+  cacheResolvedStream(conn);
+}
+
+// Called for the station's connection while it is racing: move every mirror on, measure
+// the ones that have reached their audio and pick a winner once they are all in
+void serviceMirrorRace(streamConnection &conn)
+{
+  static uint8_t chunk[1460];
+  bool settled = true;
+
+  for (uint8_t i = 0; i < mirrorRaceCount; i++)
+  {
+    streamConnection &racer = mirrorRacers[i];
+    mirrorResult &result = mirrorResults[i];
+    if (racer.state == STREAM_IDLE)
+      continue; // Failed
+
+    if (!isStreaming(racer))
+    {
+      advanceStream(racer);
+      settled = false;
+      continue;
+    }
+
+    // Only the first mirrorMeasureMS of audio is read (or as much as its ring holds),
+    // the rest waits in the socket
+    if (result.endMillis != 0)
+      continue;
+    if (result.firstByteMillis != 0 &&
+        (millis() - result.firstByteMillis >= mirrorMeasureMS || ringFree(*racer.ring) == 0))
+    {
+      result.endMillis = millis();
+      continue;
+    }
+    settled = false;
+
+    // Never read more than fits, metadata only makes the audio part smaller
+    uint32_t space = min(ringFree(*racer.ring), (uint32_t)sizeof(chunk));
+    int bytesRead = streamClient(racer).available() ? streamClient(racer).read(chunk, space) : 0;
+    if (bytesRead > 0)
+    {
+      if (result.firstByteMillis == 0)
+        result.firstByteMillis = millis();
+      result.bytes += bytesRead;
+      processStreamData(racer, chunk, bytesRead);
+    }
+    else if (!streamClient(racer).connected())
+    {
+      logInfo("Fetch: mirror %s closed the connection", racer.host);
+      closeStream(racer);
+    }
+  }
+
+  if (!settled && millis() - mirrorRaceStart < mirrorRaceTimeoutMS)
+    return;
+
+  int8_t winner = -1;
+  for (uint8_t i = 0; i < mirrorRaceCount; i++)
+  {
+    mirrorResult &result = mirrorResults[i];
+    if (mirrorRacers[i].state == STREAM_IDLE || result.firstByteMillis == 0)
+    {
+      logInfo("Fetch: mirror %s no audio", conn.mirrorUrls[i]);
+      continue;
+    }
+    logInfo("Fetch: mirror %s first byte %lums, %luB/s, prebuffered in ~%ums", conn.mirrorUrls[i],
+            result.firstByteMillis - mirrorRaceStart,
+            (result.bytes * 1000UL) / mirrorMeasuredMS(result), mirrorScore(result));
+    if (winner < 0 || mirrorScore(result) < mirrorScore(mirrorResults[winner]))
+      winner = i;
+  }
+
+  if (winner < 0)
+  {
+    closeMirrorRacers();
+    failStream(conn, "no mirror responded");
+    return;
+  }
+
+  logInfo("Fetch: mirror %s won", conn.mirrorUrls[winner]);
+  adoptMirror(conn, mirrorRacers[winner]);
+  closeMirrorRacers();
+}
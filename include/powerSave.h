@@ -0,0 +1,211 @@
+// Power saving mute (run by the audio task)
+// Muting used to leave everything running: the stream kept downloading, the decoder kept
+// decoding (or, with timeshift, kept recording) and I2S kept clocking out zeros until the
+// user came back. Now a mute that lasts longer than muteGraceMS winds the radio down in
+// stages:
+// - grace: behaves as before, so a quick mute / unmute is instant
+// - saving: decoding stops where it is, I2S is stopped and WiFi drops to modem sleep. The
+//   connection is kept while there is somewhere bounded to put the data (the stream ring
+//   fills and TCP holds the server off, or the timeshift store records) ...
+// - ... and is dropped once that runs out: after muteDropSocketMS, or when the timeshift
+//   store starts throwing away the oldest recording
+// Unmuting restarts I2S and decoding from whatever is buffered - straight away, with no
+// prebuffering - and the fetch task reconnects in the background while that plays.
+// With the CPU idle the governor already drops to 80MHz. Automatic light sleep would need
+// power management enabled in the IDF build, which the Arduino core doesn't have, so
+// modem sleep plus an idle CPU is as low as this goes.
+#include <Arduino.h>
+#include "driver/i2s.h"
+#include "main.h"
+
+// Set MUTE_POWER_SAVE to false to keep everything running while muted
+#define MUTE_POWER_SAVE true
+
+const unsigned long muteGraceMS = 10000;
+const unsigned long muteDropSocketMS = 60000;
+
+enum powerSaveState
+{
+  POWER_SAVE_OFF,   // Not muted
+  POWER_SAVE_GRACE, // Muted, still running
+  POWER_SAVE_SAVING // Decoding and I2S stopped, WiFi in modem sleep
+};
+
+const char *powerSaveStateNames[] = {"playing", "muted", "saving"};
+
+volatile powerSaveState powerSave = POWER_SAVE_OFF;
+unsigned long powerSaveStateMillis = 0;
+
+// Requests from other tasks
+volatile bool powerSaveMuted = false;
+volatile bool powerSaveWakeRequested = false;
+
+bool modemSleeping = false;
+uint32_t savingDroppedBytes = 0;
+
+// Measurements for the stage we are in, logged when it changes (and every 15 seconds)
+unsigned long measureStartMillis = 0;
+uint64_t measureLoopMicros = 0;
+uint32_t measureWakeups = 0;
+uint32_t measureFetchBytes = 0;
+
+// Rough supply current from the ESP32 datasheet (module only - the DAC, display and
+// backlight are not included). Only good for comparing one stage with another.
+uint16_t estimatedCurrentMA(uint16_t mhz, uint32_t busyPercent, bool wifiAwake, bool i2sRunning)
+{
+  uint16_t idleMA = (mhz >= 240) ? 30 : (mhz >= 160) ? 27 : 20;
+  uint16_t busyMA = (mhz >= 240) ? 68 : (mhz >= 160) ? 44 : 31;
+  uint16_t currentMA = idleMA + ((busyMA - idleMA) * min(busyPercent, (uint32_t)100)) / 100;
+  currentMA += wifiAwake ? 75 : 5; // Receiver always on, or woken for beacons
+  if (i2sRunning)
+    currentMA += 5;
+  return currentMA;
+}
+
+void startPowerSaveMeasure()
+{
+  measureStartMillis = millis();
+  measureLoopMicros = audioLoopMicros;
+  measureWakeups = audioTaskWakeups;
+  measureFetchBytes = fetchBytesTotal;
+}
+
+void logPowerSaveMeasure()
+{
+  unsigned long elapsed = millis() - measureStartMillis;
+  if (elapsed < 1000)
+    return;
+
+  uint32_t busyPercent = ((audioLoopMicros - measureLoopMicros) / 10) / elapsed;
+  uint16_t mhz = getCpuFrequencyMhz();
+  bool i2sRunning = !decodeSuspended;
+  logInfo("Power save %s for %lus: %uMHz, decode %u%%, %lu wakeups/s, fetch %luB/s, WiFi %s, I2S %s, ~%umA",
+          powerSaveStateNames[powerSave], elapsed / 1000, mhz, busyPercent,
+          ((audioTaskWakeups - measureWakeups) * 1000UL) / elapsed,
+          ((fetchBytesTotal - measureFetchBytes) * 1000UL) / elapsed,
+          modemSleeping ? "modem sleep" : "awake", i2sRunning ? "on" : "off",
+          estimatedCurrentMA(mhz, busyPercent, !modemSleeping, i2sRunning));
+}
+
+void setPowerSaveState(powerSaveState state)
+{
+  logPowerSaveMeasure();
+  powerSave = state;
+  powerSaveStateMillis = millis();
+  startPowerSaveMeasure();
+}
+
+void setModemSleep(bool sleep)
+{
+  if (sleep == modemSleeping)
+    return;
+  WiFi.setSleep(sleep);
+  modemSleeping = sleep;
+}
+
+void enterPowerSave()
+{
+  setPowerSaveState(POWER_SAVE_SAVING);
+  decodeSuspended = true;
+  i2s_stop(I2S_NUM_0);
+  setModemSleep(true);
+  savingDroppedBytes = timeshiftDroppedBytes;
+  logInfo("Power save: decoding and I2S stopped, %u bytes buffered", ringFilled(streamRing) + timeshiftFilled());
+}
+
+void leavePowerSave(const char *reason)
+{
+  setPowerSaveState(powerSaveMuted ? POWER_SAVE_GRACE : POWER_SAVE_OFF);
+  setModemSleep(false);
+  if (fetchSuspended)
+  {
+    fetchSuspended = false;
+    xTaskNotifyGive(streamFetchTaskHandle);
+  }
+  i2s_zero_dma_buffer(I2S_NUM_0);
+  i2s_start(I2S_NUM_0);
+  decodeSuspended = false;
+  logInfo("Power save: resumed (%s), %u bytes buffered", reason, ringFilled(streamRing) + timeshiftFilled());
+}
+
+// Has the buffer we are keeping the connection open for run out of room?
+bool powerSaveBufferSpent()
+{
+  if (activeStream.local)
+    return false; // Reading a file costs nothing while the ring is full
+  if (millis() - powerSaveStateMillis > muteDropSocketMS && !timeshiftPaused)
+    return true;
+  return timeshiftPaused && timeshiftDroppedBytes != savingDroppedBytes;
+}
+
+// Called from the UI task as mute is switched on or off
+void setPowerSaveMute(bool mute)
+{
+  if (!MUTE_POWER_SAVE)
+    return;
+  if (!mute && powerSave != POWER_SAVE_OFF)
+  {
+    muteResumeFromSaving = powerSave == POWER_SAVE_SAVING;
+    muteResumeStartMicros = esp_timer_get_time();
+  }
+  powerSaveMuted = mute;
+  wakeAudioTask();
+}
+
+// Called by connectToStation() - a new station needs everything running, mute or not
+void wakeFromPowerSave()
+{
+  if (!MUTE_POWER_SAVE || powerSave != POWER_SAVE_SAVING)
+    return;
+  powerSaveWakeRequested = true;
+  wakeAudioTask();
+}
+
+// Called by the audio task every time round its loop, before it decodes
+void servicePowerSave()
+{
+  if (!MUTE_POWER_SAVE)
+    return;
+
+  if (measureStartMillis == 0)
+    startPowerSaveMeasure();
+
+  bool wakeRequested = powerSaveWakeRequested;
+  powerSaveWakeRequested = false;
+
+  switch (powerSave)
+  {
+  case POWER_SAVE_OFF:
+    if (powerSaveMuted)
+      setPowerSaveState(POWER_SAVE_GRACE);
+    break;
+
+  case POWER_SAVE_GRACE:
+    if (!powerSaveMuted)
+      setPowerSaveState(POWER_SAVE_OFF);
+    else if (millis() - powerSaveStateMillis > muteGraceMS)
+      enterPowerSave();
+    break;
+
+  case POWER_SAVE_SAVING:
+    if (!powerSaveMuted)
+      leavePowerSave("unmute");
+    else if (wakeRequested)
+      leavePowerSave("station change");
+    else if (!fetchSuspended && powerSaveBufferSpent())
+    {
+      logInfo("Power save: closing connections, %u bytes buffered", ringFilled(streamRing) + timeshiftFilled());
+      fetchSuspended = true;
+      xTaskNotifyGive(streamFetchTaskHandle);
+    }
+    break;
+  }
+}
+
+void reportPowerSave()
+{
+  if (!MUTE_POWER_SAVE)
+    return;
+  logPowerSaveMeasure();
+  startPowerSaveMeasure();
+}
@@ -0,0 +1,174 @@
+// Fixed rate I2S output with a drift compensating resampler
+// With FIXED_OUTPUT_RATE set, I2S always runs at that rate (no reconfiguring on
+// station changes) and every decoded sample goes through a polyphase windowed sinc
+// resampler on its way to I2S. The resampling ratio is nudged by a slow PI loop on
+// the stream ring's fill level, so differences between the broadcaster's clock and
+// ours can never slowly fill or drain the buffer - it stays centred indefinitely.
+#include <Arduino.h>
+#include "driver/i2s.h"
+#include "main.h"
+
+// 0 = I2S follows each stream's own sample rate (no resampling)
+#define FIXED_OUTPUT_RATE 0
+uint32_t outputRate = FIXED_OUTPUT_RATE;
+
+// Filter: resampleTaps taps per phase, resamplePhases phases (power of 2)
+const uint8_t resampleTaps = 8;
+const uint8_t resamplePhaseBits = 7;
+const uint16_t resamplePhases = 1 << resamplePhaseBits;
+
+// Ratio is Q28 (input samples per output sample)
+const uint32_t resampleOne = 1UL << 28;
+
+// Drift loop - the correction is limited to +/- maxDriftPPM. Gains give a critically
+// damped loop (settling in well under an hour) for a 128kbps stream in a 32K ring.
+const int32_t maxDriftPPM = 500;
+const float driftKp = 2000.0; // ppm per unit (fraction of ring) of error
+const float driftKi = 0.5;    // ppm per unit of error per second
+
+int16_t resampleFilter[resamplePhases][resampleTaps];
+uint32_t resampleHistory[resampleTaps]; // Packed stereo, oldest first
+uint32_t resamplePhase = 0;
+volatile uint32_t resampleStep = resampleOne;
+uint32_t resampleInputRate = 0;
+uint32_t resampleFilterRate = 0; // Input rate resampleFilter was calculated for
+volatile int32_t driftCorrectionPPM = 0;
+float driftIntegral = 0;
+float smoothedRingFill = 0.5;
+
+// Output is collected and written to I2S in blocks. The write happens inside audio.loop()
+// with xMutex held, so it only waits as long as I2S takes to free a DMA descriptor (plus
+// a margin) - anything it couldn't write is dropped and counted rather than blocking
+// station changes and the UI forever if I2S stops.
+uint32_t resampleOutput[64];
+uint8_t resampleOutputCount = 0;
+const unsigned long resampleWriteMarginMS = 20;
+uint32_t resampleDroppedSamples = 0;
+
+bool fixedOutputRate()
+{
+  return outputRate != 0;
+}
+
+// Windowed sinc (Blackman) low pass at the lower of the two Nyquist rates
+void calculateResampleFilter(uint32_t inputRate)
+{
+  float cutoff = 0.45 * min((float)outputRate / inputRate, 1.0f) * 2.0;
+  for (uint16_t phase = 0; phase < resamplePhases; phase++)
+  {
+    float sum = 0;
+    float taps[resampleTaps];
+    for (uint8_t tap = 0; tap < resampleTaps; tap++)
+    {
+      // Distance (in input samples) of this tap from the output position
+      float t = (float)tap - (resampleTaps / 2 - 1) - (float)phase / resamplePhases;
+      float x = PI * cutoff * t;
+      float sinc = (fabsf(x) < 1e-6) ? 1.0 : sinf(x) / x;
+      float n = (t + resampleTaps / 2) / resampleTaps; // 0..1 across the window
+      float window = 0.42 - 0.5 * cosf(2 * PI * n) + 0.08 * cosf(4 * PI * n);
+      taps[tap] = sinc * window;
+      sum += taps[tap];
+    }
+
+    // Unity gain at DC for every phase
+    for (uint8_t tap = 0; tap < resampleTaps; tap++)
+      resampleFilter[phase][tap] = (taps[tap] / sum) * 32767.0;
+  }
+}
+
+// Ratio from the current input rate and drift correction
+void updateResampleStep()
+{
+  if (!fixedOutputRate() || resampleInputRate == 0)
+    return;
+  double ratio = (double)resampleInputRate / outputRate * (1.0 + driftCorrectionPPM / 1000000.0);
+  resampleStep = ratio * resampleOne;
+}
+
+// Called by the audio task whenever decoding (re)starts - the library will have
+// set I2S to the stream's own rate, so that has to be undone on the next sample.
+// With the stream's rate known in advance (stream cache) the filter is calculated
+// now rather than on the first sample.
+void resetResampler(uint32_t expectedRate)
+{
+  resampleInputRate = 0;
+  if (fixedOutputRate() && expectedRate != 0 && expectedRate != resampleFilterRate)
+  {
+    calculateResampleFilter(expectedRate);
+    resampleFilterRate = expectedRate;
+  }
+}
+
+void flushResampleOutput()
+{
+  size_t bytesWritten = 0;
+  TickType_t timeout = pdMS_TO_TICKS((currentProfile->dmaBufLen * 1000UL) / outputRate + resampleWriteMarginMS);
+  i2s_write(I2S_NUM_0, resampleOutput, resampleOutputCount * sizeof(uint32_t), &bytesWritten, timeout);
+  resampleDroppedSamples += resampleOutputCount - bytesWritten / sizeof(uint32_t);
+  resampleOutputCount = 0;
+}
+
+// Takes one decoded sample, writes 0 or more resampled samples to I2S
+void resampleSample(uint32_t sample)
+{
+  // Stream's sample rate changed (or new stream)? Put I2S back to the fixed rate
+  if (resampleInputRate != audio.getSampleRate())
+  {
+    resampleInputRate = audio.getSampleRate();
+    if (resampleFilterRate != resampleInputRate)
+    {
+      calculateResampleFilter(resampleInputRate);
+      resampleFilterRate = resampleInputRate;
+    }
+    updateResampleStep();
+    i2s_set_clk(I2S_NUM_0, outputRate, I2S_BITS_PER_SAMPLE_16BIT, I2S_CHANNEL_STEREO);
+    logInfo("Resampling %u to %u", resampleInputRate, outputRate);
+  }
+
+  memmove(resampleHistory, resampleHistory + 1, sizeof(resampleHistory) - sizeof(uint32_t));
+  resampleHistory[resampleTaps - 1] = sample;
+
+  // Output samples falling between the two centre taps
+  while (resamplePhase < resampleOne)
+  {
+    const int16_t *coefficients = resampleFilter[resamplePhase >> (28 - resamplePhaseBits)];
+    int32_t left = 0, right = 0;
+    for (uint8_t tap = 0; tap < resampleTaps; tap++)
+    {
+      left += (int16_t)(resampleHistory[tap] >> 16) * coefficients[tap];
+      right += (int16_t)(resampleHistory[tap] & 0xFFFF) * coefficients[tap];
+    }
+    left = constrain(left >> 15, -32768, 32767);
+    right = constrain(right >> 15, -32768, 32767);
+
+    resampleOutput[resampleOutputCount++] = ((uint32_t)(uint16_t)left << 16) | (uint16_t)right;
+    if (resampleOutputCount == sizeof(resampleOutput) / sizeof(uint32_t))
+      flushResampleOutput();
+
+    resamplePhase += resampleStep;
+  }
+  resamplePhase -= resampleOne;
+}
+
+// Called by the audio task about once a second - nudges the ratio so the stream
+// ring settles at half full (a fuller ring means we are playing too slowly)
+void updateDriftCorrection(float ringFillFraction, float elapsedSecs)
+{
+  if (!fixedOutputRate())
+    return;
+
+  // Heavily smoothed, network bursts are not drift
+  smoothedRingFill += (ringFillFraction - smoothedRingFill) * 0.05;
+  float error = smoothedRingFill - 0.5;
+
+  driftIntegral = constrain(driftIntegral + error * elapsedSecs, -maxDriftPPM / driftKi, maxDriftPPM / driftKi);
+  driftCorrectionPPM = constrain(driftKp * error + driftKi * driftIntegral, -maxDriftPPM, maxDriftPPM);
+  updateResampleStep();
+}
+
+void reportDriftCorrection()
+{
+  if (fixedOutputRate())
+    logInfo("Resampler %u->%u drift correction:%dppm ring fill:%d%% dropped:%u",
+            resampleInputRate, outputRate, driftCorrectionPPM, (int)(smoothedRingFill * 100), resampleDroppedSamples);
+}
@@ -0,0 +1,312 @@
+// Spectrum analyser and VU meter
+// The audio task taps the decoded PCM on its way to I2S: it is mixed to mono and
+// decimated to about 11kHz (averaging, which also filters out what would alias) and
+// handed over through a small lock-free ring. A low priority task on Core 0 - which
+// otherwise only runs the network fetch - windows it, runs a fixed point FFT and
+// groups the bins into bars. The UI task draws them.
+//
+// The analyser has a hard CPU budget: each frame is timed, and the frame interval is
+// stretched so the analysis never takes more than spectrumBudgetPercent of Core 0. It
+// runs below the fetch task's priority so it can never hold up the stream.
+#include <Arduino.h>
+#include "main.h"
+#include "spscRing.h"
+
+// Set SPECTRUM to false to leave the middle of the screen empty
+#define SPECTRUM true
+
+const uint16_t fftSize = 256; // Power of 2
+const uint32_t spectrumTapRate = 11025; // Decimated sample rate
+const uint8_t spectrumBars = 16;
+const uint8_t spectrumBarHeight = 44; // Pixels
+const unsigned long spectrumFrameMS = 50; // At most 20 frames per second
+const uint8_t spectrumBudgetPercent = 5;
+
+// Bars show the top spectrumRangeDB below full scale. A full scale sine comes out of the
+// (scaled, Hann windowed) FFT at 1/4 of full scale, about 78dB on approximateDB's scale;
+// a full scale sample is about 90dB.
+const uint8_t spectrumRangeDB = 48;
+const uint8_t fftFullScaleDB = 78;
+const uint8_t vuFullScaleDB = 90;
+
+// PCM tap, written by the audio task in blocks
+const uint8_t spectrumTapBlock = 32;
+spscRing spectrumTapRing;
+int16_t spectrumTapSamples[spectrumTapBlock];
+uint8_t spectrumTapCount = 0;
+int32_t spectrumTapSum = 0;
+uint8_t spectrumTapPhase = 0;
+volatile uint8_t spectrumDecimation = 4;
+volatile uint32_t spectrumTapDropped = 0;
+
+// VU peaks since the last frame (audio task writes, analyser reads and resets)
+volatile uint16_t vuPeakLeft = 0;
+volatile uint16_t vuPeakRight = 0;
+
+// FFT working data and tables
+int16_t fftReal[fftSize];
+int16_t fftImag[fftSize];
+int16_t fftSine[fftSize]; // One full cycle, Q15
+int16_t fftWindow[fftSize]; // Hann, Q15
+uint8_t spectrumBandEnd[spectrumBars]; // Last FFT bin in each bar
+
+// Latest frame, read by the UI task (copied as a whole under spectrumMux)
+portMUX_TYPE spectrumMux = portMUX_INITIALIZER_UNLOCKED;
+uint8_t spectrumHeights[spectrumBars];
+uint8_t vuLeftHeight = 0;
+uint8_t vuRightHeight = 0;
+volatile uint32_t spectrumFrames = 0;
+
+// Cost of the analysis (most recent frame) and the interval it forces
+volatile uint32_t spectrumFrameMicros = 0;
+volatile unsigned long spectrumIntervalMS = spectrumFrameMS;
+
+// Create the task handle (a reference to the task being created later)
+TaskHandle_t spectrumTaskHandle = NULL;
+
+// Called by the audio task for every sample on its way to I2S - keep it cheap
+void spectrumTap(uint32_t sample)
+{
+  if (!SPECTRUM)
+    return;
+
+  int16_t left = sample >> 16;
+  int16_t right = sample & 0xFFFF;
+  uint16_t absLeft = abs(left);
+  uint16_t absRight = abs(right);
+  if (absLeft > vuPeakLeft)
+    vuPeakLeft = absLeft;
+  if (absRight > vuPeakRight)
+    vuPeakRight = absRight;
+
+  spectrumTapSum += left + right;
+  if (++spectrumTapPhase < spectrumDecimation)
+    return;
+
+  spectrumTapSamples[spectrumTapCount++] = spectrumTapSum / (2 * spectrumDecimation);
+  spectrumTapSum = 0;
+  spectrumTapPhase = 0;
+
+  if (spectrumTapCount == spectrumTapBlock)
+  {
+    // Analyser behind? Drop rather than wait
+    if (ringFree(spectrumTapRing) >= sizeof(spectrumTapSamples))
+      ringWrite(spectrumTapRing, (uint8_t *)spectrumTapSamples, sizeof(spectrumTapSamples));
+    else
+      spectrumTapDropped++;
+    spectrumTapCount = 0;
+  }
+}
+
+// Called by the audio task when the stream's sample rate is known
+void setSpectrumSampleRate(uint32_t sampleRate)
+{
+  if (sampleRate > 0)
+    spectrumDecimation = max(sampleRate / spectrumTapRate, (uint32_t)1);
+}
+
+void setupSpectrumTables()
+{
+  for (uint16_t i = 0; i < fftSize; i++)
+  {
+    fftSine[i] = 32767 * sin(2 * PI * i / fftSize);
+    fftWindow[i] = 16383.5 * (1 - cos(2 * PI * i / (fftSize - 1)));
+  }
+
+  // Bars spaced logarithmically from bin 1 to fftSize/2, each at least one bin wide
+  uint8_t previous = 0;
+  for (uint8_t bar = 0; bar < spectrumBars; bar++)
+  {
+    uint8_t end = pow(fftSize / 2, (float)(bar + 1) / spectrumBars);
+    spectrumBandEnd[bar] = max(end, (uint8_t)(previous + 1));
+    previous = spectrumBandEnd[bar];
+  }
+  spectrumBandEnd[spectrumBars - 1] = fftSize / 2 - 1;
+}
+
+// In place radix 2 FFT, Q15 with every stage scaled by 1/2 so it can't overflow
+void fixedPointFFT(int16_t *real, int16_t *imag)
+{
+  // Bit reversed reordering
+  for (uint16_t i = 1, j = 0; i < fftSize; i++)
+  {
+    uint16_t bit = fftSize >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j)
+    {
+      int16_t swap = real[i];
+      real[i] = real[j];
+      real[j] = swap;
+      swap = imag[i];
+      imag[i] = imag[j];
+      imag[j] = swap;
+    }
+  }
+
+  for (uint16_t length = 2; length <= fftSize; length <<= 1)
+  {
+    uint16_t half = length >> 1;
+    uint16_t step = fftSize / length;
+    for (uint16_t start = 0; start < fftSize; start += length)
+    {
+      for (uint16_t k = 0; k < half; k++)
+      {
+        // Twiddle e^(-2 pi i k / length) = cos - i sin
+        int32_t wr = fftSine[(k * step + fftSize / 4) & (fftSize - 1)];
+        int32_t wi = -fftSine[k * step];
+        uint16_t a = start + k;
+        uint16_t b = a + half;
+        int32_t tr = (wr * real[b] - wi * imag[b]) >> 15;
+        int32_t ti = (wr * imag[b] + wi * real[b]) >> 15;
+        real[b] = (real[a] - tr) >> 1;
+        imag[b] = (imag[a] - ti) >> 1;
+        real[a] = (real[a] + tr) >> 1;
+        imag[a] = (imag[a] + ti) >> 1;
+      }
+    }
+  }
+}
+
+// Roughly 20*log10(value) in whole dB (6.02dB per bit, quarter bit steps)
+uint8_t approximateDB(uint32_t value)
+{
+  if (value == 0)
+    return 0;
+  uint8_t bits = 31 - __builtin_clz(value);
+  uint8_t fraction = (bits >= 2) ? (value >> (bits - 2)) & 3 : 0;
+  return (bits * 602 + fraction * 150) / 100;
+}
+
+uint8_t scaleToHeight(uint8_t db, uint8_t floorDB)
+{
+  if (db <= floorDB)
+    return 0;
+  return min((uint32_t)(db - floorDB) * spectrumBarHeight / spectrumRangeDB, (uint32_t)spectrumBarHeight);
+}
+
+// One frame: window, FFT, bars and VU meters
+void analyseSpectrumFrame()
+{
+  for (uint16_t i = 0; i < fftSize; i++)
+  {
+    fftReal[i] = ((int32_t)fftReal[i] * fftWindow[i]) >> 15;
+    fftImag[i] = 0;
+  }
+  fixedPointFFT(fftReal, fftImag);
+
+  uint8_t heights[spectrumBars];
+  uint8_t bin = 1;
+  for (uint8_t bar = 0; bar < spectrumBars; bar++)
+  {
+    // Loudest bin in the bar (magnitude approximated as max + min/2)
+    uint32_t peak = 0;
+    for (; bin <= spectrumBandEnd[bar]; bin++)
+    {
+      uint32_t re = abs(fftReal[bin]);
+      uint32_t im = abs(fftImag[bin]);
+      uint32_t magnitude = max(re, im) + min(re, im) / 2;
+      peak = max(peak, magnitude);
+    }
+
+    // Bars fall slowly, rise at once
+    uint8_t height = scaleToHeight(approximateDB(peak), fftFullScaleDB - spectrumRangeDB);
+    uint8_t previous = spectrumHeights[bar];
+    heights[bar] = (height >= previous) ? height : max((int)height, previous - 3);
+  }
+
+  uint8_t vuLeft = scaleToHeight(approximateDB(vuPeakLeft), vuFullScaleDB - spectrumRangeDB);
+  uint8_t vuRight = scaleToHeight(approximateDB(vuPeakRight), vuFullScaleDB - spectrumRangeDB);
+  vuPeakLeft = 0;
+  vuPeakRight = 0;
+
+  portENTER_CRITICAL(&spectrumMux);
+  memcpy(spectrumHeights, heights, sizeof(heights));
+  vuLeftHeight = vuLeft;
+  vuRightHeight = vuRight;
+  portEXIT_CRITICAL(&spectrumMux);
+}
+
+// This is the task that we will start running (on Core 0, below the fetch task's priority)
+void spectrumTask(void *parameter)
+{
+  static unsigned long prevMillis = 0;
+  static unsigned long prevFrameMillis = 0;
+  logInfo("Started spectrumTask");
+
+  // Loop forever
+  while (1)
+  {
+    unsigned long interval = spectrumIntervalMS;
+    vTaskDelay(max(interval - min(millis() - prevFrameMillis, interval), 1UL) / portTICK_PERIOD_MS);
+
+    // Only the most recent samples matter
+    uint32_t frameBytes = fftSize * sizeof(int16_t);
+    if (ringFilled(spectrumTapRing) >= frameBytes)
+    {
+      ringSkip(spectrumTapRing, ringFilled(spectrumTapRing) - frameBytes);
+      ringRead(spectrumTapRing, (uint8_t *)fftReal, frameBytes);
+
+      int64_t frameStart = esp_timer_get_time();
+      analyseSpectrumFrame();
+      spectrumFrameMicros = esp_timer_get_time() - frameStart;
+      spectrumFrames++;
+
+      // Stretch the interval if a frame costs more than the budget allows
+      spectrumIntervalMS = max(spectrumFrameMS, (spectrumFrameMicros * 100) / (spectrumBudgetPercent * 1000UL));
+      prevFrameMillis = millis();
+    }
+
+    if (millis() - prevMillis > 15000)
+    {
+      unsigned long remainingStack = uxTaskGetStackHighWaterMark(NULL);
+      logInfo("Spectrum Free stack:%lu", remainingStack);
+      logInfo("Spectrum: %uus per frame (%u%% of Core 0 at %lums/frame) frames:%u tap dropped:%u",
+              spectrumFrameMicros, (spectrumFrameMicros / 10) / spectrumIntervalMS, spectrumIntervalMS,
+              spectrumFrames, spectrumTapDropped);
+      prevMillis = millis();
+    }
+  }
+}
+
+// Called from the UI task - draws the latest frame if there is a new one
+void drawSpectrum()
+{
+  static uint32_t drawnFrame = 0;
+
+  if (!SPECTRUM || spectrumFrames == drawnFrame)
+    return;
+  drawnFrame = spectrumFrames;
+
+  // A consistent frame, then drawn without holding anything
+  uint8_t heights[spectrumBars];
+  portENTER_CRITICAL(&spectrumMux);
+  memcpy(heights, spectrumHeights, sizeof(heights));
+  uint8_t vuLeft = vuLeftHeight;
+  uint8_t vuRight = vuRightHeight;
+  portEXIT_CRITICAL(&spectrumMux);
+  displaySpectrum(heights, spectrumBars, vuLeft, vuRight);
+}
+
+// Called from the main setup() routine
+// - the task starts running it as soon as it declared
+void createSpectrumTask()
+{
+  if (!SPECTRUM)
+    return;
+
+  setupSpectrumTables();
+  if (!ringInit(spectrumTapRing, 2048))
+    logError("Unable to allocate spectrum tap ring");
+
+  // Independent Task to analyse the audio
+  xTaskCreatePinnedToCore(
+      spectrumTask,        /* Function to implement the task */
+      "Spectrum",          /* Name of the task */
+      2000,                /* Stack size in words */
+      NULL,                /* Task input parameter */
+      1,                   /* Priority of the task - must be higher than 0 (idle)*/
+      &spectrumTaskHandle, /* Task handle. */
+      0);                  /* Core where the task should run */
+}
@@ -0,0 +1,105 @@
+// Lock-free single producer / single consumer byte ring
+// - one task only ever writes (advances head), one task only ever reads (advances tail)
+// - head and tail are free running counters, the size must be a power of 2
+// Ensure this header file is included only once
+#ifndef _SPSCRing_
+#define _SPSCRing_
+
+#include <atomic>
+
+struct spscRing
+{
+  uint8_t *buffer;
+  uint32_t size;
+  std::atomic<uint32_t> head; // Total bytes written (producer owned)
+  std::atomic<uint32_t> tail; // Total bytes read (consumer owned)
+};
+
+// Rings at least this big are put in PSRAM when the board has it
+const uint32_t ringPsramThreshold = 16384;
+
+// Allocate the ring storage, size is rounded down to a power of 2
+bool ringInit(spscRing &ring, uint32_t size)
+{
+  while (size & (size - 1))
+    size &= size - 1;
+
+  ring.buffer = NULL;
+  if (size >= ringPsramThreshold && psramFound())
+    ring.buffer = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (ring.buffer == NULL)
+    ring.buffer = (uint8_t *)malloc(size);
+  ring.size = (ring.buffer != NULL) ? size : 0;
+  ring.head.store(0);
+  ring.tail.store(0);
+  return ring.buffer != NULL;
+}
+
+// Bytes waiting to be read
+uint32_t ringFilled(const spscRing &ring)
+{
+  return ring.head.load(std::memory_order_acquire) - ring.tail.load(std::memory_order_acquire);
+}
+
+// Space available to write
+uint32_t ringFree(const spscRing &ring)
+{
+  return ring.size - ringFilled(ring);
+}
+
+// Producer only: copy in as much as fits, returns bytes written
+uint32_t ringWrite(spscRing &ring, const uint8_t *data, uint32_t len)
+{
+  uint32_t head = ring.head.load(std::memory_order_relaxed);
+  uint32_t space = ring.size - (head - ring.tail.load(std::memory_order_acquire));
+  if (len > space)
+    len = space;
+
+  // Copy in up to two pieces (before and after the wrap point)
+  uint32_t offset = head & (ring.size - 1);
+  uint32_t first = min(len, ring.size - offset);
+  memcpy(ring.buffer + offset, data, first);
+  memcpy(ring.buffer, data + first, len - first);
+
+  // Publish the data only after it has been copied
+  ring.head.store(head + len, std::memory_order_release);
+  return len;
+}
+
+// Consumer only: copy out up to len bytes, returns bytes read
+uint32_t ringRead(spscRing &ring, uint8_t *data, uint32_t len)
+{
+  uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+  uint32_t available = ring.head.load(std::memory_order_acquire) - tail;
+  if (len > available)
+    len = available;
+
+  uint32_t offset = tail & (ring.size - 1);
+  uint32_t first = min(len, ring.size - offset);
+  memcpy(data, ring.buffer + offset, first);
+  memcpy(data + first, ring.buffer, len - first);
+
+  // Release the space only after it has been copied out
+  ring.tail.store(tail + len, std::memory_order_release);
+  return len;
+}
+
+// Consumer only: throw away up to len bytes without copying them
+uint32_t ringSkip(spscRing &ring, uint32_t len)
+{
+  uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+  uint32_t available = ring.head.load(std::memory_order_acquire) - tail;
+  if (len > available)
+    len = available;
+
+  ring.tail.store(tail + len, std::memory_order_release);
+  return len;
+}
+
+// Empty the ring - only safe when the consumer is known to be idle
+void ringReset(spscRing &ring)
+{
+  ring.tail.store(ring.head.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+#endif
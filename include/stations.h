@@ -70,26 +70,29 @@ void loadRadioStations()
 void loadStation()
 {
   // Retreive the last played station (if available)
-  preferences.begin("Radio", false);
   currentStation = preferences.getUInt("currentStation", 0);
 
-  Serial.printf("Debug: loadStation() - currentStation = %d\n", currentStation);
+  logDebug("loadStation() - currentStation = %d", currentStation);
 
   connectToStation();
 }
 
-void changeStation(int8_t btnValue)
+// Station number offset from the current one, wrapping round the list
+int8_t stationOffset(int8_t offset)
 {
-  int8_t nextStation;
+  int8_t station = currentStation + offset;
 
-  nextStation = currentStation + btnValue;
+  if (station >= numberOfStations)
+    station = 0;
+  else if (station < 0)
+    station = numberOfStations - 1;
 
-  if (nextStation >= numberOfStations)
-    nextStation = 0;
-  else if (nextStation < 0)
-    nextStation = numberOfStations - 1;
+  return station;
+}
 
-  currentStation = nextStation;
+void changeStation(int8_t btnValue)
+{
+  currentStation = stationOffset(btnValue);
 
   // Connect to selected Station
   connectToStation();
@@ -103,11 +106,30 @@ void changeStation(int8_t btnValue)
 
 void connectToStation()
 {
-  Serial.printf("Connecting to %d - %s\n", currentStation, radioStation[currentStation].name);
+  logInfo("Connecting to %d - %s", currentStation, radioStation[currentStation].name);
+
+  // Neighbouring stations are kept connected (warm standby) for fast channel changes
+  const char *prevUrl = (numberOfStations > 1) ? radioStation[stationOffset(-1)].url : NULL;
+  const char *nextUrl = (numberOfStations > 2) ? radioStation[stationOffset(+1)].url : NULL;
 
   // Semaphore required to protect against audio.loop() in playAudioTask
+  // - the decoder is stopped before the fetch stage is told about the new station so
+  //   the stream ring is never emptied while it is being read
+  // - unless crossfading: the old station plays on, the audio task stops it later
+  wakeFromPowerSave();
   xSemaphoreTake(xMutex, portMAX_DELAY);
-  audio.connecttohost(radioStation[currentStation].url);
+  if (crossfadeAvailable())
+  {
+    startCrossfade();
+    requestStreamConnect(radioStation[currentStation].url, prevUrl, nextUrl, true);
+  }
+  else
+  {
+    cancelCrossfade();
+    stationSwitchStartMicros = esp_timer_get_time();
+    audio.stopSong();
+    requestStreamConnect(radioStation[currentStation].url, prevUrl, nextUrl);
+  }
   xSemaphoreGive(xMutex);
 }
 
@@ -0,0 +1,72 @@
+// Resolved stream cache (kept in NVS, survives restarts)
+// Many stations are playlists or redirect to the real stream, costing extra HTTP
+// round trips on every connect. Once a station has been resolved we remember where
+// it ended up, keyed by the station URL, and later connects go straight to the media
+// URL. If a cached URL stops working the entry is dropped and the station is resolved
+// from scratch. The rest of the entry presets the connection until (unless) the
+// stream's own headers say otherwise:
+// - codec: servers that send no (or a generic) content type still decode correctly
+// - bitrate: buffer health has a rate to work with from the first byte
+// - sample rate: the audio task prepares the resampler and EQ filters before the
+//   first frame, rather than in the middle of the first samples
+#include <Arduino.h>
+#include <Preferences.h>
+
+struct cachedStream
+{
+  char resolvedUrl[256];
+  char codecPath[12];
+  uint32_t sampleRate; // 0 until the decoder has reported it
+  char icyBitrate[8];
+};
+
+// Own namespace, only ever used by the stream fetch task
+Preferences streamCachePrefs;
+
+// NVS keys are limited to 15 characters, so use a hash of the station URL
+void streamCacheKey(const char *stationUrl, char *key, size_t keySize)
+{
+  uint32_t hash = 2166136261UL; // FNV-1a
+  while (*stationUrl)
+  {
+    hash ^= (uint8_t)*stationUrl++;
+    hash *= 16777619UL;
+  }
+  snprintf(key, keySize, "s%08x", hash);
+}
+
+bool loadCachedStream(const char *stationUrl, cachedStream &entry)
+{
+  static bool opened = false;
+  if (!opened)
+    opened = streamCachePrefs.begin("streamCache", false);
+
+  char key[12];
+  streamCacheKey(stationUrl, key, sizeof(key));
+  if (!opened || streamCachePrefs.getBytesLength(key) != sizeof(entry))
+    return false;
+
+  streamCachePrefs.getBytes(key, &entry, sizeof(entry));
+  return strlen(entry.resolvedUrl) > 0;
+}
+
+// Only writes to flash when the entry has actually changed
+void saveCachedStream(const char *stationUrl, const cachedStream &entry)
+{
+  cachedStream existing;
+  if (loadCachedStream(stationUrl, existing) && memcmp(&existing, &entry, sizeof(entry)) == 0)
+    return;
+
+  char key[12];
+  streamCacheKey(stationUrl, key, sizeof(key));
+  streamCachePrefs.putBytes(key, &entry, sizeof(entry));
+  logInfo("Stream cache: %s -> %s", stationUrl, entry.resolvedUrl);
+}
+
+void invalidateCachedStream(const char *stationUrl)
+{
+  char key[12];
+  streamCacheKey(stationUrl, key, sizeof(key));
+  streamCachePrefs.remove(key);
+  logInfo("Stream cache: dropped %s", stationUrl);
+}
@@ -0,0 +1,778 @@
+// Non-blocking station connection engine (driven by the stream fetch task)
+// Each connection steps through its phases without ever blocking the task, so the
+// active stream keeps flowing while other connections are being set up:
+//   resolving -> connecting -> sending request -> headers [-> playlist] -> buffering -> streaming
+// Playlists and redirects go back round to resolving with the new URL. A playlist with
+// several mirrors races them (see mirrorRace.h) and carries on with the fastest. An HLS
+// playlist hands the station over to the HLS client (hlsClient.h), which fetches the
+// segments into the station's ring using connections of its own.
+// https:// hops use a TLS client from a small pool. The library does the TCP connect and
+// handshake in one blocking call (bounded by secureHandshakeTimeoutS), so that phase does
+// hold up the fetch task; everything after it is serviced like a plain connection.
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
+#include "lwip/dns.h"
+#include "lwip/sockets.h"
+#include "spscRing.h"
+#include "streamCache.h"
+#include "dnsCache.h"
+
+// Stations are usually playlists or redirects, limit how many we follow
+const uint8_t maxStreamHops = 4;
+
+// Give up on a connection phase (other than buffering) after this long
+const unsigned long streamPhaseTimeoutMS = 5000;
+
+// TLS clients for https:// hops: the station, its neighbours and an HLS session's
+// playlist and segments. A session only holds its (large) buffers while connected.
+const uint8_t maxSecureStreams = 5;
+const unsigned long secureHandshakeTimeoutS = 3;
+WiFiClientSecure secureClients[maxSecureStreams];
+bool secureClientInUse[maxSecureStreams];
+
+enum streamState
+{
+  STREAM_IDLE,
+  STREAM_RESOLVING,
+  STREAM_CONNECTING,
+  STREAM_SENDING,
+  STREAM_HEADERS,
+  STREAM_PLAYLIST,
+  STREAM_RACING, // Waiting for the playlist's mirrors to be raced
+  STREAM_BUFFERING,
+  STREAM_STREAMING
+};
+
+// Time spent in each phase of a connect (summed over any playlist/redirect hops)
+enum connectPhase
+{
+  PHASE_RESOLVE,
+  PHASE_CONNECT,
+  PHASE_SEND,
+  PHASE_HEADERS,
+  PHASE_BUFFER,
+  CONNECT_PHASES
+};
+const char *connectPhaseNames[CONNECT_PHASES] = {"dns", "tcp", "send", "headers", "buffer"};
+
+// Connections the HLS client makes for itself
+enum hlsConnectionRole
+{
+  HLS_NONE,
+  HLS_PLAYLIST, // Playlist lines go to the HLS client
+  HLS_SEGMENT   // Read (and demultiplexed) by the HLS client
+};
+
+struct connectTimings
+{
+  char host[64];
+  uint32_t phaseMillis[CONNECT_PHASES];
+  uint32_t totalMillis;
+  uint8_t hops;
+  bool succeeded;
+};
+
+// Most recently completed (or failed) connect, for anyone who wants to query it
+connectTimings lastConnectTimings;
+
+// One HTTP/ICY connection - the active station or a warm standby neighbour
+struct streamConnection
+{
+  char url[256];        // Station URL as requested (before playlists/redirects)
+  char currentUrl[256]; // URL of the current hop
+  bool fromCache;       // Went straight to a previously resolved URL
+  WiFiClient client;
+  WiFiClientSecure *tls; // https:// hop - the client in use instead, from the pool
+  bool secure;          // Current hop is https://
+  spscRing *ring;       // Where the audio data goes
+  streamState state;
+  unsigned long stateStart;
+  unsigned long connectStart;
+  connectTimings timings;
+  char host[maxHostLength];
+  char path[256];
+  uint16_t port;
+  volatile int8_t dnsResult; // 0 = pending, 1 = resolved, -1 = failed
+  volatile uint32_t resolvedIp;
+  bool dnsCached; // Address needed no lookup (our DNS cache or a numeric host)...
+  bool dnsStale;  // ...and was from the boot snapshot, not yet confirmed
+  int connectFd;
+  char line[256]; // Header/playlist line being assembled
+  uint16_t lineLen;
+  int statusCode;
+  char location[256];
+  bool isPlaylist;
+  char mirrorUrls[3][256]; // Stream URLs found in a playlist
+  uint8_t mirrorCount;
+  bool racing; // One of the mirrors in a race, not a station connection
+  bool hls;    // Station is HLS, its audio is fetched by the HLS client
+  hlsConnectionRole hlsRole;
+  bool local; // Station is a file (file:/path), read by the local player
+  char codecPath[12]; // File name the decoder opens, extension selects the codec
+  char cachedCodecPath[12]; // From the stream cache, for the cached URL only ("" if none)
+  uint32_t cachedSampleRate; // ... and the sample rate the decoder found last time (0 if none)
+  uint32_t icyMetaInt;
+  uint32_t icyBytesUntilMeta;
+  uint16_t icyMetaRemaining; // Bytes of the current metadata block still to come
+  uint16_t icyMetaLen;
+  char icyMetaData[256];
+  char icyName[64];
+  char icyBitrate[8];
+  char streamTitle[128];
+};
+
+// Forward declarations
+void beginStreamHop(streamConnection &conn);
+void followStreamUrl(streamConnection &conn, const char *url);
+bool beginMirrorRace(streamConnection &conn);
+void serviceMirrorRace(streamConnection &conn);
+void abortMirrorRace(streamConnection &conn);
+void processStreamData(streamConnection &conn, uint8_t *data, size_t len);
+void writeStreamAudio(streamConnection &conn, const uint8_t *data, size_t len);
+void beginHls(streamConnection &conn);
+void endHlsSession(streamConnection &conn);
+void hlsPlaylistLine(streamConnection &conn, const char *line);
+void endOfHlsPlaylist(streamConnection &conn);
+void serviceHls(streamConnection &conn);
+void hlsSessionMoved(streamConnection &from, streamConnection &to);
+bool addHlsWaits(streamConnection &conn, fd_set &readSet, fd_set &writeSet, int &maxFd, uint32_t &timeoutMS);
+void reportHls();
+bool isLocalUrl(const char *url);
+void beginLocalFile(streamConnection &conn);
+void endLocalFile(streamConnection &conn);
+void serviceLocalFile(streamConnection &conn);
+void localFileMoved(streamConnection &from, streamConnection &to);
+bool localFileReady(streamConnection &conn);
+void reportLocalFile();
+
+bool isStreaming(const streamConnection &conn)
+{
+  return conn.state >= STREAM_BUFFERING;
+}
+
+// The client to read from / write to, TLS or plain
+WiFiClient &streamClient(streamConnection &conn)
+{
+  return conn.tls ? *conn.tls : conn.client;
+}
+
+// Socket to select() on, -1 if there isn't one (a TLS client has to be polled)
+int streamClientFd(streamConnection &conn)
+{
+  return conn.tls ? -1 : conn.client.fd();
+}
+
+// Hand a connection's TLS client (if it has one) back to the pool
+void releaseSecureClient(streamConnection &conn)
+{
+  if (!conn.tls)
+    return;
+  conn.tls->stop();
+  secureClientInUse[conn.tls - secureClients] = false;
+  conn.tls = NULL;
+}
+
+// Move to a new state, charging the time spent to the phase just finished
+void setStreamState(streamConnection &conn, streamState state)
+{
+  static const int8_t phaseOfState[] = {-1, PHASE_RESOLVE, PHASE_CONNECT, PHASE_SEND, PHASE_HEADERS, PHASE_HEADERS, PHASE_HEADERS, PHASE_BUFFER, -1};
+
+  int8_t phase = phaseOfState[conn.state];
+  if (phase >= 0)
+    conn.timings.phaseMillis[phase] += millis() - conn.stateStart;
+
+  conn.state = state;
+  conn.stateStart = millis();
+}
+
+// Print (and publish) the timings for a connect that has finished
+void reportConnectTimings(streamConnection &conn, bool succeeded)
+{
+  conn.timings.totalMillis = millis() - conn.connectStart;
+  conn.timings.succeeded = succeeded;
+  lastConnectTimings = conn.timings;
+
+  char phases[80];
+  int len = 0;
+  for (uint8_t i = 0; i < CONNECT_PHASES; i++)
+    len += snprintf(phases + len, sizeof(phases) - len, " %s %ums", connectPhaseNames[i], conn.timings.phaseMillis[i]);
+  logInfo("Connect %s %s:%s total %ums (%d hops)", conn.timings.host, succeeded ? "ok" : "failed",
+          phases, conn.timings.totalMillis, conn.timings.hops);
+}
+
+// Drop a connection and forget which station it was for
+void closeStream(streamConnection &conn)
+{
+  if (conn.connectFd >= 0)
+  {
+    close(conn.connectFd);
+    conn.connectFd = -1;
+  }
+  if (conn.state == STREAM_RACING)
+    abortMirrorRace(conn);
+  if (conn.hls)
+    endHlsSession(conn);
+  conn.hls = false;
+  if (conn.local)
+    endLocalFile(conn);
+  conn.local = false;
+  conn.client.stop();
+  releaseSecureClient(conn);
+  conn.state = STREAM_IDLE;
+  conn.url[0] = '\0';
+  conn.cachedCodecPath[0] = '\0';
+  conn.cachedSampleRate = 0;
+}
+
+void failStream(streamConnection &conn, const char *reason)
+{
+  // A cached stream URL that no longer works - forget it and resolve the station properly
+  if (conn.fromCache)
+  {
+    logWarn("Fetch: cached stream for %s failed (%s)", conn.url, reason);
+    invalidateCachedStream(conn.url);
+    conn.fromCache = false;
+    conn.cachedCodecPath[0] = '\0';
+    conn.cachedSampleRate = 0;
+    if (conn.connectFd >= 0)
+    {
+      close(conn.connectFd);
+      conn.connectFd = -1;
+    }
+    strlcpy(conn.currentUrl, conn.url, sizeof(conn.currentUrl));
+    beginStreamHop(conn);
+    return;
+  }
+
+  // Likewise an address from the DNS snapshot that is no longer right
+  if (conn.dnsStale && conn.state == STREAM_CONNECTING)
+  {
+    logWarn("Fetch: stale address for %s failed (%s)", conn.host, reason);
+    dnsCacheForget(conn.host);
+    conn.dnsStale = false;
+    if (conn.connectFd >= 0)
+    {
+      close(conn.connectFd);
+      conn.connectFd = -1;
+    }
+    beginStreamHop(conn);
+    return;
+  }
+
+  logWarn("Fetch: %s - %s", conn.host, reason);
+  setStreamState(conn, STREAM_IDLE);
+  reportConnectTimings(conn, false);
+  closeStream(conn);
+}
+
+// Called by lwIP (on its own task) when a host name lookup completes
+void streamDnsFound(const char *name, const ip_addr_t *ipaddr, void *arg)
+{
+  streamConnection *conn = (streamConnection *)arg;
+
+  // Ignore answers for a lookup that has since been abandoned
+  if (conn->state != STREAM_RESOLVING || strcmp(name, conn->host) != 0)
+    return;
+
+  if (ipaddr)
+  {
+    conn->resolvedIp = ipaddr->u_addr.ip4.addr;
+    conn->dnsResult = 1;
+  }
+  else
+  {
+    conn->dnsResult = -1;
+  }
+}
+
+// Split http[s]://host[:port][/path] into its parts
+bool parseStreamUrl(streamConnection &conn, const char *url)
+{
+  if (strncmp(url, "http://", 7) == 0)
+    conn.secure = false;
+  else if (strncmp(url, "https://", 8) == 0)
+    conn.secure = true;
+  else
+  {
+    logWarn("Unsupported stream URL: %s", url);
+    return false;
+  }
+  url += conn.secure ? 8 : 7;
+
+  const char *pathStart = strchr(url, '/');
+  size_t hostLen = pathStart ? pathStart - url : strlen(url);
+  if (hostLen >= sizeof(conn.host))
+    return false;
+  memcpy(conn.host, url, hostLen);
+  conn.host[hostLen] = '\0';
+  strlcpy(conn.path, pathStart ? pathStart : "/", sizeof(conn.path));
+
+  conn.port = conn.secure ? 443 : 80;
+  char *portStart = strchr(conn.host, ':');
+  if (portStart)
+  {
+    *portStart = '\0';
+    conn.port = atoi(portStart + 1);
+  }
+  return true;
+}
+
+// Start (or restart after a redirect) resolving the host of conn.currentUrl
+void beginStreamHop(streamConnection &conn)
+{
+  conn.client.stop();
+  releaseSecureClient(conn);
+  if (!parseStreamUrl(conn, conn.currentUrl))
+  {
+    failStream(conn, "bad URL");
+    return;
+  }
+
+  logInfo("Fetch: connecting to %s:%d%s", conn.host, conn.port, conn.path);
+  strlcpy(conn.timings.host, conn.host, sizeof(conn.timings.host));
+  setStreamState(conn, STREAM_RESOLVING);
+
+  // A numeric host needs no lookup, and isn't cached
+  conn.dnsResult = 0;
+  conn.dnsStale = false;
+  struct in_addr numeric;
+  if (inet_aton(conn.host, &numeric))
+  {
+    conn.resolvedIp = numeric.s_addr;
+    conn.dnsCached = true;
+    conn.dnsResult = 1;
+    return;
+  }
+
+  // Our own cache first (larger than lwIP's and kept over restarts)
+  uint32_t cachedIp;
+  conn.dnsCached = dnsCacheLookup(conn.host, cachedIp, conn.dnsStale);
+  if (conn.dnsCached)
+  {
+    conn.resolvedIp = cachedIp;
+    conn.dnsResult = 1;
+    return;
+  }
+
+  // Answered straight away for numeric addresses and names lwIP has cached
+  ip_addr_t address;
+  err_t err = dns_gethostbyname(conn.host, &address, &streamDnsFound, &conn);
+  if (err == ERR_OK)
+  {
+    conn.resolvedIp = address.u_addr.ip4.addr;
+    conn.dnsResult = 1;
+  }
+  else if (err != ERR_INPROGRESS)
+  {
+    conn.dnsResult = -1;
+  }
+}
+
+// Start connecting a (closed) connection to a station URL
+void startStream(streamConnection &conn, const char *url)
+{
+  closeStream(conn);
+  strlcpy(conn.url, url, sizeof(conn.url));
+  memset(&conn.timings, 0, sizeof(conn.timings));
+  conn.connectStart = millis();
+  conn.icyName[0] = '\0';
+  conn.icyBitrate[0] = '\0';
+  conn.streamTitle[0] = '\0';
+
+  // Files are read by the local player, there is nothing to connect to
+  if (isLocalUrl(url))
+  {
+    strlcpy(conn.currentUrl, url, sizeof(conn.currentUrl));
+    conn.fromCache = false;
+    beginLocalFile(conn);
+    return;
+  }
+
+  // Skip any playlist/redirects if we already know where this station ends up
+  cachedStream cached;
+  conn.fromCache = loadCachedStream(url, cached);
+  strlcpy(conn.currentUrl, conn.fromCache ? cached.resolvedUrl : url, sizeof(conn.currentUrl));
+  if (conn.fromCache)
+  {
+    logInfo("Fetch: using cached stream %s", conn.currentUrl);
+    strlcpy(conn.cachedCodecPath, cached.codecPath, sizeof(conn.cachedCodecPath));
+    strlcpy(conn.icyBitrate, cached.icyBitrate, sizeof(conn.icyBitrate));
+    conn.cachedSampleRate = cached.sampleRate;
+  }
+  beginStreamHop(conn);
+}
+
+// Follow a redirect or playlist entry
+void followStreamUrl(streamConnection &conn, const char *url)
+{
+  if (++conn.timings.hops >= maxStreamHops)
+  {
+    failStream(conn, "too many playlist/redirect hops");
+    return;
+  }
+  strlcpy(conn.currentUrl, url, sizeof(conn.currentUrl));
+  conn.cachedCodecPath[0] = '\0';
+  conn.cachedSampleRate = 0;
+  beginStreamHop(conn);
+}
+
+// https: take a TLS client from the pool and let it connect and handshake
+void beginSecureConnect(streamConnection &conn)
+{
+  for (uint8_t i = 0; i < maxSecureStreams && !conn.tls; i++)
+  {
+    if (!secureClientInUse[i])
+    {
+      secureClientInUse[i] = true;
+      conn.tls = &secureClients[i];
+    }
+  }
+  if (!conn.tls)
+  {
+    failStream(conn, "no TLS client free");
+    return;
+  }
+
+  setStreamState(conn, STREAM_CONNECTING);
+  conn.tls->setInsecure(); // No certificate store, the stream is public audio anyway
+  conn.tls->setHandshakeTimeout(secureHandshakeTimeoutS);
+  if (!conn.tls->connect(IPAddress(conn.resolvedIp), conn.port, conn.host, NULL, NULL, NULL))
+  {
+    failStream(conn, "TLS connect failed");
+    return;
+  }
+  setStreamState(conn, STREAM_SENDING);
+}
+
+// Begin a non-blocking TCP connect to the resolved address
+void beginStreamConnect(streamConnection &conn)
+{
+  if (conn.secure)
+  {
+    beginSecureConnect(conn);
+    return;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+  {
+    failStream(conn, "no socket available");
+    return;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+  struct sockaddr_in serverAddress;
+  memset(&serverAddress, 0, sizeof(serverAddress));
+  serverAddress.sin_family = AF_INET;
+  serverAddress.sin_addr.s_addr = conn.resolvedIp;
+  serverAddress.sin_port = htons(conn.port);
+
+  if (connect(fd, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0 && errno != EINPROGRESS)
+  {
+    close(fd);
+    failStream(conn, "connect failed");
+    return;
+  }
+
+  conn.connectFd = fd;
+  setStreamState(conn, STREAM_CONNECTING);
+}
+
+// Has the non-blocking connect finished? (socket becomes writable)
+void checkStreamConnected(streamConnection &conn)
+{
+  fd_set writeSet;
+  FD_ZERO(&writeSet);
+  FD_SET(conn.connectFd, &writeSet);
+  struct timeval noWait = {0, 0};
+  if (select(conn.connectFd + 1, NULL, &writeSet, NULL, &noWait) <= 0)
+    return;
+
+  int socketError = 0;
+  socklen_t len = sizeof(socketError);
+  getsockopt(conn.connectFd, SOL_SOCKET, SO_ERROR, &socketError, &len);
+  if (socketError != 0)
+  {
+    failStream(conn, "connection refused");
+    return;
+  }
+
+  // The client now owns (and will close) the socket
+  conn.client = WiFiClient(conn.connectFd);
+  conn.connectFd = -1;
+  setStreamState(conn, STREAM_SENDING);
+}
+
+void sendStreamRequest(streamConnection &conn)
+{
+  char request[512];
+  int len = snprintf(request, sizeof(request),
+                     "GET %s HTTP/1.0\r\nHost: %s\r\nIcy-MetaData: 1\r\nUser-Agent: ESP32-I2S-Radio\r\nConnection: close\r\n\r\n",
+                     conn.path, conn.host);
+  if (streamClient(conn).write((const uint8_t *)request, len) != (size_t)len)
+  {
+    failStream(conn, "unable to send request");
+    return;
+  }
+
+  conn.lineLen = 0;
+  conn.statusCode = 0;
+  conn.location[0] = '\0';
+  conn.isPlaylist = false;
+  conn.hls = false;
+  conn.mirrorCount = 0;
+  conn.icyMetaInt = 0;
+  strlcpy(conn.codecPath, strlen(conn.cachedCodecPath) > 0 ? conn.cachedCodecPath : "/stream.mp3", sizeof(conn.codecPath));
+  setStreamState(conn, STREAM_HEADERS);
+}
+
+// Collect whatever has arrived of the current line, true once it is complete
+bool readStreamLine(streamConnection &conn)
+{
+  while (streamClient(conn).available())
+  {
+    char c = streamClient(conn).read();
+    if (c == '\n')
+    {
+      conn.line[conn.lineLen] = '\0';
+      conn.lineLen = 0;
+      return true;
+    }
+    if (c != '\r' && conn.lineLen < sizeof(conn.line) - 1)
+      conn.line[conn.lineLen++] = c;
+  }
+  return false;
+}
+
+// Reached the audio data - remember where a playlist/redirect led (or refresh the details)
+void cacheResolvedStream(streamConnection &conn)
+{
+  // Mirrors in a race are only cached if they win, HLS segments and playlists never
+  if (conn.racing || conn.hlsRole != HLS_NONE || strcmp(conn.url, conn.currentUrl) == 0)
+    return;
+
+  cachedStream entry;
+  memset(&entry, 0, sizeof(entry));
+  uint32_t sampleRate = 0;
+  if (loadCachedStream(conn.url, entry) && strcmp(entry.resolvedUrl, conn.currentUrl) == 0)
+    sampleRate = entry.sampleRate;
+
+  memset(&entry, 0, sizeof(entry));
+  strlcpy(entry.resolvedUrl, conn.currentUrl, sizeof(entry.resolvedUrl));
+  strlcpy(entry.codecPath, conn.codecPath, sizeof(entry.codecPath));
+  strlcpy(entry.icyBitrate, conn.icyBitrate, sizeof(entry.icyBitrate));
+  entry.sampleRate = sampleRate;
+  saveCachedStream(conn.url, entry);
+}
+
+// Headers processed - decide whether we have audio, a redirect or a playlist
+void endOfStreamHeaders(streamConnection &conn)
+{
+  if (conn.statusCode >= 300 && conn.statusCode < 400 && strlen(conn.location) > 0)
+  {
+    logInfo("Fetch: redirected to %s", conn.location);
+    followStreamUrl(conn, conn.location);
+  }
+  else if (conn.statusCode != 200)
+  {
+    char reason[32];
+    snprintf(reason, sizeof(reason), "HTTP status %d", conn.statusCode);
+    failStream(conn, reason);
+  }
+  else if (conn.isPlaylist || conn.hlsRole == HLS_PLAYLIST || strstr(conn.currentUrl, ".pls") ||
+           strstr(conn.currentUrl, ".m3u"))
+  {
+    setStreamState(conn, STREAM_PLAYLIST);
+  }
+  else
+  {
+    // Positioned at the start of the audio data
+    conn.icyBytesUntilMeta = conn.icyMetaInt;
+    conn.icyMetaRemaining = 0;
+    cacheResolvedStream(conn);
+    setStreamState(conn, STREAM_BUFFERING);
+  }
+}
+
+void parseStreamHeaders(streamConnection &conn)
+{
+  while (conn.state == STREAM_HEADERS && readStreamLine(conn))
+  {
+    // Status line, eg "HTTP/1.1 200 OK" or "ICY 200 OK"
+    if (conn.statusCode == 0)
+    {
+      const char *status = strchr(conn.line, ' ');
+      conn.statusCode = status ? atoi(status + 1) : -1;
+      continue;
+    }
+
+    // Headers end with an empty line
+    if (strlen(conn.line) == 0)
+    {
+      endOfStreamHeaders(conn);
+      return;
+    }
+
+    char *value = strchr(conn.line, ':');
+    if (!value)
+      continue;
+    *value++ = '\0';
+    while (*value == ' ')
+      value++;
+
+    if (strcasecmp(conn.line, "location") == 0)
+      strlcpy(conn.location, value, sizeof(conn.location));
+    else if (strcasecmp(conn.line, "icy-metaint") == 0)
+      conn.icyMetaInt = atoi(value);
+    else if (strcasecmp(conn.line, "icy-name") == 0)
+      strlcpy(conn.icyName, value, sizeof(conn.icyName));
+    else if (strcasecmp(conn.line, "icy-br") == 0)
+      strlcpy(conn.icyBitrate, value, sizeof(conn.icyBitrate));
+    else if (strcasecmp(conn.line, "content-type") == 0)
+    {
+      if (strstr(value, "scpls") || strstr(value, "mpegurl"))
+        conn.isPlaylist = true;
+      else if (strstr(value, "aac"))
+        strlcpy(conn.codecPath, "/stream.aac", sizeof(conn.codecPath));
+      else if (strstr(value, "mpeg"))
+        strlcpy(conn.codecPath, "/stream.mp3", sizeof(conn.codecPath));
+    }
+  }
+
+  if (conn.state == STREAM_HEADERS && !streamClient(conn).connected() && !streamClient(conn).available())
+    failStream(conn, "closed during headers");
+}
+
+// Collect the stream URLs in a .pls or .m3u playlist body. One is simply followed,
+// several (mirrors) are raced against each other. An HLS playlist (.m3u8) is recognised
+// by its #EXT-X- tags.
+void endOfStreamPlaylist(streamConnection &conn)
+{
+  if (conn.hlsRole == HLS_PLAYLIST)
+  {
+    endOfHlsPlaylist(conn);
+    return;
+  }
+  if (conn.hls)
+  {
+    beginHls(conn);
+    return;
+  }
+
+  if (conn.mirrorCount == 0)
+  {
+    failStream(conn, "no stream found in playlist");
+    return;
+  }
+
+  if (conn.mirrorCount > 1 && beginMirrorRace(conn))
+    return;
+
+  char entryUrl[256];
+  strlcpy(entryUrl, conn.mirrorUrls[0], sizeof(entryUrl));
+  followStreamUrl(conn, entryUrl);
+}
+
+void parseStreamPlaylist(streamConnection &conn)
+{
+  const uint8_t maxMirrors = sizeof(conn.mirrorUrls) / sizeof(conn.mirrorUrls[0]);
+
+  while (conn.state == STREAM_PLAYLIST)
+  {
+    if (!readStreamLine(conn))
+    {
+      // Last line may not have a newline
+      if (streamClient(conn).connected() || streamClient(conn).available())
+        return;
+      if (conn.lineLen == 0)
+        break;
+      conn.line[conn.lineLen] = '\0';
+      conn.lineLen = 0;
+    }
+
+    if (conn.hlsRole == HLS_PLAYLIST)
+    {
+      hlsPlaylistLine(conn, conn.line);
+      continue;
+    }
+    if (strncmp(conn.line, "#EXT-X-", 7) == 0)
+    {
+      conn.hls = true;
+      break;
+    }
+
+    const char *candidate = conn.line;
+    if (strncasecmp(conn.line, "File", 4) == 0 && strchr(conn.line, '='))
+      candidate = strchr(conn.line, '=') + 1;
+
+    bool duplicate = false;
+    for (uint8_t i = 0; i < conn.mirrorCount; i++)
+      duplicate |= (strcmp(candidate, conn.mirrorUrls[i]) == 0);
+
+    bool streamUrl = strncmp(candidate, "http://", 7) == 0 || strncmp(candidate, "https://", 8) == 0;
+    if (streamUrl && !duplicate && conn.mirrorCount < maxMirrors)
+    {
+      strlcpy(conn.mirrorUrls[conn.mirrorCount++], candidate, sizeof(conn.mirrorUrls[0]));
+      logInfo("Fetch: playlist entry %s", candidate);
+    }
+
+    // Enough to choose from, don't wait for the rest
+    if (conn.mirrorCount == maxMirrors)
+      break;
+  }
+
+  if (conn.state == STREAM_PLAYLIST)
+    endOfStreamPlaylist(conn);
+}
+
+// Move a connection on as far as it can go without waiting
+void advanceStream(streamConnection &conn)
+{
+  if (conn.state > STREAM_IDLE && conn.state < STREAM_BUFFERING &&
+      millis() - conn.stateStart > streamPhaseTimeoutMS)
+  {
+    failStream(conn, "timed out");
+    return;
+  }
+
+  switch (conn.state)
+  {
+  case STREAM_RESOLVING:
+    if (conn.dnsResult != 0 && !conn.dnsCached)
+    {
+      recordDnsLookup(conn.dnsResult > 0, millis() - conn.stateStart);
+      if (conn.dnsResult > 0)
+        dnsCacheStore(conn.host, conn.resolvedIp);
+    }
+    if (conn.dnsResult > 0)
+      beginStreamConnect(conn);
+    else if (conn.dnsResult < 0)
+      failStream(conn, "host not found");
+    break;
+  case STREAM_CONNECTING:
+    checkStreamConnected(conn);
+    break;
+  case STREAM_SENDING:
+    sendStreamRequest(conn);
+    break;
+  case STREAM_HEADERS:
+    parseStreamHeaders(conn);
+    break;
+  case STREAM_PLAYLIST:
+    parseStreamPlaylist(conn);
+    break;
+  case STREAM_RACING:
+    serviceMirrorRace(conn);
+    break;
+  default:
+    break;
+  }
+}
+
+// Enough audio buffered to start decoding - the connect is complete
+void streamBuffered(streamConnection &conn)
+{
+  setStreamState(conn, STREAM_STREAMING);
+  reportConnectTimings(conn, true);
+}
@@ -0,0 +1,760 @@
+// Network fetch stage of the audio pipeline (runs on Core 0)
+// - owns the HTTP/ICY connections, strips ICY metadata and writes the compressed
+//   audio into a lock-free ring
+// - the decoder (audio.loop() on Core 1) reads the ring as if it were a file
+// - optionally keeps the previous/next stations connected (warm standby) so a
+//   channel change can start from already buffered data
+// - connections are set up by the non-blocking engine in streamConnect.h, so no
+//   connect ever holds up the stream being played
+#include <Arduino.h>
+#include <WiFi.h>
+#include <FS.h>
+#include <FSImpl.h>
+#include "Audio.h"
+#include "main.h"
+#include "spscRing.h"
+#include "streamConnect.h"
+#include "latencyProfile.h"
+#include "mirrorRace.h"
+#include "timeshift.h"
+
+// Compressed audio ring between fetch (Core 0) and decode (Core 1) stages,
+// sized by the latency profile. Decoding starts (and restarts after an underrun)
+// once prebufferWatermark bytes are buffered.
+spscRing streamRing;
+
+// Set WARM_STANDBY_STATIONS to false to only ever connect to the current station
+#define WARM_STANDBY_STATIONS true
+
+// Memory used by each warm standby station (there are at most 2: previous and next).
+// Only the most recent data is kept, so this should be at least the prebuffer watermark
+// for the decoder to start as soon as a standby station is selected.
+const uint32_t standbyRingSize = 16384;
+const uint8_t maxStandbyStreams = 2;
+
+// Standby stations are only connected while the active stream is this full,
+// so their downloads never compete with a station that is struggling
+const uint8_t standbyConnectFillPercent = 75;
+
+streamConnection activeStream;
+streamConnection standbyStreams[maxStandbyStreams];
+spscRing standbyRings[maxStandbyStreams];
+
+// Connection requests - the generation is bumped for every new station
+portMUX_TYPE fetchMux = portMUX_INITIALIZER_UNLOCKED;
+char requestedUrl[256];
+char requestedStandbyUrls[maxStandbyStreams][256];
+volatile uint32_t requestedGeneration = 0;
+volatile uint32_t streamingGeneration = 0;
+
+// What the audio task needs to know about the stream being played, published by the
+// fetch task (which owns activeStream and swaps it about) under fetchMux
+char streamingCodecPath[12] = "/stream.mp3";
+volatile uint16_t streamingBitrateKbps = 0;
+volatile uint32_t streamingSampleRate = 0; // From the stream cache, 0 if not known
+
+// Set by the audio task after a long mute (see powerSave.h): every connection is closed
+// until it is cleared, then the active station reconnects into the ring as it is
+volatile bool fetchSuspended = false;
+
+// Set while an alarm prebuffers (see alarms.h): the decoder isn't started until it is cleared
+volatile bool decodeHeld = false;
+
+// Set while a local file is repositioned (see localFile.h): the decoder is stopped and
+// its ring emptied, it starts again from the new position once this is cleared
+volatile bool localSeekPending = false;
+
+// Was the last station change served from a warm standby connection?
+volatile bool lastSwitchWasWarm = false;
+
+// Crossfaded station change (see crossfade.h): the new station is prebuffered in a
+// standby slot while the old one plays on, and only becomes the active stream once
+// the audio task has stopped the decoder
+volatile bool requestedCrossfade = false;
+volatile bool crossfadeIncomingReady = false;  // Prebuffered (or given up waiting)
+volatile bool crossfadeDecoderStopped = false; // Set by the audio task: switch now
+const unsigned long crossfadeIncomingTimeoutMS = 5000;
+
+// Throughput counters per stage (cumulative, reported periodically)
+volatile uint32_t fetchBytesTotal = 0;
+volatile uint32_t decodeBytesTotal = 0;
+
+// Sample rate the decoder found for the active stream (recorded in the stream cache)
+volatile uint32_t decodedSampleRate = 0;
+volatile uint32_t decodedSampleRateGeneration = 0;
+
+// Scratch buffers kept off the task stack
+static uint8_t fetchChunk[1460];
+static streamConnection swapConnection;
+
+// Create the task handle (a reference to the task being created later)
+TaskHandle_t streamFetchTaskHandle;
+
+// ===================== Ring as a file ==================
+// The audio library decodes from a file system, so the ring is presented as a
+// never ending file. An empty read looks like end of file to the library, which
+// stops decoding - the audio task then restarts it once the ring has refilled.
+class RingFileImpl : public fs::FileImpl
+{
+public:
+  RingFileImpl(const char *path) : _position(0)
+  {
+    strlcpy(_name, path, sizeof(_name));
+  }
+  size_t write(const uint8_t *buf, size_t size) { return 0; }
+  size_t read(uint8_t *buf, size_t size)
+  {
+    size_t bytesRead = ringRead(streamRing, buf, size);
+    _position += bytesRead;
+    decodeBytesTotal += bytesRead;
+    return bytesRead;
+  }
+  void flush() {}
+  bool seek(uint32_t pos, SeekMode mode) { return false; }
+  size_t position() const { return _position; }
+  size_t size() const { return 0x7FFFFFFF; } // Live stream, no end
+  void close() {}
+  time_t getLastWrite() { return 0; }
+  const char *name() const { return _name; }
+  boolean isDirectory(void) { return false; }
+  fs::FileImplPtr openNextFile(const char *mode) { return fs::FileImplPtr(); }
+  void rewindDirectory(void) {}
+  operator bool() { return true; }
+
+private:
+  size_t _position;
+  char _name[16];
+};
+
+class RingFSImpl : public fs::FSImpl
+{
+public:
+  fs::FileImplPtr open(const char *path, const char *mode)
+  {
+    return std::make_shared<RingFileImpl>(path);
+  }
+  bool exists(const char *path) { return true; }
+  bool rename(const char *pathFrom, const char *pathTo) { return false; }
+  bool remove(const char *path) { return false; }
+  bool mkdir(const char *path) { return false; }
+  bool rmdir(const char *path) { return false; }
+};
+
+fs::FS ringFS = fs::FS(fs::FSImplPtr(new RingFSImpl()));
+// =======================================================
+
+// Called (from any task) to switch the fetch stage to a new stream URL. The
+// previous/next station URLs (may be NULL) are kept connected as warm standbys.
+// With crossfade the old stream carries on until the audio task is ready to switch.
+void requestStreamConnect(const char *url, const char *prevUrl, const char *nextUrl, bool crossfade = false)
+{
+  portENTER_CRITICAL(&fetchMux);
+  requestedCrossfade = crossfade;
+  strlcpy(requestedUrl, url, sizeof(requestedUrl));
+  strlcpy(requestedStandbyUrls[0], (WARM_STANDBY_STATIONS && prevUrl) ? prevUrl : "", sizeof(requestedStandbyUrls[0]));
+  strlcpy(requestedStandbyUrls[1], (WARM_STANDBY_STATIONS && nextUrl) ? nextUrl : "", sizeof(requestedStandbyUrls[1]));
+  requestedGeneration++;
+  portEXIT_CRITICAL(&fetchMux);
+
+  if (streamFetchTaskHandle != NULL)
+    xTaskNotifyGive(streamFetchTaskHandle);
+}
+
+// Called by the fetch task: copy the active stream's details for the audio task
+void publishActiveStream()
+{
+  portENTER_CRITICAL(&fetchMux);
+  strlcpy(streamingCodecPath, activeStream.codecPath, sizeof(streamingCodecPath));
+  streamingBitrateKbps = atoi(activeStream.icyBitrate);
+  streamingSampleRate = activeStream.cachedSampleRate;
+  portEXIT_CRITICAL(&fetchMux);
+}
+
+// Called by the audio task: the file name the decoder opens for the active stream
+void streamingCodec(char *path, size_t size)
+{
+  portENTER_CRITICAL(&fetchMux);
+  strlcpy(path, streamingCodecPath, size);
+  portEXIT_CRITICAL(&fetchMux);
+}
+
+// Is there enough of the current stream buffered for the decoder to (re)start?
+bool streamReadyToDecode()
+{
+  return streamingGeneration == requestedGeneration && !timeshiftLiveRequested && !decodeHeld && !localSeekPending &&
+         ringFilled(streamRing) >= prebufferWatermark;
+}
+
+// Called by the audio task once the decoder knows the active stream's sample rate
+void noteStreamSampleRate(uint32_t sampleRate)
+{
+  decodedSampleRate = sampleRate;
+  decodedSampleRateGeneration = streamingGeneration;
+}
+
+// Add the decoder's sample rate to the active station's cache entry (if it has one)
+void updateCachedSampleRate()
+{
+  if (decodedSampleRateGeneration != streamingGeneration || decodedSampleRate == 0)
+    return;
+
+  cachedStream entry;
+  if (isStreaming(activeStream) && loadCachedStream(activeStream.url, entry) &&
+      strcmp(entry.resolvedUrl, activeStream.currentUrl) == 0 && entry.sampleRate != decodedSampleRate)
+  {
+    entry.sampleRate = decodedSampleRate;
+    saveCachedStream(activeStream.url, entry);
+  }
+  decodedSampleRate = 0;
+}
+
+// Pass the active stream's details on to the display callbacks
+void announceActiveStream()
+{
+  audio_lasthost(activeStream.url);
+  audio_showstation(activeStream.icyName);
+  if (strlen(activeStream.icyBitrate) > 0)
+    audio_bitrate(activeStream.icyBitrate);
+  if (strlen(activeStream.streamTitle) > 0)
+    audio_showstreamtitle(activeStream.streamTitle);
+}
+
+// Pull StreamTitle='...'; out of an ICY metadata block
+void processIcyMetaData(streamConnection &conn, char *metaData)
+{
+  char *title = strstr(metaData, "StreamTitle='");
+  if (!title)
+    return;
+  title += 13;
+
+  char *titleEnd = strstr(title, "';");
+  if (titleEnd)
+    *titleEnd = '\0';
+
+  // Standby stations only remember the title until they become active
+  strlcpy(conn.streamTitle, title, sizeof(conn.streamTitle));
+  if (&conn == &activeStream)
+    audio_showstreamtitle(conn.streamTitle);
+}
+
+// Audio for a connection: into its ring, or the recording while the station is timeshifted
+void writeStreamAudio(streamConnection &conn, const uint8_t *data, size_t len)
+{
+  if (&conn == &activeStream && timeshifting())
+    timeshiftWrite(data, len);
+  else
+    ringWrite(*conn.ring, data, len);
+}
+
+// Copy received bytes into the connection's ring, removing any ICY metadata blocks
+// (a metadata block can be split across reads)
+void processStreamData(streamConnection &conn, uint8_t *data, size_t len)
+{
+  while (len > 0)
+  {
+    // Part way through a metadata block?
+    if (conn.icyMetaRemaining > 0)
+    {
+      size_t metaBytes = min(len, (size_t)conn.icyMetaRemaining);
+      size_t copyBytes = min(metaBytes, sizeof(conn.icyMetaData) - 1 - conn.icyMetaLen);
+      memcpy(conn.icyMetaData + conn.icyMetaLen, data, copyBytes);
+      conn.icyMetaLen += copyBytes;
+      conn.icyMetaRemaining -= metaBytes;
+      data += metaBytes;
+      len -= metaBytes;
+
+      if (conn.icyMetaRemaining == 0)
+      {
+        conn.icyMetaData[conn.icyMetaLen] = '\0';
+        processIcyMetaData(conn, conn.icyMetaData);
+        conn.icyBytesUntilMeta = conn.icyMetaInt;
+      }
+      continue;
+    }
+
+    if (conn.icyMetaInt == 0 || conn.icyBytesUntilMeta > 0)
+    {
+      size_t audioBytes = (conn.icyMetaInt == 0) ? len : min(len, (size_t)conn.icyBytesUntilMeta);
+      writeStreamAudio(conn, data, audioBytes);
+      if (conn.icyMetaInt > 0)
+        conn.icyBytesUntilMeta -= audioBytes;
+      data += audioBytes;
+      len -= audioBytes;
+      continue;
+    }
+
+    // Metadata length byte (in 16 byte blocks), usually zero as nothing has changed
+    conn.icyMetaRemaining = *data * 16;
+    conn.icyMetaLen = 0;
+    data++;
+    len--;
+    if (conn.icyMetaRemaining == 0)
+      conn.icyBytesUntilMeta = conn.icyMetaInt;
+  }
+}
+
+// Step a connection through its connect phases, then read whatever has arrived into its ring
+void serviceStream(streamConnection &conn)
+{
+  if (!isStreaming(conn))
+  {
+    advanceStream(conn);
+    if (!isStreaming(conn))
+      return;
+  }
+
+  // A file is read into its ring by the local player, an HLS station's segments by the HLS client
+  if (conn.local)
+    serviceLocalFile(conn);
+  else if (conn.hls)
+    serviceHls(conn);
+  else if (!streamClient(conn).connected() && !streamClient(conn).available())
+  {
+    logInfo("Fetch: %s closed the connection", conn.host);
+    closeStream(conn);
+    return;
+  }
+  else
+  {
+    // Standby stations keep only the most recent data, the decoder resyncs on the next frame
+    // (as does a timeshift recording once it is full)
+    uint32_t space = ringFree(*conn.ring);
+    if (&conn == &activeStream && timeshifting())
+      space = sizeof(fetchChunk);
+    else if (&conn != &activeStream && space < sizeof(fetchChunk))
+    {
+      ringSkip(*conn.ring, sizeof(fetchChunk) - space);
+      space = sizeof(fetchChunk);
+    }
+
+    if (space > 0 && streamClient(conn).available())
+    {
+      // Never read more than will fit, metadata only makes the audio part smaller
+      int bytesRead = streamClient(conn).read(fetchChunk, min(space, (uint32_t)sizeof(fetchChunk)));
+      if (bytesRead > 0)
+      {
+        fetchBytesTotal += bytesRead;
+        processStreamData(conn, fetchChunk, bytesRead);
+        if (&conn == &activeStream)
+        {
+          noteStreamReceived(bytesRead);
+          wakeAudioTask();
+        }
+      }
+    }
+  }
+
+  // A standby ring may be too small for the watermark, it is buffered once (nearly) full
+  uint32_t bufferedBytes = min((uint32_t)prebufferWatermark, conn.ring->size - (uint32_t)sizeof(fetchChunk));
+  uint32_t recordedBytes = (&conn == &activeStream) ? timeshiftFilled() : 0;
+  if (conn.state == STREAM_BUFFERING && ringFilled(*conn.ring) + recordedBytes >= bufferedBytes)
+    streamBuffered(conn);
+}
+
+// Add what a connection is waiting for to the select() sets (and shorten the timeout
+// for anything that has to be polled), true if it has data to read already
+bool addStreamWait(streamConnection &conn, fd_set &readSet, fd_set &writeSet, int &maxFd, uint32_t &timeoutMS)
+{
+  switch (conn.state)
+  {
+  case STREAM_RESOLVING:
+  case STREAM_SENDING:
+  case STREAM_RACING:
+    // DNS answers arrive by callback (and mirrors are polled), check back soon
+    timeoutMS = min(timeoutMS, (uint32_t)5);
+    break;
+  case STREAM_CONNECTING:
+    FD_SET(conn.connectFd, &writeSet);
+    maxFd = max(maxFd, conn.connectFd);
+    break;
+  case STREAM_HEADERS:
+  case STREAM_PLAYLIST:
+  case STREAM_BUFFERING:
+  case STREAM_STREAMING:
+    if (conn.local)
+      return localFileReady(conn);
+    if (conn.hls)
+      return addHlsWaits(conn, readSet, writeSet, maxFd, timeoutMS);
+    // A full active ring has to wait for the decoder, not the network
+    if (&conn == &activeStream && ringFree(streamRing) == 0 && !timeshifting())
+      break;
+    if (streamClient(conn).available())
+      return true;
+    if (streamClientFd(conn) >= 0)
+    {
+      FD_SET(streamClientFd(conn), &readSet);
+      maxFd = max(maxFd, streamClientFd(conn));
+    }
+    else if (conn.tls)
+      timeoutMS = min(timeoutMS, (uint32_t)5);
+    break;
+  default:
+    break;
+  }
+  return false;
+}
+
+// Wait (up to timeoutMS) for any connection to have something to do: data to read,
+// a connect completing or a lookup being answered
+void waitForStreamData(uint32_t timeoutMS)
+{
+  fd_set readSet, writeSet;
+  int maxFd = -1;
+  FD_ZERO(&readSet);
+  FD_ZERO(&writeSet);
+
+  for (int8_t i = -1; i < maxStandbyStreams; i++)
+  {
+    streamConnection &conn = (i < 0) ? activeStream : standbyStreams[i];
+    if (addStreamWait(conn, readSet, writeSet, maxFd, timeoutMS))
+      return;
+  }
+
+  if (maxFd < 0)
+  {
+    // No sockets to wait on, sleep until a station is requested (or the timeout)
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeoutMS));
+    return;
+  }
+
+  struct timeval timeout = {0, (long)timeoutMS * 1000};
+  select(maxFd + 1, &readSet, &writeSet, NULL, &timeout);
+}
+
+// Swap two connections, each keeping its own ring
+void swapStreams(streamConnection &a, streamConnection &b)
+{
+  spscRing *ringA = a.ring;
+  spscRing *ringB = b.ring;
+  swapConnection = a;
+  a = b;
+  b = swapConnection;
+  a.ring = ringA;
+  b.ring = ringB;
+
+  // Don't leave an extra reference to either socket behind (a TLS client is only
+  // pointed to, and has moved with its connection)
+  swapConnection.client.stop();
+  swapConnection.tls = NULL;
+
+  // A pending DNS answer would be delivered to the old slot, so ask again
+  if (a.state == STREAM_RESOLVING)
+    beginStreamHop(a);
+  if (b.state == STREAM_RESOLVING)
+    beginStreamHop(b);
+
+  // A mirror race follows its station to the other slot
+  if (a.state == STREAM_RACING)
+    mirrorRaceMoved(b, a);
+  if (b.state == STREAM_RACING)
+    mirrorRaceMoved(a, b);
+
+  // Likewise an HLS session, as long as its station stays the active one
+  if (a.hls)
+    hlsSessionMoved(b, a);
+  if (b.hls)
+    hlsSessionMoved(a, b);
+  if (a.local)
+    localFileMoved(b, a);
+  if (b.local)
+    localFileMoved(a, b);
+}
+
+bool isWantedStandby(const char *url, char wantedUrls[][256])
+{
+  for (uint8_t i = 0; i < maxStandbyStreams; i++)
+  {
+    if (strlen(url) > 0 && strcmp(url, wantedUrls[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+int8_t findStandbyStream(const char *url)
+{
+  for (uint8_t i = 0; i < maxStandbyStreams; i++)
+  {
+    if (standbyStreams[i].state != STREAM_IDLE && strcmp(standbyStreams[i].url, url) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Crossfade: connect the new station in a standby slot (unless it already has one),
+// taking a slot the new station won't want as a neighbour
+void beginIncomingStream(const char *url, char wantedUrls[][256])
+{
+  if (findStandbyStream(url) >= 0)
+    return;
+
+  uint8_t slot = maxStandbyStreams - 1;
+  for (uint8_t i = 0; i < maxStandbyStreams; i++)
+  {
+    if (!isWantedStandby(standbyStreams[i].url, wantedUrls))
+    {
+      slot = i;
+      break;
+    }
+  }
+  closeStream(standbyStreams[slot]);
+  ringReset(*standbyStreams[slot].ring);
+  logInfo("Fetch: prebuffering %s for crossfade", url);
+  startStream(standbyStreams[slot], url);
+}
+
+// Crossfade: is the new station's prebuffer there yet? (Gives up after a while, the
+// switch then connects it from cold - as it always does for HLS)
+bool incomingStreamReady(const char *url, unsigned long startMillis)
+{
+  int8_t slot = findStandbyStream(url);
+  return slot < 0 || standbyStreams[slot].state == STREAM_STREAMING || standbyStreams[slot].hls || standbyStreams[slot].local ||
+         millis() - startMillis > crossfadeIncomingTimeoutMS;
+}
+
+// Make the requested station the active stream - from a warm standby connection
+// (even one still connecting) if we have one, otherwise by connecting from cold
+void switchActiveStream(const char *url, char wantedUrls[][256])
+{
+  // Decoder has already been stopped for the new station so the ring can be emptied
+  ringReset(streamRing);
+  resetTimeshift();
+
+  for (uint8_t i = 0; i < maxStandbyStreams; i++)
+  {
+    if (standbyStreams[i].state != STREAM_IDLE && strcmp(standbyStreams[i].url, url) == 0)
+    {
+      // The old active stream becomes the standby (it is usually the new neighbour).
+      // Each ring stays with its slot, so the new station's prebuffer is still in the
+      // standby ring: hand it over to the decoder's ring, leaving that one empty for the
+      // old station.
+      swapStreams(activeStream, standbyStreams[i]);
+      uint32_t bytesMoved;
+      while ((bytesMoved = ringRead(*standbyStreams[i].ring, fetchChunk, sizeof(fetchChunk))) > 0)
+        ringWrite(streamRing, fetchChunk, bytesMoved);
+      ringReset(*standbyStreams[i].ring);
+
+      logInfo("Fetch: switched to warm standby %s (%u bytes buffered)", url, ringFilled(streamRing));
+      lastSwitchWasWarm = true;
+      return;
+    }
+  }
+
+  // Park the old active stream as a standby if it is a neighbour of the new station
+  if (activeStream.state != STREAM_IDLE && isWantedStandby(activeStream.url, wantedUrls))
+  {
+    for (uint8_t i = 0; i < maxStandbyStreams; i++)
+    {
+      if (!isWantedStandby(standbyStreams[i].url, wantedUrls))
+      {
+        closeStream(standbyStreams[i]);
+        swapStreams(activeStream, standbyStreams[i]);
+        ringReset(*standbyStreams[i].ring);
+        break;
+      }
+    }
+  }
+
+  lastSwitchWasWarm = false;
+  startStream(activeStream, url);
+}
+
+// Start connecting any missing standby stations - only while the active stream is healthy
+void connectStandbyStreams(char wantedUrls[][256])
+{
+  if (ringFilled(streamRing) < (streamRing.size * standbyConnectFillPercent) / 100)
+    return;
+
+  for (uint8_t i = 0; i < maxStandbyStreams; i++)
+  {
+    const char *url = wantedUrls[i];
+    if (strlen(url) == 0 || strcmp(url, activeStream.url) == 0)
+      continue;
+
+    // Already connected (or connecting) in some slot?
+    bool connected = false;
+    for (uint8_t j = 0; j < maxStandbyStreams; j++)
+      connected |= (standbyStreams[j].state != STREAM_IDLE && strcmp(standbyStreams[j].url, url) == 0);
+    if (connected)
+      continue;
+
+    for (uint8_t j = 0; j < maxStandbyStreams; j++)
+    {
+      if (standbyStreams[j].state == STREAM_IDLE)
+      {
+        ringReset(*standbyStreams[j].ring);
+        logInfo("Fetch: connecting warm standby %s", url);
+        startStream(standbyStreams[j], url);
+        break;
+      }
+    }
+  }
+}
+
+// This is the task that we will start running (on Core 0, keeping network stalls away from the decoder)
+void streamFetchTask(void *parameter)
+{
+  static unsigned long prevMillis = 0;
+  static unsigned long prevStandbyAttempt = 0;
+  static uint32_t prevFetchBytes = 0;
+  static uint32_t prevDecodeBytes = 0;
+  static char url[256];
+  static char wantedUrls[maxStandbyStreams][256];
+  uint32_t connectGeneration = 0;
+  bool switchWaiting = false;
+  bool crossfadePending = false;
+  bool suspended = false;
+  unsigned long switchRequestMillis = 0;
+  logInfo("Started streamFetchTask");
+
+  // Loop forever
+  while (1)
+  {
+    // Muted for long enough to let the connections go - sleep until woken
+    if (fetchSuspended)
+    {
+      if (!suspended)
+      {
+        closeStream(activeStream);
+        for (uint8_t i = 0; i < maxStandbyStreams; i++)
+          closeStream(standbyStreams[i]);
+        suspended = true;
+      }
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+      continue;
+    }
+    if (suspended)
+    {
+      // Whatever is buffered plays while the station reconnects (a new station being
+      // requested instead is connected below as usual)
+      suspended = false;
+      resetStreamWatchdog();
+      if (!switchWaiting && connectGeneration == requestedGeneration && strlen(url) > 0)
+        startStream(activeStream, url);
+      prevStandbyAttempt = millis();
+    }
+
+    // New station requested?
+    if (connectGeneration != requestedGeneration)
+    {
+      portENTER_CRITICAL(&fetchMux);
+      connectGeneration = requestedGeneration;
+      strlcpy(url, requestedUrl, sizeof(url));
+      memcpy(wantedUrls, requestedStandbyUrls, sizeof(wantedUrls));
+      crossfadePending = requestedCrossfade;
+      portEXIT_CRITICAL(&fetchMux);
+
+      switchWaiting = true;
+      crossfadeIncomingReady = false;
+      crossfadeDecoderStopped = false;
+      if (crossfadePending)
+      {
+        // Old stream plays on while the new one prebuffers
+        beginIncomingStream(url, wantedUrls);
+        switchRequestMillis = millis();
+      }
+    }
+
+    if (crossfadePending && !crossfadeIncomingReady && incomingStreamReady(url, switchRequestMillis))
+      crossfadeIncomingReady = true;
+
+    // Switch now unless a crossfade is still waiting for the decoder to be stopped
+    if (switchWaiting && (!crossfadePending || crossfadeDecoderStopped))
+    {
+      switchWaiting = false;
+      crossfadePending = false;
+      crossfadeDecoderStopped = false;
+      switchActiveStream(url, wantedUrls);
+
+      // Standby connections that are no longer neighbours are dropped
+      for (uint8_t i = 0; i < maxStandbyStreams; i++)
+      {
+        if (!isWantedStandby(standbyStreams[i].url, wantedUrls))
+          closeStream(standbyStreams[i]);
+      }
+    }
+
+    // Move every connection on, the active stream first
+    waitForStreamData(20);
+    serviceStream(activeStream);
+    serviceTimeshift(streamRing);
+    for (uint8_t i = 0; i < maxStandbyStreams; i++)
+      serviceStream(standbyStreams[i]);
+
+    // The decoder can start as soon as the active stream reaches its audio data
+    if (streamingGeneration != connectGeneration && !switchWaiting && isStreaming(activeStream))
+    {
+      publishActiveStream();
+      streamingGeneration = connectGeneration;
+      announceActiveStream();
+      wakeAudioTask();
+    }
+    // An HLS stream only finds out its codec from the first segment
+    else if (streamingGeneration == connectGeneration && strcmp(streamingCodecPath, activeStream.codecPath) != 0)
+      publishActiveStream();
+
+    // Reconnect the station being played if it stalls (a file can't)
+    serviceStreamWatchdog(url, !switchWaiting && streamingGeneration == connectGeneration && !activeStream.local);
+
+    updateCachedSampleRate();
+    serviceDnsCache();
+
+    // Keep the neighbouring stations connected (retry failures every few seconds)
+    if (WARM_STANDBY_STATIONS && millis() - prevStandbyAttempt > 5000)
+    {
+      connectStandbyStreams(wantedUrls);
+      prevStandbyAttempt = millis();
+    }
+
+    // Stack size and per stage throughput every 15 seconds
+    if (millis() - prevMillis > 15000)
+    {
+      unsigned long elapsedSecs = (millis() - prevMillis) / 1000;
+      unsigned long remainingStack = uxTaskGetStackHighWaterMark(NULL);
+      logInfo("Fetch Free stack:%lu", remainingStack);
+      logInfo("Fetch in:%luB/s decode out:%luB/s ring:%u/%u standby:%u/%u",
+              (fetchBytesTotal - prevFetchBytes) / elapsedSecs,
+              (decodeBytesTotal - prevDecodeBytes) / elapsedSecs,
+              ringFilled(streamRing), streamRing.size,
+              ringFilled(standbyRings[0]), ringFilled(standbyRings[1]));
+      reportDnsCache();
+      reportHls();
+      reportLocalFile();
+      reportTimeshift(atoi(activeStream.icyBitrate), ringFilled(streamRing));
+      prevFetchBytes = fetchBytesTotal;
+      prevDecodeBytes = decodeBytesTotal;
+      prevMillis = millis();
+    }
+  }
+}
+
+// Called from the main setup() routine
+// - the task starts running it as soon as it declared
+void createStreamFetchTask()
+{
+  // Station host addresses from last time, refreshed in the background
+  loadDnsCache();
+  setupTimeshift();
+
+  if (!ringInit(streamRing, profileRingBytes()))
+    logError("Unable to allocate stream ring");
+  activeStream.ring = &streamRing;
+  activeStream.connectFd = -1;
+
+  for (uint8_t i = 0; i < maxStandbyStreams; i++)
+  {
+    if (WARM_STANDBY_STATIONS && !ringInit(standbyRings[i], standbyRingSize))
+      logError("Unable to allocate standby ring");
+    standbyStreams[i].ring = &standbyRings[i];
+    standbyStreams[i].connectFd = -1;
+  }
+
+  // Independent Task to fetch the stream from the network
+  xTaskCreatePinnedToCore(
+      streamFetchTask,        /* Function to implement the task */
+      "StreamFetch",          /* Name of the task */
+      4000,                   /* Stack size in words */
+      NULL,                   /* Task input parameter */
+      2,                      /* Priority of the task - must be higher than 0 (idle)*/
+      &streamFetchTaskHandle, /* Task handle. */
+      0);                     /* Core where the task should run */
+}
@@ -0,0 +1,162 @@
+// Stream stall watchdog (run by the fetch task)
+// A station that stops sending - the server hangs, the connection drops, or data trickles
+// in slower than it is played - used to go unnoticed until the buffer icon turned red and
+// the user changed channel. The watchdog spots it and reconnects to the same station,
+// backing off between attempts, while whatever is left in the stream ring plays out.
+// The ring, the decoder and I2S are left alone: if the ring does run dry before the new
+// connection delivers, I2S plays silence (tx_desc_auto_clear) and the decoder restarts
+// as it does after any underrun. Reconnects and the gaps heard are kept in the telemetry.
+#include <Arduino.h>
+#include "main.h"
+
+// Set STREAM_WATCHDOG to false to leave a stalled station for the user to change
+#define STREAM_WATCHDOG true
+
+// Stalled: nothing received for this long while there was room in the ring
+const unsigned long stallTimeoutMS = 3000;
+
+// Draining: over drainWindowMS less than drainReceivedPercent of what was decoded arrived,
+// and the buffer health estimate has it running dry within drainUnderrunMS
+const unsigned long drainWindowMS = 5000;
+const uint8_t drainReceivedPercent = 50;
+const uint32_t drainUnderrunMS = 10000;
+
+// Delay before each reconnect attempt, the last is repeated. Streaming for
+// reconnectHealthyMS after a reconnect starts the sequence again.
+const uint8_t reconnectBackoffSteps = 6;
+const unsigned long reconnectBackoffMS[reconnectBackoffSteps] = {0, 500, 1000, 2000, 4000, 8000};
+const unsigned long reconnectHealthyMS = 30000;
+
+// Audio bytes received on the active stream (standby stations not included)
+volatile uint32_t watchdogReceivedBytes = 0;
+unsigned long lastReceiveMillis = 0;
+
+uint8_t reconnectAttempt = 0;
+bool reconnectScheduled = false;
+unsigned long reconnectDueMillis = 0;
+unsigned long lastReconnectMillis = 0;
+
+// An episode runs from a stall being spotted until the ring is back above the watermark
+bool watchdogEpisode = false;
+unsigned long gapStartMillis = 0;
+
+// Called by serviceStream() for data read from the active stream
+void noteStreamReceived(uint32_t bytes)
+{
+  watchdogReceivedBytes += bytes;
+  lastReceiveMillis = millis();
+}
+
+void resetStreamWatchdog()
+{
+  reconnectAttempt = 0;
+  reconnectScheduled = false;
+  watchdogEpisode = false;
+  gapStartMillis = 0;
+  lastReceiveMillis = millis();
+}
+
+// Has the active stream been receiving less than it plays? (checked once per window)
+bool streamDraining()
+{
+  static unsigned long windowStart = 0;
+  static uint32_t windowReceived = 0;
+  static uint32_t windowDecoded = 0;
+
+  if (millis() - windowStart < drainWindowMS)
+    return false;
+
+  uint32_t received = watchdogReceivedBytes - windowReceived;
+  uint32_t decoded = decodeBytesTotal - windowDecoded;
+  windowStart = millis();
+  windowReceived = watchdogReceivedBytes;
+  windowDecoded = decodeBytesTotal;
+
+  return decoded > 0 && (uint64_t)received * 100 < (uint64_t)decoded * drainReceivedPercent &&
+         predictedUnderrunMS() < drainUnderrunMS;
+}
+
+// Reconnect the active stream to the station being played, keeping its ring as it is
+void reconnectActiveStream(const char *url)
+{
+  reconnectScheduled = false;
+  lastReconnectMillis = millis();
+  lastReceiveMillis = millis();
+  logWarn("Watchdog: reconnecting %s (attempt %u, %u bytes buffered)", url, reconnectAttempt, ringFilled(streamRing));
+  startStream(activeStream, url);
+}
+
+// Called by the fetch task every time round its loop. playing is false while a station
+// change is in progress (or before the first one) - the watchdog only looks after a
+// station that has already reached its audio.
+void serviceStreamWatchdog(const char *url, bool playing)
+{
+  if (!STREAM_WATCHDOG)
+    return;
+
+  if (!playing || strlen(url) == 0)
+  {
+    resetStreamWatchdog();
+    return;
+  }
+
+  // A full ring isn't read (the decoder is behind, or paused without timeshift) - not a stall
+  uint32_t filled = ringFilled(streamRing);
+  if (ringFree(streamRing) < sizeof(fetchChunk) && !timeshifting())
+    lastReceiveMillis = millis();
+
+  // Time any silence caused by the outage: from the ring running dry until it is refilled
+  if (watchdogEpisode)
+  {
+    if (filled == 0 && gapStartMillis == 0)
+      gapStartMillis = millis();
+    if (activeStream.state == STREAM_STREAMING && filled >= prebufferWatermark)
+    {
+      uint32_t gapMillis = (gapStartMillis != 0) ? millis() - gapStartMillis : 0;
+      if (gapStartMillis != 0)
+        recordReconnectGap(gapMillis);
+      logInfo("Watchdog: %s recovered after %u attempts, gap %ums", url, reconnectAttempt, gapMillis);
+      playEarcon(EARCON_CHIME);
+      watchdogEpisode = false;
+      gapStartMillis = 0;
+    }
+  }
+
+  if (reconnectScheduled)
+  {
+    if ((long)(millis() - reconnectDueMillis) >= 0)
+      reconnectActiveStream(url);
+    return;
+  }
+
+  const char *reason = NULL;
+  if (activeStream.state == STREAM_IDLE)
+    reason = "connection lost";
+  else if (isStreaming(activeStream) && millis() - lastReceiveMillis > stallTimeoutMS)
+    reason = "stalled";
+  else if (activeStream.state == STREAM_STREAMING && streamDraining())
+    reason = "draining";
+
+  if (reason == NULL)
+  {
+    if (reconnectAttempt > 0 && activeStream.state == STREAM_STREAMING &&
+        millis() - lastReconnectMillis > reconnectHealthyMS)
+      reconnectAttempt = 0;
+    return;
+  }
+
+  recordReconnect(reason);
+  if (!watchdogEpisode)
+    playEarcon(EARCON_RECONNECTING);
+  watchdogEpisode = true;
+  unsigned long backoffMS = reconnectBackoffMS[min(reconnectAttempt, (uint8_t)(reconnectBackoffSteps - 1))];
+  reconnectAttempt++;
+  logWarn("Watchdog: %s %s, reconnect in %lums (%u bytes buffered)", url, reason, backoffMS, filled);
+
+  // Drop a stalled connection now, it only holds the socket while we wait
+  closeStream(activeStream);
+  reconnectScheduled = true;
+  reconnectDueMillis = millis() + backoffMS;
+  if (backoffMS == 0)
+    reconnectActiveStream(url);
+}
@@ -0,0 +1,341 @@
+// Audio pipeline telemetry
+// Counters and histograms kept by the audio path so stations and firmware builds can be
+// compared on numbers rather than the buffer icon. Everything is cumulative since boot (or
+// the last reset) and is dumped to Serial every telemetryDumpMS. Send 't' on the serial
+// console for a dump on demand, 'r' to reset. Every serial command is a line, run once it
+// ends; the other commands are kept with the feature they control.
+#include <Arduino.h>
+#include "driver/i2s.h"
+#include "main.h"
+
+const unsigned long telemetryDumpMS = 60000;
+
+// Ring occupancy is sampled at a fixed rate so the histogram is time weighted
+const unsigned long occupancySampleMS = 100;
+const uint8_t occupancyBuckets = 10; // 0-9%, 10-19% ... 90-100%
+
+// audio.loop() durations, bucket upper bounds in microseconds (last bucket is everything above)
+const uint8_t loopBuckets = 8;
+const uint32_t loopBucketMicros[loopBuckets - 1] = {100, 250, 500, 1000, 2500, 5000, 10000};
+
+struct audioTelemetry
+{
+  uint32_t decoderRestarts; // Stream ring ran dry, decoding had to restart
+  uint32_t silentMillis;    // Total time spent with no audio after those
+  uint32_t i2sUnderruns;    // DMA descriptors I2S sent unwritten while decoding
+  uint32_t decodeErrors;    // Frames the decoder rejected
+  int32_t lastDecodeError;  // ... and the decoder's code for the most recent
+  uint32_t bytesPerSecond;    // Most recent second
+  uint32_t minBytesPerSecond; // Over seconds spent streaming
+  uint32_t maxBytesPerSecond;
+  uint32_t occupancy[occupancyBuckets];
+  uint32_t loopCount;
+  uint32_t loopMaxMicros;
+  uint64_t loopTotalMicros;
+  uint32_t loopHistogram[loopBuckets];
+  uint32_t firstAudioCount; // Station switches that reached the first sample
+  uint32_t firstAudioWarm;  // ... of which were from a warm standby
+  uint32_t firstAudioLastMillis;
+  uint32_t firstAudioMinMillis;
+  uint32_t firstAudioMaxMillis;
+  uint32_t firstAudioTotalMillis;
+  uint32_t reconnects;       // Watchdog reconnects to the station being played...
+  uint32_t reconnectStalls;  // ...nothing arriving
+  uint32_t reconnectDrains;  // ...arriving slower than played
+  uint32_t reconnectDrops;   // ...connection closed or failed
+  uint32_t gapCount;         // Reconnects that were heard (the ring ran dry)
+  uint32_t gapLastMillis;
+  uint32_t gapMaxMillis;
+  uint32_t gapTotalMillis;
+};
+
+audioTelemetry telemetry;
+portMUX_TYPE telemetryMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Baselines for the rate/restart counters kept elsewhere
+uint32_t telemetryRestartBase = 0;
+uint32_t telemetryFetchBytesBase = 0;
+
+void resetTelemetry()
+{
+  portENTER_CRITICAL(&telemetryMux);
+  memset(&telemetry, 0, sizeof(telemetry));
+  telemetry.minBytesPerSecond = UINT32_MAX;
+  telemetry.firstAudioMinMillis = UINT32_MAX;
+  telemetryRestartBase = streamUnderruns;
+  portEXIT_CRITICAL(&telemetryMux);
+}
+
+// Query: consistent copy of the current figures
+void getTelemetry(audioTelemetry &snapshot)
+{
+  portENTER_CRITICAL(&telemetryMux);
+  snapshot = telemetry;
+  snapshot.decoderRestarts = streamUnderruns - telemetryRestartBase;
+  portEXIT_CRITICAL(&telemetryMux);
+}
+
+// Called by the audio task around every audio.loop()
+void recordAudioLoop(uint32_t micros)
+{
+  uint8_t bucket = 0;
+  while (bucket < loopBuckets - 1 && micros > loopBucketMicros[bucket])
+    bucket++;
+
+  portENTER_CRITICAL(&telemetryMux);
+  telemetry.loopCount++;
+  telemetry.loopTotalMicros += micros;
+  telemetry.loopHistogram[bucket]++;
+  if (micros > telemetry.loopMaxMicros)
+    telemetry.loopMaxMicros = micros;
+  portEXIT_CRITICAL(&telemetryMux);
+}
+
+// Called by the audio task when audio resumes after an underrun
+void recordSilence(uint32_t silentMillis)
+{
+  portENTER_CRITICAL(&telemetryMux);
+  telemetry.silentMillis += silentMillis;
+  portEXIT_CRITICAL(&telemetryMux);
+}
+
+// Called from audio_info(). The library has no error callback: its only error path,
+// printDecodeError(), reports "<codec> decode error <code> : <text>" as an info string.
+// Only that exact form counts - other info lines (stream titles, headers) can contain
+// anything.
+const char *const decoderNames[] = {"MP3", "AAC", "FLAC", "OPUS", "VORBIS"};
+
+void recordDecoderInfo(const char *info)
+{
+  for (const char *name : decoderNames)
+  {
+    size_t len = strlen(name);
+    int32_t code;
+    if (strncmp(info, name, len) == 0 && sscanf(info + len, " decode error %d", &code) == 1 && code < 0)
+    {
+      portENTER_CRITICAL(&telemetryMux);
+      telemetry.decodeErrors++;
+      telemetry.lastDecodeError = code;
+      portEXIT_CRITICAL(&telemetryMux);
+      return;
+    }
+  }
+}
+
+// Called by the audio task every wakeup - counts the descriptors I2S sent without data
+// while a stream was meant to be playing. Events from while nothing was (paused, between
+// stations) are discarded, as is anything queued across a change between the two.
+void sampleI2SEvents(bool playing)
+{
+  static bool wasPlaying = false;
+  if (i2sEventQueue == NULL)
+    return;
+
+  uint32_t underruns = 0;
+  i2s_event_t event;
+  while (xQueueReceive(i2sEventQueue, &event, 0) == pdTRUE)
+  {
+    if (event.type == I2S_EVENT_TX_Q_OVF)
+      underruns++;
+  }
+
+  if (playing && wasPlaying && underruns > 0)
+  {
+    portENTER_CRITICAL(&telemetryMux);
+    telemetry.i2sUnderruns += underruns;
+    portEXIT_CRITICAL(&telemetryMux);
+  }
+  wasPlaying = playing;
+}
+
+// connectToStation() to first sample at I2S
+void recordFirstAudio(uint32_t latencyMillis, bool warm)
+{
+  portENTER_CRITICAL(&telemetryMux);
+  telemetry.firstAudioCount++;
+  if (warm)
+    telemetry.firstAudioWarm++;
+  telemetry.firstAudioLastMillis = latencyMillis;
+  telemetry.firstAudioTotalMillis += latencyMillis;
+  telemetry.firstAudioMinMillis = min(telemetry.firstAudioMinMillis, latencyMillis);
+  telemetry.firstAudioMaxMillis = max(telemetry.firstAudioMaxMillis, latencyMillis);
+  portEXIT_CRITICAL(&telemetryMux);
+}
+
+// Called by the stream watchdog when it reconnects the station being played
+void recordReconnect(const char *reason)
+{
+  portENTER_CRITICAL(&telemetryMux);
+  telemetry.reconnects++;
+  if (strcmp(reason, "stalled") == 0)
+    telemetry.reconnectStalls++;
+  else if (strcmp(reason, "draining") == 0)
+    telemetry.reconnectDrains++;
+  else
+    telemetry.reconnectDrops++;
+  portEXIT_CRITICAL(&telemetryMux);
+}
+
+// ... and for the silence heard while it did
+void recordReconnectGap(uint32_t gapMillis)
+{
+  portENTER_CRITICAL(&telemetryMux);
+  telemetry.gapCount++;
+  telemetry.gapLastMillis = gapMillis;
+  telemetry.gapTotalMillis += gapMillis;
+  telemetry.gapMaxMillis = max(telemetry.gapMaxMillis, gapMillis);
+  portEXIT_CRITICAL(&telemetryMux);
+}
+
+// Called regularly by the audio task - takes its own samples at fixed intervals
+void sampleTelemetry()
+{
+  static unsigned long prevOccupancyMillis = 0;
+  static unsigned long prevRateMillis = 0;
+
+  if (millis() - prevOccupancyMillis >= occupancySampleMS)
+  {
+    uint8_t bucket = min((uint32_t)(ringFilled(streamRing) * occupancyBuckets) / streamRing.size, (uint32_t)occupancyBuckets - 1);
+    portENTER_CRITICAL(&telemetryMux);
+    telemetry.occupancy[bucket]++;
+    portEXIT_CRITICAL(&telemetryMux);
+    prevOccupancyMillis = millis();
+  }
+
+  if (millis() - prevRateMillis >= 1000)
+  {
+    uint32_t fetched = fetchBytesTotal;
+    uint32_t bytesPerSecond = ((uint64_t)(fetched - telemetryFetchBytesBase) * 1000) / (millis() - prevRateMillis);
+    telemetryFetchBytesBase = fetched;
+    prevRateMillis = millis();
+
+    portENTER_CRITICAL(&telemetryMux);
+    telemetry.bytesPerSecond = bytesPerSecond;
+    // Only seconds spent streaming count towards min/max (not connecting or idle)
+    if (isStreaming(activeStream))
+    {
+      telemetry.minBytesPerSecond = min(telemetry.minBytesPerSecond, bytesPerSecond);
+      telemetry.maxBytesPerSecond = max(telemetry.maxBytesPerSecond, bytesPerSecond);
+    }
+    portEXIT_CRITICAL(&telemetryMux);
+  }
+}
+
+void printTelemetry()
+{
+  audioTelemetry t;
+  getTelemetry(t);
+
+  logInfo("Telemetry station:%s uptime:%lus",
+          numberOfStations > 0 ? radioStation[currentStation].name : "", millis() / 1000);
+  logInfo("  decoder restarts:%u silent:%ums i2s underruns:%u decode errors:%u (last:%d)",
+          t.decoderRestarts, t.silentMillis, t.i2sUnderruns, t.decodeErrors, t.lastDecodeError);
+  logInfo("  bytes/s now:%u min:%u max:%u",
+          t.bytesPerSecond, t.minBytesPerSecond == UINT32_MAX ? 0 : t.minBytesPerSecond, t.maxBytesPerSecond);
+
+  uint32_t samples = 0;
+  for (uint8_t i = 0; i < occupancyBuckets; i++)
+    samples += t.occupancy[i];
+  char histogram[160];
+  int len = 0;
+  for (uint8_t i = 0; i < occupancyBuckets; i++)
+    len += snprintf(histogram + len, sizeof(histogram) - len, " %u0:%u", i, samples ? (t.occupancy[i] * 100) / samples : 0);
+  logInfo("  ring occupancy %%:%s", histogram);
+
+  logInfo("  audio.loop() calls:%u avg:%lluus max:%uus",
+          t.loopCount, t.loopCount ? t.loopTotalMicros / t.loopCount : 0, t.loopMaxMicros);
+  len = 0;
+  for (uint8_t i = 0; i < loopBuckets; i++)
+  {
+    if (i < loopBuckets - 1)
+      len += snprintf(histogram + len, sizeof(histogram) - len, " <=%u:%u", loopBucketMicros[i], t.loopHistogram[i]);
+    else
+      len += snprintf(histogram + len, sizeof(histogram) - len, " >%u:%u", loopBucketMicros[i - 1], t.loopHistogram[i]);
+  }
+  logInfo("  audio.loop() us:%s", histogram);
+
+  if (t.firstAudioCount > 0)
+    logInfo("  first audio switches:%u (warm:%u) last:%ums min:%ums avg:%ums max:%ums",
+            t.firstAudioCount, t.firstAudioWarm, t.firstAudioLastMillis, t.firstAudioMinMillis,
+            t.firstAudioTotalMillis / t.firstAudioCount, t.firstAudioMaxMillis);
+
+  logInfo("  reconnects:%u (stalled:%u draining:%u dropped:%u) gaps:%u last:%ums avg:%ums max:%ums",
+          t.reconnects, t.reconnectStalls, t.reconnectDrains, t.reconnectDrops, t.gapCount, t.gapLastMillis,
+          t.gapCount ? t.gapTotalMillis / t.gapCount : 0, t.gapMaxMillis);
+}
+
+// Serial command being typed. It is collected as the characters arrive and only run
+// once its line has ended, so the UI task never waits on the serial port for the rest.
+const uint8_t serialCommandLength = 96;
+char serialCommand[serialCommandLength];
+uint8_t serialCommandLen = 0;
+
+// Rest of the serial command line being run (after its first character)
+void readCommandLine(char *line, size_t size)
+{
+  strlcpy(line, serialCommand + 1, size);
+}
+
+// A complete command line (alarm and sleep timer commands are in alarms.h)
+void runSerialCommand()
+{
+  switch (serialCommand[0])
+  {
+  case 't':
+    printTelemetry();
+    break;
+  case 'r':
+    resetTelemetry();
+    logInfo("Telemetry reset");
+    break;
+  case 'a':
+    alarmCommand();
+    break;
+  case 's':
+    sleepTimerCommand();
+    break;
+  case 'f':
+    localFileCommand();
+    break;
+  case 'e':
+    earconCommand();
+    break;
+  case 'l':
+    latencyProfileCommand();
+    break;
+  case 'q':
+    eqCommand();
+    break;
+  case 'x':
+    crossfadeCommand();
+    break;
+  }
+}
+
+// Called by the button handler task (lowest priority) - periodic dump and serial commands
+void serviceTelemetry()
+{
+  static unsigned long prevDumpMillis = 0;
+
+  while (Serial.available())
+  {
+    char c = Serial.read();
+    if (c != '\n' && c != '\r')
+    {
+      if (serialCommandLen < serialCommandLength - 1)
+        serialCommand[serialCommandLen++] = c;
+      continue;
+    }
+    if (serialCommandLen == 0)
+      continue; // Blank line, or the \n of a \r\n
+    serialCommand[serialCommandLen] = '\0';
+    serialCommandLen = 0;
+    runSerialCommand();
+  }
+
+  if (millis() - prevDumpMillis > telemetryDumpMS)
+  {
+    printTelemetry();
+    prevDumpMillis = millis();
+  }
+}
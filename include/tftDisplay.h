@@ -101,6 +101,13 @@ bool settingsSelected = false;
 #define SETTINGS_ICON_X 280
 #define SETTINGS_ICON_Y 5
 
+// Spectrum bars and VU meters (between the track info and the bottom divider)
+#define SPECTRUM_X 0
+#define SPECTRUM_WIDTH 256
+#define SPECTRUM_BOTTOM 188
+#define VU_METER_X 276
+#define VU_METER_WIDTH 18
+
 // Button size
 #define BUTTON_WIDTH 50
 #define BUTTON_HEIGHT 40
@@ -564,6 +571,12 @@ bool isMuteButtonPressed(uint16_t t_x, uint16_t t_y)
   return false;
 }
 
+// The station name line (not a button as such)
+bool isStationNamePressed(uint16_t t_x, uint16_t t_y)
+{
+  return t_x < 270 && t_y >= 50 && t_y < 90;
+}
+
 bool isSettingsButtonPressed(uint16_t t_x, uint16_t t_y)
 {
   if (settingsBtn.contains(t_x, t_y))
@@ -736,6 +749,43 @@ void clearBitRate()
   tft.fillRect(BITRATE_LOCATION_X, BITRATE_LOCATION_Y - 15, 40, 20, TFT_BLACK);
 }
 
+// Only the parts of each bar that have changed since the last frame are drawn. Unlike
+// the text, this isn't done under mux: up to 34 rectangles is too long to hold off
+// interrupts for, and there is nothing to keep together - each fillRect() is a single
+// SPI transaction and the bars overlap nothing else on screen.
+void displaySpectrum(const uint8_t *barHeights, uint8_t bars, uint8_t vuLeft, uint8_t vuRight)
+{
+  static uint8_t drawnHeights[32 + 2];
+
+  uint8_t pitch = SPECTRUM_WIDTH / bars;
+  for (uint8_t i = 0; i < bars + 2; i++)
+  {
+    int32_t x, width, height;
+    uint16_t colour;
+    if (i < bars)
+    {
+      x = SPECTRUM_X + i * pitch;
+      width = pitch - 3;
+      height = barHeights[i];
+      colour = TFT_CYAN;
+    }
+    else
+    {
+      x = VU_METER_X + (i - bars) * (VU_METER_WIDTH + 4);
+      width = VU_METER_WIDTH;
+      height = (i == bars) ? vuLeft : vuRight;
+      colour = TFT_GREEN;
+    }
+
+    int32_t drawn = drawnHeights[i];
+    if (height > drawn)
+      tft.fillRect(x, SPECTRUM_BOTTOM - height, width, height - drawn, colour);
+    else if (height < drawn)
+      tft.fillRect(x, SPECTRUM_BOTTOM - drawn, width, drawn - height, TFT_BLACK);
+    drawnHeights[i] = height;
+  }
+}
+
 // 0 (off) to 255(bright) duty cycle
 void setScreenBrightness(int brightness)
 {
@@ -0,0 +1,293 @@
+// Live radio timeshift (runs as part of the stream fetch task, plus a task for the spill file)
+// While playback is paused - or is running behind live after a pause - the active
+// stream's compressed audio is recorded here instead of going straight to the decoder's
+// ring. Resuming plays on from the pause point (the decoder's ring still holds it) and
+// this store keeps the ring topped up, oldest first. Jumping to live throws it all away.
+//
+// The store is a large ring, in PSRAM when the board has it. With TIMESHIFT_SPILL the
+// recording carries on into a file on LittleFS once the ring is full (the ring always
+// holds the oldest data, the file the newest). When everything is full the oldest
+// recording is dropped, moving the pause point on.
+//
+// Flash writes can stall for tens of milliseconds, far too long for the fetch task, so
+// while spilling the fetch task only ever touches RAM: it records into a staging ring
+// and a low priority spill task moves that on - into the store ring while the file is
+// empty and there is room, otherwise to the file - and moves the file back into the
+// store ring as it is played. The store ring's only producer is then the spill task,
+// its only consumer the fetch task. Throwing the recording away (live, new station) is
+// the one time the fetch task touches the rest, holding a mutex the spill task takes
+// for each chunk it moves. Without the spill file there is no staging, the fetch task
+// records straight into the store ring.
+#include <Arduino.h>
+#include "main.h"
+#include "spscRing.h"
+
+// Set TIMESHIFT to false to make the mute button just mute again
+#define TIMESHIFT true
+#define TIMESHIFT_SPILL true
+
+// About 2 minutes of a 128kbps stream (only if there is PSRAM, otherwise a small
+// ring in front of the spill file)
+const uint32_t timeshiftRingBytes = 2097152;
+const uint32_t timeshiftSmallRingBytes = 16384;
+
+const char *timeshiftSpillFile = "/timeshift.bin";
+const uint32_t timeshiftSpillBytes = 524288;
+
+// Half a second of a 128kbps stream to ride out a slow flash write
+const uint32_t timeshiftStageBytes = 8192;
+const unsigned long timeshiftSpillPollMS = 50;
+
+spscRing timeshiftRing;
+spscRing timeshiftStage;
+File timeshiftSpill;
+volatile uint32_t spillWritePos = 0; // Free running, like the ring's head and tail
+volatile uint32_t spillReadPos = 0;  // (both only moved by the spill task)
+bool spillAvailable = false;
+TaskHandle_t timeshiftSpillTaskHandle = NULL;
+SemaphoreHandle_t timeshiftSpillMutex = NULL;
+
+// Control, set from other tasks
+volatile bool timeshiftPaused = false;
+volatile bool timeshiftLiveRequested = false;
+
+// Statistics (cumulative since boot)
+uint32_t timeshiftDroppedBytes = 0;
+uint32_t spillBytesWritten = 0;
+uint64_t spillWriteMicros = 0;
+uint32_t spillWriteMaxMicros = 0;
+
+uint32_t spillFilled()
+{
+  return spillWritePos - spillReadPos;
+}
+
+uint32_t timeshiftFilled()
+{
+  return ringFilled(timeshiftRing) + ringFilled(timeshiftStage) + spillFilled();
+}
+
+// Recording (or playing back a recording) rather than passing the stream straight through?
+bool timeshifting()
+{
+  return TIMESHIFT && (timeshiftPaused || timeshiftFilled() > 0);
+}
+
+void timeshiftSpillTask(void *parameter);
+
+void setupTimeshift()
+{
+  if (!TIMESHIFT)
+    return;
+
+  if (!psramFound() || !ringInit(timeshiftRing, timeshiftRingBytes))
+    ringInit(timeshiftRing, timeshiftSmallRingBytes);
+
+  if (TIMESHIFT_SPILL && ringInit(timeshiftStage, timeshiftStageBytes))
+  {
+    timeshiftSpill = LITTLEFS.open(timeshiftSpillFile, "w+");
+    spillAvailable = timeshiftSpill;
+  }
+  logInfo("Timeshift: %u byte ring%s%s", timeshiftRing.size, psramFound() ? " in PSRAM" : "",
+          spillAvailable ? ", spilling to LittleFS" : "");
+
+  if (spillAvailable)
+  {
+    timeshiftSpillMutex = xSemaphoreCreateMutex();
+
+    // Independent Task to move the recording to and from the spill file
+    xTaskCreatePinnedToCore(
+        timeshiftSpillTask,        /* Function to implement the task */
+        "TimeshiftSpill",          /* Name of the task */
+        3000,                      /* Stack size in words */
+        NULL,                      /* Task input parameter */
+        1,                         /* Priority of the task - must be higher than 0 (idle)*/
+        &timeshiftSpillTaskHandle, /* Task handle. */
+        0);                        /* Core where the task should run */
+  }
+}
+
+void wakeTimeshiftSpill()
+{
+  if (timeshiftSpillTaskHandle != NULL)
+    xTaskNotifyGive(timeshiftSpillTaskHandle);
+}
+
+// ===================== Spill task ======================
+// The spill file is used as a ring too, wrapping at timeshiftSpillBytes. When it is
+// full its oldest data is dropped.
+void spillWrite(const uint8_t *data, uint32_t len)
+{
+  int64_t writeStart = esp_timer_get_time();
+  if (spillFilled() + len > timeshiftSpillBytes)
+  {
+    uint32_t excess = spillFilled() + len - timeshiftSpillBytes;
+    spillReadPos += excess;
+    timeshiftDroppedBytes += excess;
+  }
+
+  spillBytesWritten += len;
+  while (len > 0)
+  {
+    uint32_t offset = spillWritePos % timeshiftSpillBytes;
+    uint32_t chunk = min(len, timeshiftSpillBytes - offset);
+    timeshiftSpill.seek(offset);
+    timeshiftSpill.write(data, chunk);
+    spillWritePos += chunk;
+    data += chunk;
+    len -= chunk;
+  }
+  uint32_t writeMicros = esp_timer_get_time() - writeStart;
+  spillWriteMicros += writeMicros;
+  spillWriteMaxMicros = max(spillWriteMaxMicros, writeMicros);
+}
+
+// The read position only moves on once the data is in the store ring, so the fetch task
+// never sees the recording as empty while some of it is on its way there
+uint32_t spillRead(uint8_t *data, uint32_t len)
+{
+  len = min(len, spillFilled());
+  uint32_t offset = spillReadPos % timeshiftSpillBytes;
+  len = min(len, timeshiftSpillBytes - offset);
+  timeshiftSpill.seek(offset);
+  return timeshiftSpill.read(data, len);
+}
+
+// Moves one chunk: from the file back into the store ring as room appears (oldest
+// first), otherwise from the staging ring - straight into the store ring while nothing
+// is waiting in the file, on to the file if something is. False once there is nothing to do.
+bool moveSpillChunk()
+{
+  static uint8_t chunk[512];
+
+  if (spillFilled() > 0 && ringFree(timeshiftRing) > 0)
+  {
+    uint32_t len = spillRead(chunk, min(ringFree(timeshiftRing), (uint32_t)sizeof(chunk)));
+    ringWrite(timeshiftRing, chunk, len);
+    spillReadPos += len;
+    return len > 0;
+  }
+
+  uint32_t len = ringRead(timeshiftStage, chunk, sizeof(chunk));
+  if (len == 0)
+    return false;
+  if (spillFilled() == 0 && ringFree(timeshiftRing) >= len)
+    ringWrite(timeshiftRing, chunk, len);
+  else
+    spillWrite(chunk, len);
+  return true;
+}
+
+void serviceTimeshiftSpill()
+{
+  bool moved = true;
+  while (moved)
+  {
+    xSemaphoreTake(timeshiftSpillMutex, portMAX_DELAY);
+    moved = moveSpillChunk();
+    xSemaphoreGive(timeshiftSpillMutex);
+  }
+}
+
+void timeshiftSpillTask(void *parameter)
+{
+  while (1)
+  {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeshiftSpillPollMS));
+    serviceTimeshiftSpill();
+  }
+}
+// =======================================================
+
+// Fetch task: record the active stream's audio (called with at most one network read's worth)
+void timeshiftWrite(const uint8_t *data, uint32_t len)
+{
+  // Full? Drop the oldest recording (the spill task drops from the file itself)
+  uint32_t capacity = timeshiftRing.size + (spillAvailable ? timeshiftSpillBytes : 0);
+  if (timeshiftFilled() + len > capacity)
+  {
+    uint32_t excess = timeshiftFilled() + len - capacity;
+    timeshiftDroppedBytes += ringSkip(timeshiftRing, excess);
+  }
+
+  if (!spillAvailable)
+  {
+    timeshiftDroppedBytes += len - ringWrite(timeshiftRing, data, len);
+    return;
+  }
+
+  // Spill task behind by more than the staging ring holds - the newest is lost
+  timeshiftDroppedBytes += len - ringWrite(timeshiftStage, data, len);
+  wakeTimeshiftSpill();
+}
+
+// Fetch task: throw the recording away. The spill task is held off for the moment (it
+// is between chunks), so its ends of the rings can be emptied from here too.
+void discardTimeshift()
+{
+  if (!spillAvailable)
+  {
+    ringReset(timeshiftRing);
+    return;
+  }
+  xSemaphoreTake(timeshiftSpillMutex, portMAX_DELAY);
+  ringReset(timeshiftRing);
+  ringReset(timeshiftStage);
+  spillReadPos = spillWritePos;
+  xSemaphoreGive(timeshiftSpillMutex);
+}
+
+// Called every time round the fetch task loop: top up the decoder's ring from the
+// recording, or throw the recording away when asked to go back to live
+void serviceTimeshift(spscRing &output)
+{
+  static uint8_t chunk[1024];
+
+  if (timeshiftLiveRequested)
+  {
+    // Decoder is stopped (and won't restart until the flag is cleared) so its ring can be emptied too
+    discardTimeshift();
+    ringReset(output);
+    timeshiftLiveRequested = false;
+    logInfo("Timeshift: back to live");
+    return;
+  }
+
+  if (timeshiftPaused)
+    return;
+
+  while (ringFilled(timeshiftRing) > 0 && ringFree(output) > 0)
+  {
+    uint32_t len = ringRead(timeshiftRing, chunk, min(ringFree(output), (uint32_t)sizeof(chunk)));
+    ringWrite(output, chunk, len);
+  }
+
+  // Room for the spill task to bring more back from the file
+  if (spillFilled() > 0)
+    wakeTimeshiftSpill();
+}
+
+// A new station - its recording starts from nothing
+void resetTimeshift()
+{
+  discardTimeshift();
+}
+
+// How far behind live we are (roughly - bitrate from the ICY headers), in seconds
+uint32_t timeshiftBehindSecs(uint32_t bitrateKbps, uint32_t decoderRingBytes)
+{
+  if (bitrateKbps == 0)
+    return 0;
+  return (timeshiftFilled() + decoderRingBytes) / (bitrateKbps * 125);
+}
+
+void reportTimeshift(uint32_t bitrateKbps, uint32_t decoderRingBytes)
+{
+  if (!TIMESHIFT || (!timeshifting() && spillBytesWritten == 0))
+    return;
+
+  logInfo("Timeshift %s %us behind live, recorded:%u (staged:%u spilled:%u) dropped:%u spill write:%lluKB/s (max %ums)",
+          timeshiftPaused ? "paused" : "playing", timeshiftBehindSecs(bitrateKbps, decoderRingBytes),
+          timeshiftFilled(), ringFilled(timeshiftStage), spillFilled(), timeshiftDroppedBytes,
+          spillWriteMicros ? ((uint64_t)spillBytesWritten * 1000) / spillWriteMicros : 0, spillWriteMaxMicros / 1000);
+}
@@ -0,0 +1,112 @@
+// Metadata events from the audio/fetch tasks to the UI (button handler) task
+// The audio_* callbacks run inside audio.loop() (holding xMutex) or on the fetch task,
+// so they must never draw on the display themselves. Instead they post an event and
+// the UI task does the drawing. Only the latest text of each kind matters, so a new
+// event replaces one of the same kind that hasn't been shown yet (coalesced) rather
+// than queueing behind it - the queue can't fill with stale titles.
+#include <Arduino.h>
+#include "main.h"
+
+enum uiEventType
+{
+  UI_STATION_NAME,
+  UI_TRACK_ARTIST,
+  UI_BITRATE,
+  UI_EVENT_TYPES
+};
+
+// Queue only carries the event type, the text is kept per type
+const uint8_t uiEventQueueLength = 8;
+QueueHandle_t uiEventQueue = NULL;
+
+portMUX_TYPE uiEventMux = portMUX_INITIALIZER_UNLOCKED;
+char uiEventText[UI_EVENT_TYPES][128];
+uint8_t uiEventsPending = 0; // Bit per type
+
+// Counters (cumulative since boot)
+volatile uint32_t uiEventsPosted = 0;
+volatile uint32_t uiEventsCoalesced = 0;
+volatile uint32_t uiEventsDropped = 0;
+
+void setupUiEvents()
+{
+  uiEventQueue = xQueueCreate(uiEventQueueLength, sizeof(uint8_t));
+}
+
+// Called from any task - never blocks
+void postUiEvent(uiEventType type, const char *text)
+{
+  uint8_t eventType = type;
+  uiEventsPosted++;
+
+  portENTER_CRITICAL(&uiEventMux);
+  strlcpy(uiEventText[type], text, sizeof(uiEventText[type]));
+  bool alreadyPending = uiEventsPending & (1 << type);
+  uiEventsPending |= (1 << type);
+  portEXIT_CRITICAL(&uiEventMux);
+
+  if (alreadyPending)
+  {
+    uiEventsCoalesced++;
+    return;
+  }
+
+  if (uiEventQueue == NULL || xQueueSend(uiEventQueue, &eventType, 0) != pdTRUE)
+  {
+    portENTER_CRITICAL(&uiEventMux);
+    uiEventsPending &= ~(1 << type);
+    portEXIT_CRITICAL(&uiEventMux);
+    uiEventsDropped++;
+  }
+}
+
+// Forget anything not yet shown (eg the old station's title after a channel change).
+// Queue first, then the pending bits: an event posted in between is dropped like the
+// rest, where the other way round could leave a pending bit with nothing queued for it
+// (and every later event of that type coalesced into it, never shown).
+void discardUiEvents()
+{
+  if (uiEventQueue != NULL)
+    xQueueReset(uiEventQueue);
+  portENTER_CRITICAL(&uiEventMux);
+  uiEventsPending = 0;
+  portEXIT_CRITICAL(&uiEventMux);
+}
+
+// Called by the UI task - waits up to waitTicks for an event, shows it. True if one was shown.
+bool processUiEvent(TickType_t waitTicks)
+{
+  uint8_t type;
+  if (uiEventQueue == NULL || xQueueReceive(uiEventQueue, &type, waitTicks) != pdTRUE)
+    return false;
+
+  static char text[128];
+  portENTER_CRITICAL(&uiEventMux);
+  bool pending = uiEventsPending & (1 << type);
+  uiEventsPending &= ~(1 << type);
+  strlcpy(text, uiEventText[type], sizeof(text));
+  portEXIT_CRITICAL(&uiEventMux);
+
+  // Discarded since it was posted
+  if (!pending)
+    return false;
+
+  switch (type)
+  {
+  case UI_STATION_NAME:
+    displayStationName((const char *)text);
+    break;
+  case UI_TRACK_ARTIST:
+    displayTrackArtist(text);
+    break;
+  case UI_BITRATE:
+    displayBitRate(text);
+    break;
+  }
+  return true;
+}
+
+void reportUiEvents()
+{
+  logInfo("UI events posted:%u coalesced:%u dropped:%u", uiEventsPosted, uiEventsCoalesced, uiEventsDropped);
+}
@@ -1,9 +1,48 @@
 #include <Arduino.h>
 #include "main.h"
 
+// Deferred (non-blocking) logging
+#include "asyncLog.h"
+
+// Network fetch stage of the audio pipeline
+#include "streamFetch.h"
+
+// Buffered audio in milliseconds, its trend and time to underrun
+#include "bufferHealth.h"
+
+// Reconnect a station that stalls while the buffer plays out
+#include "streamWatchdog.h"
+
+// HLS stations - playlist reloads, segment prefetch and variant selection
+#include "hlsClient.h"
+
 // Audio Tasks
 #include "AudioTask.h"
 
+// Local files (file:/path stations) - played from LittleFS with a frame seek index
+#include "localFile.h"
+
+// DSP (EQ, volume, limiter) applied to decoded audio
+#include "audioDsp.h"
+
+// Optional fixed I2S rate with clock drift compensation
+#include "resampler.h"
+
+// Crossfade between stations on a channel change
+#include "crossfade.h"
+
+// Button clicks and announcements mixed over the station
+#include "earcons.h"
+
+// Decode throughput benchmark over recordings on LittleFS (decode-benchmark build only)
+#include "decodeBenchmark.h"
+
+// CPU clock follows the decoding load
+#include "cpuGovernor.h"
+
+// Muted for a while - stop decoding, I2S and eventually the connection
+#include "powerSave.h"
+
 // Config stored in LITTLEFS
 #include "littleFSHelpers.h"
 
@@ -13,29 +52,43 @@
 // Programmed Radio stations
 #include "stations.h"
 
+// Audio pipeline counters and histograms
+#include "telemetry.h"
+
 // TFT Touch Screen routines
 #include "tftDisplay.h"
 
+// Spectrum analyser and VU meters fed from the decoded audio
+#include "spectrum.h"
+
+// Metadata events from the audio callbacks to the UI task
+#include "uiEvents.h"
+
 // Clock routines
 #include "clock.h"
 
 // Button Handler routines
 #include "buttonHandler.h"
 
+// Wake-up alarms and sleep timer
+#include "alarms.h"
+
 // Digital I2S I/O pins used by PCM5102
 #define I2S_DOUT 25 // DIN connection
 #define I2S_BCLK 27 // Bit clock
 #define I2S_LRC 26  // Left Right Clock
 // FLT, DMP, SCL and LOW pulled low
 
-int buffersample = 0;
-int buffervalue = 0;
-
 void setup()
 {
   Serial.begin(115200);
+  createLogFlushTask();
+
+  // EEPROM settings (eg: screen brightness, last station, latency profile)
+  preferences.begin("Radio", false);
 
   displaySetup();
+  setupUiEvents();
 
   // Connect to WiFi - no point continuing until connected
   do
@@ -53,20 +106,39 @@ void setup()
   // Start task to retrieve NTP time
   createDisplayClockTask();
 
-  // Start independent task to play audio
+  resetTelemetry();
+
+  // Buffer sizes and I2S DMA settings come from the latency profile
+  loadLatencyProfile();
+  applyI2SProfile();
+
+  // Start independent tasks to fetch (Core 0) and play (Core 1) audio
+  createStreamFetchTask();
   createAudioMusicTask();
+  createSpectrumTask();
 
+  // Volume is applied by our DSP (ramped, so no clicks), the library stays at full volume
   audio.setPinout(I2S_BCLK, I2S_LRC, I2S_DOUT);
-  audio.setVolume(currentVolume);
+  audio.setVolume(maxVolume);
+  setupDsp();
+  setDspVolume(currentVolume);
+  setupCrossfade();
+
+  // Benchmark build only - decode the recordings in /bench before playing anything
+  runDecodeBenchmark();
+  setupEarcons();
+  setupCpuGovernor();
 
   // Load list of Radio Stations
   loadRadioStations();
 
   // Load the last played station
   loadStation();
+  loadAlarms();
 
   // Allow audio task to run
   allowPlayAudio = true;
+  wakeAudioTask();
 
   // Start task to handle button presses
   createButtonHandlerTask();
@@ -75,7 +147,7 @@ void setup()
 // Main loop doesn't do anything
 void loop()
 {
-  Serial.println("Main loop");
+  logInfo("Main loop");
   delay(100);
   vTaskDelete(NULL);
 }
@@ -83,89 +155,120 @@ void loop()
 // Audio Callbacks
 void audio_info(const char *info)
 {
-  Serial.print("info        ");
-  Serial.println(info);
+  recordDecoderInfo(info);
+  logInfo("info        %s", info);
 }
 void audio_id3data(const char *info)
 { //id3 metadata
-  Serial.print("id3data     ");
-  Serial.println(info);
+  logInfo("id3data     %s", info);
 }
 void audio_eof_mp3(const char *info)
 { //end of file
-  Serial.print("eof_mp3     ");
-  Serial.println(info);
+  logInfo("eof_mp3     %s", info);
 }
 void audio_showstation(const char *info)
 {
-  Serial.print("station     ");
-  Serial.println(info);
-  displayStationName(info);
+  logInfo("station     %s", info);
+  postUiEvent(UI_STATION_NAME, info);
 }
 void audio_showstreaminfo(const char *info)
 {
-  Serial.print("streaminfo  ");
-  Serial.println(info);
+  logInfo("streaminfo  %s", info);
 }
 void audio_showstreamtitle(const char *info)
 {
-  Serial.print("streamtitle ");
-  Serial.println(info);
-  displayTrackArtist(info);
+  logInfo("streamtitle %s", info);
+  postUiEvent(UI_TRACK_ARTIST, info);
 }
 void audio_bitrate(const char *info)
 {
-  Serial.print("bitrate     ");
-  Serial.println(info);
-  displayBitRate(info);
+  logInfo("bitrate     %s", info);
+  postUiEvent(UI_BITRATE, info);
 }
 void audio_commercial(const char *info)
 { //duration in sec
-  Serial.print("commercial  ");
-  Serial.println(info);
+  logInfo("commercial  %s", info);
 }
 void audio_icyurl(const char *info)
 { //homepage
-  Serial.print("icyurl      ");
-  Serial.println(info);
+  logInfo("icyurl      %s", info);
 }
 void audio_lasthost(const char *info)
 { //stream URL played
-  Serial.print("lasthost    ");
-  Serial.println(info);
+  logInfo("lasthost    %s", info);
 }
 void audio_eof_speech(const char *info)
 {
-  Serial.print("eof_speech  ");
-  Serial.println(info);
+  logInfo("eof_speech  %s", info);
+}
+void audio_process_i2s(uint32_t *sample, bool *continueI2S)
+{ //each sample before it is written to I2S
+  if (decodeBenchmarkRunning)
+  {
+    benchmarkSample(sample);
+    *continueI2S = false;
+    return;
+  }
+
+  // Earcons being decoded into their cache at boot
+  if (earconDecoding)
+  {
+    earconCaptureSample(sample);
+    *continueI2S = false;
+    return;
+  }
+
+  decodedSamples++;
+  recordFirstSample();
+
+  // Outgoing station held back during a crossfade
+  if (!crossfadeSample(sample))
+  {
+    *continueI2S = false;
+    return;
+  }
+
+  // Earcon over the (ducked) station
+  mixEarcon(sample);
+
+  processDsp(sample);
+  spectrumTap(*sample);
+
+  // At a fixed output rate the resampler does the I2S writes
+  if (fixedOutputRate())
+  {
+    resampleSample(*sample);
+    *continueI2S = false;
+  }
+  else
+    *continueI2S = true;
 }
 
 void resetDisplayBuffer()
 {
-  buffersample = 0;
-  buffervalue = 0;
   displayBufferInactive();
 }
 
+// Buffer icon colour from the buffer health estimate - how many seconds are buffered
+// and whether they are running out, whatever the stream's bitrate
 void calculateDisplayBuffer()
 {
-  if (buffersample < 10)
-  {
-    buffervalue += audio.inBufferFilled();
-    //Serial.printf("buffersample[%d] = %d\n", buffersample, buffervalue);
-    buffersample++;
-  }
+  static unsigned long prevMillis = 0;
+  if (millis() - prevMillis < 500)
+    return;
+  prevMillis = millis();
+
+  bufferHealth snapshot;
+  getBufferHealth(snapshot);
+  if (!snapshot.valid)
+    return;
+
+  uint32_t redMS = min(bufferRedMS, (snapshot.capacityMS * bufferRedCapacityPercent) / 100);
+  uint32_t amberMS = min(bufferAmberMS, (snapshot.capacityMS * bufferAmberCapacityPercent) / 100);
+  if (snapshot.bufferedMS < redMS || snapshot.underrunMS < bufferRedUnderrunMS)
+    displayBufferRed();
+  else if (snapshot.bufferedMS < amberMS || snapshot.underrunMS < bufferAmberUnderrunMS)
+    displayBufferAmber();
   else
-  {
-    buffervalue = (buffervalue * 100) / 80000; // each buffer is 8000 bytes * 10 samples
-    //Serial.printf("Average buffer value = %d\n", buffervalue);
-    if (buffervalue >= 70)
-      displayBufferGreen();
-    else if (buffervalue >= 50)
-      displayBufferAmber();
-    else
-      displayBufferRed();
-    buffersample = 0;
-    buffervalue = 0;
-  }
+    displayBufferGreen();
 }
\ No newline at end of file
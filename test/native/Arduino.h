@@ -0,0 +1,274 @@
+// Host (native) stand-in for the Arduino-ESP32 core, just enough for the firmware
+// headers to build and run in the unit tests under test/
+// - millis()/micros() follow the real clock, tests can move them on with advanceMillis()
+// - tasks are never started, FreeRTOS locks and notifications do nothing
+// - Serial prints to stdout and reads what a test has queued with Serial.feed()
+#ifndef _NativeArduino_
+#define _NativeArduino_
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdarg>
+#include <cmath>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <strings.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+using std::max;
+using std::min;
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define F(x) x
+#define PROGMEM
+#define IRAM_ATTR
+#define RTC_DATA_ATTR
+#define PI 3.14159265f
+#define HALF_PI 1.5707963f
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+// Newer glibc (and the BSDs) have it already
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+inline size_t strlcpy(char *dst, const char *src, size_t size)
+{
+  size_t len = strlen(src);
+  if (size > 0)
+  {
+    size_t copy = min(len, size - 1);
+    memcpy(dst, src, copy);
+    dst[copy] = '\0';
+  }
+  return len;
+}
+#endif
+
+// Time
+inline int64_t nativeStartMicros = std::chrono::duration_cast<std::chrono::microseconds>(
+                                       std::chrono::steady_clock::now().time_since_epoch())
+                                       .count();
+inline int64_t nativeOffsetMicros = 0;
+
+inline int64_t esp_timer_get_time()
+{
+  int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count();
+  return now - nativeStartMicros + nativeOffsetMicros;
+}
+inline unsigned long micros() { return (unsigned long)esp_timer_get_time(); }
+inline unsigned long millis() { return (unsigned long)(esp_timer_get_time() / 1000); }
+inline void advanceMillis(unsigned long ms) { nativeOffsetMicros += (int64_t)ms * 1000; }
+inline void delay(unsigned long ms) { usleep(ms * 1000); }
+inline void yield() {}
+// Cycle counter of a 240MHz core
+inline uint32_t xthal_get_ccount()
+{
+  int64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  return (uint32_t)((nanos * 240) / 1000);
+}
+
+// FreeRTOS - the tests drive each task's functions directly from one thread
+typedef void *SemaphoreHandle_t;
+typedef void *TaskHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+#define portMAX_DELAY 0xffffffffu
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(x) ((TickType_t)(x))
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+struct portMUX_TYPE
+{
+  int owner;
+};
+#define portMUX_INITIALIZER_UNLOCKED {0}
+inline void portENTER_CRITICAL(portMUX_TYPE *) {}
+inline void portEXIT_CRITICAL(portMUX_TYPE *) {}
+inline SemaphoreHandle_t xSemaphoreCreateMutex() { return (SemaphoreHandle_t)1; }
+inline SemaphoreHandle_t xSemaphoreCreateBinary() { return (SemaphoreHandle_t)1; }
+inline int xSemaphoreTake(SemaphoreHandle_t, TickType_t) { return pdTRUE; }
+inline int xSemaphoreGive(SemaphoreHandle_t) { return pdTRUE; }
+inline BaseType_t xTaskCreatePinnedToCore(void (*)(void *), const char *, uint32_t, void *, UBaseType_t, TaskHandle_t *, BaseType_t) { return pdPASS; }
+inline void vTaskDelay(TickType_t) {}
+inline void vTaskDelete(TaskHandle_t) {}
+inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) { return 1000; }
+inline uint32_t ulTaskNotifyTake(BaseType_t, TickType_t) { return 0; }
+inline BaseType_t xTaskNotifyGive(TaskHandle_t) { return pdPASS; }
+inline TickType_t xTaskGetTickCount() { return millis(); }
+// Task the tick hooks see running, a test sets it (the idle tasks are 1 and 2)
+inline TaskHandle_t nativeRunningTask = NULL;
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return nativeRunningTask; }
+inline TaskHandle_t xTaskGetIdleTaskHandleForCPU(UBaseType_t cpu) { return (TaskHandle_t)(uintptr_t)(cpu + 1); }
+
+// Queues hold fixed size items in order, a full queue refuses (it never waits)
+struct nativeQueue
+{
+  std::deque<std::vector<uint8_t>> items;
+  UBaseType_t length;
+  UBaseType_t itemSize;
+};
+typedef nativeQueue *QueueHandle_t;
+inline QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) { return new nativeQueue{{}, length, itemSize}; }
+inline BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t)
+{
+  if (queue->items.size() >= queue->length)
+    return pdFALSE;
+  const uint8_t *bytes = (const uint8_t *)item;
+  queue->items.push_back(std::vector<uint8_t>(bytes, bytes + queue->itemSize));
+  return pdTRUE;
+}
+inline BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t)
+{
+  if (queue->items.empty())
+    return pdFALSE;
+  memcpy(item, queue->items.front().data(), queue->itemSize);
+  queue->items.pop_front();
+  return pdTRUE;
+}
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) { return queue->items.size(); }
+inline BaseType_t xQueueReset(QueueHandle_t queue)
+{
+  queue->items.clear();
+  return pdPASS;
+}
+inline BaseType_t xPortGetCoreID() { return 0; }
+
+// Heap - no PSRAM, like the board the radio is built for
+#define MALLOC_CAP_SPIRAM 1
+#define MALLOC_CAP_8BIT 2
+#define MALLOC_CAP_INTERNAL 4
+#define MALLOC_CAP_DEFAULT 8
+inline bool psramFound() { return false; }
+inline void *heap_caps_malloc(size_t size, uint32_t caps) { return (caps & MALLOC_CAP_SPIRAM) ? NULL : malloc(size); }
+inline size_t heap_caps_get_free_size(uint32_t) { return 160000; }
+inline size_t heap_caps_get_largest_free_block(uint32_t) { return 110000; }
+inline size_t heap_caps_get_minimum_free_size(uint32_t) { return 120000; }
+
+struct EspClass
+{
+  uint32_t getFreeHeap() { return heap_caps_get_free_size(MALLOC_CAP_8BIT); }
+  uint32_t getMinFreeHeap() { return heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT); }
+  uint32_t getCpuFreqMHz() { return 240; }
+  uint32_t getCycleCount() { return xthal_get_ccount(); }
+  uint32_t getFreePsram() { return 0; }
+  uint32_t getPsramSize() { return 0; }
+};
+inline EspClass ESP;
+
+inline uint32_t nativeCpuMhz = 240;
+inline uint32_t getCpuFrequencyMhz() { return nativeCpuMhz; }
+inline bool setCpuFrequencyMhz(uint32_t mhz)
+{
+  nativeCpuMhz = mhz;
+  return true;
+}
+
+// Print / Serial
+struct Print
+{
+  virtual ~Print() {}
+  virtual size_t write(const uint8_t *data, size_t len) { return fwrite(data, 1, len, stdout); }
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+  size_t print(long n) { return printf("%ld", n); }
+  size_t print(int n) { return printf("%d", n); }
+  size_t print(unsigned n) { return printf("%u", n); }
+  size_t print(unsigned long n) { return printf("%lu", n); }
+  size_t println(const char *s = "") { return print(s) + print("\n"); }
+  size_t println(int n) { return print(n) + print("\n"); }
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+  {
+    char text[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    return write((const uint8_t *)text, min((size_t)max(len, 0), sizeof(text) - 1));
+  }
+  void flush() { fflush(stdout); }
+  int availableForWrite() { return 128; }
+};
+
+struct HardwareSerial : Print
+{
+  std::deque<char> input;
+  void begin(unsigned long) {}
+  void feed(const char *text) { input.insert(input.end(), text, text + strlen(text)); }
+  int available() { return input.size(); }
+  int peek() { return input.empty() ? -1 : input.front(); }
+  int read()
+  {
+    if (input.empty())
+      return -1;
+    char c = input.front();
+    input.pop_front();
+    return c;
+  }
+  size_t readBytesUntil(char terminator, char *buffer, size_t length)
+  {
+    size_t len = 0;
+    while (len < length && !input.empty())
+    {
+      char c = read();
+      if (c == terminator)
+        break;
+      buffer[len++] = c;
+    }
+    return len;
+  }
+};
+inline HardwareSerial Serial;
+
+struct String
+{
+  std::string text;
+  String(const char *s = "") : text(s) {}
+  const char *c_str() const { return text.c_str(); }
+};
+
+struct IPAddress
+{
+  uint32_t address;
+  IPAddress() : address(0) {}
+  IPAddress(uint32_t ip) : address(ip) {}
+  operator uint32_t() const { return address; }
+  String toString() const
+  {
+    struct in_addr in;
+    in.s_addr = address;
+    return String(inet_ntoa(in));
+  }
+};
+
+// LEDC (backlight), time
+inline void ledcSetup(int, int, int) {}
+inline void ledcAttachPin(int, int) {}
+inline void ledcWrite(int, int) {}
+inline bool getLocalTime(struct tm *info, uint32_t = 5000)
+{
+  time_t now = time(NULL);
+  localtime_r(&now, info);
+  return true;
+}
+inline void configTime(long, int, const char *, const char * = nullptr, const char * = nullptr) {}
+
+#endif
@@ -0,0 +1,34 @@
+// Host stand-in for the part of ArduinoJson the station list uses. The tests set their
+// stations directly, so documents always come back empty.
+#pragma once
+#include "FS.h"
+
+struct DeserializationError
+{
+  operator bool() const { return true; }
+  const char *c_str() const { return "not on the host"; }
+};
+
+struct JsonVariant;
+struct JsonArray
+{
+  size_t size() const { return 0; }
+  JsonVariant getElement(size_t) const;
+};
+struct JsonVariant
+{
+  operator JsonArray() const { return JsonArray(); }
+  JsonVariant operator[](const char *) const { return JsonVariant(); }
+  template <class T>
+  T as() const { return (T) ""; }
+};
+inline JsonVariant JsonArray::getElement(size_t) const { return JsonVariant(); }
+
+template <size_t N>
+struct StaticJsonDocument
+{
+  JsonVariant operator[](const char *) { return JsonVariant(); }
+};
+
+template <class D, class S>
+DeserializationError deserializeJson(D &, S &) { return DeserializationError(); }
@@ -0,0 +1,47 @@
+// Host stand-in for the ESP32-audioI2S Audio class. Nothing is decoded: a test sets what
+// the decoder reports (sample rate, input fill) and feeds samples through
+// audio_process_i2s() itself.
+#pragma once
+#include "FS.h"
+
+class Audio
+{
+public:
+  bool running = false;
+  uint32_t sampleRate = 44100;
+  uint32_t filled = 0;
+  char path[32] = "";
+  uint32_t loops = 0;
+
+  bool connecttoFS(fs::FS &, const char *file)
+  {
+    strlcpy(path, file, sizeof(path));
+    running = true;
+    return true;
+  }
+  bool connecttohost(const char *) { return false; }
+  void loop() { loops++; }
+  void setPinout(int, int, int) {}
+  void setVolume(uint8_t) {}
+  uint32_t inBufferFilled() { return filled; }
+  uint32_t getSampleRate() { return running ? sampleRate : 0; }
+  bool isRunning() { return running; }
+  uint32_t stopSong()
+  {
+    running = false;
+    return 0;
+  }
+};
+
+void audio_info(const char *info);
+void audio_id3data(const char *info);
+void audio_eof_mp3(const char *info);
+void audio_showstation(const char *info);
+void audio_showstreaminfo(const char *info);
+void audio_showstreamtitle(const char *info);
+void audio_bitrate(const char *info);
+void audio_commercial(const char *info);
+void audio_icyurl(const char *info);
+void audio_lasthost(const char *info);
+void audio_eof_speech(const char *info);
+void audio_process_i2s(uint32_t *sample, bool *continueI2S);
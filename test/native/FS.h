@@ -0,0 +1,80 @@
+// Host stand-in for the FS library's File and FS wrappers
+#pragma once
+#include "FSImpl.h"
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+namespace fs
+{
+  class File : public Print
+  {
+  public:
+    File(FileImplPtr p = FileImplPtr()) : _p(p) {}
+    operator bool() const { return _p && *_p; }
+    size_t write(const uint8_t *buf, size_t size) { return _p ? _p->write(buf, size) : 0; }
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t read(uint8_t *buf, size_t size) { return _p ? _p->read(buf, size) : 0; }
+    int read()
+    {
+      uint8_t c;
+      return (read(&c, 1) == 1) ? c : -1;
+    }
+    int peek()
+    {
+      int c = read();
+      if (c >= 0)
+        seek(position() - 1);
+      return c;
+    }
+    int available() { return _p ? _p->size() - _p->position() : 0; }
+    size_t readBytes(char *buffer, size_t length) { return read((uint8_t *)buffer, length); }
+    size_t readBytesUntil(char terminator, char *buffer, size_t length)
+    {
+      size_t len = 0;
+      int c;
+      while (len < length && (c = read()) >= 0 && c != terminator)
+        buffer[len++] = c;
+      return len;
+    }
+    bool seek(uint32_t pos, SeekMode mode = SeekSet) { return _p && _p->seek(pos, mode); }
+    size_t position() const { return _p ? _p->position() : 0; }
+    size_t size() const { return _p ? _p->size() : 0; }
+    void flush()
+    {
+      if (_p)
+        _p->flush();
+    }
+    void close()
+    {
+      if (_p)
+        _p->close();
+      _p = FileImplPtr();
+    }
+    const char *name() const { return _p ? _p->name() : ""; }
+    bool isDirectory() { return _p && _p->isDirectory(); }
+    File openNextFile(const char *mode = FILE_READ) { return _p ? File(_p->openNextFile(mode)) : File(); }
+
+  private:
+    FileImplPtr _p;
+  };
+
+  class FS
+  {
+  public:
+    FS(FSImplPtr impl) : _impl(impl) {}
+    File open(const char *path, const char *mode = FILE_READ) { return File(_impl->open(path, mode)); }
+    bool exists(const char *path) { return _impl->exists(path); }
+    bool remove(const char *path) { return _impl->remove(path); }
+    bool rename(const char *pathFrom, const char *pathTo) { return _impl->rename(pathFrom, pathTo); }
+    bool mkdir(const char *path) { return _impl->mkdir(path); }
+    bool rmdir(const char *path) { return _impl->rmdir(path); }
+
+  protected:
+    FSImplPtr _impl;
+  };
+}
+
+using fs::File;
+using fs::FS;
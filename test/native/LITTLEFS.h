@@ -0,0 +1,86 @@
+// Host stand-in for LittleFS: files live in a scratch directory of the host's own
+#pragma once
+#include "FS.h"
+#include <sys/stat.h>
+
+class nativeFileImpl : public fs::FileImpl
+{
+public:
+  nativeFileImpl(FILE *file, const char *path) : _file(file) { strlcpy(_name, path, sizeof(_name)); }
+  ~nativeFileImpl() { close(); }
+  size_t write(const uint8_t *buf, size_t size) { return _file ? fwrite(buf, 1, size, _file) : 0; }
+  size_t read(uint8_t *buf, size_t size) { return _file ? fread(buf, 1, size, _file) : 0; }
+  void flush()
+  {
+    if (_file)
+      fflush(_file);
+  }
+  bool seek(uint32_t pos, SeekMode mode)
+  {
+    return _file && fseek(_file, pos, mode == SeekSet ? SEEK_SET : mode == SeekCur ? SEEK_CUR : SEEK_END) == 0;
+  }
+  size_t position() const { return _file ? ftell(_file) : 0; }
+  size_t size() const
+  {
+    if (!_file)
+      return 0;
+    struct stat info;
+    fflush(_file);
+    return (fstat(fileno(_file), &info) == 0) ? info.st_size : 0;
+  }
+  void close()
+  {
+    if (_file)
+      fclose(_file);
+    _file = NULL;
+  }
+  time_t getLastWrite() { return 0; }
+  const char *name() const { return _name; }
+  bool isDirectory(void) { return false; }
+  fs::FileImplPtr openNextFile(const char *mode) { return fs::FileImplPtr(); }
+  void rewindDirectory(void) {}
+  operator bool() { return _file != NULL; }
+
+private:
+  FILE *_file;
+  char _name[64];
+};
+
+class nativeFSImpl : public fs::FSImpl
+{
+public:
+  std::string root;
+
+  std::string hostPath(const char *path) { return root + path; }
+  fs::FileImplPtr open(const char *path, const char *mode)
+  {
+    // LittleFS creates the directories in a path as it goes
+    std::string full = hostPath(path);
+    for (size_t slash = full.find('/', root.size() + 1); slash != std::string::npos; slash = full.find('/', slash + 1))
+      ::mkdir(full.substr(0, slash).c_str(), 0755);
+
+    const char *hostMode = mode[0] == 'w' ? "w+b" : mode[0] == 'a' ? "a+b" : mode[1] == '+' ? "r+b" : "rb";
+    FILE *file = fopen(full.c_str(), hostMode);
+    return file ? std::make_shared<nativeFileImpl>(file, path) : fs::FileImplPtr();
+  }
+  bool exists(const char *path) { return access(hostPath(path).c_str(), F_OK) == 0; }
+  bool rename(const char *pathFrom, const char *pathTo) { return ::rename(hostPath(pathFrom).c_str(), hostPath(pathTo).c_str()) == 0; }
+  bool remove(const char *path) { return ::remove(hostPath(path).c_str()) == 0; }
+  bool mkdir(const char *path) { return ::mkdir(hostPath(path).c_str(), 0755) == 0; }
+  bool rmdir(const char *path) { return ::rmdir(hostPath(path).c_str()) == 0; }
+};
+
+class LITTLEFSFS : public fs::FS
+{
+public:
+  LITTLEFSFS() : fs::FS(std::make_shared<nativeFSImpl>()) {}
+  bool begin(bool = false)
+  {
+    char root[] = "/tmp/radio-littlefs-XXXXXX";
+    ((nativeFSImpl *)_impl.get())->root = mkdtemp(root);
+    return true;
+  }
+  size_t totalBytes() { return 1441792; }
+  size_t usedBytes() { return 0; }
+};
+inline LITTLEFSFS LITTLEFS;
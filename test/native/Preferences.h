@@ -0,0 +1,83 @@
+// Host stand-in for Preferences (NVS): kept in memory for the life of the test program
+#pragma once
+#include "Arduino.h"
+#include <map>
+
+inline std::map<std::string, std::vector<uint8_t>> nativePreferences;
+
+class Preferences
+{
+public:
+  bool begin(const char *name, bool = false)
+  {
+    space = name;
+    return true;
+  }
+  void end() {}
+  bool clear()
+  {
+    for (auto entry = nativePreferences.begin(); entry != nativePreferences.end();)
+      entry = (entry->first.compare(0, space.size() + 1, space + "/") == 0) ? nativePreferences.erase(entry) : std::next(entry);
+    return true;
+  }
+  bool remove(const char *key) { return nativePreferences.erase(keyName(key)) > 0; }
+  bool isKey(const char *key) { return nativePreferences.count(keyName(key)) > 0; }
+
+  size_t putBytes(const char *key, const void *value, size_t len)
+  {
+    const uint8_t *bytes = (const uint8_t *)value;
+    nativePreferences[keyName(key)] = std::vector<uint8_t>(bytes, bytes + len);
+    return len;
+  }
+  size_t getBytesLength(const char *key)
+  {
+    auto entry = nativePreferences.find(keyName(key));
+    return (entry != nativePreferences.end()) ? entry->second.size() : 0;
+  }
+  size_t getBytes(const char *key, void *buffer, size_t maxLen)
+  {
+    auto entry = nativePreferences.find(keyName(key));
+    if (entry == nativePreferences.end() || entry->second.size() > maxLen)
+      return 0;
+    memcpy(buffer, entry->second.data(), entry->second.size());
+    return entry->second.size();
+  }
+
+  size_t putChar(const char *key, int8_t value) { return putValue(key, value); }
+  size_t putUChar(const char *key, uint8_t value) { return putValue(key, value); }
+  size_t putShort(const char *key, int16_t value) { return putValue(key, value); }
+  size_t putUShort(const char *key, uint16_t value) { return putValue(key, value); }
+  size_t putInt(const char *key, int32_t value) { return putValue(key, value); }
+  size_t putUInt(const char *key, uint32_t value) { return putValue(key, value); }
+  size_t putBool(const char *key, bool value) { return putValue(key, (uint8_t)value); }
+  int8_t getChar(const char *key, int8_t value = 0) { return getValue(key, value); }
+  uint8_t getUChar(const char *key, uint8_t value = 0) { return getValue(key, value); }
+  int16_t getShort(const char *key, int16_t value = 0) { return getValue(key, value); }
+  uint16_t getUShort(const char *key, uint16_t value = 0) { return getValue(key, value); }
+  int32_t getInt(const char *key, int32_t value = 0) { return getValue(key, value); }
+  uint32_t getUInt(const char *key, uint32_t value = 0) { return getValue(key, value); }
+  bool getBool(const char *key, bool value = false) { return getValue(key, (uint8_t)value); }
+
+  size_t putString(const char *key, const char *value) { return putBytes(key, value, strlen(value) + 1); }
+  size_t getString(const char *key, char *value, size_t maxLen)
+  {
+    size_t len = getBytes(key, value, maxLen);
+    if (len == 0 && maxLen > 0)
+      value[0] = '\0';
+    return len;
+  }
+
+private:
+  std::string space;
+
+  std::string keyName(const char *key) { return space + "/" + key; }
+
+  template <class T>
+  size_t putValue(const char *key, T value) { return putBytes(key, &value, sizeof(value)); }
+  template <class T>
+  T getValue(const char *key, T value)
+  {
+    getBytes(key, &value, sizeof(value));
+    return value;
+  }
+};
@@ -0,0 +1,69 @@
+// Host stand-in for TFT_eSPI: nothing is drawn, drawing calls are counted
+#pragma once
+#include "Arduino.h"
+
+struct GFXfont
+{
+  int unused;
+};
+inline GFXfont FreeSansOblique12pt7b, FreeSans9pt7b, FreeSansBold18pt7b, FreeSerifBold24pt7b, FreeSansBold12pt7b;
+
+#define TFT_BLACK 0x0000
+#define TFT_WHITE 0xFFFF
+#define TFT_YELLOW 0xFFE0
+#define TFT_GREEN 0x07E0
+#define TFT_RED 0xF800
+#define TFT_ORANGE 0xFDA0
+#define TFT_MAGENTA 0xF81F
+#define TFT_LIGHTGREY 0xD69A
+#define TFT_DARKGREY 0x7BEF
+#define TFT_CYAN 0x07FF
+#define TFT_BLUE 0x001F
+#define TFT_DARKGREEN 0x03E0
+
+class TFT_eSPI : public Print
+{
+public:
+  uint32_t fillRectCalls = 0;
+
+  size_t write(const uint8_t *, size_t len) { return len; }
+  void init() {}
+  void setRotation(int) {}
+  void fillScreen(uint32_t) {}
+  void fillRect(int, int, int, int, uint32_t) { fillRectCalls++; }
+  void drawRect(int, int, int, int, uint32_t) {}
+  void drawFastVLine(int, int, int, uint32_t) {}
+  void drawFastHLine(int, int, int, uint32_t) {}
+  void setCursor(int, int) {}
+  void setTextFont(int) {}
+  void setTextSize(int) {}
+  void setTextColor(uint32_t) {}
+  void setTextColor(uint32_t, uint32_t) {}
+  void setFreeFont(const GFXfont *) {}
+  void calibrateTouch(uint16_t *, uint32_t, uint32_t, int) {}
+  void setTouch(uint16_t *) {}
+  bool getTouch(uint16_t *, uint16_t *) { return false; }
+  int width() { return 320; }
+  int height() { return 240; }
+  bool getSwapBytes() { return false; }
+  void setSwapBytes(bool) {}
+  void pushImage(int, int, int, int, uint16_t *) {}
+};
+
+class TFT_eSPI_Button
+{
+public:
+  void initButtonUL(TFT_eSPI *, int16_t x, int16_t y, uint16_t w, uint16_t h, uint16_t, uint16_t, uint16_t, char *, uint8_t)
+  {
+    _x = x;
+    _y = y;
+    _w = w;
+    _h = h;
+  }
+  void drawButton(bool = false, String = "") {}
+  bool contains(int16_t x, int16_t y) { return x >= _x && x < _x + _w && y >= _y && y < _y + _h; }
+
+private:
+  int16_t _x = 0, _y = 0;
+  uint16_t _w = 0, _h = 0;
+};
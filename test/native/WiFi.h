@@ -0,0 +1,90 @@
+// Host stand-in for the WiFi library: always connected, and WiFiClient is a real
+// (non-blocking) socket so tests can point the fetch stage at servers on localhost
+#pragma once
+#include "Arduino.h"
+#include <memory>
+
+typedef enum
+{
+  WL_NO_SHIELD = 255,
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL,
+  WL_SCAN_COMPLETED,
+  WL_CONNECTED,
+  WL_CONNECT_FAILED,
+  WL_CONNECTION_LOST,
+  WL_DISCONNECTED
+} wl_status_t;
+#define WIFI_STA 1
+
+// As on the board, copies of a client share its socket, which closes with the last one
+struct nativeSocket
+{
+  int fd;
+  nativeSocket(int socketFd) : fd(socketFd) {}
+  ~nativeSocket() { close(fd); }
+};
+
+class WiFiClient : public Print
+{
+public:
+  WiFiClient() {}
+  WiFiClient(int fd) : socket(std::make_shared<nativeSocket>(fd)) {}
+  virtual ~WiFiClient() {}
+
+  virtual int available()
+  {
+    if (!socket)
+      return 0;
+    uint8_t buffer[4096];
+    int len = recv(socket->fd, buffer, sizeof(buffer), MSG_PEEK | MSG_DONTWAIT);
+    return max(len, 0);
+  }
+  virtual int read(uint8_t *buffer, size_t size)
+  {
+    if (!socket)
+      return -1;
+    int len = recv(socket->fd, buffer, size, MSG_DONTWAIT);
+    return (len > 0) ? len : -1;
+  }
+  int read()
+  {
+    uint8_t c;
+    return (read(&c, 1) == 1) ? c : -1;
+  }
+  virtual size_t write(const uint8_t *data, size_t size)
+  {
+    if (!socket)
+      return 0;
+    int len = send(socket->fd, data, size, MSG_NOSIGNAL);
+    return max(len, 0);
+  }
+  virtual uint8_t connected()
+  {
+    if (!socket)
+      return 0;
+    uint8_t c;
+    int len = recv(socket->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return len > 0 || (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+  }
+  virtual void stop() { socket.reset(); }
+  int fd() const { return socket ? socket->fd : -1; }
+  operator bool() { return connected(); }
+
+protected:
+  std::shared_ptr<nativeSocket> socket;
+};
+
+struct WiFiClass
+{
+  wl_status_t status() { return WL_CONNECTED; }
+  void disconnect(bool = false, bool = false) {}
+  void mode(int) {}
+  void persistent(bool) {}
+  void setSleep(bool) {}
+  void begin(const char *, const char *) {}
+  uint8_t waitForConnectResult() { return WL_CONNECTED; }
+  IPAddress localIP() { return IPAddress(0x0100007f); }
+  int RSSI() { return -50; }
+};
+inline WiFiClass WiFi;
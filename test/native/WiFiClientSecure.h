@@ -0,0 +1,11 @@
+// Host stand-in for WiFiClientSecure - there is no TLS on the host, connects fail
+#pragma once
+#include "WiFi.h"
+
+class WiFiClientSecure : public WiFiClient
+{
+public:
+  void setInsecure() {}
+  void setHandshakeTimeout(unsigned long) {}
+  int connect(IPAddress, uint16_t, const char *, const char *, const char *, const char *) { return 0; }
+};
@@ -0,0 +1,2 @@
+// Some of the firmware includes the core in lower case (fine on the board's file system)
+#include "Arduino.h"
@@ -0,0 +1,101 @@
+// Host stand-in for the legacy I2S driver - writes are counted and always fit (unless a
+// test stalls them), the event queue is filled by the test
+#pragma once
+#include "../Arduino.h"
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_ERR_TIMEOUT 0x107
+typedef enum
+{
+  I2S_NUM_0 = 0,
+  I2S_NUM_1
+} i2s_port_t;
+typedef enum
+{
+  I2S_MODE_MASTER = 1,
+  I2S_MODE_TX = 4
+} i2s_mode_t;
+typedef enum
+{
+  I2S_BITS_PER_SAMPLE_16BIT = 16
+} i2s_bits_per_sample_t;
+typedef enum
+{
+  I2S_CHANNEL_FMT_RIGHT_LEFT = 0
+} i2s_channel_fmt_t;
+typedef enum
+{
+  I2S_CHANNEL_MONO = 1,
+  I2S_CHANNEL_STEREO = 2
+} i2s_channel_t;
+typedef enum
+{
+  I2S_COMM_FORMAT_I2S = 1,
+  I2S_COMM_FORMAT_I2S_MSB = 2
+} i2s_comm_format_t;
+#define ESP_INTR_FLAG_LEVEL1 2
+typedef enum
+{
+  I2S_EVENT_DMA_ERROR,
+  I2S_EVENT_TX_DONE,
+  I2S_EVENT_RX_DONE,
+  I2S_EVENT_TX_Q_OVF,
+  I2S_EVENT_RX_Q_OVF
+} i2s_event_type_t;
+typedef struct
+{
+  i2s_event_type_t type;
+  size_t size;
+} i2s_event_t;
+
+typedef struct
+{
+  i2s_mode_t mode;
+  int sample_rate;
+  i2s_bits_per_sample_t bits_per_sample;
+  i2s_channel_fmt_t channel_format;
+  i2s_comm_format_t communication_format;
+  int intr_alloc_flags;
+  int dma_buf_count;
+  int dma_buf_len;
+  bool use_apll;
+  bool tx_desc_auto_clear;
+  int fixed_mclk;
+} i2s_config_t;
+
+inline uint64_t nativeI2sBytes = 0;
+inline uint32_t nativeI2sSampleRate = 44100;
+inline TickType_t nativeI2sLastTimeout = 0;
+inline bool nativeI2sStalled = false; // DMA queue full: writes time out
+
+inline QueueHandle_t nativeI2sEvents = NULL;
+
+inline esp_err_t i2s_driver_install(i2s_port_t, const i2s_config_t *config, int queueLength, void *queue)
+{
+  nativeI2sSampleRate = config->sample_rate;
+  if (queueLength > 0 && queue != NULL)
+    *(QueueHandle_t *)queue = nativeI2sEvents = xQueueCreate(queueLength, sizeof(i2s_event_t));
+  return ESP_OK;
+}
+inline esp_err_t i2s_driver_uninstall(i2s_port_t) { return ESP_OK; }
+inline esp_err_t i2s_set_clk(i2s_port_t, uint32_t rate, i2s_bits_per_sample_t, i2s_channel_t)
+{
+  nativeI2sSampleRate = rate;
+  return ESP_OK;
+}
+inline esp_err_t i2s_set_sample_rates(i2s_port_t, uint32_t rate)
+{
+  nativeI2sSampleRate = rate;
+  return ESP_OK;
+}
+inline esp_err_t i2s_write(i2s_port_t, const void *, size_t size, size_t *written, TickType_t timeout)
+{
+  nativeI2sLastTimeout = timeout;
+  *written = nativeI2sStalled ? 0 : size;
+  nativeI2sBytes += *written;
+  return nativeI2sStalled ? ESP_ERR_TIMEOUT : ESP_OK;
+}
+inline esp_err_t i2s_zero_dma_buffer(i2s_port_t) { return ESP_OK; }
+inline esp_err_t i2s_stop(i2s_port_t) { return ESP_OK; }
+inline esp_err_t i2s_start(i2s_port_t) { return ESP_OK; }
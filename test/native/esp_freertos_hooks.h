@@ -0,0 +1,26 @@
+// Host stand-in for esp_freertos_hooks.h - a test can run the idle and tick hooks itself
+#pragma once
+#include "Arduino.h"
+
+typedef bool (*esp_freertos_idle_cb_t)();
+inline esp_freertos_idle_cb_t nativeIdleHooks[2] = {NULL, NULL};
+
+inline int esp_register_freertos_idle_hook_for_cpu(esp_freertos_idle_cb_t hook, unsigned cpu)
+{
+  nativeIdleHooks[cpu & 1] = hook;
+  return 0;
+}
+inline void esp_deregister_freertos_idle_hook_for_cpu(esp_freertos_idle_cb_t hook, unsigned cpu)
+{
+  if (nativeIdleHooks[cpu & 1] == hook)
+    nativeIdleHooks[cpu & 1] = NULL;
+}
+
+typedef void (*esp_freertos_tick_cb_t)();
+inline esp_freertos_tick_cb_t nativeTickHooks[2] = {NULL, NULL};
+
+inline int esp_register_freertos_tick_hook_for_cpu(esp_freertos_tick_cb_t hook, unsigned cpu)
+{
+  nativeTickHooks[cpu & 1] = hook;
+  return 0;
+}
@@ -0,0 +1,4 @@
+// The whole firmware as one translation unit, the way src/main.cpp is built for the board.
+// Tests that drive several modules together include this rather than single headers
+// (setup() and loop() are never called, each test calls what it needs).
+#include "../../src/main.cpp"
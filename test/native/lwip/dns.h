@@ -0,0 +1,84 @@
+// Host stand-in for lwIP's resolver: numeric addresses answer straight away, names come
+// from a table the test fills in. Answers are given straight away (as for names lwIP has
+// cached) or, with nativeDnsAsync set, through the callback when the test calls
+// nativeDnsDeliver(). Names not in the table fail.
+#pragma once
+#include "../Arduino.h"
+#include <map>
+
+typedef int err_t;
+#define ERR_OK 0
+#define ERR_INPROGRESS -5
+#define ERR_ARG -16
+#define IPADDR_TYPE_V4 0
+
+struct ip4_addr_t
+{
+  uint32_t addr;
+};
+struct ip_addr_t
+{
+  struct
+  {
+    ip4_addr_t ip4;
+  } u_addr;
+  uint8_t type;
+};
+typedef void (*dns_found_callback)(const char *name, const ip_addr_t *ipaddr, void *callback_arg);
+
+struct nativeDnsQuery
+{
+  std::string host;
+  dns_found_callback found;
+  void *arg;
+};
+
+inline std::map<std::string, uint32_t> nativeDnsTable;
+inline std::vector<nativeDnsQuery> nativeDnsPending;
+inline bool nativeDnsAsync = false;
+inline uint32_t nativeDnsQueries = 0; // Names looked up (numeric addresses aren't)
+
+inline void nativeDnsSet(const char *host, const char *ip)
+{
+  struct in_addr address;
+  inet_aton(ip, &address);
+  nativeDnsTable[host] = address.s_addr;
+}
+
+inline err_t dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback found, void *callback_arg)
+{
+  struct in_addr numeric;
+  if (inet_aton(hostname, &numeric))
+  {
+    addr->u_addr.ip4.addr = numeric.s_addr;
+    return ERR_OK;
+  }
+
+  nativeDnsQueries++;
+  if (!nativeDnsAsync)
+  {
+    auto entry = nativeDnsTable.find(hostname);
+    if (entry == nativeDnsTable.end())
+      return ERR_ARG;
+    addr->u_addr.ip4.addr = entry->second;
+    return ERR_OK;
+  }
+  nativeDnsPending.push_back({hostname, found, callback_arg});
+  return ERR_INPROGRESS;
+}
+
+// Answer the lookups in progress from the table
+inline void nativeDnsDeliver()
+{
+  std::vector<nativeDnsQuery> queries;
+  queries.swap(nativeDnsPending);
+  for (nativeDnsQuery &query : queries)
+  {
+    auto entry = nativeDnsTable.find(query.host);
+    ip_addr_t address;
+    address.type = IPADDR_TYPE_V4;
+    if (entry != nativeDnsTable.end())
+      address.u_addr.ip4.addr = entry->second;
+    query.found(query.host.c_str(), entry != nativeDnsTable.end() ? &address : NULL, query.arg);
+  }
+}
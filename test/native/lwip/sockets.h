@@ -0,0 +1,3 @@
+// Host stand-in for lwip/sockets.h - lwIP's socket API is the POSIX one
+#pragma once
+#include "../Arduino.h"
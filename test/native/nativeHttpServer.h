@@ -0,0 +1,153 @@
+// Canned HTTP server on localhost for the tests that drive the fetch stage against real
+// sockets. Each path has a fixed response: optionally delayed, then the head and body,
+// then (for live streams) a paced run of audio-like bytes. The connection is held open
+// until the body is done, or until stop() for a live stream.
+#pragma once
+#include "Arduino.h"
+#include <map>
+#include <mutex>
+#include <thread>
+#include <poll.h>
+
+struct nativeHttpRoute
+{
+  std::string head = "HTTP/1.0 200 OK\r\n\r\n";
+  std::string body;
+  uint32_t delayMS = 0;       // Before anything is sent (time to first byte)
+  uint32_t streamBytes = 0;   // Live stream: this many bytes after the body...
+  uint32_t bytesPerSec = 16000; // ...at this rate, then held open
+  uint8_t streamByte = 0xAA;  // ...all this value, so tests can tell servers apart
+};
+
+class nativeHttpServer
+{
+public:
+  uint16_t port = 0;
+  std::atomic<int> requests{0};
+
+  ~nativeHttpServer() { stop(); }
+
+  void route(const std::string &path, const nativeHttpRoute &response)
+  {
+    std::lock_guard<std::mutex> lock(routesMutex);
+    routes[path] = response;
+  }
+
+  std::string url(const std::string &path) const
+  {
+    return "http://127.0.0.1:" + std::to_string(port) + path;
+  }
+
+  void start()
+  {
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listenFd, (struct sockaddr *)&address, sizeof(address));
+    socklen_t len = sizeof(address);
+    getsockname(listenFd, (struct sockaddr *)&address, &len);
+    port = ntohs(address.sin_port);
+    listen(listenFd, 8);
+    stopping = false;
+    acceptThread = std::thread([this]()
+                               { acceptLoop(); });
+  }
+
+  void stop()
+  {
+    if (listenFd < 0)
+      return;
+    stopping = true;
+    acceptThread.join();
+    for (std::thread &connection : connections)
+      connection.join();
+    connections.clear();
+    close(listenFd);
+    listenFd = -1;
+  }
+
+private:
+  int listenFd = -1;
+  std::atomic<bool> stopping{false};
+  std::thread acceptThread;
+  std::vector<std::thread> connections;
+  std::mutex routesMutex;
+  std::map<std::string, nativeHttpRoute> routes;
+
+  void acceptLoop()
+  {
+    while (!stopping)
+    {
+      struct pollfd waiting = {listenFd, POLLIN, 0};
+      if (poll(&waiting, 1, 20) <= 0)
+        continue;
+      int fd = accept(listenFd, NULL, NULL);
+      if (fd >= 0)
+        connections.emplace_back([this, fd]()
+                                 { serve(fd); });
+    }
+  }
+
+  bool sendAll(int fd, const std::string &data)
+  {
+    size_t sent = 0;
+    while (sent < data.size() && !stopping)
+    {
+      int len = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (len <= 0)
+        return false;
+      sent += len;
+    }
+    return true;
+  }
+
+  void serve(int fd)
+  {
+    // Request line and headers, only the path matters
+    std::string request;
+    char buffer[512];
+    while (request.find("\r\n\r\n") == std::string::npos && !stopping)
+    {
+      struct pollfd waiting = {fd, POLLIN, 0};
+      if (poll(&waiting, 1, 20) <= 0)
+        continue;
+      int len = recv(fd, buffer, sizeof(buffer), 0);
+      if (len <= 0)
+        break;
+      request.append(buffer, len);
+    }
+    requests++;
+
+    size_t pathStart = request.find(' ') + 1;
+    std::string path = request.substr(pathStart, request.find(' ', pathStart) - pathStart);
+    nativeHttpRoute response;
+    {
+      std::lock_guard<std::mutex> lock(routesMutex);
+      if (routes.count(path))
+        response = routes[path];
+      else
+        response.head = "HTTP/1.0 404 Not Found\r\n\r\n";
+    }
+
+    for (uint32_t waited = 0; waited < response.delayMS && !stopping; waited += 5)
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+    if (sendAll(fd, response.head + response.body) && response.streamBytes > 0)
+    {
+      // 20ms worth at a time
+      uint32_t chunk = max(response.bytesPerSec / 50, (uint32_t)1);
+      for (uint32_t sent = 0; sent < response.streamBytes && !stopping; sent += chunk)
+      {
+        if (!sendAll(fd, std::string(min(chunk, response.streamBytes - sent), (char)response.streamByte)))
+          break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      }
+      while (!stopping)
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    close(fd);
+  }
+};
@@ -0,0 +1,152 @@
+// DSP (audioDsp.h): EQ, volume ramp and limiter on generated tones, plus the cost per
+// sample on the host
+#include "firmware.h"
+#include <unity.h>
+
+const uint32_t testRate = 44100;
+
+uint32_t stereo(int16_t left, int16_t right)
+{
+  return ((uint32_t)(uint16_t)left << 16) | (uint16_t)right;
+}
+
+// Peak of the left channel for a sine through the DSP, after the filters have settled
+int32_t sinePeak(float frequency, int16_t amplitude)
+{
+  int32_t peak = 0;
+  for (uint32_t i = 0; i < testRate / 2; i++)
+  {
+    uint32_t sample = stereo(amplitude * sinf(2 * PI * frequency * i / testRate), 0);
+    processDsp(&sample);
+    if (i > testRate / 4)
+      peak = max(peak, (int32_t)abs((int16_t)(sample >> 16)));
+  }
+  return peak;
+}
+
+// Full volume, flat EQ, ramp finished
+void setUp()
+{
+  for (uint8_t band = 0; band < EQ_BANDS; band++)
+    setEqBand(band, 0);
+  setupDsp();
+  setDspSampleRate(testRate);
+  setDspVolume(maxVolume);
+  uint32_t sample = 0;
+  for (uint32_t i = 0; i < testRate; i++)
+    processDsp(&sample);
+}
+void tearDown() {}
+
+void test_flat_eq_full_volume_is_transparent()
+{
+  for (int32_t level = -20000; level <= 20000; level += 2500)
+  {
+    uint32_t sample = stereo(level, -level);
+    processDsp(&sample);
+    TEST_ASSERT_EQUAL(stereo(level, -level), sample);
+  }
+}
+
+// Volume changes ramp (no step bigger than the ramp allows) and reach silence in time
+void test_volume_ramps_without_steps()
+{
+  setDspVolume(0);
+  int32_t previous = 16000;
+  uint32_t samples = 0;
+  while (previous > 0 && samples < testRate)
+  {
+    uint32_t sample = stereo(16000, 16000);
+    processDsp(&sample);
+    int32_t level = (int16_t)(sample >> 16);
+    TEST_ASSERT_LESS_OR_EQUAL(previous, level);
+    TEST_ASSERT_LESS_THAN(200, previous - level);
+    previous = level;
+    samples++;
+  }
+  TEST_ASSERT_EQUAL(0, previous);
+  TEST_ASSERT_LESS_OR_EQUAL(testRate * volumeRampMS / 1000 + 1, samples);
+}
+
+// A band boost shows at its frequency and not far from it
+void test_bass_boost()
+{
+  setEqBand(EQ_BASS, 12);
+  setDspSampleRate(testRate);
+  TEST_ASSERT_EQUAL(12, preferences.getChar("eqBass", 0));
+
+  float lowGainDB = 20 * log10f(sinePeak(40, 2000) / 2000.0);
+  float highGainDB = 20 * log10f(sinePeak(6000, 2000) / 2000.0);
+  TEST_ASSERT_FLOAT_WITHIN(1.0, 12.0, lowGainDB);
+  TEST_ASSERT_FLOAT_WITHIN(1.0, 0.0, highGainDB);
+}
+
+void test_eq_gain_is_limited()
+{
+  setEqBand(EQ_TREBLE, 40);
+  TEST_ASSERT_EQUAL(maxEqDB, eqGainDB[EQ_TREBLE]);
+}
+
+// 'q' on the serial console sets a band
+void test_eq_serial_command()
+{
+  Serial.feed("qm-6\n");
+  serviceTelemetry();
+  TEST_ASSERT_EQUAL(-6, eqGainDB[EQ_MID]);
+  TEST_ASSERT_EQUAL(-6, preferences.getChar("eqMid", 0));
+
+  Serial.feed("qx3\n");
+  serviceTelemetry();
+  TEST_ASSERT_EQUAL(-6, eqGainDB[EQ_MID]);
+}
+
+// Full scale with a boost is held near the limiter threshold, not clipped
+void test_limiter_holds_peaks()
+{
+  setEqBand(EQ_BASS, 12);
+  setDspSampleRate(testRate);
+  int32_t peak = sinePeak(60, 20000);
+  TEST_ASSERT_LESS_OR_EQUAL(limiterThreshold + 100, peak);
+  TEST_ASSERT_GREATER_THAN(limiterThreshold - 3000, peak);
+}
+
+// Every band active plus the volume ramp and limiter - the worst case per sample, timed on
+// the host. This says nothing about the ESP32's cycles per sample: that figure comes from
+// reportDspLoad() in the audio task's log on the board.
+void test_dsp_cost_per_sample()
+{
+  setEqBand(EQ_BASS, 6);
+  setEqBand(EQ_MID, -3);
+  setEqBand(EQ_TREBLE, 4);
+  setDspSampleRate(testRate);
+
+  const uint32_t samples = 2000000;
+  int64_t start = esp_timer_get_time();
+  uint32_t sample = 0;
+  for (uint32_t i = 0; i < samples; i++)
+  {
+    sample = stereo(i * 37, i * 53);
+    processDsp(&sample);
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  char result[96];
+  snprintf(result, sizeof(result), "DSP: %.1fns/sample on the host", elapsed * 1000.0 / samples);
+  TEST_MESSAGE(result);
+
+  // Well inside one sample period at 44.1kHz (22.7us)
+  TEST_ASSERT_LESS_THAN(2000, elapsed * 1000 / samples);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_flat_eq_full_volume_is_transparent);
+  RUN_TEST(test_volume_ramps_without_steps);
+  RUN_TEST(test_bass_boost);
+  RUN_TEST(test_eq_gain_is_limited);
+  RUN_TEST(test_eq_serial_command);
+  RUN_TEST(test_limiter_holds_peaks);
+  RUN_TEST(test_dsp_cost_per_sample);
+  return UNITY_END();
+}
@@ -0,0 +1,155 @@
+// Buffer health (bufferHealth.h): bytes buffered converted to ms at the stream's bitrate,
+// the bitrate measured at the decoder when the station doesn't send one, and the time to
+// underrun predicted for a falling buffer
+#include "firmware.h"
+#include <unity.h>
+
+const uint32_t bytesPerSec = 16000; // 128kbps
+
+// Ring holding exactly this many bytes
+void setBuffered(uint32_t bytes)
+{
+  static uint8_t filler[1024];
+  ringReset(streamRing);
+  while (bytes > 0)
+  {
+    uint32_t len = min(bytes, (uint32_t)sizeof(filler));
+    ringWrite(streamRing, filler, len);
+    bytes -= len;
+  }
+}
+
+// One sample period on
+void nextSample(uint32_t decoderBytes = 0)
+{
+  advanceMillis(bufferHealthSampleMS);
+  serviceBufferHealth(decoderBytes);
+}
+
+// Each test is a new station
+void setUp()
+{
+  static bool initialised = false;
+  if (!initialised)
+  {
+    createStreamFetchTask();
+    initialised = true;
+  }
+  streamingGeneration++;
+  streamingBitrateKbps = 128;
+  setBuffered(0);
+}
+void tearDown() {}
+
+void test_bytes_to_ms()
+{
+  setBuffered(bytesPerSec);
+  nextSample();
+  bufferHealth snapshot;
+  getBufferHealth(snapshot);
+  TEST_ASSERT_TRUE(snapshot.valid);
+  TEST_ASSERT_EQUAL(128, snapshot.kbps);
+  TEST_ASSERT_EQUAL(1000, snapshot.bufferedMS);
+  TEST_ASSERT_EQUAL((streamRing.size * 8) / 128, snapshot.capacityMS);
+  TEST_ASSERT_EQUAL(noUnderrun, snapshot.underrunMS);
+
+  // What the decoder holds counts too, and a higher bitrate is less time
+  streamingGeneration++;
+  streamingBitrateKbps = 320;
+  nextSample(8000);
+  getBufferHealth(snapshot);
+  TEST_ASSERT_EQUAL(((bytesPerSec + 8000) * 8) / 320, snapshot.bufferedMS);
+}
+
+// No icy-br: the rate the decoder reads at stands in for it
+void test_bitrate_measured_at_decoder()
+{
+  streamingBitrateKbps = 0;
+  setBuffered(bytesPerSec);
+  nextSample();
+  for (uint8_t i = 0; i < 50; i++)
+  {
+    decodeBytesTotal += bytesPerSec / 10;
+    nextSample();
+  }
+  bufferHealth snapshot;
+  getBufferHealth(snapshot);
+  TEST_ASSERT_UINT32_WITHIN(2, 128, snapshot.kbps);
+  TEST_ASSERT_UINT32_WITHIN(20, 1000, snapshot.bufferedMS);
+}
+
+// Steady buffer: no underrun predicted, however low it is
+void test_steady_buffer_never_runs_dry()
+{
+  setBuffered(bytesPerSec / 4);
+  for (uint8_t i = 0; i < 50; i++)
+    nextSample();
+  TEST_ASSERT_EQUAL(noUnderrun, predictedUnderrunMS());
+}
+
+// Half of what is played arriving at 64kbps (4s of it in the ring): the buffer falls at
+// 500ms/s, starting from full. leftMS is what is left after seconds of it.
+void fallFor(uint8_t seconds, uint32_t &leftMS)
+{
+  const uint32_t slowBytesPerSec = 8000;
+  streamingBitrateKbps = 64;
+  uint32_t buffered = 4 * slowBytesPerSec;
+  setBuffered(buffered);
+  nextSample();
+
+  uint32_t dropPerSample = (slowBytesPerSec / 2) * bufferHealthSampleMS / 1000;
+  uint32_t previousPrediction = noUnderrun;
+  for (uint16_t i = 0; i < seconds * 1000 / bufferHealthSampleMS; i++)
+  {
+    buffered -= dropPerSample;
+    setBuffered(buffered);
+    nextSample();
+    if (i >= 1000 / bufferHealthSampleMS)
+    {
+      // Falling for a second: a prediction, and never later than the last one
+      uint32_t prediction = predictedUnderrunMS();
+      TEST_ASSERT_LESS_THAN(noUnderrun, prediction);
+      TEST_ASSERT_LESS_OR_EQUAL(previousPrediction, prediction);
+      previousPrediction = prediction;
+    }
+  }
+  leftMS = (buffered * 1000) / slowBytesPerSec;
+}
+
+// The prediction closes in on when the buffer will actually run dry. The level lags a
+// few samples behind and the slope is smoothed over a couple of seconds, so the estimate
+// errs long, by under a second.
+void test_falling_buffer_predicts_underrun()
+{
+  uint32_t leftMS;
+  fallFor(5, leftMS);
+  uint32_t actualMS = leftMS * 1000 / 500;
+  bufferHealth snapshot;
+  getBufferHealth(snapshot);
+  TEST_ASSERT_INT_WITHIN(75, -500, snapshot.slopeMSPerSec);
+  TEST_ASSERT_UINT32_WITHIN(200, leftMS, snapshot.bufferedMS);
+  TEST_ASSERT_GREATER_OR_EQUAL(actualMS, snapshot.underrunMS);
+  TEST_ASSERT_LESS_THAN(actualMS + 1000, snapshot.underrunMS);
+}
+
+// An estimate nobody has refreshed (nothing playing) isn't used
+void test_stale_estimate_ignored()
+{
+  uint32_t leftMS;
+  fallFor(3, leftMS);
+  TEST_ASSERT_LESS_THAN(noUnderrun, predictedUnderrunMS());
+
+  advanceMillis(bufferHealthStaleMS);
+  TEST_ASSERT_EQUAL(noUnderrun, predictedUnderrunMS());
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_bytes_to_ms);
+  RUN_TEST(test_bitrate_measured_at_decoder);
+  RUN_TEST(test_steady_buffer_never_runs_dry);
+  RUN_TEST(test_falling_buffer_predicts_underrun);
+  RUN_TEST(test_stale_estimate_ignored);
+  return UNITY_END();
+}
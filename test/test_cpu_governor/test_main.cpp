@@ -0,0 +1,68 @@
+// CPU governor (cpuGovernor.h): load is counted on the whole CPU, and connecting to a
+// station doesn't count as idle
+#include "firmware.h"
+#include <unity.h>
+
+// One simulated second: 1000 ticks on each core, busyPercent of them away from idle
+void runSecond(uint8_t core0Busy, uint8_t core1Busy)
+{
+  for (uint16_t tick = 0; tick < 1000; tick++)
+  {
+    nativeRunningTask = tick < core0Busy * 10 ? NULL : xTaskGetIdleTaskHandleForCPU(0);
+    nativeTickHooks[0]();
+    nativeRunningTask = tick < core1Busy * 10 ? NULL : xTaskGetIdleTaskHandleForCPU(1);
+    nativeTickHooks[1]();
+  }
+  advanceMillis(1000);
+  serviceCpuGovernor(audioLoopMicros);
+}
+
+void setUp()
+{
+  nativeCpuMhz = 160;
+  setupCpuGovernor();
+  allowPlayAudio = true;
+  muted = false;
+  audio.running = false;
+  runSecond(0, 0);
+}
+void tearDown() {}
+
+void test_load_is_the_busier_core()
+{
+  runSecond(20, 70);
+  TEST_ASSERT_EQUAL(20, governorCoreLoad[0]);
+  TEST_ASSERT_EQUAL(70, governorCoreLoad[1]);
+  TEST_ASSERT_EQUAL(240, getCpuFrequencyMhz());
+}
+
+// Connecting or prebuffering (playing wanted, nothing decoding yet) isn't idle
+void test_connecting_is_not_idle()
+{
+  for (uint8_t secs = 0; secs < 5; secs++)
+    runSecond(30, 10);
+  TEST_ASSERT_EQUAL(160, getCpuFrequencyMhz());
+
+  muted = true;
+  for (uint8_t secs = 0; secs < 5; secs++)
+    runSecond(5, 5);
+  TEST_ASSERT_EQUAL(80, getCpuFrequencyMhz());
+}
+
+// Muted, but something else is keeping a core busy - not worth dropping to 80MHz
+void test_busy_while_muted_stays_up()
+{
+  muted = true;
+  for (uint8_t secs = 0; secs < 5; secs++)
+    runSecond(40, 5);
+  TEST_ASSERT_EQUAL(160, getCpuFrequencyMhz());
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_load_is_the_busier_core);
+  RUN_TEST(test_connecting_is_not_idle);
+  RUN_TEST(test_busy_while_muted_stays_up);
+  return UNITY_END();
+}
@@ -0,0 +1,209 @@
+// Crossfade (crossfade.h): the buffer is only held around a channel change on a board
+// without PSRAM, the 'x' serial command sets the overlap, and a whole crossfaded change
+// (prebuffer in a standby slot, warm switch, mix) on localhost servers
+#include "firmware.h"
+#include "nativeHttpServer.h"
+#include <unity.h>
+
+void setUp()
+{
+  nativePreferences.clear();
+  crossfade = CROSSFADE_IDLE;
+  setupCrossfade();
+}
+void tearDown() {}
+
+void test_no_buffer_at_boot()
+{
+  TEST_ASSERT_EQUAL(maxCrossfadeMSNoPsram, crossfadeMS);
+  TEST_ASSERT_NULL(crossfadeBuffer);
+  TEST_ASSERT_EQUAL(0, crossfadeCapacity);
+}
+
+// Taken for a change, given back by the audio task once the fade is over
+void test_buffer_released_after_change()
+{
+  TEST_ASSERT_TRUE(reserveCrossfadeBuffer());
+  TEST_ASSERT_NOT_NULL(crossfadeBuffer);
+  TEST_ASSERT_EQUAL(crossfadeMaxSampleRate * crossfadeMS / 1000, crossfadeCapacity);
+
+  crossfade = CROSSFADE_FILLING;
+  serviceCrossfade();
+  TEST_ASSERT_NOT_NULL(crossfadeBuffer);
+
+  crossfade = CROSSFADE_IDLE;
+  serviceCrossfade();
+  TEST_ASSERT_NULL(crossfadeBuffer);
+  TEST_ASSERT_EQUAL(0, crossfadeCapacity);
+}
+
+void test_serial_command_sets_overlap()
+{
+  Serial.feed("x100\n");
+  serviceTelemetry();
+  TEST_ASSERT_EQUAL(100, crossfadeMS);
+  TEST_ASSERT_EQUAL(100, preferences.getUShort("crossfadeMS", 0));
+  setupCrossfade();
+  TEST_ASSERT_EQUAL(100, crossfadeMS);
+
+  // Held to what internal RAM allows
+  Serial.feed("x3000\n");
+  serviceTelemetry();
+  TEST_ASSERT_EQUAL(maxCrossfadeMSNoPsram, crossfadeMS);
+
+  Serial.feed("x0\n");
+  serviceTelemetry();
+  TEST_ASSERT_EQUAL(0, crossfadeMS);
+  TEST_ASSERT_FALSE(crossfadeAvailable());
+
+  Serial.feed("xfast\n");
+  serviceTelemetry();
+  TEST_ASSERT_EQUAL(0, crossfadeMS);
+}
+
+uint32_t stereo(int16_t left, int16_t right)
+{
+  return ((uint32_t)(uint16_t)left << 16) | (uint16_t)right;
+}
+
+int16_t leftOf(uint32_t sample)
+{
+  return (int16_t)(sample >> 16);
+}
+
+int16_t rightOf(uint32_t sample)
+{
+  return (int16_t)(sample & 0xFFFF);
+}
+
+// One decoded sample through the I2S hook, true if it went on to I2S
+bool decodeSample(uint32_t &sample)
+{
+  bool continueI2S = true;
+  audio_process_i2s(&sample, &continueI2S);
+  return continueI2S;
+}
+
+void serviceStreams()
+{
+  serviceStream(activeStream);
+  for (uint8_t i = 0; i < maxStandbyStreams; i++)
+    serviceStream(standbyStreams[i]);
+}
+
+// The old station (left channel only) fades out as the new one (right channel only)
+// fades in. Both are decoded from the same ring one after the other, the new station
+// picked up warm from its standby slot so its decoder can start straight away.
+void test_crossfaded_change_mixes_both_stations()
+{
+  const int16_t level = 8000;
+  nativeHttpServer server;
+  nativeHttpRoute oldStation, newStation;
+  oldStation.head = newStation.head = "HTTP/1.0 200 OK\r\nContent-Type: audio/mpeg\r\n\r\n";
+  oldStation.streamBytes = 64000;
+  oldStation.bytesPerSec = newStation.bytesPerSec = 64000;
+  newStation.streamBytes = 14000;
+  server.route("/old", oldStation);
+  server.route("/new", newStation);
+  server.start();
+  std::string oldUrl = server.url("/old");
+  std::string newUrl = server.url("/new");
+  char wantedUrls[maxStandbyStreams][256] = {};
+
+  LITTLEFS.begin(false);
+  createStreamFetchTask();
+  setupDsp();
+  setDspSampleRate(44100);
+  setDspVolume(maxVolume);
+  uint32_t settle = 0;
+  for (uint32_t i = 0; i < 44100; i++)
+    processDsp(&settle);
+
+  // Old station playing
+  startStream(activeStream, oldUrl.c_str());
+  audio.connecttoFS(ringFS, "/stream.mp3");
+  TEST_ASSERT_TRUE(crossfadeAvailable());
+  startCrossfade();
+  beginIncomingStream(newUrl.c_str(), wantedUrls);
+  unsigned long requestMillis = millis();
+
+  // Old decoder runs ahead until the overlap is held, while the new station prebuffers
+  uint32_t decoded = 0, played = 0;
+  unsigned long start = millis();
+  while (crossfade == CROSSFADE_FILLING && millis() - start < 3000)
+  {
+    serviceStreams();
+    crossfadeIncomingReady = incomingStreamReady(newUrl.c_str(), requestMillis);
+    for (uint16_t i = 0; i < 256; i++)
+    {
+      uint32_t sample = stereo(level, 0);
+      decoded++;
+      if (decodeSample(sample))
+      {
+        TEST_ASSERT_EQUAL(level, leftOf(sample));
+        played++;
+      }
+    }
+    serviceCrossfade();
+    delay(1);
+  }
+  TEST_ASSERT_EQUAL(CROSSFADE_SWITCHING, crossfade);
+  TEST_ASSERT_FALSE(audio.isRunning());
+  TEST_ASSERT_TRUE(crossfadeDecoderStopped);
+  TEST_ASSERT_EQUAL(crossfadeTarget, crossfadeFilled());
+  TEST_ASSERT_EQUAL(decoded - played, crossfadeFilled());
+
+  // Fetch stage switches the ring over: the new station's prebuffer is already there
+  switchActiveStream(newUrl.c_str(), wantedUrls);
+  TEST_ASSERT_TRUE(lastSwitchWasWarm);
+  TEST_ASSERT_TRUE(streamReadyToDecode());
+  audio.connecttoFS(ringFS, "/stream.mp3");
+
+  // Mix: the old station falls along the cosine as the new one rises along the sine
+  uint32_t overlap = crossfadeFilled();
+  int16_t prevLeft = level + 1, prevRight = -1;
+  bool bothHeard = false;
+  for (uint32_t i = 0; i < overlap; i++)
+  {
+    uint32_t sample = stereo(0, level);
+    TEST_ASSERT_TRUE(decodeSample(sample));
+    TEST_ASSERT_LESS_OR_EQUAL(prevLeft, leftOf(sample));
+    TEST_ASSERT_GREATER_OR_EQUAL(prevRight, rightOf(sample));
+    prevLeft = leftOf(sample);
+    prevRight = rightOf(sample);
+    // Equal power: half way through both are at about 0.707
+    if (i == overlap / 2)
+    {
+      TEST_ASSERT_INT_WITHIN(300, level * 0.707, leftOf(sample));
+      TEST_ASSERT_INT_WITHIN(300, level * 0.707, rightOf(sample));
+      bothHeard = true;
+    }
+  }
+  TEST_ASSERT_TRUE(bothHeard);
+  TEST_ASSERT_LESS_THAN(300, prevLeft);
+  TEST_ASSERT_GREATER_THAN(level - 300, prevRight);
+
+  // Done: the new station plays on untouched and the buffer is given back
+  uint32_t sample = stereo(0, level);
+  TEST_ASSERT_TRUE(decodeSample(sample));
+  TEST_ASSERT_EQUAL(stereo(0, level), sample);
+  serviceCrossfade();
+  TEST_ASSERT_EQUAL(CROSSFADE_IDLE, crossfade);
+  TEST_ASSERT_NULL(crossfadeBuffer);
+
+  audio.stopSong();
+  closeStream(activeStream);
+  for (uint8_t i = 0; i < maxStandbyStreams; i++)
+    closeStream(standbyStreams[i]);
+  server.stop();
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_no_buffer_at_boot);
+  RUN_TEST(test_buffer_released_after_change);
+  RUN_TEST(test_serial_command_sets_overlap);
+  RUN_TEST(test_crossfaded_change_mixes_both_stations);
+  return UNITY_END();
+}
@@ -0,0 +1,128 @@
+// DNS cache (dnsCache.h) against the stub resolver in test/native/lwip/dns.h: numeric
+// hosts skip it, snapshot entries are refreshed or dropped, long names are kept whole
+#include "firmware.h"
+#include <unity.h>
+
+uint32_t address(const char *ip)
+{
+  struct in_addr in;
+  inet_aton(ip, &in);
+  return in.s_addr;
+}
+
+// Boot with a snapshot holding one host, its refresh left pending
+void loadSnapshot(const char *host, const char *ip)
+{
+  static dnsSnapshotEntry snapshot[dnsCacheSize];
+  memset(snapshot, 0, sizeof(snapshot));
+  strlcpy(snapshot[0].host, host, sizeof(snapshot[0].host));
+  snapshot[0].ip = address(ip);
+  Preferences prefs;
+  prefs.begin("dnsCache");
+  prefs.putBytes("hosts", snapshot, sizeof(snapshot));
+  loadDnsCache();
+}
+
+void setUp()
+{
+  nativeDnsTable.clear();
+  nativeDnsPending.clear();
+  nativeDnsAsync = true;
+  nativeDnsQueries = 0;
+  nativePreferences.clear();
+  loadDnsCache();
+}
+void tearDown() {}
+
+// Numeric hosts are neither looked up nor cached
+void test_numeric_host_skips_the_cache()
+{
+  streamConnection &conn = activeStream;
+  conn.connectFd = -1;
+  strlcpy(conn.currentUrl, "http://192.168.1.20:8000/live", sizeof(conn.currentUrl));
+  beginStreamHop(conn);
+
+  TEST_ASSERT_EQUAL(1, conn.dnsResult);
+  TEST_ASSERT_EQUAL(address("192.168.1.20"), conn.resolvedIp);
+  TEST_ASSERT_EQUAL(0, nativeDnsQueries);
+  TEST_ASSERT_EQUAL(0, dnsStats.misses);
+  TEST_ASSERT_EQUAL(-1, findDnsCacheEntry("192.168.1.20"));
+  closeStream(conn);
+}
+
+// A stale address is used at once and replaced by the refresh
+void test_stale_entry_refreshed()
+{
+  loadSnapshot("radio.example", "10.0.0.1");
+  nativeDnsSet("radio.example", "10.0.0.2");
+  TEST_ASSERT_EQUAL(1, nativeDnsPending.size());
+
+  uint32_t ip;
+  bool stale;
+  TEST_ASSERT_TRUE(dnsCacheLookup("radio.example", ip, stale));
+  TEST_ASSERT_TRUE(stale);
+  TEST_ASSERT_EQUAL(address("10.0.0.1"), ip);
+
+  nativeDnsDeliver();
+  TEST_ASSERT_TRUE(dnsCacheLookup("radio.example", ip, stale));
+  TEST_ASSERT_FALSE(stale);
+  TEST_ASSERT_EQUAL(address("10.0.0.2"), ip);
+}
+
+// The name has gone - the old address is not served again
+void test_failed_refresh_drops_entry()
+{
+  loadSnapshot("gone.example", "10.0.0.1");
+  nativeDnsDeliver();
+
+  uint32_t ip;
+  bool stale;
+  TEST_ASSERT_FALSE(dnsCacheLookup("gone.example", ip, stale));
+  TEST_ASSERT_EQUAL(1, dnsStats.refreshFailures);
+
+  // Same when the resolver refuses straight away
+  nativeDnsAsync = false;
+  loadSnapshot("gone.example", "10.0.0.1");
+  TEST_ASSERT_FALSE(dnsCacheLookup("gone.example", ip, stale));
+}
+
+// No answer at all - stale entries still expire
+void test_unrefreshed_entry_expires()
+{
+  loadSnapshot("slow.example", "10.0.0.1");
+  uint32_t ip;
+  bool stale;
+  TEST_ASSERT_TRUE(dnsCacheLookup("slow.example", ip, stale));
+  advanceMillis(dnsCacheTTLSecs * 1000 + 1);
+  TEST_ASSERT_FALSE(dnsCacheLookup("slow.example", ip, stale));
+}
+
+// Names as long as a URL's host can be are kept whole, in the cache and the snapshot
+void test_long_host_names()
+{
+  char host[maxHostLength];
+  memset(host, 'a', sizeof(host) - 9);
+  strlcpy(host + sizeof(host) - 9, ".example", 9);
+  TEST_ASSERT_EQUAL(maxHostLength - 1, strlen(host));
+
+  dnsCacheStore(host, address("10.0.0.3"));
+  uint32_t ip;
+  bool stale;
+  TEST_ASSERT_TRUE(dnsCacheLookup(host, ip, stale));
+
+  advanceMillis(dnsCacheSaveMS + 1);
+  serviceDnsCache();
+  loadDnsCache();
+  TEST_ASSERT_EQUAL_STRING(host, dnsCache[0].host);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_numeric_host_skips_the_cache);
+  RUN_TEST(test_stale_entry_refreshed);
+  RUN_TEST(test_failed_refresh_drops_entry);
+  RUN_TEST(test_unrefreshed_entry_expires);
+  RUN_TEST(test_long_host_names);
+  return UNITY_END();
+}
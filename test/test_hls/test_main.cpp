@@ -0,0 +1,128 @@
+// HLS client (hlsClient.h) against a canned playlist and segments on localhost: segments
+// reach the station's ring in order, and while paused they are recorded, not dropped
+#include "firmware.h"
+#include "nativeHttpServer.h"
+#include <unity.h>
+
+nativeHttpServer server;
+const uint32_t segmentBytes = 6000;
+const uint8_t segments = 3;
+
+void setUp()
+{
+  static bool initialised = false;
+  if (!initialised)
+  {
+    LITTLEFS.begin(false);
+    setupTimeshift();
+    ringInit(streamRing, 32768);
+    initialised = true;
+  }
+  nativePreferences.clear();
+  resetTimeshift();
+  timeshiftPaused = false;
+  ringReset(streamRing);
+  activeStream.ring = &streamRing;
+  activeStream.connectFd = -1;
+
+  // Packed audio segments, each filled with its own number
+  std::string playlist = "#EXTM3U\n#EXT-X-TARGETDURATION:2\n#EXT-X-MEDIA-SEQUENCE:0\n";
+  for (uint8_t i = 0; i < segments; i++)
+  {
+    std::string path = "/seg" + std::to_string(i) + ".aac";
+    nativeHttpRoute segment;
+    segment.body = std::string(segmentBytes, (char)i);
+    server.route(path, segment);
+    playlist += "#EXTINF:2.0,\n" + path.substr(1) + "\n";
+  }
+  nativeHttpRoute media;
+  media.head = "HTTP/1.0 200 OK\r\nContent-Type: application/vnd.apple.mpegurl\r\n\r\n";
+  media.body = playlist + "#EXT-X-ENDLIST\n";
+  server.route("/live.m3u8", media);
+  server.start();
+}
+void tearDown()
+{
+  closeStream(activeStream);
+  server.stop();
+}
+
+// Run the fetch stage (and the spill task) until every segment has been fetched
+void fetchSegments()
+{
+  uint32_t before = hlsSegmentsFetched + hlsSegmentsFailed;
+  startStream(activeStream, server.url("/live.m3u8").c_str());
+  unsigned long start = millis();
+  while (hlsSegmentsFetched + hlsSegmentsFailed - before < segments && millis() - start < 3000)
+  {
+    serviceStream(activeStream);
+    serviceTimeshiftSpill();
+    delay(1);
+  }
+  // Last of the prefetched audio handed over
+  for (uint8_t i = 0; i < 10; i++)
+  {
+    serviceStream(activeStream);
+    serviceTimeshiftSpill();
+  }
+}
+
+// Bytes of each segment found in order in data, false at the first out of place
+bool inSegmentOrder(const uint8_t *data, uint32_t len)
+{
+  for (uint32_t i = 0; i < len; i++)
+  {
+    if (data[i] != i / segmentBytes)
+      return false;
+  }
+  return true;
+}
+
+void test_segments_in_order()
+{
+  uint32_t failed = hlsSegmentsFailed;
+  fetchSegments();
+  TEST_ASSERT_EQUAL(failed, hlsSegmentsFailed);
+  TEST_ASSERT_EQUAL(segments * segmentBytes, ringFilled(streamRing));
+
+  static uint8_t data[segments * segmentBytes];
+  ringRead(streamRing, data, sizeof(data));
+  TEST_ASSERT_TRUE(inSegmentOrder(data, sizeof(data)));
+}
+
+// Paused with the station's ring full: every segment goes to the recording, and plays
+// back in order
+void test_paused_segments_are_recorded()
+{
+  static uint8_t data[segments * segmentBytes];
+  memset(data, 0xEE, sizeof(data));
+  while (ringFree(streamRing) > 0)
+    ringWrite(streamRing, data, ringFree(streamRing));
+  timeshiftPaused = true;
+
+  fetchSegments();
+  TEST_ASSERT_EQUAL(streamRing.size, ringFilled(streamRing));
+  TEST_ASSERT_EQUAL(segments * segmentBytes, timeshiftFilled());
+  TEST_ASSERT_EQUAL(0, timeshiftDroppedBytes);
+
+  // Resume: what was playing when paused, then the recording
+  ringReset(streamRing);
+  timeshiftPaused = false;
+  uint32_t played = 0;
+  for (uint16_t pass = 0; pass < 1000 && played < sizeof(data); pass++)
+  {
+    serviceTimeshiftSpill();
+    serviceTimeshift(streamRing);
+    played += ringRead(streamRing, data + played, sizeof(data) - played);
+  }
+  TEST_ASSERT_EQUAL(sizeof(data), played);
+  TEST_ASSERT_TRUE(inSegmentOrder(data, sizeof(data)));
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_segments_in_order);
+  RUN_TEST(test_paused_segments_are_recorded);
+  return UNITY_END();
+}
@@ -0,0 +1,183 @@
+// Local file playback (localFile.h): MPEG frame headers, the frame index halving as it
+// fills, and seeks landing on the right frame of a synthetic MP3 longer than the index
+#include "firmware.h"
+#include <unity.h>
+
+const char *testFile = "/local/test.mp3";
+const uint32_t testFrames = 3000;   // Nearly three times maxFrameIndexEntries
+const uint32_t testTagBytes = 110;  // ID3v2 tag in front of the first frame
+uint32_t frameOffsets[testFrames];
+
+// MPEG-1 Layer III, 128kbps, 44.1kHz: 417 bytes, 418 with padding
+const uint8_t frameHeader[4] = {0xFF, 0xFB, 0x90, 0x44};
+const uint8_t paddedFrameHeader[4] = {0xFF, 0xFB, 0x92, 0x44};
+
+// Every third frame padded, so the frames aren't evenly spaced
+void writeTestFile()
+{
+  File file = LITTLEFS.open(testFile, FILE_WRITE);
+  uint8_t tag[testTagBytes] = {'I', 'D', '3', 4, 0, 0, 0, 0, 0, testTagBytes - 10};
+  file.write(tag, sizeof(tag));
+
+  static uint8_t frame[418];
+  uint32_t offset = sizeof(tag);
+  for (uint32_t i = 0; i < testFrames; i++)
+  {
+    bool padded = i % 3 == 0;
+    uint16_t length = padded ? 418 : 417;
+    memset(frame, 0, sizeof(frame));
+    memcpy(frame, padded ? paddedFrameHeader : frameHeader, 4);
+    frame[4] = i; // Some audio that differs from frame to frame
+    file.write(frame, length);
+    frameOffsets[i] = offset;
+    offset += length;
+  }
+  file.close();
+}
+
+// The frame a seek to ms should land on
+uint32_t frameAtMS(uint32_t ms)
+{
+  return min(((uint64_t)ms * 44100) / (1152 * 1000), (uint64_t)testFrames - 1);
+}
+
+void setUp()
+{
+  static bool initialised = false;
+  if (!initialised)
+  {
+    LITTLEFS.begin(false);
+    writeTestFile();
+    initialised = true;
+  }
+  LITTLEFS.remove("/local/test.mp3.idx");
+
+  // As startLocalSession() leaves it for an MP3 without an index
+  memset(&localPlayer, 0, sizeof(localPlayer));
+  strlcpy(localPlayer.path, testFile, sizeof(localPlayer.path));
+  localPlayer.mp3 = true;
+  localFile = LITTLEFS.open(testFile, FILE_READ);
+  beginFrameIndexScan();
+}
+void tearDown()
+{
+  if (!localPlayer.indexComplete)
+    indexScanFile.close();
+  localFile.close();
+}
+
+void test_mpeg_headers()
+{
+  mpegFrame frame;
+  TEST_ASSERT_TRUE(parseMpegHeader(frameHeader, frame));
+  TEST_ASSERT_EQUAL(417, frame.length);
+  TEST_ASSERT_EQUAL(1152, frame.samples);
+  TEST_ASSERT_EQUAL(44100, frame.sampleRate);
+  TEST_ASSERT_EQUAL(128, frame.kbps);
+
+  TEST_ASSERT_TRUE(parseMpegHeader(paddedFrameHeader, frame));
+  TEST_ASSERT_EQUAL(418, frame.length);
+
+  // MPEG-2 Layer III, 64kbps, 22.05kHz: half the samples per frame
+  const uint8_t mpeg2[4] = {0xFF, 0xF3, 0x80, 0x44};
+  TEST_ASSERT_TRUE(parseMpegHeader(mpeg2, frame));
+  TEST_ASSERT_EQUAL(576, frame.samples);
+  TEST_ASSERT_EQUAL(22050, frame.sampleRate);
+  TEST_ASSERT_EQUAL(64, frame.kbps);
+  TEST_ASSERT_EQUAL(208, frame.length);
+
+  // MPEG-1 Layer II, 192kbps, 48kHz
+  const uint8_t layer2[4] = {0xFF, 0xFD, 0xA4, 0x44};
+  TEST_ASSERT_TRUE(parseMpegHeader(layer2, frame));
+  TEST_ASSERT_EQUAL(1152, frame.samples);
+  TEST_ASSERT_EQUAL(576, frame.length);
+
+  // No sync, free format, bad bitrate, reserved rate, reserved version
+  const uint8_t notFrames[][4] = {{0xFE, 0xFB, 0x90, 0x44},
+                                  {0xFF, 0xFB, 0x00, 0x44},
+                                  {0xFF, 0xFB, 0xF0, 0x44},
+                                  {0xFF, 0xFB, 0x9C, 0x44},
+                                  {0xFF, 0xEB, 0x90, 0x44}};
+  for (const uint8_t *header : notFrames)
+    TEST_ASSERT_FALSE(parseMpegHeader(header, frame));
+}
+
+// Filling the index drops every other entry and doubles the spacing, each time it fills
+void test_index_halves_when_full()
+{
+  for (uint32_t frame = 0; frame < maxFrameIndexEntries; frame++)
+    addFrameIndexEntry(frame, frame * 100);
+  TEST_ASSERT_EQUAL(maxFrameIndexEntries, localPlayer.index.entries);
+  TEST_ASSERT_EQUAL(1, localPlayer.index.framesPerEntry);
+
+  addFrameIndexEntry(maxFrameIndexEntries, maxFrameIndexEntries * 100);
+  TEST_ASSERT_EQUAL(2, localPlayer.index.framesPerEntry);
+  TEST_ASSERT_EQUAL(maxFrameIndexEntries / 2 + 1, localPlayer.index.entries);
+
+  for (uint32_t frame = maxFrameIndexEntries + 1; frame < testFrames; frame++)
+    addFrameIndexEntry(frame, frame * 100);
+  TEST_ASSERT_EQUAL(4, localPlayer.index.framesPerEntry);
+  TEST_ASSERT_EQUAL((testFrames + 3) / 4, localPlayer.index.entries);
+  for (uint16_t i = 0; i < localPlayer.index.entries; i++)
+    TEST_ASSERT_EQUAL(i * 4 * 100, frameIndexEntries[i]);
+}
+
+// Scanning the whole file: past the tag, every frame counted, one entry per 4 frames
+void test_index_built_from_file()
+{
+  while (!localPlayer.indexComplete)
+    scanFrameIndex(frameIndexScanFrames);
+
+  const frameIndexHeader &index = localPlayer.index;
+  TEST_ASSERT_EQUAL(testFrames, index.frames);
+  TEST_ASSERT_EQUAL(44100, index.sampleRate);
+  TEST_ASSERT_EQUAL(1152, index.samplesPerFrame);
+  TEST_ASSERT_EQUAL(4, index.framesPerEntry);
+  TEST_ASSERT_EQUAL((testFrames + 3) / 4, index.entries);
+  for (uint16_t i = 0; i < index.entries; i++)
+    TEST_ASSERT_EQUAL(frameOffsets[i * index.framesPerEntry], frameIndexEntries[i]);
+  TEST_ASSERT_TRUE(LITTLEFS.exists("/local/test.mp3.idx"));
+}
+
+// A seek before the index is built scans only as far as it needs to
+void test_seek_while_indexing()
+{
+  uint32_t targetMS = 30000;
+  TEST_ASSERT_TRUE(positionLocalFile(targetMS));
+  TEST_ASSERT_FALSE(localPlayer.indexComplete);
+  TEST_ASSERT_LESS_THAN(testFrames, localPlayer.index.frames);
+  TEST_ASSERT_EQUAL(frameOffsets[frameAtMS(targetMS)], localPlayer.playedOffset);
+  TEST_ASSERT_EQUAL(frameOffsets[frameAtMS(targetMS)], localFile.position());
+}
+
+// With the index complete every seek lands on the frame playing at that time
+void test_seek_lands_on_frame()
+{
+  while (!localPlayer.indexComplete)
+    scanFrameIndex(frameIndexScanFrames);
+
+  const uint32_t targetsMS[] = {0, 26, 27, 1000, 26749, 45000, 78000};
+  for (uint32_t targetMS : targetsMS)
+  {
+    TEST_ASSERT_TRUE(positionLocalFile(targetMS));
+    TEST_ASSERT_EQUAL(frameOffsets[frameAtMS(targetMS)], localPlayer.playedOffset);
+    TEST_ASSERT_EQUAL(frameOffsets[frameAtMS(targetMS)], localFile.position());
+    // The position shown is only rough (frames taken as evenly spread between entries)
+    TEST_ASSERT_UINT32_WITHIN(2 * 27, targetMS, localPositionMS(localPlayer.playedOffset));
+  }
+
+  // Past the end: the last frame
+  TEST_ASSERT_TRUE(positionLocalFile(3600000));
+  TEST_ASSERT_EQUAL(frameOffsets[testFrames - 1], localPlayer.playedOffset);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_mpeg_headers);
+  RUN_TEST(test_index_halves_when_full);
+  RUN_TEST(test_index_built_from_file);
+  RUN_TEST(test_seek_while_indexing);
+  RUN_TEST(test_seek_lands_on_frame);
+  return UNITY_END();
+}
@@ -0,0 +1,124 @@
+// Mirror race (mirrorRace.h): a playlist's mirrors are raced on real sockets, the one that
+// would prebuffer soonest wins and none of the audio it sent during the race is lost
+#include "firmware.h"
+#include "nativeHttpServer.h"
+#include <unity.h>
+
+nativeHttpServer server;
+const char *audioHead = "HTTP/1.0 200 OK\r\nContent-Type: audio/mpeg\r\n\r\n";
+
+void setUp()
+{
+  nativePreferences.clear();
+  if (streamRing.buffer == NULL)
+    ringInit(streamRing, 32768);
+  ringReset(streamRing);
+  activeStream.ring = &streamRing;
+  activeStream.connectFd = -1;
+  server.start();
+}
+void tearDown()
+{
+  closeStream(activeStream);
+  server.stop();
+}
+
+nativeHttpRoute mirror(uint8_t streamByte, uint32_t delayMS, uint32_t bytesPerSec, uint32_t streamBytes)
+{
+  nativeHttpRoute route;
+  route.head = audioHead;
+  route.streamByte = streamByte;
+  route.delayMS = delayMS;
+  route.bytesPerSec = bytesPerSec;
+  route.streamBytes = streamBytes;
+  return route;
+}
+
+void servicePlaylist(const char *path, unsigned long forMS)
+{
+  startStream(activeStream, server.url(path).c_str());
+  unsigned long start = millis();
+  while (millis() - start < forMS)
+  {
+    serviceStream(activeStream);
+    delay(1);
+  }
+}
+
+// Slow to answer, thin, and one that answers straight away at a good rate
+void test_fastest_mirror_wins_and_keeps_its_audio()
+{
+  const uint32_t streamBytes = 12000;
+  server.route("/slow", mirror(0x11, 400, 32000, streamBytes));
+  server.route("/fast", mirror(0x22, 0, 32000, streamBytes));
+  server.route("/thin", mirror(0x33, 0, 4000, streamBytes));
+  nativeHttpRoute playlist;
+  playlist.head = "HTTP/1.0 200 OK\r\nContent-Type: audio/x-mpegurl\r\n\r\n";
+  playlist.body = server.url("/slow") + "\n" + server.url("/fast") + "\n" + server.url("/thin") + "\n";
+  server.route("/list.m3u", playlist);
+
+  servicePlaylist("/list.m3u", 2500);
+  TEST_ASSERT_NULL(mirrorRaceOwner);
+  TEST_ASSERT_TRUE(isStreaming(activeStream));
+  TEST_ASSERT_EQUAL_STRING(server.url("/fast").c_str(), activeStream.currentUrl);
+  TEST_ASSERT_EQUAL(4, server.requests.load());
+
+  // Every byte the winner sent, race included, and nothing from the others
+  TEST_ASSERT_EQUAL(streamBytes, ringFilled(streamRing));
+  uint8_t data[streamBytes];
+  ringRead(streamRing, data, sizeof(data));
+  uint32_t others = 0;
+  for (uint32_t i = 0; i < streamBytes; i++)
+    others += data[i] != 0x22;
+  TEST_ASSERT_EQUAL(0, others);
+
+  // The rings are only held for the race
+  TEST_ASSERT_NULL(mirrorRings[0].buffer);
+
+  cachedStream entry;
+  TEST_ASSERT_TRUE(loadCachedStream(server.url("/list.m3u").c_str(), entry));
+  TEST_ASSERT_EQUAL_STRING(server.url("/fast").c_str(), entry.resolvedUrl);
+}
+
+// Nothing answers with audio
+void test_no_mirror_fails_the_station()
+{
+  nativeHttpRoute playlist;
+  playlist.head = "HTTP/1.0 200 OK\r\nContent-Type: audio/x-mpegurl\r\n\r\n";
+  playlist.body = server.url("/gone1") + "\n" + server.url("/gone2") + "\n";
+  server.route("/list.m3u", playlist);
+
+  servicePlaylist("/list.m3u", 500);
+  TEST_ASSERT_NULL(mirrorRaceOwner);
+  TEST_ASSERT_FALSE(isStreaming(activeStream));
+  TEST_ASSERT_EQUAL(0, ringFilled(streamRing));
+}
+
+// A later first byte can still win on rate: the score is the time to the prebuffer
+void test_score_weighs_first_byte_against_rate()
+{
+  uint32_t watermark = prebufferWatermark;
+  prebufferWatermark = 16000;
+  mirrorRaceStart = millis() - 1000;
+
+  mirrorResult early = {mirrorRaceStart + 100, mirrorRaceStart + 600, 8000};
+  mirrorResult quick = {mirrorRaceStart + 300, mirrorRaceStart + 800, 16000};
+  TEST_ASSERT_EQUAL(100 + 16000 * 500 / 8000, mirrorScore(early));
+  TEST_ASSERT_EQUAL(300 + 16000 * 500 / 16000, mirrorScore(quick));
+  TEST_ASSERT_LESS_THAN(mirrorScore(early), mirrorScore(quick));
+
+  // Measuring stopped early (its ring filled): the rate is over the time it took
+  mirrorResult full = {mirrorRaceStart + 100, mirrorRaceStart + 200, 8192};
+  TEST_ASSERT_EQUAL(100 + 16000 * 100 / 8192, mirrorScore(full));
+
+  prebufferWatermark = watermark;
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_fastest_mirror_wins_and_keeps_its_audio);
+  RUN_TEST(test_no_mirror_fails_the_station);
+  RUN_TEST(test_score_weighs_first_byte_against_rate);
+  return UNITY_END();
+}
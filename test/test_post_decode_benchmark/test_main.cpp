@@ -0,0 +1,247 @@
+// Post-decode benchmark: what every decoded sample costs on its way to I2S - the earcon
+// mix, DSP, spectrum tap (and its share of the analyser's frames) and the resampler -
+// each on its own and all together through audio_process_i2s(), in ns per sample on the
+// host. The decoder itself only runs on the board (see decodeBenchmark.h).
+//
+// Results are written to results.txt next to this file. If baseline.txt is there (an
+// earlier results file copied over it, from the same machine and build flags) each stage
+// is compared against it and anything more than postDecodeTolerancePercent slower fails.
+#include "firmware.h"
+#include <unity.h>
+#include <string>
+
+const uint32_t benchRate = 44100;
+const uint32_t benchSamples = 441000; // 10s of audio per run
+const uint8_t benchRuns = 5;          // Best of, to keep other load on the host out of it
+const uint8_t postDecodeTolerancePercent = 25;
+
+struct stageResult
+{
+  const char *stage;
+  double nsPerSample;
+};
+stageResult stageResults[8];
+uint8_t stageCount = 0;
+
+std::string benchPath(const char *file)
+{
+  std::string path = __FILE__;
+  return path.substr(0, path.find_last_of('/') + 1) + file;
+}
+
+uint32_t stereo(int16_t left, int16_t right)
+{
+  return ((uint32_t)(uint16_t)left << 16) | (uint16_t)right;
+}
+
+// Programme material: two tones, different in each channel
+uint32_t programmeSample(uint32_t i)
+{
+  return stereo(12000 * sinf(2 * PI * 440 * i / benchRate), 9000 * sinf(2 * PI * 1250 * i / benchRate));
+}
+
+// Keep a clip playing the whole time (the slow path of mixEarcon)
+void keepEarconPlaying()
+{
+  if (earconPlaying < 0 && earconRequested < 0)
+    playEarcon(EARCON_RECONNECTING);
+}
+
+// What the spectrum task does once a frame's worth has been tapped
+void analyseTappedFrame()
+{
+  uint32_t frameBytes = fftSize * sizeof(int16_t);
+  if (ringFilled(spectrumTapRing) < frameBytes)
+    return;
+  ringSkip(spectrumTapRing, ringFilled(spectrumTapRing) - frameBytes);
+  ringRead(spectrumTapRing, (uint8_t *)fftReal, frameBytes);
+  analyseSpectrumFrame();
+  spectrumFrames++;
+}
+
+// Best of benchRuns, in ns per sample
+template <typename Stage> double timeStage(Stage stage)
+{
+  static uint32_t input[benchSamples];
+  for (uint32_t i = 0; i < benchSamples; i++)
+    input[i] = programmeSample(i);
+
+  double best = 0;
+  for (uint8_t run = 0; run < benchRuns; run++)
+  {
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i = 0; i < benchSamples; i++)
+    {
+      uint32_t sample = input[i];
+      stage(sample);
+    }
+    double nsPerSample = (esp_timer_get_time() - start) * 1000.0 / benchSamples;
+    if (run == 0 || nsPerSample < best)
+      best = nsPerSample;
+  }
+  return best;
+}
+
+void recordStage(const char *stage, double nsPerSample)
+{
+  stageResults[stageCount++] = {stage, nsPerSample};
+  char result[80];
+  snprintf(result, sizeof(result), "%s: %.1fns/sample on the host", stage, nsPerSample);
+  TEST_MESSAGE(result);
+}
+
+// Baseline for a stage, 0 if it isn't in the baseline
+double findStageBaseline(const char *stage)
+{
+  FILE *file = fopen(benchPath("baseline.txt").c_str(), "r");
+  if (file == NULL)
+    return 0;
+
+  char line[96], name[24];
+  double nsPerSample = 0;
+  while (fgets(line, sizeof(line), file))
+  {
+    if (line[0] != '#' && sscanf(line, "%23s %lf", name, &nsPerSample) == 2 && strcmp(name, stage) == 0)
+    {
+      fclose(file);
+      return nsPerSample;
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+// Flat EQ bar the bands set below, full volume, ramp finished; the resampler taking
+// 44.1kHz to 48kHz; the analyser's tables and tap ring; the earcon cache
+void setUp()
+{
+  LITTLEFS.begin(false);
+  setEqBand(EQ_BASS, 6);
+  setEqBand(EQ_MID, -3);
+  setEqBand(EQ_TREBLE, 4);
+  setupDsp();
+  setDspSampleRate(benchRate);
+  setDspVolume(maxVolume);
+  uint32_t sample = 0;
+  for (uint32_t i = 0; i < benchRate; i++)
+    processDsp(&sample);
+
+  audio.sampleRate = benchRate;
+  audio.running = true;
+  outputRate = 48000;
+  resetResampler(benchRate);
+  nativeI2sStalled = false;
+
+  if (spectrumTapRing.buffer == NULL)
+  {
+    createSpectrumTask();
+    setSpectrumSampleRate(benchRate);
+  }
+  if (earconCache == NULL)
+    setupEarcons();
+}
+void tearDown()
+{
+  outputRate = FIXED_OUTPUT_RATE;
+  audio.running = false;
+}
+
+void test_earcon_mix()
+{
+  recordStage("earcon", timeStage([](uint32_t &sample)
+                                  {
+                                    keepEarconPlaying();
+                                    mixEarcon(&sample);
+                                  }));
+  TEST_ASSERT_EQUAL(0, earconDropped);
+}
+
+void test_dsp()
+{
+  recordStage("dsp", timeStage([](uint32_t &sample) { processDsp(&sample); }));
+}
+
+void test_spectrum()
+{
+  uint32_t framesBefore = spectrumFrames;
+  recordStage("spectrum", timeStage([](uint32_t &sample)
+                                    {
+                                      spectrumTap(sample);
+                                      analyseTappedFrame();
+                                    }));
+  TEST_ASSERT_GREATER_THAN(framesBefore, spectrumFrames);
+  TEST_ASSERT_EQUAL(0, spectrumTapDropped);
+}
+
+void test_resampler()
+{
+  uint32_t bytesBefore = nativeI2sBytes;
+  recordStage("resampler", timeStage([](uint32_t &sample) { resampleSample(sample); }));
+  TEST_ASSERT_GREATER_THAN(bytesBefore, nativeI2sBytes);
+  TEST_ASSERT_EQUAL(0, resampleDroppedSamples);
+}
+
+// The whole hook, as the audio task runs it for every decoded sample
+void test_audio_process_i2s()
+{
+  recordStage("total", timeStage([](uint32_t &sample)
+                                 {
+                                   keepEarconPlaying();
+                                   bool continueI2S = true;
+                                   audio_process_i2s(&sample, &continueI2S);
+                                   analyseTappedFrame();
+                                 }));
+
+  // Well inside one sample period at 44.1kHz (22.7us)
+  TEST_ASSERT_LESS_THAN(22676, stageResults[stageCount - 1].nsPerSample);
+}
+
+// Written last: every stage against the baseline, and this run's results for the next one
+void test_against_baseline()
+{
+  FILE *results = fopen(benchPath("results.txt").c_str(), "w");
+  if (results != NULL)
+    fprintf(results, "# stage ns/sample (post-decode benchmark, best of %u runs of %u samples)\n", benchRuns,
+            benchSamples);
+
+  uint8_t compared = 0, regressions = 0;
+  for (uint8_t i = 0; i < stageCount; i++)
+  {
+    if (results != NULL)
+      fprintf(results, "%s %.1f\n", stageResults[i].stage, stageResults[i].nsPerSample);
+
+    double baseline = findStageBaseline(stageResults[i].stage);
+    if (baseline <= 0)
+      continue;
+    compared++;
+    if (stageResults[i].nsPerSample * 100 > baseline * (100 + postDecodeTolerancePercent))
+    {
+      char regression[96];
+      snprintf(regression, sizeof(regression), "Regression: %s %.1fns/sample (baseline %.1f, +%.0f%%)",
+               stageResults[i].stage, stageResults[i].nsPerSample, baseline,
+               (stageResults[i].nsPerSample - baseline) * 100 / baseline);
+      TEST_MESSAGE(regression);
+      regressions++;
+    }
+  }
+  if (results != NULL)
+    fclose(results);
+
+  char summary[96];
+  snprintf(summary, sizeof(summary), "Post-decode benchmark %s: %u stages, %u compared with baseline, %u regressions",
+           regressions ? "FAIL" : (compared ? "PASS" : "NO BASELINE"), stageCount, compared, regressions);
+  TEST_MESSAGE(summary);
+  TEST_ASSERT_EQUAL(0, regressions);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_earcon_mix);
+  RUN_TEST(test_dsp);
+  RUN_TEST(test_spectrum);
+  RUN_TEST(test_resampler);
+  RUN_TEST(test_audio_process_i2s);
+  RUN_TEST(test_against_baseline);
+  return UNITY_END();
+}
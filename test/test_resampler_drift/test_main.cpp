@@ -0,0 +1,90 @@
+// Resampler (resampler.h): the drift loop holding the stream ring centred against a
+// broadcaster clock that is off by +/-200ppm, and the I2S write never blocking for good
+#include "firmware.h"
+#include <unity.h>
+
+// 128kbps into a 32K ring, as the loop gains are tuned for
+const float streamBytesPerSec = 16000;
+const float ringBytes = 32768;
+
+void setUp()
+{
+  outputRate = 48000;
+  resampleInputRate = 44100;
+  driftCorrectionPPM = 0;
+  driftIntegral = 0;
+  smoothedRingFill = 0.5;
+  resampleOutputCount = 0;
+  resampleDroppedSamples = 0;
+  nativeI2sStalled = false;
+}
+void tearDown() {}
+
+// Hours of once a second updates. The broadcaster sends (1 + clockPPM) of the nominal
+// rate, we consume (1 + correction) of it; the ring must never run dry or overflow
+// and the correction has to end up matching the broadcaster's clock.
+void runDriftLoop(float clockPPM)
+{
+  float fill = ringBytes / 2;
+  float lowest = fill, highest = fill;
+  for (uint32_t second = 0; second < 4 * 3600; second++)
+  {
+    fill += streamBytesPerSec * (clockPPM - driftCorrectionPPM) / 1000000.0;
+    lowest = min(lowest, fill);
+    highest = max(highest, fill);
+    updateDriftCorrection(fill / ringBytes, 1.0);
+  }
+
+  TEST_ASSERT_GREATER_THAN(0, lowest);
+  TEST_ASSERT_LESS_THAN(ringBytes, highest);
+  TEST_ASSERT_FLOAT_WITHIN(0.02, 0.5, fill / ringBytes);
+  TEST_ASSERT_FLOAT_WITHIN(5, clockPPM, driftCorrectionPPM);
+
+  double expectedStep = 44100.0 / 48000 * (1 + driftCorrectionPPM / 1000000.0) * resampleOne;
+  TEST_ASSERT_FLOAT_WITHIN(resampleOne / 1000000.0, expectedStep, resampleStep);
+}
+
+void test_drift_loop_fast_broadcaster()
+{
+  runDriftLoop(200);
+}
+
+void test_drift_loop_slow_broadcaster()
+{
+  runDriftLoop(-200);
+}
+
+// Network bursts (the ring jumping about from one second to the next) hardly move the
+// correction
+void test_drift_loop_ignores_bursts()
+{
+  for (uint32_t second = 0; second < 600; second++)
+    updateDriftCorrection(second % 2 ? 0.9 : 0.1, 1.0);
+  TEST_ASSERT_LESS_THAN(60, abs(driftCorrectionPPM));
+}
+
+// A stalled I2S costs one bounded wait per block, the block is dropped and counted
+void test_stalled_i2s_write_is_bounded()
+{
+  resampleOutputCount = 64;
+  nativeI2sStalled = true;
+  flushResampleOutput();
+  TEST_ASSERT_LESS_THAN(pdMS_TO_TICKS(100), nativeI2sLastTimeout);
+  TEST_ASSERT_EQUAL(64, resampleDroppedSamples);
+  TEST_ASSERT_EQUAL(0, resampleOutputCount);
+
+  nativeI2sStalled = false;
+  resampleOutputCount = 64;
+  flushResampleOutput();
+  TEST_ASSERT_EQUAL(64, resampleDroppedSamples);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_drift_loop_fast_broadcaster);
+  RUN_TEST(test_drift_loop_slow_broadcaster);
+  RUN_TEST(test_drift_loop_ignores_bursts);
+  RUN_TEST(test_stalled_i2s_write_is_bounded);
+  return UNITY_END();
+}
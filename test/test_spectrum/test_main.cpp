@@ -0,0 +1,125 @@
+// Spectrum analyser (spectrum.h): tones land in the right bar, the cost of a frame on the
+// host, and drawing only what changed
+#include "firmware.h"
+#include <unity.h>
+
+// Bar showing FFT bin
+uint8_t barOfBin(uint16_t bin)
+{
+  uint8_t bar = 0;
+  while (spectrumBandEnd[bar] < bin)
+    bar++;
+  return bar;
+}
+
+void analyseTone(uint16_t bin, int16_t amplitude)
+{
+  for (uint16_t i = 0; i < fftSize; i++)
+    fftReal[i] = amplitude * sinf(2 * PI * bin * i / fftSize);
+  analyseSpectrumFrame();
+}
+
+void setUp()
+{
+  setupSpectrumTables();
+  memset(spectrumHeights, 0, sizeof(spectrumHeights));
+}
+void tearDown() {}
+
+void test_silence_shows_nothing()
+{
+  analyseTone(0, 0);
+  for (uint8_t bar = 0; bar < spectrumBars; bar++)
+    TEST_ASSERT_EQUAL(0, spectrumHeights[bar]);
+}
+
+// A full scale tone fills its own bar, the bars well away from it stay low
+void test_tone_lands_in_its_bar()
+{
+  const uint16_t bins[] = {3, 20, 90};
+  for (uint16_t bin : bins)
+  {
+    memset(spectrumHeights, 0, sizeof(spectrumHeights));
+    analyseTone(bin, 32000);
+    uint8_t bar = barOfBin(bin);
+    TEST_ASSERT_GREATER_OR_EQUAL(spectrumBarHeight - 2, spectrumHeights[bar]);
+    for (uint8_t other = 0; other < spectrumBars; other++)
+    {
+      if (abs(other - bar) > 2)
+        TEST_ASSERT_LESS_THAN(spectrumBarHeight / 2, spectrumHeights[other]);
+    }
+  }
+}
+
+// 6dB quieter is about spectrumBarHeight * 6 / spectrumRangeDB lower
+void test_bar_height_follows_level()
+{
+  analyseTone(20, 32000);
+  uint8_t loud = spectrumHeights[barOfBin(20)];
+  memset(spectrumHeights, 0, sizeof(spectrumHeights));
+  analyseTone(20, 16000);
+  uint8_t quiet = spectrumHeights[barOfBin(20)];
+  TEST_ASSERT_INT_WITHIN(2, spectrumBarHeight * 6 / spectrumRangeDB, loud - quiet);
+}
+
+// Window, FFT and bars for one frame - what spectrumFrameMicros measures on the board.
+// The cycle figure is counted at 240MHz on the host.
+void test_frame_cost()
+{
+  const uint32_t frames = 20000;
+  uint32_t noise = 1;
+  int64_t start = esp_timer_get_time();
+  uint32_t startCycles = xthal_get_ccount();
+  for (uint32_t frame = 0; frame < frames; frame++)
+  {
+    for (uint16_t i = 0; i < fftSize; i++)
+    {
+      noise = noise * 1664525 + 1013904223;
+      fftReal[i] = (int16_t)(noise >> 16);
+    }
+    analyseSpectrumFrame();
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+  uint32_t cycles = xthal_get_ccount() - startCycles;
+
+  char result[96];
+  snprintf(result, sizeof(result), "Spectrum: %.1fus/frame on the host, %u cycles/frame at 240MHz",
+           (double)elapsed / frames, cycles / frames);
+  TEST_MESSAGE(result);
+
+  // Far inside the 5% of a 50ms frame interval the board allows (2.5ms)
+  TEST_ASSERT_LESS_THAN(2500, elapsed / frames);
+}
+
+// Only bars that moved are redrawn
+void test_draws_only_changes()
+{
+  analyseTone(20, 32000);
+  spectrumFrames++;
+  drawSpectrum();
+
+  tft.fillRectCalls = 0;
+  spectrumFrames++;
+  drawSpectrum();
+  TEST_ASSERT_EQUAL(0, tft.fillRectCalls);
+
+  spectrumHeights[0] += 5;
+  spectrumFrames++;
+  drawSpectrum();
+  TEST_ASSERT_EQUAL(1, tft.fillRectCalls);
+
+  // No new frame, nothing drawn
+  drawSpectrum();
+  TEST_ASSERT_EQUAL(1, tft.fillRectCalls);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_silence_shows_nothing);
+  RUN_TEST(test_tone_lands_in_its_bar);
+  RUN_TEST(test_bar_height_follows_level);
+  RUN_TEST(test_frame_cost);
+  RUN_TEST(test_draws_only_changes);
+  return UNITY_END();
+}
@@ -0,0 +1,108 @@
+// Stream ring (spscRing.h): one producer thread and one consumer thread, as the fetch
+// and audio tasks use it
+#include <Arduino.h>
+#include <unity.h>
+#include <thread>
+#include <random>
+#include "spscRing.h"
+
+void setUp() {}
+void tearDown() {}
+
+// Sizes are rounded down to a power of 2
+void test_ring_size_rounds_down()
+{
+  spscRing ring;
+  TEST_ASSERT_TRUE(ringInit(ring, 3000));
+  TEST_ASSERT_EQUAL(2048, ring.size);
+  TEST_ASSERT_EQUAL(0, ringFilled(ring));
+  TEST_ASSERT_EQUAL(2048, ringFree(ring));
+  free(ring.buffer);
+}
+
+// Writes stop at the free space, reads at what is filled, both across the wrap point
+void test_ring_wraps_and_limits()
+{
+  spscRing ring;
+  ringInit(ring, 16);
+  uint8_t in[24], out[24];
+  for (uint8_t i = 0; i < sizeof(in); i++)
+    in[i] = i;
+
+  TEST_ASSERT_EQUAL(12, ringWrite(ring, in, 12));
+  TEST_ASSERT_EQUAL(10, ringRead(ring, out, 10));
+  TEST_ASSERT_EQUAL(14, ringWrite(ring, in + 12, 12) + ringWrite(ring, in, 2));
+  TEST_ASSERT_EQUAL(0, ringWrite(ring, in, 1));
+  TEST_ASSERT_EQUAL(16, ringRead(ring, out, sizeof(out)));
+  TEST_ASSERT_EQUAL(10, out[0]);
+  TEST_ASSERT_EQUAL(23, out[13]);
+  TEST_ASSERT_EQUAL(1, out[15]);
+
+  ringWrite(ring, in, 5);
+  TEST_ASSERT_EQUAL(3, ringSkip(ring, 3));
+  ringReset(ring);
+  TEST_ASSERT_EQUAL(0, ringFilled(ring));
+  free(ring.buffer);
+}
+
+// Random sized writes and reads on two threads: every byte arrives once, in order, and
+// the consumer never sees more filled than the ring holds
+void test_ring_two_thread_stress()
+{
+  const uint32_t totalBytes = 8 * 1024 * 1024;
+  spscRing ring;
+  ringInit(ring, 4096);
+  std::atomic<bool> overfilled(false);
+
+  std::thread producer([&]()
+                       {
+    std::mt19937 random(1);
+    uint8_t chunk[1460];
+    uint32_t sent = 0;
+    while (sent < totalBytes)
+    {
+      uint32_t len = min(totalBytes - sent, (uint32_t)(random() % sizeof(chunk) + 1));
+      for (uint32_t i = 0; i < len; i++)
+        chunk[i] = (sent + i) % 251;
+      uint32_t written = 0;
+      while (written < len)
+      {
+        uint32_t n = ringWrite(ring, chunk + written, len - written);
+        if (n == 0)
+          std::this_thread::sleep_for(std::chrono::microseconds(10)); // Full
+        written += n;
+      }
+      sent += len;
+    } });
+
+  std::mt19937 random(2);
+  uint8_t chunk[2048];
+  uint32_t received = 0;
+  uint32_t mismatches = 0;
+  while (received < totalBytes)
+  {
+    if (ringFilled(ring) > ring.size)
+      overfilled = true;
+    uint32_t len = ringRead(ring, chunk, random() % sizeof(chunk) + 1);
+    if (len == 0)
+      std::this_thread::sleep_for(std::chrono::microseconds(10)); // Empty
+    for (uint32_t i = 0; i < len; i++)
+      mismatches += chunk[i] != (received + i) % 251;
+    received += len;
+  }
+  producer.join();
+
+  TEST_ASSERT_EQUAL(0, mismatches);
+  TEST_ASSERT_FALSE(overfilled);
+  TEST_ASSERT_EQUAL(0, ringFilled(ring));
+  free(ring.buffer);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_ring_size_rounds_down);
+  RUN_TEST(test_ring_wraps_and_limits);
+  RUN_TEST(test_ring_two_thread_stress);
+  return UNITY_END();
+}
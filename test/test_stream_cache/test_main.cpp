@@ -0,0 +1,119 @@
+// Stream cache (streamCache.h): a cached station goes straight to its media URL, and the
+// codec, bitrate and sample rate stored with it are used until the stream says otherwise
+#include "firmware.h"
+#include "nativeHttpServer.h"
+#include <unity.h>
+
+nativeHttpServer server;
+const char *stationUrl = "http://radio.invalid/station.pls";
+
+void setUp()
+{
+  if (streamRing.buffer == NULL)
+    ringInit(streamRing, 32768);
+  ringReset(streamRing);
+  activeStream.ring = &streamRing;
+  activeStream.connectFd = -1;
+  server.start();
+}
+void tearDown()
+{
+  closeStream(activeStream);
+  server.stop();
+}
+
+void saveEntry(const char *path, const char *codecPath, uint32_t sampleRate, const char *bitrate)
+{
+  cachedStream entry;
+  memset(&entry, 0, sizeof(entry));
+  strlcpy(entry.resolvedUrl, server.url(path).c_str(), sizeof(entry.resolvedUrl));
+  strlcpy(entry.codecPath, codecPath, sizeof(entry.codecPath));
+  strlcpy(entry.icyBitrate, bitrate, sizeof(entry.icyBitrate));
+  entry.sampleRate = sampleRate;
+  saveCachedStream(stationUrl, entry);
+}
+
+// Step the connection until it is buffering (or gives up)
+void connectActiveStream()
+{
+  startStream(activeStream, stationUrl);
+  unsigned long start = millis();
+  while (activeStream.state != STREAM_IDLE && activeStream.state < STREAM_BUFFERING && millis() - start < 2000)
+  {
+    serviceStream(activeStream);
+    delay(1);
+  }
+}
+
+// Headers with no content type or bitrate - the cached ones stand
+void test_cached_details_preset_the_connection()
+{
+  nativeHttpRoute live;
+  live.streamBytes = 64000;
+  server.route("/live", live);
+  saveEntry("/live", "/stream.aac", 48000, "64");
+
+  connectActiveStream();
+  TEST_ASSERT_TRUE(activeStream.fromCache);
+  TEST_ASSERT_EQUAL(STREAM_BUFFERING, activeStream.state);
+  TEST_ASSERT_EQUAL(1, server.requests.load());
+  TEST_ASSERT_EQUAL_STRING("/stream.aac", activeStream.codecPath);
+
+  publishActiveStream();
+  TEST_ASSERT_EQUAL(64, streamingBitrateKbps);
+  TEST_ASSERT_EQUAL(48000, streamingSampleRate);
+}
+
+// The stream's own headers win over the cache
+void test_stream_headers_override_the_cache()
+{
+  nativeHttpRoute live;
+  live.head = "HTTP/1.0 200 OK\r\nContent-Type: audio/mpeg\r\nicy-br:128\r\n\r\n";
+  live.streamBytes = 64000;
+  server.route("/live", live);
+  saveEntry("/live", "/stream.aac", 48000, "64");
+
+  connectActiveStream();
+  TEST_ASSERT_EQUAL(STREAM_BUFFERING, activeStream.state);
+  TEST_ASSERT_EQUAL_STRING("/stream.mp3", activeStream.codecPath);
+  TEST_ASSERT_EQUAL_STRING("128", activeStream.icyBitrate);
+}
+
+// A cached URL that fails is dropped, and so are its presets
+void test_failed_cached_url_drops_the_presets()
+{
+  saveEntry("/gone", "/stream.aac", 48000, "64");
+  startStream(activeStream, stationUrl);
+  unsigned long start = millis();
+  while (activeStream.fromCache && millis() - start < 2000)
+  {
+    serviceStream(activeStream);
+    delay(1);
+  }
+
+  cachedStream entry;
+  TEST_ASSERT_FALSE(activeStream.fromCache);
+  TEST_ASSERT_FALSE(loadCachedStream(stationUrl, entry));
+  TEST_ASSERT_EQUAL(0, activeStream.cachedSampleRate);
+  TEST_ASSERT_EQUAL_STRING("", activeStream.cachedCodecPath);
+}
+
+// With a known rate the resampler's filter is ready before the first sample
+void test_resampler_filter_preset()
+{
+  outputRate = 48000;
+  resetResampler(44100);
+  TEST_ASSERT_EQUAL(44100, resampleFilterRate);
+  TEST_ASSERT_EQUAL(0, resampleInputRate);
+  outputRate = FIXED_OUTPUT_RATE;
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_cached_details_preset_the_connection);
+  RUN_TEST(test_stream_headers_override_the_cache);
+  RUN_TEST(test_failed_cached_url_drops_the_presets);
+  RUN_TEST(test_resampler_filter_preset);
+  return UNITY_END();
+}
@@ -0,0 +1,129 @@
+// Fetch stage (streamFetch.h) on real sockets: a warm standby station hands its prebuffer
+// to the decoder's ring when it is selected
+#include "firmware.h"
+#include "nativeHttpServer.h"
+#include <unity.h>
+
+nativeHttpServer server;
+char wantedUrls[maxStandbyStreams][256];
+
+void setUp()
+{
+  static bool initialised = false;
+  if (!initialised)
+  {
+    createStreamFetchTask();
+    initialised = true;
+  }
+  nativePreferences.clear();
+  ringReset(streamRing);
+  memset(wantedUrls, 0, sizeof(wantedUrls));
+  server.start();
+}
+void tearDown()
+{
+  closeStream(activeStream);
+  for (uint8_t i = 0; i < maxStandbyStreams; i++)
+  {
+    closeStream(standbyStreams[i]);
+    ringReset(standbyRings[i]);
+  }
+  server.stop();
+}
+
+nativeHttpRoute liveRoute(uint8_t streamByte, uint32_t streamBytes)
+{
+  nativeHttpRoute route;
+  route.head = "HTTP/1.0 200 OK\r\nContent-Type: audio/mpeg\r\n\r\n";
+  route.streamByte = streamByte;
+  route.streamBytes = streamBytes;
+  route.bytesPerSec = 64000;
+  return route;
+}
+
+// Service every connection until the condition holds (or 2s pass)
+template <typename Condition>
+bool serviceUntil(Condition done)
+{
+  unsigned long start = millis();
+  while (!done() && millis() - start < 2000)
+  {
+    serviceStream(activeStream);
+    for (uint8_t i = 0; i < maxStandbyStreams; i++)
+      serviceStream(standbyStreams[i]);
+    delay(1);
+  }
+  return done();
+}
+
+void test_warm_switch_hands_over_the_prebuffer()
+{
+  const uint32_t standbyBytes = 8000;
+  server.route("/playing", liveRoute(0x11, 64000));
+  server.route("/next", liveRoute(0x22, standbyBytes));
+  std::string playing = server.url("/playing");
+  std::string next = server.url("/next");
+
+  startStream(activeStream, playing.c_str());
+  startStream(standbyStreams[0], next.c_str());
+  TEST_ASSERT_TRUE(serviceUntil([&]()
+                                { return ringFilled(standbyRings[0]) == standbyBytes && ringFilled(streamRing) > 0; }));
+
+  // The old station is the new one's neighbour, so it is kept as the standby
+  strlcpy(wantedUrls[0], playing.c_str(), sizeof(wantedUrls[0]));
+  switchActiveStream(next.c_str(), wantedUrls);
+
+  TEST_ASSERT_TRUE(lastSwitchWasWarm);
+  TEST_ASSERT_EQUAL_STRING(next.c_str(), activeStream.url);
+  TEST_ASSERT_EQUAL_STRING(playing.c_str(), standbyStreams[0].url);
+  TEST_ASSERT_TRUE(activeStream.ring == &streamRing);
+  TEST_ASSERT_TRUE(standbyStreams[0].ring == &standbyRings[0]);
+
+  // Every prebuffered byte of the new station, none of the old one's
+  TEST_ASSERT_EQUAL(standbyBytes, ringFilled(streamRing));
+  static uint8_t data[standbyBytes];
+  ringRead(streamRing, data, sizeof(data));
+  uint32_t wrong = 0;
+  for (uint32_t i = 0; i < standbyBytes; i++)
+    wrong += data[i] != 0x22;
+  TEST_ASSERT_EQUAL(0, wrong);
+
+  // The old station carries on into the (emptied) standby ring
+  TEST_ASSERT_TRUE(serviceUntil([]()
+                                { return ringFilled(standbyRings[0]) > 0; }));
+  ringRead(standbyRings[0], data, 1);
+  TEST_ASSERT_EQUAL(0x11, data[0]);
+}
+
+// No standby for the station: connected from cold, the old station parked as a neighbour
+void test_cold_switch_parks_the_old_station()
+{
+  server.route("/playing", liveRoute(0x11, 64000));
+  server.route("/other", liveRoute(0x33, 64000));
+  std::string playing = server.url("/playing");
+  std::string other = server.url("/other");
+
+  startStream(activeStream, playing.c_str());
+  TEST_ASSERT_TRUE(serviceUntil([]()
+                                { return ringFilled(streamRing) > 0; }));
+
+  strlcpy(wantedUrls[1], playing.c_str(), sizeof(wantedUrls[1]));
+  ringReset(streamRing);
+  switchActiveStream(other.c_str(), wantedUrls);
+  TEST_ASSERT_FALSE(lastSwitchWasWarm);
+  TEST_ASSERT_EQUAL(0, ringFilled(streamRing));
+  TEST_ASSERT_TRUE(findStandbyStream(playing.c_str()) >= 0);
+  TEST_ASSERT_TRUE(serviceUntil([]()
+                                { return ringFilled(streamRing) > 0; }));
+  uint8_t first;
+  ringRead(streamRing, &first, 1);
+  TEST_ASSERT_EQUAL(0x33, first);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_warm_switch_hands_over_the_prebuffer);
+  RUN_TEST(test_cold_switch_parks_the_old_station);
+  return UNITY_END();
+}
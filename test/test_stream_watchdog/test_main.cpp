@@ -0,0 +1,210 @@
+// Stream watchdog (streamWatchdog.h) on real sockets: a stalled or draining station is
+// reconnected but a full ring is not, and the backoff grows with each failed attempt and
+// starts again once the station has streamed for long enough
+#include "firmware.h"
+#include "nativeHttpServer.h"
+#include <unity.h>
+
+nativeHttpServer server;
+
+void setUp()
+{
+  static bool initialised = false;
+  if (!initialised)
+  {
+    createStreamFetchTask();
+    initialised = true;
+  }
+  ringReset(streamRing);
+  resetStreamWatchdog();
+  server.start();
+}
+void tearDown()
+{
+  closeStream(activeStream);
+  server.stop();
+}
+
+// Enough to get past the watermark, then nothing more (held open)
+nativeHttpRoute liveRoute(uint32_t streamBytes)
+{
+  nativeHttpRoute route;
+  route.head = "HTTP/1.0 200 OK\r\nContent-Type: audio/mpeg\r\n\r\n";
+  route.streamBytes = streamBytes;
+  route.bytesPerSec = 64000;
+  return route;
+}
+
+// Service the active stream until the condition holds (or 2s pass)
+template <typename Condition>
+bool serviceUntil(Condition done)
+{
+  unsigned long start = millis();
+  while (!done() && millis() - start < 2000)
+  {
+    serviceStream(activeStream);
+    delay(1);
+  }
+  return done();
+}
+
+// Connect and read everything the server sends
+void playStation(const char *url, uint32_t streamBytes)
+{
+  uint32_t before = watchdogReceivedBytes;
+  startStream(activeStream, url);
+  TEST_ASSERT_TRUE(serviceUntil([&]()
+                                { return watchdogReceivedBytes - before == streamBytes; }));
+  TEST_ASSERT_EQUAL(STREAM_STREAMING, activeStream.state);
+}
+
+void test_stalled_station_reconnects()
+{
+  server.route("/stall", liveRoute(14000));
+  std::string url = server.url("/stall");
+  playStation(url.c_str(), 14000);
+
+  serviceStreamWatchdog(url.c_str(), true);
+  TEST_ASSERT_EQUAL(0, reconnectAttempt);
+
+  uint32_t stalls = telemetry.reconnectStalls;
+  advanceMillis(stallTimeoutMS + 100);
+  serviceStreamWatchdog(url.c_str(), true);
+  TEST_ASSERT_EQUAL(stalls + 1, telemetry.reconnectStalls);
+  TEST_ASSERT_EQUAL(1, reconnectAttempt);
+  TEST_ASSERT_TRUE(watchdogEpisode);
+
+  // First attempt straight away, keeping what is buffered to play out meanwhile
+  TEST_ASSERT_FALSE(reconnectScheduled);
+  TEST_ASSERT_EQUAL(14000, ringFilled(streamRing));
+  TEST_ASSERT_TRUE(serviceUntil([&]()
+                                { return server.requests == 2; }));
+}
+
+// A full ring isn't read from, so nothing arriving isn't a stall
+void test_full_ring_is_not_a_stall()
+{
+  server.route("/full", liveRoute(14000));
+  std::string url = server.url("/full");
+  playStation(url.c_str(), 14000);
+
+  static uint8_t filler[1024];
+  while (ringFree(streamRing) >= sizeof(filler))
+    ringWrite(streamRing, filler, sizeof(filler));
+  TEST_ASSERT_LESS_THAN(sizeof(fetchChunk), ringFree(streamRing));
+
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    advanceMillis(stallTimeoutMS + 100);
+    serviceStreamWatchdog(url.c_str(), true);
+  }
+  TEST_ASSERT_EQUAL(0, reconnectAttempt);
+  TEST_ASSERT_FALSE(watchdogEpisode);
+  TEST_ASSERT_EQUAL(STREAM_STREAMING, activeStream.state);
+}
+
+// Buffer health prediction as the audio task would have left it
+void setPredictedUnderrun(uint32_t underrunMS)
+{
+  health.underrunMS = underrunMS;
+  health.valid = true;
+  bufferHealthMillis = millis();
+}
+
+// Data still arriving but at a fraction of the rate it is played: only a reconnect once
+// the buffer is also predicted to run dry soon
+void test_draining_station_reconnects()
+{
+  server.route("/trickle", liveRoute(14000));
+  std::string url = server.url("/trickle");
+  playStation(url.c_str(), 14000);
+  streamDraining(); // Start a window
+
+  // A quarter of what was decoded arrived, but the buffer isn't falling
+  advanceMillis(drainWindowMS);
+  noteStreamReceived(10000);
+  decodeBytesTotal += 40000;
+  setPredictedUnderrun(noUnderrun);
+  serviceStreamWatchdog(url.c_str(), true);
+  TEST_ASSERT_EQUAL(0, reconnectAttempt);
+
+  // ...and the same again running dry
+  uint32_t drains = telemetry.reconnectDrains;
+  advanceMillis(drainWindowMS);
+  noteStreamReceived(10000);
+  decodeBytesTotal += 40000;
+  setPredictedUnderrun(drainUnderrunMS / 2);
+  serviceStreamWatchdog(url.c_str(), true);
+  TEST_ASSERT_EQUAL(drains + 1, telemetry.reconnectDrains);
+  TEST_ASSERT_EQUAL(1, reconnectAttempt);
+
+  // Most of it arriving is fine whatever the prediction
+  resetStreamWatchdog();
+  TEST_ASSERT_TRUE(serviceUntil([&]()
+                                { return activeStream.state == STREAM_STREAMING; }));
+  streamDraining();
+  advanceMillis(drainWindowMS);
+  noteStreamReceived(30000);
+  decodeBytesTotal += 40000;
+  setPredictedUnderrun(drainUnderrunMS / 2);
+  serviceStreamWatchdog(url.c_str(), true);
+  TEST_ASSERT_EQUAL(0, reconnectAttempt);
+}
+
+// Each failed attempt waits longer, up to the last step; streaming for reconnectHealthyMS
+// after a reconnect starts the sequence again
+void test_backoff_grows_then_resets()
+{
+  std::string url = server.url("/down"); // 404 until routed
+  uint32_t drops = telemetry.reconnectDrops;
+  for (uint8_t attempt = 0; attempt < reconnectBackoffSteps + 2; attempt++)
+  {
+    // Wait for the attempt to fail
+    TEST_ASSERT_TRUE(serviceUntil([&]()
+                                  { return activeStream.state == STREAM_IDLE; }));
+    serviceStreamWatchdog(url.c_str(), true);
+    TEST_ASSERT_EQUAL(attempt + 1, reconnectAttempt);
+    unsigned long backoffMS = reconnectBackoffMS[min(attempt, (uint8_t)(reconnectBackoffSteps - 1))];
+    if (backoffMS == 0)
+      continue;
+
+    TEST_ASSERT_TRUE(reconnectScheduled);
+    TEST_ASSERT_EQUAL(backoffMS, reconnectDueMillis - millis());
+    advanceMillis(backoffMS - 1);
+    serviceStreamWatchdog(url.c_str(), true);
+    TEST_ASSERT_TRUE(reconnectScheduled);
+    advanceMillis(1);
+    serviceStreamWatchdog(url.c_str(), true);
+    TEST_ASSERT_FALSE(reconnectScheduled);
+  }
+  TEST_ASSERT_EQUAL(drops + reconnectBackoffSteps + 2, telemetry.reconnectDrops);
+
+  // The station comes back: not healthy yet until it has streamed reconnectHealthyMS
+  TEST_ASSERT_TRUE(serviceUntil([&]()
+                                { return activeStream.state == STREAM_IDLE; }));
+  server.route("/down", liveRoute(64000));
+  serviceStreamWatchdog(url.c_str(), true);
+  advanceMillis(reconnectBackoffMS[reconnectBackoffSteps - 1]);
+  serviceStreamWatchdog(url.c_str(), true);
+  TEST_ASSERT_TRUE(serviceUntil([&]()
+                                { return activeStream.state == STREAM_STREAMING; }));
+  serviceStreamWatchdog(url.c_str(), true);
+  TEST_ASSERT_EQUAL(reconnectBackoffSteps + 3, reconnectAttempt);
+
+  advanceMillis(reconnectHealthyMS + 1);
+  uint32_t received = watchdogReceivedBytes;
+  TEST_ASSERT_TRUE(serviceUntil([&]()
+                                { return watchdogReceivedBytes > received; }));
+  serviceStreamWatchdog(url.c_str(), true);
+  TEST_ASSERT_EQUAL(0, reconnectAttempt);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_stalled_station_reconnects);
+  RUN_TEST(test_full_ring_is_not_a_stall);
+  RUN_TEST(test_draining_station_reconnects);
+  RUN_TEST(test_backoff_grows_then_resets);
+  return UNITY_END();
+}
@@ -0,0 +1,105 @@
+// Telemetry (telemetry.h): what counts as a decode error, and I2S underruns counted from
+// the driver's events only while a stream is playing
+#include "firmware.h"
+#include <unity.h>
+
+void postI2sEvent(i2s_event_type_t type)
+{
+  i2s_event_t event = {type, 0};
+  xQueueSend(nativeI2sEvents, &event, 0);
+}
+
+void setUp()
+{
+  applyI2SProfile();
+  resetTelemetry();
+}
+void tearDown() {}
+
+void test_decode_errors_from_the_library_error_path()
+{
+  recordDecoderInfo("MP3 decode error -6 : MAINDATA_UNDERFLOW");
+  recordDecoderInfo("AAC decode error -21 : NCHANS_TOO_HIGH");
+  audioTelemetry t;
+  getTelemetry(t);
+  TEST_ASSERT_EQUAL(2, t.decodeErrors);
+  TEST_ASSERT_EQUAL(-21, t.lastDecodeError);
+}
+
+// Other info lines can say anything
+void test_other_info_is_not_a_decode_error()
+{
+  recordDecoderInfo("StreamTitle='MP3 decode error - Live'");
+  recordDecoderInfo("MP3 decode error");
+  recordDecoderInfo("syncword found at pos 0");
+  recordDecoderInfo("MP3 decode error 0 : none");
+  audioTelemetry t;
+  getTelemetry(t);
+  TEST_ASSERT_EQUAL(0, t.decodeErrors);
+}
+
+// Descriptors sent empty count while playing, not while paused or between stations
+void test_i2s_underruns_only_while_playing()
+{
+  TEST_ASSERT_NOT_NULL(i2sEventQueue);
+  sampleI2SEvents(true);
+
+  postI2sEvent(I2S_EVENT_TX_DONE);
+  postI2sEvent(I2S_EVENT_TX_Q_OVF);
+  postI2sEvent(I2S_EVENT_TX_Q_OVF);
+  sampleI2SEvents(true);
+
+  postI2sEvent(I2S_EVENT_TX_Q_OVF);
+  sampleI2SEvents(false);
+
+  // Queued while stopped, drained on the first wakeup after playing again
+  postI2sEvent(I2S_EVENT_TX_Q_OVF);
+  sampleI2SEvents(true);
+
+  audioTelemetry t;
+  getTelemetry(t);
+  TEST_ASSERT_EQUAL(2, t.i2sUnderruns);
+  TEST_ASSERT_EQUAL(0, uxQueueMessagesWaiting(i2sEventQueue));
+}
+
+// Ring running dry (decoding restarting) is counted separately
+void test_decoder_restarts()
+{
+  noteStreamUnderrun();
+  audioTelemetry t;
+  getTelemetry(t);
+  TEST_ASSERT_EQUAL(1, t.decoderRestarts);
+  TEST_ASSERT_EQUAL(0, t.i2sUnderruns);
+}
+
+// A command line arriving in pieces is only run once it is complete, nothing waits for it
+void test_serial_command_split_across_reads()
+{
+  setEqBand(EQ_TREBLE, 0);
+  Serial.feed("qt");
+  serviceTelemetry();
+  TEST_ASSERT_EQUAL(0, Serial.available());
+  Serial.feed("-4");
+  serviceTelemetry();
+  TEST_ASSERT_EQUAL(0, eqGainDB[EQ_TREBLE]);
+
+  Serial.feed("\r\n");
+  serviceTelemetry();
+  TEST_ASSERT_EQUAL(-4, eqGainDB[EQ_TREBLE]);
+
+  // Blank lines are skipped
+  Serial.feed("\nqt+2\r\n");
+  serviceTelemetry();
+  TEST_ASSERT_EQUAL(2, eqGainDB[EQ_TREBLE]);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_decode_errors_from_the_library_error_path);
+  RUN_TEST(test_other_info_is_not_a_decode_error);
+  RUN_TEST(test_i2s_underruns_only_while_playing);
+  RUN_TEST(test_decoder_restarts);
+  RUN_TEST(test_serial_command_split_across_reads);
+  return UNITY_END();
+}
@@ -0,0 +1,134 @@
+// Timeshift (timeshift.h) on a board without PSRAM: a pause longer than the store ring
+// spills to the file through the spill task, never from the fetch task, and plays back
+// in order
+#include "firmware.h"
+#include <unity.h>
+
+spscRing output;
+uint32_t recorded = 0; // Bytes of the test pattern recorded so far
+uint32_t played = 0;   // ...and checked on the way out
+
+void recordPattern(uint32_t len)
+{
+  static uint8_t chunk[1460];
+  for (uint32_t i = 0; i < len; i++)
+    chunk[i] = (recorded + i) % 251;
+  timeshiftWrite(chunk, len);
+  recorded += len;
+}
+
+uint32_t playAndCheck()
+{
+  static uint8_t chunk[1024];
+  uint32_t mismatches = 0;
+  uint32_t len;
+  while ((len = ringRead(output, chunk, sizeof(chunk))) > 0)
+  {
+    for (uint32_t i = 0; i < len; i++)
+      mismatches += chunk[i] != (played + i) % 251;
+    played += len;
+  }
+  return mismatches;
+}
+
+void setUp()
+{
+  static bool initialised = false;
+  if (!initialised)
+  {
+    LITTLEFS.begin(false);
+    setupTimeshift();
+    ringInit(output, 4096);
+    initialised = true;
+  }
+  resetTimeshift();
+  ringReset(output);
+  recorded = played = 0;
+  timeshiftDroppedBytes = 0;
+}
+void tearDown() {}
+
+void test_small_ring_without_psram()
+{
+  TEST_ASSERT_EQUAL(timeshiftSmallRingBytes, timeshiftRing.size);
+  TEST_ASSERT_TRUE(spillAvailable);
+}
+
+// Recording only ever goes to RAM from the fetch task
+void test_fetch_task_never_writes_the_file()
+{
+  timeshiftPaused = true;
+  uint32_t fileWrites = spillBytesWritten;
+  for (uint8_t i = 0; i < 5; i++)
+    recordPattern(1460);
+  TEST_ASSERT_EQUAL(fileWrites, spillBytesWritten);
+  TEST_ASSERT_EQUAL(5 * 1460, timeshiftFilled());
+  TEST_ASSERT_EQUAL(0, timeshiftDroppedBytes);
+
+  // Spill task: the store ring takes it all, nothing for the file yet
+  serviceTimeshiftSpill();
+  TEST_ASSERT_EQUAL(5 * 1460, ringFilled(timeshiftRing));
+  TEST_ASSERT_EQUAL(fileWrites, spillBytesWritten);
+}
+
+// Half a minute's pause at 128kbps, then playing it back - everything in order
+void test_long_pause_spills_and_plays_back_in_order()
+{
+  timeshiftPaused = true;
+  for (uint32_t i = 0; i < 30 * 16000 / 1460; i++)
+  {
+    recordPattern(1460);
+    if (i % 4 == 0)
+      serviceTimeshiftSpill();
+  }
+  serviceTimeshiftSpill();
+  TEST_ASSERT_GREATER_THAN(400000, spillFilled());
+  TEST_ASSERT_EQUAL(recorded, timeshiftFilled());
+
+  // Playing again, behind live: the recording is drained oldest first as live carries on
+  // (arriving on every other pass of the fetch loop)
+  timeshiftPaused = false;
+  uint32_t mismatches = 0;
+  for (uint32_t pass = 0; timeshiftFilled() > 0 && pass < 100000; pass++)
+  {
+    if (pass % 2 == 0)
+      recordPattern(200);
+    serviceTimeshift(output);
+    serviceTimeshiftSpill();
+    mismatches += playAndCheck();
+  }
+  TEST_ASSERT_EQUAL(0, mismatches);
+  TEST_ASSERT_EQUAL(0, timeshiftDroppedBytes);
+  TEST_ASSERT_EQUAL(recorded, played);
+  TEST_ASSERT_FALSE(timeshifting());
+}
+
+// Back to live throws away the ring, staging and file
+void test_live_discards_everything()
+{
+  timeshiftPaused = true;
+  for (uint8_t i = 0; i < 40; i++)
+  {
+    recordPattern(1460);
+    if (i % 4 == 0)
+      serviceTimeshiftSpill();
+  }
+  TEST_ASSERT_GREATER_THAN(0, spillFilled());
+  TEST_ASSERT_GREATER_THAN(0, ringFilled(timeshiftStage));
+
+  timeshiftPaused = false;
+  timeshiftLiveRequested = true;
+  serviceTimeshift(output);
+  TEST_ASSERT_EQUAL(0, timeshiftFilled());
+  TEST_ASSERT_FALSE(timeshifting());
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_small_ring_without_psram);
+  RUN_TEST(test_fetch_task_never_writes_the_file);
+  RUN_TEST(test_long_pause_spills_and_plays_back_in_order);
+  RUN_TEST(test_live_discards_everything);
+  return UNITY_END();
+}
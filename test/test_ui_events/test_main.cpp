@@ -0,0 +1,119 @@
+// UI events (uiEvents.h): a burst of metadata coalesces instead of filling the queue, an
+// event that can't be queued is dropped cleanly, and discarded events are never shown
+// while later ones still are
+#include "firmware.h"
+#include <unity.h>
+
+void setUp()
+{
+  if (uiEventQueue == NULL)
+    setupUiEvents();
+  discardUiEvents();
+  uiEventsPosted = 0;
+  uiEventsCoalesced = 0;
+  uiEventsDropped = 0;
+}
+void tearDown() {}
+
+// Everything shown, counting the events
+uint8_t showAll()
+{
+  uint8_t shown = 0;
+  while (uxQueueMessagesWaiting(uiEventQueue) > 0)
+    shown += processUiEvent(0);
+  return shown;
+}
+
+// Hundreds of titles while the UI task is busy: one queue entry per kind, the latest text
+void test_burst_coalesces()
+{
+  char text[32];
+  for (uint16_t i = 0; i < 300; i++)
+  {
+    snprintf(text, sizeof(text), "Track %u", i);
+    postUiEvent(UI_TRACK_ARTIST, text);
+    postUiEvent(UI_BITRATE, "128");
+  }
+  postUiEvent(UI_STATION_NAME, "Station");
+  TEST_ASSERT_EQUAL(UI_EVENT_TYPES, uxQueueMessagesWaiting(uiEventQueue));
+  TEST_ASSERT_EQUAL(601, uiEventsPosted);
+  TEST_ASSERT_EQUAL(598, uiEventsCoalesced);
+  TEST_ASSERT_EQUAL(0, uiEventsDropped);
+
+  TEST_ASSERT_EQUAL_STRING("Track 299", uiEventText[UI_TRACK_ARTIST]);
+  TEST_ASSERT_EQUAL(UI_EVENT_TYPES, showAll());
+  TEST_ASSERT_EQUAL(0, uiEventsPending);
+}
+
+// A full queue drops the event without leaving it pending, so the next one isn't
+// coalesced into something that will never be shown
+void test_full_queue_drops_cleanly()
+{
+  uint8_t filler = UI_BITRATE;
+  while (xQueueSend(uiEventQueue, &filler, 0) == pdTRUE)
+    ;
+  postUiEvent(UI_TRACK_ARTIST, "Lost");
+  TEST_ASSERT_EQUAL(1, uiEventsDropped);
+  TEST_ASSERT_EQUAL(0, uiEventsPending);
+
+  // The fillers were never posted, so nothing is shown for them
+  TEST_ASSERT_EQUAL(0, showAll());
+
+  postUiEvent(UI_TRACK_ARTIST, "Shown");
+  TEST_ASSERT_EQUAL(0, uiEventsCoalesced);
+  TEST_ASSERT_TRUE(processUiEvent(0));
+  TEST_ASSERT_EQUAL_STRING("Shown", uiEventText[UI_TRACK_ARTIST]);
+}
+
+// Before the queue exists (early in setup()) events are dropped, not left pending
+void test_no_queue_drops_cleanly()
+{
+  QueueHandle_t queue = uiEventQueue;
+  uiEventQueue = NULL;
+  postUiEvent(UI_STATION_NAME, "Too early");
+  TEST_ASSERT_EQUAL(1, uiEventsDropped);
+  TEST_ASSERT_EQUAL(0, uiEventsPending);
+  TEST_ASSERT_FALSE(processUiEvent(0));
+  uiEventQueue = queue;
+
+  postUiEvent(UI_STATION_NAME, "Station");
+  TEST_ASSERT_TRUE(processUiEvent(0));
+}
+
+// A channel change throws away the old station's titles; the new station's are shown
+void test_discard_then_post()
+{
+  postUiEvent(UI_STATION_NAME, "Old station");
+  postUiEvent(UI_TRACK_ARTIST, "Old track");
+  discardUiEvents();
+  TEST_ASSERT_EQUAL(0, uxQueueMessagesWaiting(uiEventQueue));
+  TEST_ASSERT_FALSE(processUiEvent(0));
+
+  postUiEvent(UI_TRACK_ARTIST, "New track");
+  TEST_ASSERT_EQUAL(0, uiEventsCoalesced);
+  TEST_ASSERT_EQUAL(1, showAll());
+  TEST_ASSERT_EQUAL_STRING("New track", uiEventText[UI_TRACK_ARTIST]);
+}
+
+// An event still queued when its pending bit has gone (discarded in between) isn't shown
+void test_discarded_event_not_shown()
+{
+  postUiEvent(UI_BITRATE, "320");
+  portENTER_CRITICAL(&uiEventMux);
+  uiEventsPending = 0;
+  portEXIT_CRITICAL(&uiEventMux);
+  TEST_ASSERT_EQUAL(1, uxQueueMessagesWaiting(uiEventQueue));
+  TEST_ASSERT_FALSE(processUiEvent(0));
+  TEST_ASSERT_EQUAL(0, uxQueueMessagesWaiting(uiEventQueue));
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_burst_coalesces);
+  RUN_TEST(test_full_queue_drops_cleanly);
+  RUN_TEST(test_no_queue_drops_cleanly);
+  RUN_TEST(test_discard_then_post);
+  RUN_TEST(test_discarded_event_not_shown);
+  return UNITY_END();
+}